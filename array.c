@@ -0,0 +1,428 @@
+#include "array.h"
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+ * The kernels are written once against a tiny "Lanes" vocabulary - a vector of LANES doubles and the handful of
+ * operations we need on it - which maps onto AVX (4 doubles), SSE2 (2 doubles, always there on x86-64), or plain
+ * scalar C on anything else. Loads and stores are the unaligned forms: arrays start 64-byte aligned, but the scalar
+ * tail and any future slices of arrays needn't be, and on current hardware unaligned loads of aligned data cost nothing.
+ * LANES_MIN / LANES_MAX follow the hardware's rule for NaN (the second operand wins), and so does the scalar fallback,
+ * so a NaN gives the same answer whichever path a reduction takes.
+ */
+#if defined(__AVX__)
+    #include <immintrin.h>
+    #define LANES 4
+    typedef __m256d Lanes;
+    #define LANES_LOAD(pointer)         _mm256_loadu_pd(pointer)
+    #define LANES_STORE(pointer, lanes) _mm256_storeu_pd(pointer, lanes)
+    #define LANES_SPLAT(scalar)         _mm256_set1_pd(scalar)
+    #define LANES_ADD(a, b)             _mm256_add_pd(a, b)
+    #define LANES_SUBTRACT(a, b)        _mm256_sub_pd(a, b)
+    #define LANES_MULTIPLY(a, b)        _mm256_mul_pd(a, b)
+    #define LANES_DIVIDE(a, b)          _mm256_div_pd(a, b)
+    #define LANES_MIN(a, b)             _mm256_min_pd(a, b)
+    #define LANES_MAX(a, b)             _mm256_max_pd(a, b)
+#elif defined(__SSE2__) || defined(_M_X64)
+    #include <emmintrin.h>
+    #define LANES 2
+    typedef __m128d Lanes;
+    #define LANES_LOAD(pointer)         _mm_loadu_pd(pointer)
+    #define LANES_STORE(pointer, lanes) _mm_storeu_pd(pointer, lanes)
+    #define LANES_SPLAT(scalar)         _mm_set1_pd(scalar)
+    #define LANES_ADD(a, b)             _mm_add_pd(a, b)
+    #define LANES_SUBTRACT(a, b)        _mm_sub_pd(a, b)
+    #define LANES_MULTIPLY(a, b)        _mm_mul_pd(a, b)
+    #define LANES_DIVIDE(a, b)          _mm_div_pd(a, b)
+    #define LANES_MIN(a, b)             _mm_min_pd(a, b)
+    #define LANES_MAX(a, b)             _mm_max_pd(a, b)
+#else
+    #define LANES 1
+    typedef double Lanes;
+    #define LANES_LOAD(pointer)         (*(pointer))
+    #define LANES_STORE(pointer, lanes) (*(pointer) = (lanes))
+    #define LANES_SPLAT(scalar)         (scalar)
+    #define LANES_ADD(a, b)             ((a) + (b))
+    #define LANES_SUBTRACT(a, b)        ((a) - (b))
+    #define LANES_MULTIPLY(a, b)        ((a) * (b))
+    #define LANES_DIVIDE(a, b)          ((a) / (b))
+    #define LANES_MIN(a, b)             (((a) < (b)) ? (a) : (b))
+    #define LANES_MAX(a, b)             (((a) > (b)) ? (a) : (b))
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64)
+    #include <emmintrin.h>
+    #define ARRAY_USE_SSE2
+#endif
+
+static inline double scalar_min(double a, double b) {
+    return (a < b) ? a : b;
+}
+
+static inline double scalar_max(double a, double b) {
+    return (a > b) ? a : b;
+}
+
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+ * Elementwise arithmetic. ELEMENTWISE_KERNELS writes out the three shapes (array op array, array op scalar, scalar op
+ * array) of one operation as separate straight-line loops, two vectors per trip, with a scalar loop for the tail.
+ * array_elementwise() picks the right one.
+ */
+#define ELEMENTWISE_KERNELS(name, lanes_op, operator)                                                   \
+    static void name##_array_array(const double* a, const double* b, double* out, size_t count) {       \
+        size_t index = 0;                                                                               \
+        for (; index + 2 * LANES <= count; index += 2 * LANES) {                                        \
+            Lanes first  = lanes_op(LANES_LOAD(a + index), LANES_LOAD(b + index));                      \
+            Lanes second = lanes_op(LANES_LOAD(a + index + LANES), LANES_LOAD(b + index + LANES));      \
+            LANES_STORE(out + index, first);                                                            \
+            LANES_STORE(out + index + LANES, second);                                                   \
+        }                                                                                               \
+        for (; index < count; index++) {                                                                \
+            out[index] = a[index] operator b[index];                                                    \
+        }                                                                                               \
+    }                                                                                                   \
+    static void name##_array_scalar(const double* a, double b, double* out, size_t count) {             \
+        Lanes splat  = LANES_SPLAT(b);                                                                  \
+        size_t index = 0;                                                                               \
+        for (; index + 2 * LANES <= count; index += 2 * LANES) {                                        \
+            Lanes first  = lanes_op(LANES_LOAD(a + index), splat);                                      \
+            Lanes second = lanes_op(LANES_LOAD(a + index + LANES), splat);                              \
+            LANES_STORE(out + index, first);                                                            \
+            LANES_STORE(out + index + LANES, second);                                                   \
+        }                                                                                               \
+        for (; index < count; index++) {                                                                \
+            out[index] = a[index] operator b;                                                           \
+        }                                                                                               \
+    }                                                                                                   \
+    static void name##_scalar_array(double a, const double* b, double* out, size_t count) {             \
+        Lanes splat  = LANES_SPLAT(a);                                                                  \
+        size_t index = 0;                                                                               \
+        for (; index + 2 * LANES <= count; index += 2 * LANES) {                                        \
+            Lanes first  = lanes_op(splat, LANES_LOAD(b + index));                                      \
+            Lanes second = lanes_op(splat, LANES_LOAD(b + index + LANES));                              \
+            LANES_STORE(out + index, first);                                                            \
+            LANES_STORE(out + index + LANES, second);                                                   \
+        }                                                                                               \
+        for (; index < count; index++) {                                                                \
+            out[index] = a operator b[index];                                                           \
+        }                                                                                               \
+    }
+
+ELEMENTWISE_KERNELS(add, LANES_ADD, +)
+ELEMENTWISE_KERNELS(subtract, LANES_SUBTRACT, -)
+ELEMENTWISE_KERNELS(multiply, LANES_MULTIPLY, *)
+ELEMENTWISE_KERNELS(divide, LANES_DIVIDE, /)
+
+#undef ELEMENTWISE_KERNELS
+
+#define DISPATCH_SHAPES(name)                                       \
+    do {                                                            \
+        if (a != NULL && b != NULL) {                               \
+            name##_array_array(a, b, out, count);                   \
+        } else if (a != NULL) {                                     \
+            name##_array_scalar(a, b_scalar, out, count);           \
+        } else {                                                    \
+            name##_scalar_array(a_scalar, b, out, count);           \
+        }                                                           \
+    } while (false)
+
+static void elementwise_contiguous(ArrayOp op, const double* a, double a_scalar, const double* b, double b_scalar,
+                                   double* out, size_t count) {
+    assert(a != NULL || b != NULL);
+
+    switch (op) {
+        case ARRAY_ADD:
+            DISPATCH_SHAPES(add);
+            break;
+        case ARRAY_SUBTRACT:
+            DISPATCH_SHAPES(subtract);
+            break;
+        case ARRAY_MULTIPLY:
+            DISPATCH_SHAPES(multiply);
+            break;
+        case ARRAY_DIVIDE:
+            DISPATCH_SHAPES(divide);
+            break;
+    }
+}
+
+#undef DISPATCH_SHAPES
+
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+ * Reductions. Each keeps four vectors of partial results going side by side, so that consecutive adds don't have to
+ * wait on each other, then folds them into one vector, that vector into one double, and finishes off the tail.
+ * REDUCE_STEP(combine, load) advances all four accumulators over the next 4 * LANES elements.
+ */
+#define REDUCE_STEP(combine, load)                                  \
+    do {                                                            \
+        partial_0 = combine(partial_0, load(index));                \
+        partial_1 = combine(partial_1, load(index + LANES));        \
+        partial_2 = combine(partial_2, load(index + 2 * LANES));    \
+        partial_3 = combine(partial_3, load(index + 3 * LANES));    \
+    } while (false)
+
+#define FOLD_PARTIALS(combine) combine(combine(partial_0, partial_1), combine(partial_2, partial_3))
+
+static inline double fold_lanes(Lanes lanes, double (*combine)(double, double)) {
+    double parts[LANES];
+    LANES_STORE(parts, lanes);
+
+    double result = parts[0];
+    for (int lane = 1; lane < LANES; lane++) {
+        result = combine(parts[lane], result);
+    }
+    return result;
+}
+
+static inline double scalar_add(double a, double b) {
+    return a + b;
+}
+
+
+static double sum_contiguous(const double* values, size_t count) {
+    Lanes partial_0 = LANES_SPLAT(0.0), partial_1 = partial_0, partial_2 = partial_0, partial_3 = partial_0;
+    size_t index    = 0;
+
+    #define LOAD_VALUES(at) LANES_LOAD(values + (at))
+    for (; index + 4 * LANES <= count; index += 4 * LANES) {
+        REDUCE_STEP(LANES_ADD, LOAD_VALUES);
+    }
+    #undef LOAD_VALUES
+
+    double total = fold_lanes(FOLD_PARTIALS(LANES_ADD), scalar_add);
+    for (; index < count; index++) {
+        total += values[index];
+    }
+    return total;
+}
+
+
+static double dot_contiguous(const double* a, const double* b, size_t count) {
+    Lanes partial_0 = LANES_SPLAT(0.0), partial_1 = partial_0, partial_2 = partial_0, partial_3 = partial_0;
+    size_t index    = 0;
+
+    #define LOAD_PRODUCT(at) LANES_MULTIPLY(LANES_LOAD(a + (at)), LANES_LOAD(b + (at)))
+    for (; index + 4 * LANES <= count; index += 4 * LANES) {
+        REDUCE_STEP(LANES_ADD, LOAD_PRODUCT);
+    }
+    #undef LOAD_PRODUCT
+
+    double total = fold_lanes(FOLD_PARTIALS(LANES_ADD), scalar_add);
+    for (; index < count; index++) {
+        total += a[index] * b[index];
+    }
+    return total;
+}
+
+
+/*
+ * min and max need at least one element - the caller checks. Every accumulator starts off as the first element, which
+ * is as good a starting guess as any and saves having to think about infinities. The new element goes first in each
+ * comparison, so a NaN element loses to the running result on every path.
+ */
+#define LANES_MIN_NEW(partial, lanes) LANES_MIN(lanes, partial)
+#define LANES_MAX_NEW(partial, lanes) LANES_MAX(lanes, partial)
+
+static double min_contiguous(const double* values, size_t count) {
+    assert(count > 0);
+    Lanes partial_0 = LANES_SPLAT(values[0]), partial_1 = partial_0, partial_2 = partial_0, partial_3 = partial_0;
+    size_t index    = 0;
+
+    #define LOAD_VALUES(at) LANES_LOAD(values + (at))
+    for (; index + 4 * LANES <= count; index += 4 * LANES) {
+        REDUCE_STEP(LANES_MIN_NEW, LOAD_VALUES);
+    }
+    #undef LOAD_VALUES
+
+    double result = fold_lanes(FOLD_PARTIALS(LANES_MIN), scalar_min);
+    for (; index < count; index++) {
+        result = scalar_min(values[index], result);
+    }
+    return result;
+}
+
+
+static double max_contiguous(const double* values, size_t count) {
+    assert(count > 0);
+    Lanes partial_0 = LANES_SPLAT(values[0]), partial_1 = partial_0, partial_2 = partial_0, partial_3 = partial_0;
+    size_t index    = 0;
+
+    #define LOAD_VALUES(at) LANES_LOAD(values + (at))
+    for (; index + 4 * LANES <= count; index += 4 * LANES) {
+        REDUCE_STEP(LANES_MAX_NEW, LOAD_VALUES);
+    }
+    #undef LOAD_VALUES
+
+    double result = fold_lanes(FOLD_PARTIALS(LANES_MAX), scalar_max);
+    for (; index < count; index++) {
+        result = scalar_max(values[index], result);
+    }
+    return result;
+}
+
+#undef REDUCE_STEP
+#undef FOLD_PARTIALS
+#undef LANES_MIN_NEW
+#undef LANES_MAX_NEW
+
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+ * Inclusive prefix sum. A running total is one long chain of dependent adds, which no amount of vector width gets rid
+ * of - but the chain only needs one link per *pair* of elements. With SSE2, each pair [x0, x1] is turned into
+ * [x0, x0 + x1] inside the register, the carry from everything before it is added to both, and the top half becomes
+ * the next carry.
+ */
+static void scan_contiguous(const double* values, double* out, size_t count) {
+    size_t index = 0;
+    double total = 0.0;
+
+    #ifdef ARRAY_USE_SSE2
+        __m128d carry = _mm_setzero_pd();
+
+        for (; index + 2 <= count; index += 2) {
+            __m128d pair = _mm_loadu_pd(values + index);
+            pair         = _mm_add_pd(pair, _mm_unpacklo_pd(_mm_setzero_pd(), pair));
+            pair         = _mm_add_pd(pair, carry);
+            _mm_storeu_pd(out + index, pair);
+            carry        = _mm_unpackhi_pd(pair, pair);
+        }
+
+        total = _mm_cvtsd_f64(carry);
+    #endif
+
+    for (; index < count; index++) {
+        total     += values[index];
+        out[index] = total;
+    }
+}
+
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+ * The entry points. An array with a stride of 1 goes straight to the kernels above. A strided one - a column out of a
+ * mapped file (object.h) - is gathered ARRAY_BLOCK elements at a time into a buffer small enough to stay in L1, and
+ * each block goes through the same kernels; a reduction then combines the blocks' results in order. Either way the
+ * elements are only read front to back, once, which is what the mapping's read-ahead is counting on.
+ */
+static inline size_t block_length(size_t start, size_t count) {
+    return (count - start < ARRAY_BLOCK) ? count - start : ARRAY_BLOCK;
+}
+
+
+void array_gather(const double* values, size_t stride, double* out, size_t count) {
+    for (size_t index = 0; index < count; index++) {
+        out[index] = values[index * stride];
+    }
+}
+
+
+void array_elementwise(ArrayOp op, const double* a, size_t a_stride, double a_scalar,
+                       const double* b, size_t b_stride, double b_scalar, double* out, size_t count) {
+    if ((a == NULL || a_stride == 1) && (b == NULL || b_stride == 1)) {
+        elementwise_contiguous(op, a, a_scalar, b, b_scalar, out, count);
+        return;
+    }
+
+    double a_block[ARRAY_BLOCK];
+    double b_block[ARRAY_BLOCK];
+
+    for (size_t start = 0; start < count; start += ARRAY_BLOCK) {
+        size_t length   = block_length(start, count);
+        const double* x = (a == NULL || a_stride == 1) ? ((a == NULL) ? NULL : a + start) : a_block;
+        const double* y = (b == NULL || b_stride == 1) ? ((b == NULL) ? NULL : b + start) : b_block;
+
+        if (x == a_block) {
+            array_gather(a + start * a_stride, a_stride, a_block, length);
+        }
+        if (y == b_block) {
+            array_gather(b + start * b_stride, b_stride, b_block, length);
+        }
+        elementwise_contiguous(op, x, a_scalar, y, b_scalar, out + start, length);
+    }
+}
+
+
+double array_sum(const double* values, size_t stride, size_t count) {
+    if (stride == 1) {
+        return sum_contiguous(values, count);
+    }
+
+    double block[ARRAY_BLOCK];
+    double total = 0.0;
+    for (size_t start = 0; start < count; start += ARRAY_BLOCK) {
+        size_t length = block_length(start, count);
+        array_gather(values + start * stride, stride, block, length);
+        total += sum_contiguous(block, length);
+    }
+    return total;
+}
+
+
+double array_dot(const double* a, size_t a_stride, const double* b, size_t b_stride, size_t count) {
+    if (a_stride == 1 && b_stride == 1) {
+        return dot_contiguous(a, b, count);
+    }
+
+    double a_block[ARRAY_BLOCK];
+    double b_block[ARRAY_BLOCK];
+    double total = 0.0;
+    for (size_t start = 0; start < count; start += ARRAY_BLOCK) {
+        size_t length = block_length(start, count);
+        array_gather(a + start * a_stride, a_stride, a_block, length);
+        array_gather(b + start * b_stride, b_stride, b_block, length);
+        total += dot_contiguous(a_block, b_block, length);
+    }
+    return total;
+}
+
+
+double array_min(const double* values, size_t stride, size_t count) {
+    if (stride == 1) {
+        return min_contiguous(values, count);
+    }
+
+    double block[ARRAY_BLOCK];
+    double result = values[0];
+    for (size_t start = 0; start < count; start += ARRAY_BLOCK) {
+        size_t length = block_length(start, count);
+        array_gather(values + start * stride, stride, block, length);
+        result = scalar_min(min_contiguous(block, length), result);
+    }
+    return result;
+}
+
+
+double array_max(const double* values, size_t stride, size_t count) {
+    if (stride == 1) {
+        return max_contiguous(values, count);
+    }
+
+    double block[ARRAY_BLOCK];
+    double result = values[0];
+    for (size_t start = 0; start < count; start += ARRAY_BLOCK) {
+        size_t length = block_length(start, count);
+        array_gather(values + start * stride, stride, block, length);
+        result = scalar_max(max_contiguous(block, length), result);
+    }
+    return result;
+}
+
+
+void array_scan(const double* values, size_t stride, double* out, size_t count) {
+    if (stride == 1) {
+        scan_contiguous(values, out, count);
+        return;
+    }
+
+    double block[ARRAY_BLOCK];
+    double carry = 0.0;
+    for (size_t start = 0; start < count; start += ARRAY_BLOCK) {
+        size_t length = block_length(start, count);
+        array_gather(values + start * stride, stride, block, length);
+        scan_contiguous(block, out + start, length);
+
+        for (size_t index = start; index < start + length; index++) {
+            out[index] += carry;
+        }
+        carry = out[start + length - 1];
+    }
+}
@@ -0,0 +1,39 @@
+#ifndef cypsa_array_h
+    #define cypsa_array_h
+
+    #include "common.h"
+
+    /* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+     * Kernels over arrays of doubles - the work behind elementwise arithmetic on arrays (run(), vm.c) and the array
+     * builtins (native.c). They know nothing about Values or objects, just pointers, strides and counts, and are written
+     * with SIMD intrinsics where the target has them (see array.c). Element i of an input is pointer[i * stride]; the
+     * stride is 1 except for a column mapped out of a file (object.h), which is gathered into contiguous blocks of
+     * ARRAY_BLOCK elements on the way through. Outputs are always contiguous.
+     *
+     * array_elementwise():  out[i] = a[i] op b[i]. Either side may instead be a single scalar, broadcast across the
+     *                       whole array: pass a NULL array pointer and the scalar. out may be the same as a or b, if
+     *                       that one's contiguous.
+     * array_gather():       out[i] = values[i * stride] - for anything else which needs a strided array contiguous.
+     * array_scan():         Inclusive prefix sum - out[i] = values[0] + ... + values[i].
+     * The reductions (sum, dot, min, max) keep several partial results in flight at once, so they add up in a different
+     * order to a plain left-to-right loop and may differ from one in the last bits.
+     */
+    typedef enum {
+        ARRAY_ADD,
+        ARRAY_SUBTRACT,
+        ARRAY_MULTIPLY,
+        ARRAY_DIVIDE
+    } ArrayOp;
+
+    #define ARRAY_BLOCK 1024
+
+    void array_elementwise(ArrayOp op, const double* a, size_t a_stride, double a_scalar,
+                           const double* b, size_t b_stride, double b_scalar, double* out, size_t count);
+    void array_gather(const double* values, size_t stride, double* out, size_t count);
+    double array_sum(const double* values, size_t stride, size_t count);
+    double array_dot(const double* a, size_t a_stride, const double* b, size_t b_stride, size_t count);
+    double array_min(const double* values, size_t stride, size_t count);
+    double array_max(const double* values, size_t stride, size_t count);
+    void array_scan(const double* values, size_t stride, double* out, size_t count);
+
+#endif
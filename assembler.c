@@ -0,0 +1,485 @@
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "assembler.h"
+#include "debug.h"
+#include "memory.h"
+#include "native.h"
+#include "object.h"
+#include "parallel.h"
+#include "table.h"
+#include "vm.h"
+
+#define HEADER_START "* ~ ~ ~ ~ ~ ~ "
+#define HEADER_END   " ~ ~ ~ ~ ~ ~ *"
+#define WIDE_SUFFIX  " [wide]"
+
+/*
+ * One line of the text at a time. at moves along it as it's read; end is its '\n' (or the end of the text).
+ *      line:       Which line of the text it is, for errors.
+ *      hiterror:   Whether any line has been wrong so far. The rest are still read, so that every mistake is reported.
+ *      resync:     Whether the line before was wrong, in which case this one's offset is taken as given - otherwise one
+ *                  mistake would put every offset after it out too.
+ *      drift:      How far the offsets have been put out by resyncing, since the lines that were wrong weren't written.
+ */
+typedef struct {
+    const char* at;
+    const char* end;
+    int line;
+    bool hiterror;
+    bool resync;
+    long drift;
+} Cursor;
+
+static void error(Cursor* cursor, const char* format, ...) {
+    fprintf(stderr, "[line %d] Error: ", cursor->line);
+
+    va_list args;
+    va_start(args, format);
+    vfprintf(stderr, format, args);
+    va_end(args);
+
+    fputs("\n", stderr);
+    cursor->hiterror = true;
+    cursor->resync   = true;
+}
+
+
+static bool match(Cursor* cursor, const char* text) {
+    size_t length = strlen(text);
+    if ((size_t)(cursor->end - cursor->at) < length || memcmp(cursor->at, text, length) != 0) {
+        return false;
+    }
+    cursor->at += length;
+    return true;
+}
+
+
+static void skip_spaces(Cursor* cursor) {
+    while (cursor->at < cursor->end && *cursor->at == ' ') {
+        cursor->at++;
+    }
+}
+
+
+static bool read_number(Cursor* cursor, long* number) {
+    const char* start = cursor->at;
+    long value        = 0;
+
+    while (cursor->at < cursor->end && *cursor->at >= '0' && *cursor->at <= '9' && value <= WIDE_OPERAND_MAX) {
+        value = value * 10 + (*cursor->at++ - '0');
+    }
+    *number = value;
+    return cursor->at > start;
+}
+
+
+// [number], with any amount of padding in front of it
+static bool read_operand_number(Cursor* cursor, long* number) {
+    skip_spaces(cursor);
+    if (!match(cursor, "[")) {
+        return false;
+    }
+    skip_spaces(cursor);
+    return read_number(cursor, number) && match(cursor, "]");
+}
+
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+ * Constants. A value is whatever the disassembler made of it (debug.c), read back as best it can be (see assembler.h).
+ * defined remembers which indices have been given a value, so that two lines can't give the same one different values.
+ */
+typedef struct {
+    bool* defined;
+    int capacity;
+} Defined;
+
+static bool parse_constant(Cursor* cursor, const char* text, int length, Value* value) {
+    if (length == 3 && memcmp(text, "nil", 3) == 0) {
+        *value = NIL_VAL;
+        return true;
+    }
+    if (length == 4 && memcmp(text, "true", 4) == 0) {
+        *value = BOOL_VAL(true);
+        return true;
+    }
+    if (length == 5 && memcmp(text, "false", 5) == 0) {
+        *value = BOOL_VAL(false);
+        return true;
+    }
+    if (length > 6 && memcmp(text, "<func ", 6) == 0 && text[length - 1] == '>') {
+        error(cursor, "Can't assemble the function constant %.*s - only its name was printed.", length, text);
+        return false;
+    }
+
+    char number[64];
+    if (length > 0 && length < (int)sizeof(number)) {
+        memcpy(number, text, length);
+        number[length] = '\0';
+
+        char* parsed;
+        double as_number = strtod(number, &parsed);
+        if (parsed == number + length) {
+            *value = NUMBER_VAL(as_number);
+            return true;
+        }
+    }
+
+    *value = OBJ_VAL(intern_string(text, length));
+    return true;
+}
+
+
+static bool place_constant(Cursor* cursor, Nugget* nugget, Defined* defined, long index, Value value) {
+    while (nugget->constants.occupied <= index) {
+        write_valuepool(&nugget->constants, NIL_VAL);
+    }
+    if (index >= defined->capacity) {
+        int capacity = defined->capacity;
+        while (capacity <= index) {
+            capacity = GROW_CAPACITY(capacity);
+        }
+        defined->defined = realloc(defined->defined, sizeof(bool) * capacity);
+        check_failure(defined->defined, "Unable to grow the assembler's constant list.", sizeof(bool) * capacity);
+        memset(defined->defined + defined->capacity, 0, sizeof(bool) * (capacity - defined->capacity));
+        defined->capacity = capacity;
+    }
+
+    if (defined->defined[index] && !values_equal(nugget->constants.values[index], value)) {
+        error(cursor, "Constant [%ld] has already been given a different value.", index);
+        return false;
+    }
+    nugget->constants.values[index] = value;
+    defined->defined[index]         = true;
+    return true;
+}
+
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+ * Globals. Slot numbers are the VM's (vm.h), so the name printed next to one is given that slot there. A slot nobody
+ * has named yet gets a placeholder, which can't be a real name since it isn't an identifier.
+ */
+static bool is_placeholder(ObjString* name) {
+    return name->length > 0 && name->chars[0] == '<';
+}
+
+
+static ObjString* placeholder_name(long slot) {
+    char name[32];
+    int length = snprintf(name, sizeof(name), "<slot %ld>", slot);
+    return intern_string(name, length);
+}
+
+
+static bool resolve_global(Cursor* cursor, long slot, const char* text, int length) {
+    if (slot > WIDE_OPERAND_MAX) {
+        error(cursor, "Global slot %ld is out of range.", slot);
+        return false;
+    }
+    while (vm.globals.occupied < slot) {
+        add_global(placeholder_name(vm.globals.occupied));
+    }
+    if (length == 0) {
+        if (vm.globals.occupied == slot) {
+            add_global(placeholder_name(slot));
+        }
+        return true;
+    }
+
+    ObjString* name = intern_string(text, length);
+    Value existing;
+    if (table_get(&vm.global_slots, name, &existing)) {
+        if ((long)AS_NUMBER(existing) != slot) {
+            error(cursor, "'%s' is global slot %ld already, not %ld.", name->chars, (long)AS_NUMBER(existing), slot);
+            return false;
+        }
+        return true;
+    }
+
+    if (vm.globals.occupied == slot) {
+        add_global(name);
+        return true;
+    }
+
+    ObjString* current = AS_STRING(vm.global_names.values[slot]);
+    if (!is_placeholder(current)) {
+        error(cursor, "Global slot %ld is '%s' already, not '%s'.", slot, current->chars, name->chars);
+        return false;
+    }
+    table_delete(&vm.global_slots, current);
+    table_set(&vm.global_slots, name, NUMBER_VAL(slot));
+    vm.global_names.values[slot] = OBJ_VAL(name);
+    return true;
+}
+
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+ * Property caches (nugget.h). The index says which of the nugget's caches the instruction uses, and the name (and, for
+ * INVOKE, the argument count) what it's for. Caches skipped over get placeholder names, like global slots, until a
+ * later line says what they are; a cache which already has a name has to be given the same one again.
+ */
+static bool place_property_cache(Cursor* cursor, Nugget* nugget, long index, const char* text, int length, bool invoke) {
+    int arg_count = 0;
+    const char* open = memchr(text, ' ', length);
+    if (invoke) {
+        char* parsed;
+        if (open == NULL || open[1] != '(' || text[length - 1] != ')') {
+            error(cursor, "Expected the method's name, then how many arguments it's called with in brackets.");
+            return false;
+        }
+        long count = strtol(open + 2, &parsed, 10);
+        if (parsed != text + length - 1 || count < 0 || count > UINT8_MAX) {
+            error(cursor, "Expected an argument count between 0 and %d.", UINT8_MAX);
+            return false;
+        }
+        arg_count = (int)count;
+        length    = (int)(open - text);
+    } else if (open != NULL) {
+        error(cursor, "Expected just the property's name after the operand.");
+        return false;
+    }
+    if (length == 0) {
+        error(cursor, "Expected the property's name after the operand.");
+        return false;
+    }
+    if (index > WIDE_OPERAND_MAX) {
+        error(cursor, "Property cache %ld is out of range.", index);
+        return false;
+    }
+
+    while (nugget->cache_count <= index) {
+        char placeholder[32];
+        int placeholder_length = snprintf(placeholder, sizeof(placeholder), "<cache %d>", nugget->cache_count);
+        add_property_cache(nugget, intern_string(placeholder, placeholder_length), 0);
+    }
+
+    PropertyCache* cache = &nugget->caches[index];
+    ObjString* name      = intern_string(text, length);
+    if (is_placeholder(cache->name)) {
+        cache->name      = name;
+        cache->arg_count = arg_count;
+        return true;
+    }
+    if (cache->name != name || cache->arg_count != arg_count) {
+        error(cursor, "Property cache [%ld] is for '%s' (%d) already, not '%s' (%d).", index, cache->name->chars,
+              cache->arg_count, name->chars, arg_count);
+        return false;
+    }
+    return true;
+}
+
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+ * One instruction line, from the opcode name on. Works out the operand to write, and checks whatever was printed
+ * alongside it. line holds the source line of the instruction before, for '|>', and is updated.
+ */
+static bool read_instruction(Cursor* cursor, Nugget* nugget, Defined* defined, int* line) {
+    long offset;
+    if (!read_number(cursor, &offset) || !match(cursor, "\t->\t")) {
+        error(cursor, "Expected an instruction's offset, then a tab, '->' and a tab.");
+        return false;
+    }
+    if (cursor->resync) {
+        cursor->resync = false;
+    } else if (offset != nugget->occupied + cursor->drift) {
+        error(cursor, "This instruction is at offset %04ld, not %04ld.", nugget->occupied + cursor->drift, offset);
+        return false;
+    }
+    cursor->drift = offset - nugget->occupied;
+
+    if (match(cursor, "     |> ")) {
+        if (offset == 0) {
+            error(cursor, "The first instruction needs a line number rather than '|>'.");
+            return false;
+        }
+    } else {
+        long source_line;
+        skip_spaces(cursor);
+        if (!read_number(cursor, &source_line) || !match(cursor, " ")) {
+            error(cursor, "Expected a line number, or '|>', after the offset.");
+            return false;
+        }
+        *line = (int)source_line;
+    }
+
+    const char* name = cursor->at;
+    while (cursor->at < cursor->end && *cursor->at != ' ') {
+        cursor->at++;
+    }
+    int name_length = (int)(cursor->at - name);
+    int opcode      = find_opcode(name, name_length);
+    if (opcode < 0) {
+        error(cursor, "Unknown opcode '%.*s'.", name_length, name);
+        return false;
+    }
+
+    // What's printed after the [operand], if anything, is the rest of the line
+    long number           = 0;
+    uint32_t operand      = 0;
+    OperandFormat format  = operand_format((uint8_t)opcode);
+    int size              = instruction_size(nugget, (uint8_t)opcode);
+    const char* rest      = NULL;
+    int rest_length       = 0;
+
+    if (format != OPERAND_NONE && !read_operand_number(cursor, &number)) {
+        error(cursor, "Expected %.*s's operand, in square brackets.", name_length, name);
+        return false;
+    }
+    if (format == OPERAND_CONSTANT || format == OPERAND_GLOBAL || format == OPERAND_NATIVE ||
+        format == OPERAND_PARALLEL || format == OPERAND_PROPERTY || format == OPERAND_INVOKE) {
+        if (!match(cursor, "  ") && !(format == OPERAND_GLOBAL && cursor->at == cursor->end)) {
+            error(cursor, "Expected two spaces after the operand.");
+            return false;
+        }
+        rest        = cursor->at;
+        rest_length = (int)(cursor->end - cursor->at);
+        cursor->at  = cursor->end;
+    }
+
+    switch (format) {
+        case OPERAND_NONE:
+            break;
+        case OPERAND_CONSTANT: {
+            Value value;
+            if (!parse_constant(cursor, rest, rest_length, &value) || !place_constant(cursor, nugget, defined, number,
+                                                                                      value)) {
+                return false;
+            }
+            operand = (uint32_t)number;
+            break;
+        }
+        case OPERAND_LOCAL:
+        case OPERAND_COUNT:
+            operand = (uint32_t)number;
+            break;
+        case OPERAND_GLOBAL:
+            if (!resolve_global(cursor, number, rest, rest_length)) {
+                return false;
+            }
+            operand = (uint32_t)number;
+            break;
+        case OPERAND_NATIVE:
+            if (number >= native_count || (int)strlen(natives[number].name) != rest_length ||
+                memcmp(natives[number].name, rest, rest_length) != 0) {
+                error(cursor, "Native [%ld] isn't '%.*s'.", number, rest_length, rest);
+                return false;
+            }
+            operand = (uint32_t)number;
+            break;
+        case OPERAND_PARALLEL:
+            if (number >= PARALLEL_KINDS || (int)strlen(parallel_kind_name((ParallelKind)number)) != rest_length ||
+                memcmp(parallel_kind_name((ParallelKind)number), rest, rest_length) != 0) {
+                error(cursor, "Parallel loop kind [%ld] isn't '%.*s'.", number, rest_length, rest);
+                return false;
+            }
+            operand = (uint32_t)number;
+            break;
+        case OPERAND_JUMP:
+        case OPERAND_LOOP: {
+            long target;
+            if (number != offset || !match(cursor, " -> ") || !read_number(cursor, &target)) {
+                error(cursor, "Expected the jump's own offset in square brackets, then '->' and where it goes.");
+                return false;
+            }
+            long next     = offset + size;
+            long distance = (format == OPERAND_JUMP) ? target - next : next - target;
+            if (distance < 0) {
+                error(cursor, "%.*s can only jump %s.", name_length, name,
+                      (format == OPERAND_JUMP) ? "forwards" : "backwards");
+                return false;
+            }
+            number  = distance;
+            operand = (uint32_t)distance;
+            break;
+        }
+        case OPERAND_PROPERTY:
+        case OPERAND_INVOKE:
+            if (!place_property_cache(cursor, nugget, number, rest, rest_length, format == OPERAND_INVOKE)) {
+                return false;
+            }
+            operand = (uint32_t)number;
+            break;
+    }
+
+    if (cursor->at != cursor->end) {
+        error(cursor, "Unexpected '%.*s' after the instruction.", (int)(cursor->end - cursor->at), cursor->at);
+        return false;
+    }
+
+    long limit = (nugget->encoding == ENCODING_WIDE) ? WIDE_OPERAND_MAX : (1L << (8 * (size - 1))) - 1;
+    if (number > limit) {
+        error(cursor, "%ld is too big for %.*s's operand here (at most %ld).", number, name_length, name, limit);
+        return false;
+    }
+
+    write_instruction(nugget, (uint8_t)opcode, operand, *line);
+    return true;
+}
+
+
+/*
+ * Assemble text into nugget (see assembler.h). name gets the name from the header.
+ */
+bool assemble(const char* text, Nugget* nugget, char name[ASSEMBLER_NAME_MAX]) {
+    Cursor cursor     = {text, text, 0, false, false, 0};
+    Defined defined   = {NULL, 0};
+    bool header       = false;
+    int line          = 0;
+
+    init_nugget(nugget);
+    vm.nugget = nugget;
+
+    while (*cursor.at != '\0') {
+        cursor.line++;
+        cursor.end = strchr(cursor.at, '\n');
+        if (cursor.end == NULL) {
+            cursor.end = cursor.at + strlen(cursor.at);
+        }
+        const char* next = (*cursor.end == '\n') ? cursor.end + 1 : cursor.end;
+        if (cursor.end > cursor.at && cursor.end[-1] == '\r') {
+            cursor.end--;
+        }
+
+        if (cursor.at == cursor.end) {
+            DO_NOTHING
+        } else if (match(&cursor, HEADER_START)) {
+            int length = (int)(cursor.end - cursor.at) - (int)strlen(HEADER_END);
+            if (header) {
+                error(&cursor, "Only one nugget can be assembled at a time.");
+            } else if (length < 0 || memcmp(cursor.at + length, HEADER_END, strlen(HEADER_END)) != 0) {
+                error(&cursor, "Expected the header to end with '%s'.", HEADER_END);
+            } else {
+                int suffix = (int)strlen(WIDE_SUFFIX);
+                if (length >= suffix && memcmp(cursor.at + length - suffix, WIDE_SUFFIX, suffix) == 0) {
+                    nugget->encoding = ENCODING_WIDE;
+                    length -= suffix;
+                }
+                snprintf(name, ASSEMBLER_NAME_MAX, "%.*s", length, cursor.at);
+            }
+            header = true;
+        } else if (!header) {
+            error(&cursor, "Expected the header, '%sname%s', before any instructions.", HEADER_START, HEADER_END);
+            header = true;
+        } else {
+            read_instruction(&cursor, nugget, &defined, &line);
+        }
+
+        cursor.at = next;
+    }
+
+    free(defined.defined);
+
+    if (!header) {
+        cursor.line++;
+        error(&cursor, "Expected the header, '%sname%s'.", HEADER_START, HEADER_END);
+    }
+    if (cursor.hiterror) {
+        free_nugget(nugget);
+        vm.nugget = NULL;
+        return false;
+    }
+
+    finalize_nugget(nugget);
+    return true;
+}
@@ -0,0 +1,43 @@
+#ifndef cypsa_assembler_h
+    #define cypsa_assembler_h
+
+    #include "common.h"
+    #include "nugget.h"
+
+    /* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+     * The assembler: builds a nugget from text in exactly the format disassemble_nugget() prints (debug.c), so that code
+     * can be written, or a compiled listing edited, by hand and run without going anywhere near the compiler - to time
+     * the VM on one precise mix of instructions, say. Disassembling what it builds gives back the very same text.
+     *
+     * The text is the header line, '* ~ ~ ~ ~ ~ ~ name ~ ~ ~ ~ ~ ~ *' (with ' [wide]' after the name for the wide
+     * encoding), then one instruction per line:
+     *      0004 -> 2 OPCODE_CONSTANT  [   1]  10
+     *      0006 -> |> OPCODE_GREATER
+     * (spaced out with tabs in the real thing): the offset, a tab, '->', a tab, then the source line (or '|>' for the
+     * same line as the instruction before), the opcode's name and its operand in the format debug.h gives for it. Blank
+     * lines are skipped. Each offset has to be where the instruction really lands - the sizes of the ones before it add
+     * up to it - which catches a line left out or put in by mistake.
+     *
+     * Operands are taken at their word, with a couple of exceptions:
+     *      Constants:  The index says where in the constant pool the value goes. The value is read back the way it was
+     *                  printed - nil, true, false, a number, and anything else is a string. Numbers are printed with
+     *                  as many digits as it takes to come back exactly; a string which looks like a number comes back
+     *                  as one. A function can't be rebuilt from its name, so '<func name>' is an error.
+     *      Globals:    The name printed with a slot is given that slot in the VM, if it hasn't got one already; a slot
+     *                  named differently already is an error. Slots skipped over are filled in with placeholder names,
+     *                  which a later line can rename.
+     *      Natives, parallel loops:  The name has to match what the index stands for in this build.
+     *      Jumps:      The target is turned back into a distance from the end of the instruction.
+     *      Properties: The index says which of the nugget's property caches the instruction uses, and the name (and
+     *                  argument count, for INVOKE) is what the cache is for. Like global slots, caches skipped over
+     *                  get placeholders until a later line names them, and a cache named differently already is an error.
+     *
+     * The nugget is finalized and ready to run (run_nugget(), vm.c). Its constants are safe from the garbage collector only
+     * while vm.nugget points at it, as for any nugget - which is where assemble() leaves it. On failure the errors have
+     * been reported, by line of the text, and nugget has been freed.
+     */
+    #define ASSEMBLER_NAME_MAX 64
+
+    bool assemble(const char* text, Nugget* nugget, char name[ASSEMBLER_NAME_MAX]);
+
+#endif
@@ -0,0 +1,93 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "column.h"
+#include "object.h"
+
+
+static _Thread_local char message[256];
+
+
+static bool whole_number(double number, double least) {
+    return number >= least && number == floor(number) && number <= (double)(SIZE_MAX / sizeof(double));
+}
+
+
+static const char* file_error(const char* what, const char* path) {
+    snprintf(message, sizeof(message), "Could not %s '%s' (%s).", what, path, strerror(errno));
+    return message;
+}
+
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+ * Only the pages from the first element to the last are mapped - the offset handed to mmap() has to be a whole number
+ * of pages, so the mapping may start a little before the first element, and values points that far in.
+ */
+const char* map_column(const char* path, double offset, double stride, double count, Value* result) {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+    (void)path; (void)offset; (void)stride; (void)count; (void)result;
+    return "Columns are little-endian, and this machine isn't.";
+#else
+    if (!whole_number(offset, 0) || !whole_number(stride, 1)) {
+        return "Offset must be a non-negative whole number, and stride a positive one.";
+    }
+    if (count >= 0 && !whole_number(count, 0)) {
+        return "Count must be a whole number (or negative for the rest of the file).";
+    }
+
+    int descriptor = open(path, O_RDONLY);
+    if (descriptor < 0) {
+        return file_error("open", path);
+    }
+
+    struct stat status;
+    if (fstat(descriptor, &status) != 0) {
+        close(descriptor);
+        return file_error("read", path);
+    }
+    if (status.st_size % sizeof(double) != 0) {
+        close(descriptor);
+        snprintf(message, sizeof(message), "'%s' isn't a whole number of doubles (%lld bytes).", path,
+                 (long long)status.st_size);
+        return message;
+    }
+
+    size_t total     = (size_t)status.st_size / sizeof(double);
+    size_t first     = (size_t)offset;
+    size_t step      = (size_t)stride;
+    size_t available = (first < total) ? (total - first + step - 1) / step : 0;
+    size_t length    = (count < 0) ? available : (size_t)count;
+
+    if (first > total || length > available) {
+        close(descriptor);
+        snprintf(message, sizeof(message), "'%s' only has %zu doubles.", path, total);
+        return message;
+    }
+    if (length == 0) {
+        close(descriptor);
+        *result = OBJ_VAL(new_array(0));
+        return NULL;
+    }
+
+    size_t page  = (size_t)sysconf(_SC_PAGESIZE);
+    size_t start = first * sizeof(double);
+    size_t end   = (first + (length - 1) * step + 1) * sizeof(double);
+    size_t base  = start & ~(page - 1);
+
+    void* mapping = mmap(NULL, end - base, PROT_READ, MAP_SHARED, descriptor, (off_t)base);
+    close(descriptor);
+    if (mapping == MAP_FAILED) {
+        return file_error("map", path);
+    }
+    madvise(mapping, end - base, MADV_SEQUENTIAL);
+
+    double* values = (double*)((char*)mapping + (start - base));
+    *result = OBJ_VAL(new_mapped_array(mapping, end - base, values, step, length));
+    return NULL;
+#endif
+}
@@ -0,0 +1,30 @@
+#ifndef cypsa_column_h
+    #define cypsa_column_h
+
+    #include "common.h"
+    #include "values.h"
+
+    /* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+     * Columns of doubles straight out of a binary file, without reading it in:
+     *      map_column(path)                          Every double in the file.
+     *      map_column(path, offset, stride, count)   count doubles, starting offset doubles in and stride doubles apart -
+     *                                                one column of a file of rows, say. A negative count means as many
+     *                                                as there are to the end of the file.
+     * The file is raw little-endian IEEE doubles, nothing else - what numpy's tofile() writes, for instance. Its length
+     * must be a whole number of doubles.
+     *
+     * The result is an ordinary array as far as scripts can tell, except that it can't be written to. Underneath, it's
+     * a read-only shared mapping of just the pages the column lies on (object.h), which the kernel is told will be read
+     * front to back, so it reads ahead and drops pages behind. Nothing is copied: sum(), min(), arithmetic and the rest
+     * stream over the mapping through the same kernels as any other array (array.h), so a column can be far bigger
+     * than memory. The mapping goes when the array is collected.
+     *
+     * The file shouldn't change underneath a mapped column. If it's made shorter, touching a page that's gone kills the
+     * process with SIGBUS - that's mmap(), and there's nothing sensible to recover to.
+     *
+     * map_column() returns NULL and the array in *result, or an error message, like a native (native.h). Hosts which
+     * aren't little-endian get an error, rather than a column of nonsense.
+     */
+    const char* map_column(const char* path, double offset, double stride, double count, Value* result);
+
+#endif
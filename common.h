@@ -10,6 +10,10 @@
     #define LOOP for(;;)
     #define EXIT_SUCCESS 0
     #define DEBUG_TRACE_EXECUTION
+    // #define DEBUG_NUGGET_FOOTPRINT
+    // #define DEBUG_TABLE_STATS
+    // #define DEBUG_STRESS_GC
+    // #define DEBUG_STRESS_INCREMENTAL
     #define DO_NOTHING ;
 
 #endif
\ No newline at end of file
@@ -1,19 +1,103 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include "common.h"
 #include "compiler.h"
+#include "memory.h"
+#include "native.h"
+#include "object.h"
+#include "parallel.h"
+#include "perf.h"
 #include "scanner.h"
+#include "vm.h"
 
+#ifdef DEBUG_PRINT_CODE
+    #include "debug.h"
+#endif
 
+
+/*
+ * tokens:  When the source was scanned up front (see compile()), the tokens still to be read start here.
+ * queue:   When a scanner thread is feeding tokens through a queue instead, that queue.
+ * With neither, the compiler pulls tokens from the scanner itself, one at a time.
+ */
 typedef struct {
     Token current;
     Token previous;
     bool hiterror;
     bool panicking;
+    const Token* tokens;
+    TokenQueue* queue;
 } Parser;
 
-Parser parser;
-Nugget* compiling_nugget;
+/*
+ * Operator precedences, lowest to highest. The Pratt parser climbs this list: parse_precedence(p) keeps consuming
+ * infix operators as long as they bind at least as tightly as p.
+ */
+typedef enum {
+    PREC_NONE,
+    PREC_ASSIGNMENT,  // =
+    PREC_OR,          // or
+    PREC_AND,         // and
+    PREC_EQUALITY,    // == !=
+    PREC_COMPARISON,  // < > <= >=
+    PREC_TERM,        // + -
+    PREC_FACTOR,      // * /
+    PREC_UNARY,       // ! -
+    PREC_CALL,        // . () []
+    PREC_PRIMARY
+} Precedence;
+
+typedef void (*ParseFn)(bool can_assign);
+
+typedef struct {
+    ParseFn prefix;
+    ParseFn infix;
+    Precedence precedence;
+} ParseRule;
+
+/*
+ * Variables are resolved to numeric slots while compiling, so the VM never has to look a name up at runtime.
+ *      Locals:   Live on the VM stack. The compiler mirrors what the stack will look like with the locals[] array -
+ *                a local's index in locals[] is exactly its stack slot, which becomes the operand of GET_LOCAL /
+ *                SET_LOCAL. depth is the scope depth it was declared at, or -1 between being declared and having its
+ *                initializer compiled (so that 'var a = a;' can be caught).
+ *      Globals:  Live in the dense vm.globals array. vm.global_slots maps each name to its index, which becomes the
+ *                operand of GET_GLOBAL / SET_GLOBAL / DEFINE_GLOBAL. The table belongs to the VM rather than the
+ *                compiler so that slots carry over between REPL lines.
+ * There's one Compiler per function body being compiled, chained through enclosing, with function NULL for top-level
+ * code. A function's local slots count from the start of its call frame (vm.h), and slot 0 is the callee itself, so
+ * the parameters come next. There are no closures: a function can see its own locals and the globals, nothing else.
+ * The body of a parallel loop is a function too, with parallel set: it mustn't write to anything its workers share
+ * (see parallel.h). pure is set for a function declared 'pure func', which mustn't have side effects (see memo.h).
+ * initializer is set for a class's 'init' method, which always gives back the new instance - 'this', in slot 0.
+ * last_call is the offset of the last CALL or INVOKE emitted, -1 before there's been one, so that a 'return' can tell
+ * whether it returns a call's result directly - a tail call (see return_statement()).
+ */
+#define LOCALS_MAX 256
+
+typedef struct {
+    Token name;
+    int depth;
+} Local;
+
+typedef struct Compiler {
+    struct Compiler* enclosing;
+    ObjFunction* function;
+    Local locals[LOCALS_MAX];
+    int local_count;
+    int scope_depth;
+    int first_new_global;
+    bool parallel;
+    bool pure;
+    bool initializer;
+    int last_call;
+} Compiler;
+
+// One of each per thread, so that fibers running on different threads (fiber.c) can compile at the same time.
+_Thread_local Parser parser;
+_Thread_local Compiler* current = NULL;
+_Thread_local Nugget* compiling_nugget;
 
 static Nugget* current_nugget() {
     return compiling_nugget;
@@ -51,27 +135,29 @@ static void error(const char* message) {
 }
 
 /*
- * For the moment, just read one token at a time using scan_token() and print it.
- * A cool feature - the printf specified '%.*s' prints the first token.length characters starting at token.start.
- * This specifier therefore lets you pass the precision to which you want to print (in this case, the number of
- * characters) to printf as a separate argument. We need this here because a token .start pointer is pointing
- * somewhere into the original source string, so there is no NUL terminator at the end of the corresponding substring.
- * The * in the format specifier lets us limit this using an argument.
+ * Where the compiler gets its next token from: the pre-scanned token list or the scanner thread's queue if there is
+ * one, otherwise the scanner, one token at a time. All three keep returning TOKEN_EOF once they reach the end, as
+ * match(TOKEN_EOF) advances past it.
  */
-bool compile(Nugget* nugget, const char* source) {
-    init_scanner(source);
-    parser.hiterror = false;
-    parser.panicking = false;
-    advance();
-    expression();
-    consume(TOKEN_EOF, "Expected end of expression!");
+static Token next_token() {
+    if (parser.tokens != NULL) {
+        Token token = *parser.tokens;
+        if (token.type != TOKEN_EOF) {
+            parser.tokens++;
+        }
+        return token;
+    }
+    if (parser.queue != NULL) {
+        return take_token(parser.queue);
+    }
+    return scan_token();
 }
 
 
 static void advance() {
     parser.previous = parser.current;
 
-    for LOOP {
+    LOOP {
         parser.current = next_token();
 
         if (parser.current.type != TOKEN_ERROR) {
@@ -93,11 +179,1794 @@ static void consume(TokenType type, const char* message) {
 }
 
 
-static void emit_byte(uint8_t byte) {
-    write_nugget(current_nugget(), byte, parser.previous.line);
+static bool check(TokenType type) {
+    return (parser.current.type == type);
+}
+
+
+static bool match(TokenType type) {
+    if (!check(type)) {
+        return false;
+    }
+
+    advance();
+    return true;
+}
+
+
+/*
+ * Emitting bytecode. emit_opcode() writes a whole operand-less instruction and emit_operand() one with its operand -
+ * an opcode byte and the operand's bytes, or a single 32-bit word, depending on the encoding the nugget was created
+ * with (see nugget.h). Everything goes through these and emit_constant(), never raw bytes, so that both encodings work.
+ */
+static void emit_opcode(uint8_t opcode) {
+    write_instruction(current_nugget(), opcode, 0, parser.previous.line);
+}
+
+
+static void emit_operand(uint8_t opcode, uint32_t operand) {
+    write_instruction(current_nugget(), opcode, operand, parser.previous.line);
+}
+
+
+static void emit_constant(Value value) {
+    write_constant(current_nugget(), value, parser.previous.line);
+}
+
+
+/*
+ * Jumps. A jump's operand is a distance in bytes, counted from the end of the jump instruction: forwards for JUMP and
+ * JUMP_IF_FALSE, backwards for LOOP. A forward jump is emitted before we know how far it goes, so emit_jump() writes a
+ * placeholder and returns where the instruction starts, and patch_jump() fills the distance in once the code being
+ * jumped over has been compiled.
+ */
+static uint32_t jump_limit() {
+    return (current_nugget()->encoding == ENCODING_WIDE) ? WIDE_OPERAND_MAX : UINT16_MAX;
+}
+
+
+static int emit_jump(uint8_t opcode) {
+    int offset = current_nugget()->occupied;
+    emit_operand(opcode, 0);
+    return offset;
+}
+
+
+static void patch_jump(int offset) {
+    Nugget* nugget = current_nugget();
+    int distance   = nugget->occupied - (offset + instruction_size(nugget, read_opcode(nugget, offset)));
+
+    if ((uint32_t)distance > jump_limit()) {
+        error("Too much code to jump over.");
+        return;
+    }
+    patch_operand(nugget, offset, (uint32_t)distance);
+}
+
+
+static void emit_loop(int loop_start) {
+    Nugget* nugget = current_nugget();
+    int distance   = nugget->occupied + instruction_size(nugget, OPCODE_LOOP) - loop_start;
+
+    if ((uint32_t)distance > jump_limit()) {
+        error("Loop body too large.");
+        distance = 0;
+    }
+    emit_operand(OPCODE_LOOP, (uint32_t)distance);
+}
+
+
+static void init_compiler(Compiler* compiler, ObjFunction* function) {
+    compiler->enclosing        = current;
+    compiler->function         = function;
+    compiler->local_count      = 0;
+    compiler->scope_depth      = 0;
+    compiler->first_new_global = vm.globals.occupied;
+    compiler->parallel         = false;
+    compiler->pure             = (function != NULL) && function->declared_pure;
+    compiler->initializer      = (function != NULL) && function->method && function->name->length == 4 &&
+                                 memcmp(function->name->chars, "init", 4) == 0;
+    compiler->last_call        = -1;
+    current = compiler;
+
+    if (function != NULL) {
+        Local* callee = &compiler->locals[compiler->local_count++];
+        callee->name  = (Token){TOKEN_IDENTIFIER, "", 0, 0};
+        callee->depth = 0;
+    }
+}
+
+
+static void end_compiler() {
+    emit_opcode(OPCODE_RETURN);
+
+    #ifdef DEBUG_PRINT_CODE
+        if (!parser.hiterror) {
+            disassemble_nugget(current_nugget(), "code");
+        }
+    #endif
+}
+
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+ * Expressions are parsed without recursing in C, so that nesting depth is limited only by memory rather than by the C
+ * stack: (((((1))))) a hundred thousand levels deep, or a - - - - ... chain, is fine.
+ * The parser is still Pratt's, rules table and all, but every parse_precedence() in progress is an ExprFrame on an
+ * explicit, heap-allocated stack instead of a C stack frame. Where a rule would have called parse_precedence() (or
+ * expression()) for an operand, it calls expect_operand() instead, which records on the rule's own frame what's left to
+ * do once that operand has been compiled (its ExprResume), and pushes a fresh frame for the operand. When the operand's
+ * frame finishes, parse_precedence() pops it and calls the matching resume_*() function to pick up where the rule left
+ * off - emitting the operator, consuming the closing bracket, moving on to the next argument, and so on.
+ *
+ * struct ExprFrame:
+ *      precedence, can_assign: As for the recursive parse_precedence() call this frame stands in for.
+ *      resume:                 What to do when the operand this frame is waiting on is done. RESUME_NONE otherwise.
+ *      operator_type:          Binary and unary operators: which one.
+ *      set_op, slot:           Assignments: the instruction which stores the value, and its variable slot (or for a
+ *                              field, its property cache). Method calls: the INVOKE's property cache, in slot.
+ *      count:                  Array literals and calls: elements / arguments compiled so far.
+ *      name, code_start, constant_start, argument_start, foldable: Native calls - see native_call().
+ *      jump:                   'and' / 'or': the jump to patch once the right-hand side is compiled.
+ *      name, index, kind:      Parallel loops: the element and index variables (index.length is 0 if there isn't
+ *                              one), and what to do with the body's values.
+ */
+typedef enum {
+    RESUME_NONE,
+    RESUME_BINARY,
+    RESUME_UNARY,
+    RESUME_GROUPING,
+    RESUME_ASSIGN,
+    RESUME_ELEMENT,
+    RESUME_INDEX,
+    RESUME_SET_INDEX,
+    RESUME_ARGUMENT,
+    RESUME_LOGICAL,
+    RESUME_CALL,
+    RESUME_INVOKE,
+    RESUME_PARALLEL
+} ExprResume;
+
+typedef struct {
+    Precedence precedence;
+    bool can_assign;
+    ExprResume resume;
+    TokenType operator_type;
+    uint8_t set_op;
+    int slot;
+    uint32_t count;
+    Token name;
+    int code_start;
+    int constant_start;
+    int argument_start;
+    bool foldable;
+    int jump;
+    Token index;
+    int kind;
+} ExprFrame;
+
+typedef struct {
+    ExprFrame* frames;
+    int count;
+    int capacity;
+} ExprStack;
+
+_Thread_local ExprStack expr_stack = {NULL, 0, 0};
+
+
+static ExprFrame* top_frame() {
+    return &expr_stack.frames[expr_stack.count - 1];
+}
+
+
+static void push_frame(Precedence precedence) {
+    if (expr_stack.count == expr_stack.capacity) {
+        int capacity       = GROW_CAPACITY(expr_stack.capacity);
+        ExprFrame* frames  = realloc(expr_stack.frames, sizeof(ExprFrame) * capacity);
+        check_failure(frames, "Unable to grow the expression stack.", sizeof(ExprFrame) * capacity);
+        expr_stack.frames   = frames;
+        expr_stack.capacity = capacity;
+    }
+
+    ExprFrame* frame  = &expr_stack.frames[expr_stack.count++];
+    frame->precedence = precedence;
+    frame->can_assign = (precedence <= PREC_ASSIGNMENT);
+    frame->resume     = RESUME_NONE;
+}
+
+
+/*
+ * Called by a rule which needs an operand compiled before it can carry on. Any ExprFrame pointer held by the caller is
+ * stale after this (the stack may have moved), so set up everything the resume_*() function will need first.
+ */
+static void expect_operand(Precedence precedence, ExprResume resume) {
+    top_frame()->resume = resume;
+    push_frame(precedence);
+}
+
+
+static void free_expr_stack() {
+    free(expr_stack.frames);
+    expr_stack = (ExprStack){NULL, 0, 0};
+}
+
+
+static void expression();
+static void statement();
+static void declaration();
+static ParseRule* get_rule(TokenType type);
+
+
+/*
+ * Infix arithmetic. By the time we get here the left operand has already been compiled and the operator consumed. Compile
+ * the right operand one precedence level higher than this operator (so that 1 - 2 - 3 groups as (1 - 2) - 3), then
+ * emit the instruction which combines the two (resume_binary()).
+ */
+static void binary(bool can_assign) {
+    TokenType operator_type = parser.previous.type;
+    ParseRule* rule = get_rule(operator_type);
+
+    top_frame()->operator_type = operator_type;
+    expect_operand((Precedence)(rule->precedence + 1), RESUME_BINARY);
+}
+
+
+static void resume_binary(ExprFrame* frame) {
+    switch (frame->operator_type) {
+        case TOKEN_PLUS:
+            emit_opcode(OPCODE_ADD);
+            break;
+        case TOKEN_MINUS:
+            emit_opcode(OPCODE_SUBTRACT);
+            break;
+        case TOKEN_STAR:
+            emit_opcode(OPCODE_MULTIPLY);
+            break;
+        case TOKEN_SLASH:
+            emit_opcode(OPCODE_DIVIDE);
+            break;
+        case TOKEN_NOTEQUAL:
+            emit_opcode(OPCODE_EQUAL);
+            emit_opcode(OPCODE_NOT);
+            break;
+        case TOKEN_EXACTEQUAL:
+            emit_opcode(OPCODE_EQUAL);
+            break;
+        case TOKEN_GREATER:
+            emit_opcode(OPCODE_GREATER);
+            break;
+        case TOKEN_GREATEREQUAL:
+            emit_opcode(OPCODE_LESS);
+            emit_opcode(OPCODE_NOT);
+            break;
+        case TOKEN_LESS:
+            emit_opcode(OPCODE_LESS);
+            break;
+        case TOKEN_LESSEQUAL:
+            emit_opcode(OPCODE_GREATER);
+            emit_opcode(OPCODE_NOT);
+            break;
+        default:
+            return;
+    }
+}
+
+
+/*
+ * 'and' and 'or' short-circuit. The left operand is already on the stack: 'and' jumps over the right operand if it's
+ * falsey, 'or' if it's truthy, leaving the left operand as the result; otherwise the left operand is popped and the
+ * right one takes its place. There's no JUMP_IF_TRUE, so 'or' gets there with a JUMP_IF_FALSE over an unconditional JUMP.
+ */
+static void and_(bool can_assign) {
+    int end_jump = emit_jump(OPCODE_JUMP_IF_FALSE);
+    emit_opcode(OPCODE_POP);
+
+    top_frame()->jump = end_jump;
+    expect_operand(PREC_AND, RESUME_LOGICAL);
+}
+
+
+static void or_(bool can_assign) {
+    int else_jump = emit_jump(OPCODE_JUMP_IF_FALSE);
+    int end_jump  = emit_jump(OPCODE_JUMP);
+
+    patch_jump(else_jump);
+    emit_opcode(OPCODE_POP);
+
+    top_frame()->jump = end_jump;
+    expect_operand(PREC_OR, RESUME_LOGICAL);
+}
+
+
+static void resume_logical(ExprFrame* frame) {
+    patch_jump(frame->jump);
+}
+
+
+static void literal(bool can_assign) {
+    switch (parser.previous.type) {
+        case TOKEN_FALSE:
+            emit_opcode(OPCODE_FALSE);
+            break;
+        case TOKEN_NIL:
+            emit_opcode(OPCODE_NIL);
+            break;
+        case TOKEN_TRUE:
+            emit_opcode(OPCODE_TRUE);
+            break;
+        default:
+            return;
+    }
+}
+
+
+static void grouping(bool can_assign) {
+    expect_operand(PREC_ASSIGNMENT, RESUME_GROUPING);
+}
+
+
+static void resume_grouping(ExprFrame* frame) {
+    consume(TOKEN_RIGHTPAREN, "Expected ')' after expression.");
+}
+
+
+/*
+ * Array literal: [1, 2, 3]. The elements go onto the stack one after another, and OPCODE_ARRAY gathers that many of
+ * them up into a new array (checking that they're all numbers as it goes). resume_element() runs after each element.
+ */
+static void end_array(uint32_t count) {
+    consume(TOKEN_RIGHTSQUARE, "Expected ']' after array elements.");
+
+    if (count > UINT16_MAX && vm.encoding != ENCODING_WIDE) {
+        error("Too many elements in an array literal.");
+        return;
+    }
+    emit_operand(OPCODE_ARRAY, count);
+}
+
+
+static void array(bool can_assign) {
+    if (check(TOKEN_RIGHTSQUARE)) {
+        end_array(0);
+        return;
+    }
+
+    top_frame()->count = 0;
+    expect_operand(PREC_ASSIGNMENT, RESUME_ELEMENT);
+}
+
+
+static void resume_element(ExprFrame* frame) {
+    frame->count++;
+
+    if (match(TOKEN_COMMA)) {
+        expect_operand(PREC_ASSIGNMENT, RESUME_ELEMENT);
+        return;
+    }
+    end_array(frame->count);
+}
+
+
+/*
+ * array[index], or array[index] = value.
+ */
+static void subscript(bool can_assign) {
+    expect_operand(PREC_ASSIGNMENT, RESUME_INDEX);
+}
+
+
+static void resume_index(ExprFrame* frame) {
+    consume(TOKEN_RIGHTSQUARE, "Expected ']' after index.");
+
+    if (frame->can_assign && match(TOKEN_EQUAL)) {
+        if (current->parallel) {
+            error("Can't write to an array inside a parallel loop - every worker shares it.");
+        }
+        if (current->pure) {
+            error("Can't write to an array inside a pure function.");
+        }
+        expect_operand(PREC_ASSIGNMENT, RESUME_SET_INDEX);
+    } else {
+        emit_opcode(OPCODE_GET_INDEX);
+    }
+}
+
+
+static void resume_set_index(ExprFrame* frame) {
+    emit_opcode(OPCODE_SET_INDEX);
+}
+
+
+/*
+ * callee(arguments). The callee is already on the stack; the arguments go on top of it (resume_call() runs after each
+ * one), and CALL says how many there are. Natives never get here - see named_variable().
+ */
+static void emit_call(int arg_count) {
+    current->last_call = current_nugget()->occupied;
+    emit_operand(OPCODE_CALL, (uint32_t)arg_count);
+}
+
+
+static void emit_invoke(int cache) {
+    current->last_call = current_nugget()->occupied;
+    emit_operand(OPCODE_INVOKE, (uint32_t)cache);
+}
+
+
+static void call(bool can_assign) {
+    if (match(TOKEN_RIGHTPAREN)) {
+        emit_call(0);
+        return;
+    }
+
+    top_frame()->count = 0;
+    expect_operand(PREC_ASSIGNMENT, RESUME_CALL);
+}
+
+
+static void resume_call(ExprFrame* frame) {
+    if (frame->count == UINT8_MAX) {
+        error("Can't have more than 255 arguments.");
+        return;
+    }
+    frame->count++;
+
+    if (match(TOKEN_COMMA)) {
+        expect_operand(PREC_ASSIGNMENT, RESUME_CALL);
+        return;
+    }
+
+    consume(TOKEN_RIGHTPAREN, "Expected ')' after arguments.");
+    emit_call(frame->count);
+}
+
+
+/*
+ * Properties: instance.name, instance.name = value, and instance.name(arguments). Each of these gets a property cache
+ * of its own (nugget.h), which carries the name - the operand is the cache's index. A method call is a single INVOKE
+ * rather than a GET_PROPERTY and then a CALL, so that calling a method doesn't have to make a bound method first; the
+ * number of arguments goes in the cache too, once they've all been compiled (resume_invoke()).
+ * A pure function can't touch properties at all: its results are remembered by its arguments, and an instance passed
+ * as one can have its fields changed from one call to the next without being a different argument.
+ */
+static int property_cache(Token* name) {
+    Nugget* nugget = current_nugget();
+    uint32_t limit = (nugget->encoding == ENCODING_WIDE) ? WIDE_OPERAND_MAX : UINT16_MAX;
+
+    if ((uint32_t)nugget->cache_count > limit) {
+        error("Too many property accesses in one function.");
+        return 0;
+    }
+    return add_property_cache(nugget, intern_string(name->start, name->length), 0);
+}
+
+
+static void dot(bool can_assign) {
+    consume(TOKEN_IDENTIFIER, "Expected a property name after '.'.");
+    Token name = parser.previous;
+
+    if (current->pure) {
+        error("Can't use properties inside a pure function.");
+    }
+
+    if (can_assign && match(TOKEN_EQUAL)) {
+        if (current->parallel) {
+            error("Can't set a field inside a parallel loop - every worker shares the instance.");
+        }
+        ExprFrame* frame = top_frame();
+        frame->set_op    = OPCODE_SET_PROPERTY;
+        frame->slot      = property_cache(&name);
+        expect_operand(PREC_ASSIGNMENT, RESUME_ASSIGN);
+    } else if (match(TOKEN_LEFTPAREN)) {
+        int cache = property_cache(&name);
+        if (match(TOKEN_RIGHTPAREN)) {
+            emit_invoke(cache);
+            return;
+        }
+        ExprFrame* frame = top_frame();
+        frame->slot      = cache;
+        frame->count     = 0;
+        expect_operand(PREC_ASSIGNMENT, RESUME_INVOKE);
+    } else {
+        emit_operand(OPCODE_GET_PROPERTY, property_cache(&name));
+    }
+}
+
+
+static void resume_invoke(ExprFrame* frame) {
+    if (frame->count == UINT8_MAX) {
+        error("Can't have more than 255 arguments.");
+        return;
+    }
+    frame->count++;
+
+    if (match(TOKEN_COMMA)) {
+        expect_operand(PREC_ASSIGNMENT, RESUME_INVOKE);
+        return;
+    }
+
+    consume(TOKEN_RIGHTPAREN, "Expected ')' after arguments.");
+    if (frame->slot < current_nugget()->cache_count) {
+        current_nugget()->caches[frame->slot].arg_count = (int)frame->count;
+    }
+    emit_invoke(frame->slot);
+}
+
+
+/*
+ * 'this' is slot 0 of a method's frame - where the callee would be in any other function (see call_value(), vm.c).
+ */
+static void this_(bool can_assign) {
+    if (current->parallel) {
+        error("Can't use 'this' inside a parallel loop.");
+    } else if (current->function == NULL || !current->function->method) {
+        error("Can't use 'this' outside of a method.");
+    }
+    emit_operand(OPCODE_GET_LOCAL, 0);
+}
+
+
+static void number(bool can_assign) {
+    double value = strtod(parser.previous.start, NULL);
+    emit_constant(NUMBER_VAL(value));
+}
+
+
+/*
+ * String literals are interned straight out of the source - the token's slice minus its two quote marks is looked up
+ * (and, if it's new, copied) by intern_string(), with no intermediate buffer.
+ */
+static void string(bool can_assign) {
+    emit_constant(OBJ_VAL(intern_string(parser.previous.start + 1, parser.previous.length - 2)));
+}
+
+
+/*
+ * Find a local by name, searching from the innermost scope outwards so that shadowing works. Returns its stack slot,
+ * or -1 if there's no such local and the name must be a global.
+ */
+static bool identifiers_equal(Token* a, Token* b) {
+    return (a->length == b->length) && (memcmp(a->start, b->start, a->length) == 0);
 }
 
 
+static int resolve_local(Compiler* compiler, Token* name) {
+    for (int index = compiler->local_count - 1; index >= 0; index--) {
+        Local* local = &compiler->locals[index];
+        if (identifiers_equal(name, &local->name)) {
+            if (local->depth == -1) {
+                error("Can't read a local variable in its own initializer.");
+            }
+            return index;
+        }
+    }
+
+    return -1;
+}
+
+
+/*
+ * Global slot for a name. Globals are late-bound in the sense that a function may mention one which is only declared
+ * further down the file, so a name we haven't seen before is simply given the next free slot in vm.globals. Until a
+ * 'var' actually defines it the slot holds UNDEFINED_VAL, and touching it is a runtime error. The name is interned
+ * straight from the token; since interned strings are unique, the lookup in vm.global_slots is by pointer.
+ */
+static bool global_exists(Token* name) {
+    Value slot;
+    return table_get(&vm.global_slots, intern_string(name->start, name->length), &slot);
+}
+
+
+static int global_slot(Token* name) {
+    ObjString* string = intern_string(name->start, name->length);
+    Value slot;
+
+    if (table_get(&vm.global_slots, string, &slot)) {
+        return (int)AS_NUMBER(slot);
+    }
+
+    if (vm.globals.occupied > WIDE_OPERAND_MAX || (vm.globals.occupied > UINT16_MAX && vm.encoding != ENCODING_WIDE)) {
+        error("Too many global variables.");
+        return 0;
+    }
+
+    return add_global(string);
+}
+
+
+/*
+ * Is the code from start to the end of the nugget exactly one constant load of a number? If so, fetch the number.
+ */
+static bool is_constant_number(int start, Value* value) {
+    Nugget* nugget = current_nugget();
+    uint8_t opcode = read_opcode(nugget, start);
+
+    if ((opcode != OPCODE_CONSTANT && opcode != OPCODE_CONSTANT_LONG) ||
+        (nugget->occupied - start) != instruction_size(nugget, opcode)) {
+        return false;
+    }
+
+    *value = nugget->constants.values[read_operand(nugget, start)];
+    return IS_NUMBER(*value);
+}
+
+
+/*
+ * name(arguments) where name is a native (native.h). The arguments are compiled onto the stack as normal (with
+ * resume_argument() running after each one), and then CALL_NATIVE with the index of the native with that name and
+ * arity - which one that is can only be settled once the arguments have been counted, and after that the VM knows
+ * exactly how many arguments there are.
+ * If the native is pure and every argument compiled down to a single constant number, the call is worked out right now
+ * instead: the argument loads are dropped again (along with their constants, which were the last ones added) and the
+ * result goes in as one constant. Folded results are constants too, so sqrt(max(4, 9)) folds all the way down. A call
+ * that would fail (say, sum(4)) is left for run() to report.
+ */
+static void end_native_call(Token name, int code_start, int constant_start, bool foldable, int arg_count);
+
+static void native_call(Token name) {
+    Nugget* nugget = current_nugget();
+    int code_start = nugget->occupied;
+    int constant_start = nugget->constants.occupied;
+
+    consume(TOKEN_LEFTPAREN, "Native functions can only be called.");
+
+    if (check(TOKEN_RIGHTPAREN)) {
+        end_native_call(name, code_start, constant_start, true, 0);
+        return;
+    }
+
+    ExprFrame* frame      = top_frame();
+    frame->name           = name;
+    frame->code_start     = code_start;
+    frame->constant_start = constant_start;
+    frame->argument_start = code_start;
+    frame->foldable       = true;
+    frame->count          = 0;
+    expect_operand(PREC_ASSIGNMENT, RESUME_ARGUMENT);
+}
+
+
+static void resume_argument(ExprFrame* frame) {
+    Value argument;
+
+    if (frame->count == UINT8_MAX) {
+        error("Can't have more than 255 arguments.");
+        return;
+    }
+    if (frame->foldable) {
+        frame->foldable = is_constant_number(frame->argument_start, &argument);
+    }
+    frame->count++;
+
+    if (match(TOKEN_COMMA)) {
+        frame->argument_start = current_nugget()->occupied;
+        expect_operand(PREC_ASSIGNMENT, RESUME_ARGUMENT);
+        return;
+    }
+    end_native_call(frame->name, frame->code_start, frame->constant_start, frame->foldable, (int)frame->count);
+}
+
+
+/*
+ * When every argument is foldable, the code from code_start is exactly arg_count constant loads in a row, so the
+ * argument values are read straight back out of it.
+ */
+static void end_native_call(Token name, int code_start, int constant_start, bool foldable, int arg_count) {
+    Nugget* nugget = current_nugget();
+    Value arguments[UINT8_MAX];
+
+    consume(TOKEN_RIGHTPAREN, "Expected ')' after arguments.");
+
+    if (foldable) {
+        for (int offset = code_start, index = 0; index < arg_count; index++) {
+            uint8_t opcode   = read_opcode(nugget, offset);
+            arguments[index] = nugget->constants.values[read_operand(nugget, offset)];
+            offset += instruction_size(nugget, opcode);
+        }
+    }
+
+    int index = find_native(name.start, name.length, arg_count);
+    if (index < 0) {
+        char message[96];
+        snprintf(message, sizeof(message), "'%.*s' doesn't take %d argument%s.",
+                 name.length, name.start, arg_count, (arg_count == 1) ? "" : "s");
+        error(message);
+        return;
+    }
+
+    Native* native = &natives[index];
+    Value result;
+
+    if (current->pure && !native->pure) {
+        char message[96];
+        snprintf(message, sizeof(message), "Can't call %s() inside a pure function.", native->name);
+        error(message);
+    }
+
+    if (foldable && native->pure && call_native(native, arguments, &result) == NULL) {
+        nugget->occupied = code_start;
+        if (nugget->constants.occupied == constant_start + arg_count) {
+            nugget->constants.occupied = constant_start;
+        }
+        emit_constant(result);
+        return;
+    }
+
+    emit_operand(OPCODE_CALL_NATIVE, index);
+}
+
+
+/*
+ * Compile a read of (or, if it's followed by '=' and we're allowed to assign here, a write to) a variable. Whether it
+ * is a local or a global is decided right here, once, and the slot number goes straight into the instruction.
+ * A name which isn't a local or an already-known global, but is a native, is a call to that native.
+ */
+static void named_variable(Token name, bool can_assign) {
+    uint8_t get_op, set_op;
+    int slot = resolve_local(current, &name);
+
+    if (slot < 0 && !global_exists(&name)) {
+        if (find_native(name.start, name.length, -1) >= 0) {
+            native_call(name);
+            return;
+        }
+    }
+
+    if (slot >= 0) {
+        get_op = OPCODE_GET_LOCAL;
+        set_op = OPCODE_SET_LOCAL;
+    } else {
+        slot = global_slot(&name);
+        get_op = OPCODE_GET_GLOBAL;
+        set_op = OPCODE_SET_GLOBAL;
+    }
+
+    if (can_assign && match(TOKEN_EQUAL)) {
+        if (set_op == OPCODE_SET_GLOBAL && current->parallel) {
+            error("Can't assign to a global inside a parallel loop - every worker shares it.");
+        }
+        if (set_op == OPCODE_SET_GLOBAL && current->pure) {
+            error("Can't assign to a global inside a pure function.");
+        } else if (current->pure && slot <= current->function->arity) {
+            error("Can't assign to a parameter of a pure function - its results are remembered by its arguments.");
+        }
+        ExprFrame* frame = top_frame();
+        frame->set_op    = set_op;
+        frame->slot      = slot;
+        expect_operand(PREC_ASSIGNMENT, RESUME_ASSIGN);
+    } else {
+        emit_operand(get_op, slot);
+    }
+}
+
+
+static void resume_assign(ExprFrame* frame) {
+    emit_operand(frame->set_op, frame->slot);
+}
+
+
+static void variable(bool can_assign) {
+    named_variable(parser.previous, can_assign);
+}
+
+
+static void unary(bool can_assign) {
+    top_frame()->operator_type = parser.previous.type;
+    expect_operand(PREC_UNARY, RESUME_UNARY);
+}
+
+
+static void resume_unary(ExprFrame* frame) {
+    switch (frame->operator_type) {
+        case TOKEN_EXCLAMATION:
+            emit_opcode(OPCODE_NOT);
+            break;
+        case TOKEN_MINUS:
+            emit_opcode(OPCODE_NEGATE);
+            break;
+        default:
+            return;
+    }
+}
+
+
+// Parallel loops need the function machinery further down.
+static void parallel_(bool can_assign);
+static void resume_parallel(ExprFrame* frame);
+
+
+/*
+ * The Pratt parser table. Each token type gets the function to call when it appears at the start of an expression
+ * (prefix), the function to call when it appears after an operand (infix), and how tightly it binds as an infix operator.
+ */
+ParseRule rules[] = {
+    [TOKEN_LEFTPAREN]    = {grouping, call,      PREC_CALL},
+    [TOKEN_RIGHTPAREN]   = {NULL,     NULL,      PREC_NONE},
+    [TOKEN_LEFTCURLY]    = {NULL,     NULL,      PREC_NONE},
+    [TOKEN_RIGHTCURLY]   = {NULL,     NULL,      PREC_NONE},
+    [TOKEN_LEFTSQUARE]   = {array,    subscript, PREC_CALL},
+    [TOKEN_RIGHTSQUARE]  = {NULL,     NULL,      PREC_NONE},
+    [TOKEN_COMMA]        = {NULL,     NULL,      PREC_NONE},
+    [TOKEN_DOT]          = {NULL,     dot,       PREC_CALL},
+    [TOKEN_MINUS]        = {unary,    binary,    PREC_TERM},
+    [TOKEN_PLUS]         = {NULL,     binary,    PREC_TERM},
+    [TOKEN_SEMICOLON]    = {NULL,     NULL,      PREC_NONE},
+    [TOKEN_SLASH]        = {NULL,     binary,    PREC_FACTOR},
+    [TOKEN_STAR]         = {NULL,     binary,    PREC_FACTOR},
+    [TOKEN_EXCLAMATION]  = {unary,    NULL,      PREC_NONE},
+    [TOKEN_NOTEQUAL]     = {NULL,     binary,    PREC_EQUALITY},
+    [TOKEN_EQUAL]        = {NULL,     NULL,      PREC_NONE},
+    [TOKEN_EXACTEQUAL]   = {NULL,     binary,    PREC_EQUALITY},
+    [TOKEN_GREATER]      = {NULL,     binary,    PREC_COMPARISON},
+    [TOKEN_GREATEREQUAL] = {NULL,     binary,    PREC_COMPARISON},
+    [TOKEN_LESS]         = {NULL,     binary,    PREC_COMPARISON},
+    [TOKEN_LESSEQUAL]    = {NULL,     binary,    PREC_COMPARISON},
+    [TOKEN_IDENTIFIER]   = {variable, NULL,      PREC_NONE},
+    [TOKEN_STRING]       = {string,   NULL,      PREC_NONE},
+    [TOKEN_NUMBER]       = {number,   NULL,      PREC_NONE},
+    [TOKEN_AND]          = {NULL,     and_,      PREC_AND},
+    [TOKEN_CLASS]        = {NULL,     NULL,      PREC_NONE},
+    [TOKEN_ELSE]         = {NULL,     NULL,      PREC_NONE},
+    [TOKEN_FALSE]        = {literal,  NULL,      PREC_NONE},
+    [TOKEN_FOR]          = {NULL,     NULL,      PREC_NONE},
+    [TOKEN_FUNC]         = {NULL,     NULL,      PREC_NONE},
+    [TOKEN_IF]           = {NULL,     NULL,      PREC_NONE},
+    [TOKEN_NIL]          = {literal,  NULL,      PREC_NONE},
+    [TOKEN_OR]           = {NULL,     or_,       PREC_OR},
+    [TOKEN_PARALLEL]     = {parallel_, NULL,     PREC_NONE},
+    [TOKEN_PRINT]        = {NULL,     NULL,      PREC_NONE},
+    [TOKEN_PURE]         = {NULL,     NULL,      PREC_NONE},
+    [TOKEN_RETURN]       = {NULL,     NULL,      PREC_NONE},
+    [TOKEN_SUPER]        = {NULL,     NULL,      PREC_NONE},
+    [TOKEN_THIS]         = {this_,    NULL,      PREC_NONE},
+    [TOKEN_TRUE]         = {literal,  NULL,      PREC_NONE},
+    [TOKEN_VAR]          = {NULL,     NULL,      PREC_NONE},
+    [TOKEN_WHILE]        = {NULL,     NULL,      PREC_NONE},
+    [TOKEN_YIELD]        = {NULL,     NULL,      PREC_NONE},
+    [TOKEN_ERROR]        = {NULL,     NULL,      PREC_NONE},
+    [TOKEN_EOF]          = {NULL,     NULL,      PREC_NONE},
+};
+
+
+typedef void (*ResumeFn)(ExprFrame* frame);
+
+ResumeFn resumes[] = {
+    [RESUME_NONE]      = NULL,
+    [RESUME_BINARY]    = resume_binary,
+    [RESUME_UNARY]     = resume_unary,
+    [RESUME_GROUPING]  = resume_grouping,
+    [RESUME_ASSIGN]    = resume_assign,
+    [RESUME_ELEMENT]   = resume_element,
+    [RESUME_INDEX]     = resume_index,
+    [RESUME_SET_INDEX] = resume_set_index,
+    [RESUME_ARGUMENT]  = resume_argument,
+    [RESUME_LOGICAL]   = resume_logical,
+    [RESUME_CALL]      = resume_call,
+    [RESUME_INVOKE]    = resume_invoke,
+    [RESUME_PARALLEL]  = resume_parallel,
+};
+
+
+/*
+ * The heart of the Pratt parser. Read the next token and look up its prefix rule - if there isn't one, this token can't
+ * start an expression. Otherwise compile it, then keep folding in infix operators for as long as the next one binds at
+ * least as tightly as the precedence we were asked for.
+ * Only an expression parsed at assignment precedence may be the target of '='. If an '=' is still sitting there after
+ * everything else has been parsed, the thing in front of it wasn't something that can be assigned to (like a + b = c).
+ *
+ * All of that happens for the frame on top of the expression stack. Whenever a rule asks for an operand (the stack
+ * grows), go round again to start on the operand's frame; whenever a frame is finished, pop it and resume its parent.
+ * base is where the stack stood when we were called, so that we stop once our own frame is done.
+ */
+static void parse_precedence(Precedence precedence) {
+    int base = expr_stack.count;
+    bool need_operand = true;
+
+    push_frame(precedence);
+
+    LOOP {
+        ExprFrame* frame = top_frame();
+        bool finished    = false;
+
+        if (need_operand) {
+            advance();
+            ParseFn prefix_rule = get_rule(parser.previous.type)->prefix;
+
+            if (prefix_rule == NULL) {
+                error("Expected an expression.");
+                finished = true;
+            } else {
+                int depth = expr_stack.count;
+                prefix_rule(frame->can_assign);
+                if (expr_stack.count > depth) {
+                    continue;
+                }
+            }
+        }
+
+        if (!finished) {
+            frame = top_frame();
+            need_operand = false;
+
+            while (frame->precedence <= get_rule(parser.current.type)->precedence) {
+                advance();
+                ParseFn infix_rule = get_rule(parser.previous.type)->infix;
+                int depth = expr_stack.count;
+                infix_rule(frame->can_assign);
+                if (expr_stack.count > depth) {
+                    need_operand = true;
+                    break;
+                }
+            }
+            if (need_operand) {
+                continue;
+            }
+
+            if (frame->can_assign && match(TOKEN_EQUAL)) {
+                error("Invalid assignment target.");
+            }
+        }
+
+        // This frame's expression is complete: hand control back to whichever rule was waiting on it.
+        expr_stack.count--;
+        if (expr_stack.count == base) {
+            return;
+        }
+
+        frame = top_frame();
+        ExprResume resume = frame->resume;
+        frame->resume = RESUME_NONE;
+
+        int depth = expr_stack.count;
+        resumes[resume](frame);
+        need_operand = (expr_stack.count > depth);
+    }
+}
+
+
+static ParseRule* get_rule(TokenType type) {
+    return &rules[type];
+}
+
+
+static void expression() {
+    parse_precedence(PREC_ASSIGNMENT);
+}
+
+
+/*
+ * Scopes. Leaving a scope pops every local declared inside it off the stack.
+ */
+static void begin_scope() {
+    current->scope_depth++;
+}
+
+
+static void end_scope() {
+    current->scope_depth--;
+
+    while (current->local_count > 0 && current->locals[current->local_count - 1].depth > current->scope_depth) {
+        emit_opcode(OPCODE_POP);
+        current->local_count--;
+    }
+}
+
+
+static void block() {
+    while (!check(TOKEN_RIGHTCURLY) && !check(TOKEN_EOF)) {
+        declaration();
+    }
+
+    consume(TOKEN_RIGHTCURLY, "Expected '}' after block.");
+}
+
+
+/*
+ * Add a local to the compiler's picture of the stack. It's marked uninitialized (depth -1) until its initializer has
+ * been compiled - see mark_initialized().
+ */
+static void add_local(Token name) {
+    if (current->local_count == LOCALS_MAX) {
+        error("Too many local variables in scope.");
+        return;
+    }
+
+    Local* local = &current->locals[current->local_count++];
+    local->name  = name;
+    local->depth = -1;
+}
+
+
+static void declare_local() {
+    Token* name = &parser.previous;
+
+    for (int index = current->local_count - 1; index >= 0; index--) {
+        Local* local = &current->locals[index];
+        if (local->depth != -1 && local->depth < current->scope_depth) {
+            break;
+        }
+        if (identifiers_equal(name, &local->name)) {
+            error("A variable with this name already exists in this scope.");
+        }
+    }
+
+    add_local(*name);
+}
+
+
+static void mark_initialized() {
+    current->locals[current->local_count - 1].depth = current->scope_depth;
+}
+
+
+/*
+ * var name [= initializer];
+ * A local's value simply stays where the initializer left it on the stack - that's its slot. A global's initializer is
+ * is compiled first, then DEFINE_GLOBAL moves the value into the name's slot.
+ */
+static void var_declaration() {
+    consume(TOKEN_IDENTIFIER, "Expected a variable name.");
+    Token name = parser.previous;
+
+    if (current->scope_depth > 0) {
+        declare_local();
+    }
+
+    if (match(TOKEN_EQUAL)) {
+        expression();
+    } else {
+        emit_opcode(OPCODE_NIL);
+    }
+
+    consume(TOKEN_SEMICOLON, "Expected ';' after variable declaration.");
+
+    if (current->scope_depth > 0) {
+        mark_initialized();
+        return;
+    }
+
+    emit_operand(OPCODE_DEFINE_GLOBAL, global_slot(&name));
+}
+
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+ * Functions. Big scripts declare far more functions than any one run calls, so by default a function body isn't
+ * compiled where it's declared. The declaration just reads the parameter list (for the arity), then skips the body
+ * token by token, counting braces, to find where it ends - which is as much parsing as it takes to catch an unbalanced
+ * body now rather than at some later call. The function keeps a copy of its source from '(' to '}', and
+ * compile_function() turns that into bytecode the first time it's called (call_value(), vm.c). Any other mistake in
+ * the body is reported then, too.
+ * With lazy_functions off (--eager, main.c) the body is compiled right where it's declared instead, which is what to
+ * compare against. Either way the function keeps its source text, and compiling it goes through function_body().
+ */
+static bool lazy_functions = true;
+
+void set_lazy_functions(bool lazy) {
+    lazy_functions = lazy;
+}
+
+
+/*
+ * The parameter list, from just after its '(' up to and including the ')'. Returns how many there were; declares each
+ * one as a local first if asked to.
+ */
+static int parameter_list(bool declare) {
+    int arity = 0;
+
+    if (!check(TOKEN_RIGHTPAREN)) {
+        do {
+            if (arity == UINT8_MAX) {
+                error_current_token("Can't have more than 255 parameters.");
+            }
+            arity++;
+            consume(TOKEN_IDENTIFIER, "Expected a parameter name.");
+            if (declare) {
+                declare_local();
+                mark_initialized();
+            }
+        } while (match(TOKEN_COMMA));
+    }
+
+    consume(TOKEN_RIGHTPAREN, "Expected ')' after parameters.");
+    return arity;
+}
+
+
+/*
+ * Start and finish compiling into a function's own nugget. In between, the function's compiler is current, with a
+ * scope open for the parameters.
+ */
+static void begin_function(Compiler* compiler, ObjFunction* function) {
+    init_compiler(compiler, function);
+    compiling_nugget = &function->nugget;
+    compiling_nugget->encoding = vm.encoding;
+    begin_scope();
+}
+
+
+static void end_function(Compiler* compiler, Nugget* enclosing_nugget) {
+    ObjFunction* function = compiler->function;
+
+    #ifdef DEBUG_PRINT_CODE
+        if (!parser.hiterror) {
+            disassemble_nugget(compiling_nugget, function->name->chars);
+        }
+    #endif
+
+    if (!parser.hiterror) {
+        finalize_nugget(compiling_nugget);
+        function->compiled = true;
+    }
+
+    current          = compiler->enclosing;
+    compiling_nugget = enclosing_nugget;
+}
+
+
+/*
+ * Compile a function's parameters and body, starting just after the '(', into the function's own nugget. Falling off
+ * the end of the body returns nil.
+ */
+static void function_body(ObjFunction* function) {
+    Compiler compiler;
+    Nugget* enclosing_nugget = compiling_nugget;
+
+    begin_function(&compiler, function);
+
+    function->arity = parameter_list(true);
+    consume(TOKEN_LEFTCURLY, "Expected '{' before function body.");
+    block();
+
+    if (compiler.initializer) {
+        emit_operand(OPCODE_GET_LOCAL, 0);
+    } else {
+        emit_opcode(OPCODE_NIL);
+    }
+    emit_opcode(OPCODE_RETURN);
+
+    end_function(&compiler, enclosing_nugget);
+}
+
+
+/*
+ * Skip over a function body, from just after its '{' to just after the matching '}'.
+ */
+static void skip_function_body() {
+    int depth = 1;
+
+    while (depth > 0) {
+        if (check(TOKEN_EOF)) {
+            error_current_token("Expected '}' at the end of the function body - its braces don't balance.");
+            return;
+        }
+        if (check(TOKEN_LEFTCURLY)) {
+            depth++;
+        } else if (check(TOKEN_RIGHTCURLY)) {
+            depth--;
+        }
+        advance();
+    }
+}
+
+
+/*
+ * The rest of a function's declaration, from just after the '(' of its parameter list: compiled or skipped over,
+ * depending on lazy_functions, and its source text kept either way.
+ */
+static void function_definition(ObjFunction* function) {
+    Token open = parser.previous;
+
+    if (lazy_functions) {
+        function->arity = parameter_list(false);
+        consume(TOKEN_LEFTCURLY, "Expected '{' before function body.");
+        skip_function_body();
+    } else {
+        function_body(function);
+    }
+
+    set_function_source(function, open.start, (int)(parser.previous.start + parser.previous.length - open.start),
+                        open.line);
+}
+
+
+/*
+ * [pure] func name(parameters) { body }
+ * The function object is created up front and rides on the VM stack until it's safely stored as a constant, since
+ * everything after creating it allocates. A global function's name gets its slot before the body is looked at, so that
+ * the body can call the function recursively.
+ */
+static void func_declaration(bool pure) {
+    consume(TOKEN_IDENTIFIER, "Expected a function name.");
+    Token name = parser.previous;
+    int global = 0;
+
+    if (current->parallel) {
+        error("Can't declare a function inside a parallel loop.");
+    }
+
+    if (current->scope_depth > 0) {
+        declare_local();
+        mark_initialized();
+    } else {
+        global = global_slot(&name);
+    }
+
+    ObjFunction* function = new_function();
+    push(OBJ_VAL(function));
+    function->name          = intern_string(name.start, name.length);
+    function->declared_pure = pure;
+
+    consume(TOKEN_LEFTPAREN, "Expected '(' after function name.");
+    function_definition(function);
+    emit_constant(OBJ_VAL(function));
+    pop();
+
+    if (current->scope_depth == 0) {
+        emit_operand(OPCODE_DEFINE_GLOBAL, global);
+    }
+}
+
+
+/*
+ * class Name { method(parameters) { body } ... }
+ * The class is built right here, as a constant, like a function - there's nothing about it to work out at runtime. Its
+ * methods are functions like any other (compiled on their first call, unless --eager), except that slot 0 of their
+ * frame is the instance they were called on. Calling the class makes an instance and calls its 'init' method on it, if
+ * it has one (call_value(), vm.c). There's no inheritance, so 'super' is still only a reserved word.
+ * The class (and before that its name) rides on the VM stack until it's stored as a constant, and each method until
+ * it's in the class's table.
+ */
+static void method(ObjClass* klass) {
+    consume(TOKEN_IDENTIFIER, "Expected a method name.");
+    Token name = parser.previous;
+
+    ObjFunction* function = new_function();
+    push(OBJ_VAL(function));
+    function->name   = intern_string(name.start, name.length);
+    function->method = true;
+
+    Value existing;
+    if (table_get(&klass->methods, function->name, &existing)) {
+        error("A method with this name already exists in this class.");
+    }
+
+    consume(TOKEN_LEFTPAREN, "Expected '(' after method name.");
+    function_definition(function);
+
+    table_set(&klass->methods, function->name, OBJ_VAL(function));
+    if (name.length == 4 && memcmp(name.start, "init", 4) == 0) {
+        klass->initializer = function;
+    }
+    pop();
+}
+
+
+static void class_declaration() {
+    consume(TOKEN_IDENTIFIER, "Expected a class name.");
+    Token name = parser.previous;
+    int global = 0;
+
+    if (current->parallel) {
+        error("Can't declare a class inside a parallel loop.");
+    }
+    if (current->pure) {
+        error("Can't declare a class inside a pure function.");
+    }
+
+    if (current->scope_depth > 0) {
+        declare_local();
+        mark_initialized();
+    } else {
+        global = global_slot(&name);
+    }
+
+    ObjString* class_name = intern_string(name.start, name.length);
+    push(OBJ_VAL(class_name));
+    ObjClass* klass = new_class(class_name);
+    pop();
+    push(OBJ_VAL(klass));
+
+    consume(TOKEN_LEFTCURLY, "Expected '{' before class body.");
+    while (!check(TOKEN_RIGHTCURLY) && !check(TOKEN_EOF)) {
+        method(klass);
+    }
+    consume(TOKEN_RIGHTCURLY, "Expected '}' after class body.");
+
+    emit_constant(OBJ_VAL(klass));
+    pop();
+
+    if (current->scope_depth == 0) {
+        emit_operand(OPCODE_DEFINE_GLOBAL, global);
+    }
+}
+
+
+/*
+ * First call of a function declared lazily: compile its body from its own copy of the source, with a scanner of its
+ * own. Only ever called from run(), never while another compile is underway, so the parser is ours to reuse. Returns
+ * false, having reported the errors, if the body doesn't compile - the function is left uncompiled, so every later
+ * call fails the same way.
+ */
+bool compile_function(ObjFunction* function) {
+    init_scanner_range(function->source, function->source + function->source_length, function->line);
+    parser.hiterror  = false;
+    parser.panicking = false;
+    parser.tokens    = NULL;
+    parser.queue     = NULL;
+
+    advance();
+    consume(TOKEN_LEFTPAREN, "Expected '(' at the start of the function.");
+    function_body(function);
+    consume(TOKEN_EOF, "Expected the function to end after its body.");
+
+    free_expr_stack();
+
+    if (parser.hiterror) {
+        free_nugget(&function->nugget);
+        function->compiled = false;
+    }
+    return !parser.hiterror;
+}
+
+
+/*
+ * The functions being compiled right now, for the garbage collector (memory.c). Their constant pools are marked
+ * directly rather than left to tracing, because they grow as the compiler goes - even after a function has been
+ * blackened.
+ */
+void mark_compiler_roots(void) {
+    for (Compiler* compiler = current; compiler != NULL; compiler = compiler->enclosing) {
+        if (compiler->function != NULL) {
+            mark_object((Obj*)compiler->function);
+            mark_nugget(&compiler->function->nugget);
+        }
+    }
+}
+
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+ * parallel kind (element [, index] in array) body - see parallel.h.
+ * The array expression is compiled in line, then the body into a function of its own with the loop variables as its
+ * parameters. Unlike any other function it's compiled right here rather than on its first call, because the workers
+ * which call it must never compile anything (VM.shared_code, vm.h). The function goes on the stack as a constant, and
+ * OPCODE_PARALLEL takes it and the array from there.
+ * 'in' isn't a keyword - it's only special right here - and neither are map / sum / min / max.
+ */
+static void parallel_(bool can_assign) {
+    if (current->parallel) {
+        error("Can't have a parallel loop inside another one.");
+    }
+
+    consume(TOKEN_IDENTIFIER, "Expected map, sum, min or max after 'parallel'.");
+    int kind = find_parallel_kind(parser.previous.start, parser.previous.length);
+    if (kind < 0) {
+        error("A parallel loop can only be a map, sum, min or max.");
+    }
+
+    consume(TOKEN_LEFTPAREN, "Expected '(' after the kind of parallel loop.");
+    consume(TOKEN_IDENTIFIER, "Expected a name for the element.");
+    Token element = parser.previous;
+    Token index   = {TOKEN_IDENTIFIER, parser.previous.start, 0, parser.previous.line};
+
+    if (match(TOKEN_COMMA)) {
+        consume(TOKEN_IDENTIFIER, "Expected a name for the index.");
+        index = parser.previous;
+    }
+    if (!check(TOKEN_IDENTIFIER) || parser.current.length != 2 || memcmp(parser.current.start, "in", 2) != 0) {
+        error_current_token("Expected 'in' after the loop variables.");
+    }
+    advance();
+
+    ExprFrame* frame = top_frame();
+    frame->name      = element;
+    frame->index     = index;
+    frame->kind      = kind;
+    expect_operand(PREC_ASSIGNMENT, RESUME_PARALLEL);
+}
+
+
+static void resume_parallel(ExprFrame* frame) {
+    Token element = frame->name;
+    Token index   = frame->index;
+    int kind      = frame->kind;
+    int line      = parser.previous.line;
+
+    consume(TOKEN_RIGHTPAREN, "Expected ')' after the array.");
+
+    ObjFunction* function = new_function();
+    push(OBJ_VAL(function));
+    function->name = intern_string("parallel", 8);
+    function->line = line;
+
+    Compiler compiler;
+    Nugget* enclosing_nugget = compiling_nugget;
+    begin_function(&compiler, function);
+    compiler.parallel = true;
+
+    add_local(element);
+    mark_initialized();
+    function->arity = 1;
+    if (index.length > 0) {
+        add_local(index);
+        mark_initialized();
+        function->arity = 2;
+    }
+
+    if (match(TOKEN_LEFTCURLY)) {
+        block();
+        emit_opcode(OPCODE_NIL);
+    } else {
+        expression();
+    }
+    emit_opcode(OPCODE_RETURN);
+
+    end_function(&compiler, enclosing_nugget);
+
+    emit_constant(OBJ_VAL(function));
+    pop();
+    emit_operand(OPCODE_PARALLEL, (uint32_t)((kind < 0) ? 0 : kind));
+}
+
+
+/*
+ * return [value]; - only inside a function. A bare return gives back nil, or from an initializer the instance.
+ * A value which is the result of a call, straight from the CALL instruction, makes it a tail call: the CALL becomes a
+ * TAIL_CALL, which hands the callee the returning function's own frame (vm.c), so that recursion in tail position runs
+ * in constant space. A method call, 'return this.next(n);', is one too - its INVOKE becomes a TAIL_INVOKE. The RETURN
+ * stays after it all the same - for the calls that can't take the frame over, and for any jump which lands just past
+ * the call, as in 'return done or next(n);'.
+ */
+static void return_statement() {
+    if (current->function == NULL) {
+        error("Can't return from top-level code.");
+    }
+
+    if (match(TOKEN_SEMICOLON)) {
+        if (current->initializer) {
+            emit_operand(OPCODE_GET_LOCAL, 0);
+        } else {
+            emit_opcode(OPCODE_NIL);
+        }
+    } else {
+        if (current->initializer) {
+            error("Can't return a value from an initializer.");
+        }
+        expression();
+        consume(TOKEN_SEMICOLON, "Expected ';' after return value.");
+
+        Nugget* nugget = current_nugget();
+        if (current->last_call >= 0) {
+            uint8_t opcode = read_opcode(nugget, current->last_call);
+            if (current->last_call + instruction_size(nugget, opcode) == nugget->occupied) {
+                if (opcode == OPCODE_CALL) {
+                    rewrite_opcode(nugget, current->last_call, OPCODE_TAIL_CALL);
+                } else if (opcode == OPCODE_INVOKE) {
+                    rewrite_opcode(nugget, current->last_call, OPCODE_TAIL_INVOKE);
+                }
+            }
+        }
+    }
+    emit_opcode(OPCODE_RETURN);
+}
+
+
+static void expression_statement() {
+    expression();
+    consume(TOKEN_SEMICOLON, "Expected ';' after expression.");
+    emit_opcode(OPCODE_POP);
+}
+
+
+static void print_statement() {
+    if (current->parallel) {
+        error("Can't print inside a parallel loop - the workers' output would come out in any order.");
+    }
+    if (current->pure) {
+        error("Can't print inside a pure function.");
+    }
+    expression();
+    consume(TOKEN_SEMICOLON, "Expected ';' after value.");
+    emit_opcode(OPCODE_PRINT);
+}
+
+
+/*
+ * if (condition) statement [else statement]. JUMP_IF_FALSE leaves the condition on the stack, so both branches start
+ * by popping it.
+ */
+static void if_statement() {
+    consume(TOKEN_LEFTPAREN, "Expected '(' after 'if'.");
+    expression();
+    consume(TOKEN_RIGHTPAREN, "Expected ')' after condition.");
+
+    int then_jump = emit_jump(OPCODE_JUMP_IF_FALSE);
+    emit_opcode(OPCODE_POP);
+    statement();
+
+    int else_jump = emit_jump(OPCODE_JUMP);
+    patch_jump(then_jump);
+    emit_opcode(OPCODE_POP);
+
+    if (match(TOKEN_ELSE)) {
+        statement();
+    }
+    patch_jump(else_jump);
+}
+
+
+/*
+ * while (condition) statement. The LOOP back to the condition is the only backward jump there is, which makes it the
+ * place where run() checks whether the VM has used up its budget (see vm.h).
+ */
+static void while_statement() {
+    int loop_start = current_nugget()->occupied;
+
+    consume(TOKEN_LEFTPAREN, "Expected '(' after 'while'.");
+    expression();
+    consume(TOKEN_RIGHTPAREN, "Expected ')' after condition.");
+
+    int exit_jump = emit_jump(OPCODE_JUMP_IF_FALSE);
+    emit_opcode(OPCODE_POP);
+    statement();
+    emit_loop(loop_start);
+
+    patch_jump(exit_jump);
+    emit_opcode(OPCODE_POP);
+}
+
+
+/*
+ * for (name in sequence) statement - over an array, a generator or a lazy iterator (object.h). ITERATE turns the
+ * sequence into something iterator_next() (vm.c) can pull elements from, and it sits in a hidden local for the length of
+ * the loop, with the loop variable in the slot just above it. Each time round, FOR_ITER puts the next element in the
+ * variable, or jumps out of the loop once there are none left. 'in' is only special right here, as in parallel loops.
+ */
+static void for_statement() {
+    begin_scope();
+
+    consume(TOKEN_LEFTPAREN, "Expected '(' after 'for'.");
+    consume(TOKEN_IDENTIFIER, "Expected a name for the element.");
+    Token name = parser.previous;
+
+    if (!check(TOKEN_IDENTIFIER) || parser.current.length != 2 || memcmp(parser.current.start, "in", 2) != 0) {
+        error_current_token("Expected 'in' after the loop variable.");
+    }
+    advance();
+    expression();
+    consume(TOKEN_RIGHTPAREN, "Expected ')' after the sequence.");
+
+    emit_opcode(OPCODE_ITERATE);
+    add_local((Token){TOKEN_IDENTIFIER, "", 0, name.line});
+    mark_initialized();
+    emit_opcode(OPCODE_NIL);
+    add_local(name);
+    mark_initialized();
+
+    int loop_start = current_nugget()->occupied;
+    int exit_jump  = emit_jump(OPCODE_FOR_ITER);
+    statement();
+    emit_loop(loop_start);
+    patch_jump(exit_jump);
+
+    end_scope();
+}
+
+
+/*
+ * yield [value]; - only inside a function, and its being there at all is what makes the function a generator. A bare
+ * yield gives nil. The generator's frame is put away until somebody asks for its next element (resume_generator(),
+ * vm.c), so nothing else can be going on in the frame - which rules out parallel loop bodies.
+ */
+static void yield_statement() {
+    if (current->function == NULL) {
+        error("Can't yield from top-level code.");
+    } else if (current->parallel) {
+        error("Can't yield inside a parallel loop.");
+    } else if (current->pure) {
+        error("Can't yield inside a pure function - every call has to make a new generator.");
+    } else if (current->initializer) {
+        error("Can't yield inside an initializer - calling the class has to give back the instance.");
+    } else {
+        current->function->generator = true;
+    }
+
+    if (match(TOKEN_SEMICOLON)) {
+        emit_opcode(OPCODE_NIL);
+    } else {
+        expression();
+        consume(TOKEN_SEMICOLON, "Expected ';' after yield value.");
+    }
+    emit_opcode(OPCODE_YIELD);
+}
+
+
+/*
+ * After an error, skip tokens until we get to something that looks like the start of a new statement, so that one
+ * mistake doesn't set off a cascade of confused error messages.
+ */
+static void synchronize() {
+    parser.panicking = false;
+
+    while (parser.current.type != TOKEN_EOF) {
+        if (parser.previous.type == TOKEN_SEMICOLON) {
+            return;
+        }
+
+        switch (parser.current.type) {
+            case TOKEN_CLASS:
+            case TOKEN_FUNC:
+            case TOKEN_PURE:
+            case TOKEN_VAR:
+            case TOKEN_FOR:
+            case TOKEN_IF:
+            case TOKEN_WHILE:
+            case TOKEN_PRINT:
+            case TOKEN_RETURN:
+            case TOKEN_YIELD:
+                return;
+            default:
+                DO_NOTHING
+        }
+
+        advance();
+    }
+}
+
+
+static void declaration() {
+    if (match(TOKEN_CLASS)) {
+        class_declaration();
+    } else if (match(TOKEN_FUNC)) {
+        func_declaration(false);
+    } else if (match(TOKEN_PURE)) {
+        consume(TOKEN_FUNC, "Expected 'func' after 'pure'.");
+        func_declaration(true);
+    } else if (match(TOKEN_VAR)) {
+        var_declaration();
+    } else {
+        statement();
+    }
+
+    if (parser.panicking) {
+        synchronize();
+    }
+}
+
+
+static void statement() {
+    if (match(TOKEN_PRINT)) {
+        print_statement();
+    } else if (match(TOKEN_IF)) {
+        if_statement();
+    } else if (match(TOKEN_WHILE)) {
+        while_statement();
+    } else if (match(TOKEN_FOR)) {
+        for_statement();
+    } else if (match(TOKEN_RETURN)) {
+        return_statement();
+    } else if (match(TOKEN_YIELD)) {
+        yield_statement();
+    } else if (match(TOKEN_LEFTCURLY)) {
+        begin_scope();
+        block();
+        end_scope();
+    } else {
+        expression_statement();
+    }
+}
+
+
+/*
+ * How the source gets scanned depends on its size, once there's more than one thread to scan with:
+ *      - At least PARALLEL_LEX_MIN bytes: scanned up front by lex_threads threads (scan_parallel(), scanner.c).
+ *      - At least PIPELINE_MIN bytes: scanned by one thread while this one compiles, the tokens passed across through a
+ *        TokenQueue, so that scanning and code generation overlap.
+ *      - Anything smaller is scanned token by token as the parser goes. Starting threads would cost more than it saves.
+ * lex_threads is 1 until main() says otherwise, so by default everything is scanned serially. Under --perf the whole
+ * source is scanned up front on this thread whatever its size, so that the scanner's counters aren't mixed up with the
+ * compiler's (perf.h).
+ */
+#define PARALLEL_LEX_MIN (256 * 1024)
+#define PIPELINE_MIN     (32 * 1024)
+
+static int lex_threads = 1;
+
+void set_lex_threads(int threads) {
+    lex_threads = (threads < 1) ? 1 : threads;
+}
+
+
+/*
+ * Compile every declaration the scanner (or parser.tokens / parser.queue) has to give into the given nugget, as top-level
+ * code. compiling_nugget is set for the duration so that the emit_ functions know where to write. Returns false if any
+ * errors were reported along the way - in which case any globals this code declared are forgotten again, since the code
+ * that would have defined them is never going to run.
+ */
+static bool compile_declarations(Nugget* nugget) {
+    Compiler compiler;
+
+    current = NULL;
+    init_compiler(&compiler, NULL);
+    compiling_nugget = nugget;
+    parser.hiterror = false;
+    parser.panicking = false;
+
+    advance();
+
+    while (!match(TOKEN_EOF)) {
+        declaration();
+    }
+
+    end_compiler();
+
+    if (parser.hiterror) {
+        discard_globals(compiler.first_new_global);
+    }
+
+    free_expr_stack();
+    current = NULL;
+    return !parser.hiterror;
+}
+
+
+/*
+ * Compile the source into the given nugget, scanning it whichever way suits its size (see above).
+ */
+bool compile(Nugget* nugget, const char* source) {
+    TokenList tokens = {NULL, 0, 0};
+    size_t length    = strlen(source);
+
+    TokenQueue* queue = NULL;
+
+    if (perf_on) {
+        perf_begin(PERF_SCAN);
+        scan_all(source, length, &tokens);
+        perf_end(PERF_SCAN);
+    } else if (lex_threads > 1 && length >= PARALLEL_LEX_MIN) {
+        scan_parallel(source, length, lex_threads, &tokens);
+    } else if (lex_threads > 1 && length >= PIPELINE_MIN) {
+        queue = start_token_queue(source);
+    }
+    if (tokens.tokens == NULL && queue == NULL) {
+        init_scanner(source);
+    }
+
+    parser.tokens = tokens.tokens;
+    parser.queue = queue;
+
+    bool compiled = compile_declarations(nugget);
+
+    if (queue != NULL) {
+        finish_token_queue(queue);
+    }
+    free_token_list(&tokens);
+    parser.tokens = NULL;
+    parser.queue = NULL;
+    return compiled;
+}
+
+
+/*
+ * Compile just the stretch of a larger source from start up to end, which begins on the given line, as top-level code
+ * of its own. --watch keeps a script as one nugget per top-level declaration, and recompiles only the ones an edit
+ * touched (watch.c). The stretches are small, so they're always scanned as the parser goes.
+ */
+bool compile_unit(Nugget* nugget, const char* start, const char* end, int line) {
+    init_scanner_range(start, end, line);
+    parser.tokens = NULL;
+    parser.queue = NULL;
+
+    return compile_declarations(nugget);
+}
+
+
+/*
+ * For debugging the scanner: read one token at a time using scan_token() and print it.
+ * A cool feature - the printf specified '%.*s' prints the first token.length characters starting at token.start.
+ * This specifier therefore lets you pass the precision to which you want to print (in this case, the number of
+ * characters) to printf as a separate argument. We need this here because a token .start pointer is pointing
+ * somewhere into the original source string, so there is no NUL terminator at the end of the corresponding substring.
+ * The * in the format specifier lets us limit this using an argument.
+ */
 bool compile_debug(Nugget* nugget, const char* source) {
     init_scanner(source);
     int line = -1;
@@ -1,6 +1,15 @@
 #ifndef cypsa_compiler_h
     #define cypsa_compiler_h
 
-    bool compile(Nugget nugget, const char* source);
+    #include "common.h"
+    #include "nugget.h"
+    #include "object.h"
+
+    bool compile(Nugget* nugget, const char* source);
+    bool compile_unit(Nugget* nugget, const char* start, const char* end, int line);
+    bool compile_function(ObjFunction* function);
+    void mark_compiler_roots(void);
+    void set_lex_threads(int threads);
+    void set_lazy_functions(bool lazy);
 
 #endif
\ No newline at end of file
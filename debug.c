@@ -1,6 +1,90 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include "debug.h"
+#include "native.h"
+#include "parallel.h"
 #include "values.h"
+#include "vm.h"
+
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+ * Every opcode's name, and how its operand is printed (debug.h). The assembler (assembler.c) looks names up here too,
+ * so what one prints the other reads.
+ */
+typedef struct {
+    const char* name;
+    OperandFormat format;
+} OpcodeInfo;
+
+static const OpcodeInfo opcodes[] = {
+    [OPCODE_CONSTANT]         = {"OPCODE_CONSTANT",         OPERAND_CONSTANT},
+    [OPCODE_CONSTANT_LONG]    = {"OPCODE_CONSTANT_LONG",    OPERAND_CONSTANT},
+    [OPCODE_NIL]              = {"OPCODE_NIL",              OPERAND_NONE},
+    [OPCODE_TRUE]             = {"OPCODE_TRUE",             OPERAND_NONE},
+    [OPCODE_FALSE]            = {"OPCODE_FALSE",            OPERAND_NONE},
+    [OPCODE_EQUAL]            = {"OPCODE_EQUAL",            OPERAND_NONE},
+    [OPCODE_GREATER]          = {"OPCODE_GREATER",          OPERAND_NONE},
+    [OPCODE_LESS]             = {"OPCODE_LESS",             OPERAND_NONE},
+    [OPCODE_NOT]              = {"OPCODE_NOT",              OPERAND_NONE},
+    [OPCODE_NEGATE]           = {"OPCODE_NEGATE",           OPERAND_NONE},
+    [OPCODE_ADD]              = {"OPCODE_ADD",              OPERAND_NONE},
+    [OPCODE_SUBTRACT]         = {"OPCODE_SUBTRACT",         OPERAND_NONE},
+    [OPCODE_MULTIPLY]         = {"OPCODE_MULTIPLY",         OPERAND_NONE},
+    [OPCODE_DIVIDE]           = {"OPCODE_DIVIDE",           OPERAND_NONE},
+    [OPCODE_POP]              = {"OPCODE_POP",              OPERAND_NONE},
+    [OPCODE_PRINT]            = {"OPCODE_PRINT",            OPERAND_NONE},
+    [OPCODE_GET_LOCAL]        = {"OPCODE_GET_LOCAL",        OPERAND_LOCAL},
+    [OPCODE_SET_LOCAL]        = {"OPCODE_SET_LOCAL",        OPERAND_LOCAL},
+    [OPCODE_DEFINE_GLOBAL]    = {"OPCODE_DEFINE_GLOBAL",    OPERAND_GLOBAL},
+    [OPCODE_GET_GLOBAL]       = {"OPCODE_GET_GLOBAL",       OPERAND_GLOBAL},
+    [OPCODE_SET_GLOBAL]       = {"OPCODE_SET_GLOBAL",       OPERAND_GLOBAL},
+    [OPCODE_CALL_NATIVE]      = {"OPCODE_CALL_NATIVE",      OPERAND_NATIVE},
+    [OPCODE_ARRAY]            = {"OPCODE_ARRAY",            OPERAND_COUNT},
+    [OPCODE_GET_INDEX]        = {"OPCODE_GET_INDEX",        OPERAND_NONE},
+    [OPCODE_SET_INDEX]        = {"OPCODE_SET_INDEX",        OPERAND_NONE},
+    [OPCODE_JUMP]             = {"OPCODE_JUMP",             OPERAND_JUMP},
+    [OPCODE_JUMP_IF_FALSE]    = {"OPCODE_JUMP_IF_FALSE",    OPERAND_JUMP},
+    [OPCODE_LOOP]             = {"OPCODE_LOOP",             OPERAND_LOOP},
+    [OPCODE_CALL]             = {"OPCODE_CALL",             OPERAND_COUNT},
+    [OPCODE_TAIL_CALL]        = {"OPCODE_TAIL_CALL",        OPERAND_COUNT},
+    [OPCODE_PARALLEL]         = {"OPCODE_PARALLEL",         OPERAND_PARALLEL},
+    [OPCODE_ITERATE]          = {"OPCODE_ITERATE",          OPERAND_NONE},
+    [OPCODE_FOR_ITER]         = {"OPCODE_FOR_ITER",         OPERAND_JUMP},
+    [OPCODE_YIELD]            = {"OPCODE_YIELD",            OPERAND_NONE},
+    [OPCODE_GET_PROPERTY]     = {"OPCODE_GET_PROPERTY",     OPERAND_PROPERTY},
+    [OPCODE_SET_PROPERTY]     = {"OPCODE_SET_PROPERTY",     OPERAND_PROPERTY},
+    [OPCODE_INVOKE]           = {"OPCODE_INVOKE",           OPERAND_INVOKE},
+    [OPCODE_TAIL_INVOKE]      = {"OPCODE_TAIL_INVOKE",      OPERAND_INVOKE},
+    [OPCODE_RETURN]           = {"OPCODE_RETURN",           OPERAND_NONE},
+    [OPCODE_ADD_NUM_NUM]      = {"OPCODE_ADD_NUM_NUM",      OPERAND_NONE},
+    [OPCODE_ADD_STR_STR]      = {"OPCODE_ADD_STR_STR",      OPERAND_NONE},
+    [OPCODE_SUBTRACT_NUM_NUM] = {"OPCODE_SUBTRACT_NUM_NUM", OPERAND_NONE},
+    [OPCODE_MULTIPLY_NUM_NUM] = {"OPCODE_MULTIPLY_NUM_NUM", OPERAND_NONE},
+    [OPCODE_DIVIDE_NUM_NUM]   = {"OPCODE_DIVIDE_NUM_NUM",   OPERAND_NONE},
+    [OPCODE_GREATER_NUM_NUM]  = {"OPCODE_GREATER_NUM_NUM",  OPERAND_NONE},
+    [OPCODE_LESS_NUM_NUM]     = {"OPCODE_LESS_NUM_NUM",     OPERAND_NONE}
+};
+
+#define OPCODE_TOTAL ((int)(sizeof(opcodes) / sizeof(opcodes[0])))
+
+
+/*
+ * The opcode called name (length characters of it, not NUL-terminated), or -1 if there isn't one.
+ */
+int find_opcode(const char* name, int length) {
+    for (int opcode = 0; opcode < OPCODE_TOTAL; opcode++) {
+        if ((int)strlen(opcodes[opcode].name) == length && memcmp(opcodes[opcode].name, name, length) == 0) {
+            return opcode;
+        }
+    }
+    return -1;
+}
+
+
+OperandFormat operand_format(uint8_t opcode) {
+    return (opcode < OPCODE_TOTAL) ? opcodes[opcode].format : OPERAND_NONE;
+}
 
 
 /* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
@@ -11,114 +95,210 @@
  * NOTE that the for-loop does not increment the offset, as instructions can be more than a single
  * byte in size. Updating the offset is handled in disassemble_instruction() which will switch on
  * the instruction given and return the correct corresponding byte size.
+ * Both print to stdout; the fdisassemble_ versions print to whichever stream they're given (--disassemble, main.c).
  */
 void disassemble_nugget(Nugget* nugget, const char* op_name) {
-    printf("\n* ~ ~ ~ ~ ~ ~ %s ~ ~ ~ ~ ~ ~ *\n", op_name);
+    fdisassemble_nugget(stdout, nugget, op_name);
+}
+
+
+int disassemble_instruction(Nugget* nugget, int offset) {
+    return fdisassemble_instruction(stdout, nugget, offset);
+}
+
+
+void fdisassemble_nugget(FILE* out, Nugget* nugget, const char* op_name) {
+    fprintf(out, "\n* ~ ~ ~ ~ ~ ~ %s%s ~ ~ ~ ~ ~ ~ *\n", op_name, (nugget->encoding == ENCODING_WIDE) ? " [wide]" : "");
 
     for (int offset = 0; offset < nugget->occupied; /* No increment */ ) {
-        offset = disassemble_instruction(nugget, offset);
+        offset = fdisassemble_instruction(out, nugget, offset);
     }
 }
 
 
 /* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
- * OPCODE_LONG_CONSTANT constant values are obtained with 24-bit index values. This is serialized in the
- * nugget.code[] block as 4 sequential bytes - the opcode followed by the high, middle, and low bytes.
- * To index the actual Value, this index needs to be reconstructed by shifting the bytes into the correct
- * places and then OR-ing everything together.
+ * Simple instructions are just an opcode with no other parameters we need to handle. For these, we can just print
+ * the corresponding name and step over the instruction - a single byte, or a whole word in a wide nugget.
+ */
+static int simple_instruction(FILE* out, const char* op_name, Nugget* nugget, int offset) {
+    fprintf(out, "%s\n", op_name);
+    return (offset + instruction_size(nugget, nugget->code[offset]));
+}
+
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+ * Handles instructions which load some constant / immediate value. In a byte-encoded nugget OPCODE_CONSTANT is a
+ * two-byte instruction (opcode, then a one-byte location of the Value), and OPCODE_CONSTANT_LONG is a 4-byte one:
+ *      [opcode, high, mid, low]
+ * Where high, mid, and low are the byte values which constitute a 24-bit index into the constants.values[] array.
+ * This longer 24-bit index greatly expands the number of constants that can be addressed beyond the limit of 256
+ * using the 1-byte index of plain OPCODE_CONSTANT. In a wide nugget both are a single word with the index in its top
+ * 24 bits. read_operand() (nugget.c) knows how to pull the location out of either, and the Value is then loaded from
+ * the ValuePool value array. The opcode name and index of the constant are printed, and the value is handed off to the
+ * fprint_value() helper (values.c) for display - except for numbers. fprint_value() gives them %g's six significant
+ * digits, and a listing can be assembled back into a program (assembler.h), which mustn't quietly turn 1234567.891
+ * into 1234570. So numbers get the fewest digits which read back as exactly the same double: 0.1 stays 0.1, and
+ * nothing needs more than 17.
  */
-static int reconstruct_long_location(uint8_t high, uint8_t mid, uint8_t low) {
-    return ((high << 16) | (mid << 8) | (low));
+static void print_constant(FILE* out, Value value) {
+    if (!IS_NUMBER(value)) {
+        fprint_value(out, value);
+        return;
+    }
+
+    char digits[32];
+    for (int precision = 6; precision <= 17; precision++) {
+        snprintf(digits, sizeof(digits), "%.*g", precision, AS_NUMBER(value));
+        if (strtod(digits, NULL) == AS_NUMBER(value)) {
+            break;
+        }
+    }
+    fprintf(out, "%s", digits);
+}
+
+
+static int constant_instruction(FILE* out, const char* op_name, Nugget* nugget, int offset) {
+    uint32_t constant_location = read_operand(nugget, offset);
+    Value constant_value       = nugget->constants.values[constant_location];
+    fprintf(out, "%-16s [%4d]  ", op_name, constant_location);
+    print_constant(out, constant_value);
+    fprintf(out, "\n");
+    return (offset + instruction_size(nugget, nugget->code[offset]));
 }
 
 
 /* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
- * Simple instructions are just single-byte instructs with no other parameters we need to handle. For
- * these, we can just print the corresponding name, increment the offset, and return.
+ * Variable instructions carry a slot number rather than a name. For locals that's a stack slot, and all we can print
+ * is the number. Global slots index vm.globals, and vm.global_names remembers which name each one was given, so we
+ * print that alongside.
  */
-static int simple_instruction(const char* op_name, int offset) {
-    printf("%s\n", op_name);
-    return (offset + 1);
+static int local_instruction(FILE* out, const char* op_name, Nugget* nugget, int offset) {
+    uint32_t slot = read_operand(nugget, offset);
+    fprintf(out, "%-16s [%4d]\n", op_name, slot);
+    return (offset + instruction_size(nugget, nugget->code[offset]));
+}
+
+
+static int global_instruction(FILE* out, const char* op_name, Nugget* nugget, int offset) {
+    uint32_t slot = read_operand(nugget, offset);
+    fprintf(out, "%-16s [%4d]  ", op_name, slot);
+    if (slot < (uint32_t)vm.global_names.occupied) {
+        fprint_value(out, vm.global_names.values[slot]);
+    }
+    fprintf(out, "\n");
+    return (offset + instruction_size(nugget, nugget->code[offset]));
 }
 
 
 /* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
- * Handles instructions which load some constant / immediate value. OPCODE_CONSTANT is a two-byte instruction;
- * one byte for the opcode, and one for the operand (location of the Value). First, the location of the operand
- * is taken from the next byte along in the code [offset + 1], and then the Value is loaded from the ValuePool
- * value array. First, the opcode name and index of the constant are printed. The value is handed off to the
- * print_value() helper (values.c) for display. Since this is a two-byte instruction, offset is incremented by 2
+ * CALL_NATIVE's operand is an index into the native registry (native.h) - print the name it refers to.
  */
-static int constant_instruction(const char* op_name, Nugget* nugget, int offset) {
-    uint8_t constant_location = nugget->code[offset + 1];
-    Value constant_value      = nugget->constants.values[constant_location];
-    printf("%-16s [%4d]  ", op_name, constant_location);
-    print_value(constant_value);
-    return (offset + 2);
+static int native_instruction(FILE* out, const char* op_name, Nugget* nugget, int offset) {
+    uint32_t index = read_operand(nugget, offset);
+    fprintf(out, "%-16s [%4d]  %s\n", op_name, index, (index < (uint32_t)native_count) ? natives[index].name : "?");
+    return (offset + instruction_size(nugget, nugget->code[offset]));
 }
 
 
 /* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
- * OPCODE_CONSTANT_LONG is a 4-byte instruction:
- *      [opcode, high, mid, low]
- * Where high, mid, and low are the byte values which constitute a 24-bit index into the constants.values[] array.
- * This longer 24-bit index greatly expands the number of constants that can be addressed beyond the limit of 256
- * using the 1-byte index of plain OPCODE_CONSTANT. To reconstruct this the three bytes after the opcode (high, mid,
- * and low bytes of the final index) are taken from the code array and passed to reconstruct_long_location(), which
- * shifts the values into the correct locations and ORs them together. The resulting 32-bit int is used to index 
- * the actual constant value, which is displayed.
+ * PARALLEL's operand says what kind of loop it is (parallel.h).
  */
-static int constant_long_instruction(const char* op_name, Nugget* nugget, int offset) {
-    uint8_t high_byte     = nugget->code[offset + 1];
-    uint8_t mid_byte      = nugget->code[offset + 2];
-    uint8_t low_byte      = nugget->code[offset + 3];
-    int constant_location = reconstruct_long_location(high_byte, mid_byte, low_byte);
-    Value constant_value  = nugget->constants.values[constant_location];
+static int parallel_instruction(FILE* out, const char* op_name, Nugget* nugget, int offset) {
+    uint32_t kind = read_operand(nugget, offset);
+    fprintf(out, "%-16s [%4u]  %s\n", op_name, kind,
+            (kind < PARALLEL_KINDS) ? parallel_kind_name((ParallelKind)kind) : "?");
+    return (offset + instruction_size(nugget, nugget->code[offset]));
+}
+
 
-    printf("%-16s [%4d]  ", op_name, constant_location);
-    print_value(constant_value);
-    return (offset + 4);
+/*
+ * OPCODE_ARRAY's operand is just how many elements to gather up off the stack, and OPCODE_CALL's how many arguments
+ * the callee is getting.
+ */
+static int count_instruction(FILE* out, const char* op_name, Nugget* nugget, int offset) {
+    fprintf(out, "%-16s [%4u]\n", op_name, read_operand(nugget, offset));
+    return (offset + instruction_size(nugget, nugget->code[offset]));
+}
+
+
+/*
+ * Property instructions carry the index of their property cache (nugget.h), which knows the property's name - and for
+ * INVOKE, how many arguments there are.
+ */
+static int property_instruction(FILE* out, const char* op_name, Nugget* nugget, int offset, bool invoke) {
+    uint32_t index = read_operand(nugget, offset);
+    fprintf(out, "%-16s [%4u]  ", op_name, index);
+    if (index < (uint32_t)nugget->cache_count) {
+        PropertyCache* cache = &nugget->caches[index];
+        fprintf(out, "%s", cache->name->chars);
+        if (invoke) {
+            fprintf(out, " (%d)", cache->arg_count);
+        }
+    } else {
+        fprintf(out, "?");
+    }
+    fprintf(out, "\n");
+    return (offset + instruction_size(nugget, nugget->code[offset]));
+}
+
+
+/*
+ * Jumps carry a distance in bytes from the end of the instruction - forwards for JUMP / JUMP_IF_FALSE / FOR_ITER,
+ * backwards for LOOP (sign says which). Print where they land rather than the raw distance.
+ */
+static int jump_instruction(FILE* out, const char* op_name, int sign, Nugget* nugget, int offset) {
+    int next = offset + instruction_size(nugget, read_opcode(nugget, offset));
+    fprintf(out, "%-16s [%04d] -> %04d\n", op_name, offset, next + sign * (int)read_operand(nugget, offset));
+    return next;
 }
 
 
 /* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
- * Basically just a big switch statement which determines the type of the instruction at the current offset, and
- * hands off a name and its operand(s) to an appropriate display / logging function. If we hit the default (an
- * unknown instruction), just increment the offset by 1 and try again. 
+ * Look the instruction at the current offset up in opcodes[], and hand its name and operand(s) off to the display
+ * function for its format. If we hit an unknown instruction, just step over one instruction's worth and try again.
  * The initial if checks whether the line in the source code that the current instruction came from is the same
  * as the previous. If instructions come from the same line of source code, then indent and print a | to visually
  * indicate this. Else, just print the line number.
  */
-int disassemble_instruction(Nugget* nugget, int offset) {
-    printf("%04d\t->\t", offset);
+int fdisassemble_instruction(FILE* out, Nugget* nugget, int offset) {
+    fprintf(out, "%04d\t->\t", offset);
 
-    if (offset > 0 && nugget->lines[offset] == nugget->lines[offset - 1]) {
-        printf("     |> ");
+    if (offset > 0 && get_line(nugget, offset) == get_line(nugget, offset - 1)) {
+        fprintf(out, "     |> ");
     } else {
-        printf("%4d ", nugget->lines[offset]);
+        fprintf(out, "%4d ", get_line(nugget, offset));
+    }
+
+    uint8_t instruction = read_opcode(nugget, offset);
+    if (instruction >= OPCODE_TOTAL || opcodes[instruction].name == NULL) {
+        fprintf(out, "Encountered unknown / unimplemented Opcode '%d' [offset: %04d]\n", instruction, offset);
+        return offset + ((nugget->encoding == ENCODING_WIDE) ? (int)sizeof(InstructionWord) : 1);
     }
 
-    uint8_t instruction = nugget->code[offset];
-
-    switch (instruction) {
-        case OPCODE_CONSTANT:
-            return constant_instruction("OPCODE_CONSTANT", nugget, offset);
-        case OPCODE_CONSTANT_LONG:
-            return constant_long_instruction("OPCODE_CONSTANT_LONG", nugget, offset);
-        case OPCODE_NEGATE:
-            return simple_instruction("OPCODE_NEGATE", offset);
-        case OPCODE_ADD:
-            return simple_instruction("OPCODE_ADD", offset);
-        case OPCODE_SUBTRACT:
-            return simple_instruction("OPCODE_SUBTRACT", offset);
-        case OPCODE_MULTIPLY:
-            return simple_instruction("OPCODE_MULTIPLY", offset);
-        case OPCODE_DIVIDE:
-            return simple_instruction("OPCODE_DIVIDE", offset);
-        case OPCODE_RETURN:
-            return simple_instruction("OPCODE_RETURN", offset);
-        default:
-            printf("Encountered unknown / unimplemented Opcode '%d' [offset: %04d]", instruction, offset);
-            return offset + 1;
+    const char* name = opcodes[instruction].name;
+    switch (opcodes[instruction].format) {
+        case OPERAND_NONE:
+            return simple_instruction(out, name, nugget, offset);
+        case OPERAND_CONSTANT:
+            return constant_instruction(out, name, nugget, offset);
+        case OPERAND_LOCAL:
+            return local_instruction(out, name, nugget, offset);
+        case OPERAND_GLOBAL:
+            return global_instruction(out, name, nugget, offset);
+        case OPERAND_NATIVE:
+            return native_instruction(out, name, nugget, offset);
+        case OPERAND_PARALLEL:
+            return parallel_instruction(out, name, nugget, offset);
+        case OPERAND_COUNT:
+            return count_instruction(out, name, nugget, offset);
+        case OPERAND_JUMP:
+            return jump_instruction(out, name, 1, nugget, offset);
+        case OPERAND_LOOP:
+            return jump_instruction(out, name, -1, nugget, offset);
+        case OPERAND_PROPERTY:
+            return property_instruction(out, name, nugget, offset, false);
+        case OPERAND_INVOKE:
+            return property_instruction(out, name, nugget, offset, true);
     }
+    return offset + instruction_size(nugget, instruction);
 }
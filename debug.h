@@ -3,7 +3,39 @@
 
     #include "nugget.h"
 
+    /*
+     * How the disassembler prints an instruction's operand - and so how the assembler (assembler.h) reads it back.
+     *      OPERAND_NONE:       Just the opcode name.
+     *      OPERAND_CONSTANT:   [index]  value - an index into the constant pool, and the constant.
+     *      OPERAND_LOCAL:      [slot] - a stack slot, counted from the start of the frame.
+     *      OPERAND_GLOBAL:     [slot]  name - a slot in vm.globals, and the name it was given.
+     *      OPERAND_NATIVE:     [index]  name - an index into the native registry (native.h), and the native's name.
+     *      OPERAND_PARALLEL:   [kind]  name - the kind of parallel loop (parallel.h).
+     *      OPERAND_COUNT:      [count] - how many elements or arguments.
+     *      OPERAND_JUMP:       [offset] -> target - where the jump is, and where it lands. Forwards.
+     *      OPERAND_LOOP:       Likewise, backwards.
+     *      OPERAND_PROPERTY:   [index]  name - a property cache (nugget.h), and the name of the property.
+     *      OPERAND_INVOKE:     [index]  name (count) - likewise, and how many arguments the method is called with.
+     */
+    typedef enum {
+        OPERAND_NONE,
+        OPERAND_CONSTANT,
+        OPERAND_LOCAL,
+        OPERAND_GLOBAL,
+        OPERAND_NATIVE,
+        OPERAND_PARALLEL,
+        OPERAND_COUNT,
+        OPERAND_JUMP,
+        OPERAND_LOOP,
+        OPERAND_PROPERTY,
+        OPERAND_INVOKE
+    } OperandFormat;
+
     void disassemble_nugget(Nugget* nugget, const char* name);
     int disassemble_instruction(Nugget* nugget, int offset);
-    
+    void fdisassemble_nugget(FILE* out, Nugget* nugget, const char* name);
+    int fdisassemble_instruction(FILE* out, Nugget* nugget, int offset);
+    int find_opcode(const char* name, int length);
+    OperandFormat operand_format(uint8_t opcode);
+
 #endif
\ No newline at end of file
@@ -0,0 +1,235 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "fiber.h"
+#include "memory.h"
+
+
+static uint64_t now_nanoseconds(void) {
+    struct timespec now;
+    timespec_get(&now, TIME_UTC);
+    return (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+}
+
+
+/*
+ * The scheduler takes its encoding from whatever the calling thread's VM was set up with (--wide, main.c), so that
+ * every fiber compiles the same way a plain run would.
+ */
+void init_scheduler(Scheduler* scheduler, uint64_t budget) {
+    pthread_mutex_init(&scheduler->lock, NULL);
+    pthread_cond_init(&scheduler->ready, NULL);
+    scheduler->head           = NULL;
+    scheduler->tail           = NULL;
+    scheduler->fibers         = NULL;
+    scheduler->fiber_count    = 0;
+    scheduler->fiber_capacity = 0;
+    scheduler->live           = 0;
+    scheduler->budget         = budget;
+    scheduler->encoding       = vm.encoding;
+}
+
+
+static void enqueue(Scheduler* scheduler, Fiber* fiber) {
+    fiber->next = NULL;
+    if (scheduler->tail == NULL) {
+        scheduler->head = fiber;
+    } else {
+        scheduler->tail->next = fiber;
+    }
+    scheduler->tail = fiber;
+}
+
+
+static Fiber* dequeue(Scheduler* scheduler) {
+    Fiber* fiber = scheduler->head;
+    scheduler->head = fiber->next;
+    if (scheduler->head == NULL) {
+        scheduler->tail = NULL;
+    }
+    return fiber;
+}
+
+
+/*
+ * Queue up a script to run as a new fiber. Fibers are allocated with plain malloc() - they live outside any VM's heap,
+ * and the thread spawning them may well not have a VM of its own at all.
+ */
+Fiber* spawn_fiber(Scheduler* scheduler, const char* source, size_t quota) {
+    Fiber* fiber = malloc(sizeof(Fiber));
+    check_failure(fiber, "Unable to allocate fiber.", sizeof(Fiber));
+
+    size_t length = strlen(source);
+    fiber->source = malloc(length + 1);
+    check_failure(fiber->source, "Unable to allocate fiber source.", length + 1);
+    memcpy(fiber->source, source, length + 1);
+
+    fiber->quota     = quota;
+    fiber->started   = false;
+    fiber->result    = INTERPRETER_YIELD;
+    fiber->submitted = now_nanoseconds();
+    fiber->finished  = 0;
+    fiber->slices    = 0;
+
+    pthread_mutex_lock(&scheduler->lock);
+    if (scheduler->fiber_count == scheduler->fiber_capacity) {
+        int capacity   = GROW_CAPACITY(scheduler->fiber_capacity);
+        Fiber** fibers = realloc(scheduler->fibers, sizeof(Fiber*) * capacity);
+        check_failure(fibers, "Unable to grow fiber list.", sizeof(Fiber*) * capacity);
+        scheduler->fibers         = fibers;
+        scheduler->fiber_capacity = capacity;
+    }
+    scheduler->fibers[scheduler->fiber_count++] = fiber;
+    scheduler->live++;
+    enqueue(scheduler, fiber);
+    pthread_cond_signal(&scheduler->ready);
+    pthread_mutex_unlock(&scheduler->lock);
+
+    return fiber;
+}
+
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+ * One slice of one fiber, on the current worker thread. The fiber's VM is copied in to this thread's vm for the
+ * duration and copied back out afterwards - a few hundred bytes, since everything big hangs off pointers. A fiber's
+ * first slice sets its VM up and compiles its script; its last one tears the VM down again.
+ * Returns true once the fiber has finished.
+ */
+static bool run_slice(Scheduler* scheduler, Fiber* fiber) {
+    InterpretationResult result;
+
+    if (!fiber->started) {
+        init_VM();
+        vm.encoding     = scheduler->encoding;
+        vm.gc.quota     = fiber->quota;
+        fiber->started  = true;
+        result = begin_interpret(&fiber->nugget, fiber->source);
+    } else {
+        vm = fiber->vm;
+        result = INTERPRETER_YIELD;
+    }
+
+    if (result == INTERPRETER_YIELD) {
+        result = resume_interpret((scheduler->budget == 0) ? UINT64_MAX : scheduler->budget);
+    }
+    fiber->slices++;
+
+    if (result == INTERPRETER_YIELD) {
+        fiber->vm = vm;
+        return false;
+    }
+
+    fiber->result   = result;
+    fiber->finished = now_nanoseconds();
+    free_nugget(&fiber->nugget);
+    vm.nugget = NULL;
+    free_VM();
+    return true;
+}
+
+
+static void* scheduler_worker(void* argument) {
+    Scheduler* scheduler = argument;
+
+    pthread_mutex_lock(&scheduler->lock);
+
+    LOOP {
+        while (scheduler->head == NULL && scheduler->live > 0) {
+            pthread_cond_wait(&scheduler->ready, &scheduler->lock);
+        }
+        if (scheduler->live == 0) {
+            break;
+        }
+
+        Fiber* fiber = dequeue(scheduler);
+        pthread_mutex_unlock(&scheduler->lock);
+
+        bool finished = run_slice(scheduler, fiber);
+
+        pthread_mutex_lock(&scheduler->lock);
+        if (finished) {
+            scheduler->live--;
+            if (scheduler->live == 0) {
+                pthread_cond_broadcast(&scheduler->ready);
+            }
+        } else {
+            enqueue(scheduler, fiber);
+            pthread_cond_signal(&scheduler->ready);
+        }
+    }
+
+    pthread_mutex_unlock(&scheduler->lock);
+    return NULL;
+}
+
+
+/*
+ * Run every queued fiber to completion on 'threads' worker threads, returning once they've all finished.
+ */
+void run_scheduler(Scheduler* scheduler, int threads) {
+    pthread_t* workers = malloc(sizeof(pthread_t) * threads);
+    check_failure(workers, "Unable to allocate scheduler threads.", sizeof(pthread_t) * threads);
+
+    int started = 0;
+    for (; started < threads; started++) {
+        if (pthread_create(&workers[started], NULL, scheduler_worker, scheduler) != 0) {
+            break;
+        }
+    }
+    if (started == 0) {
+        scheduler_worker(scheduler);
+    }
+
+    for (int index = 0; index < started; index++) {
+        pthread_join(workers[index], NULL);
+    }
+    free(workers);
+}
+
+
+static int compare_latencies(const void* a, const void* b) {
+    uint64_t left  = *(const uint64_t*)a;
+    uint64_t right = *(const uint64_t*)b;
+    return (left > right) - (left < right);
+}
+
+
+/*
+ * Latency (submission to completion) percentiles over every fiber, and how they finished.
+ */
+void print_fiber_stats(Scheduler* scheduler) {
+    int count = scheduler->fiber_count;
+    if (count == 0) {
+        return;
+    }
+
+    uint64_t* latencies = malloc(sizeof(uint64_t) * count);
+    check_failure(latencies, "Unable to allocate memory for fiber statistics.", sizeof(uint64_t) * count);
+
+    int failed = 0;
+    long slices = 0;
+    for (int index = 0; index < count; index++) {
+        Fiber* fiber = scheduler->fibers[index];
+        latencies[index] = fiber->finished - fiber->submitted;
+        failed += (fiber->result != INTERPRETER_OK);
+        slices += fiber->slices;
+    }
+    qsort(latencies, count, sizeof(uint64_t), compare_latencies);
+
+    printf("[fibers] %d fibers, %d failed, %ld slices\n", count, failed, slices);
+    printf("[fibers] latency (ms): p50 %.2f  p90 %.2f  p99 %.2f  max %.2f\n",
+           latencies[(count * 50) / 100] / 1e6, latencies[(count * 90) / 100] / 1e6,
+           latencies[(count * 99) / 100] / 1e6, latencies[count - 1] / 1e6);
+    free(latencies);
+}
+
+
+void free_scheduler(Scheduler* scheduler) {
+    for (int index = 0; index < scheduler->fiber_count; index++) {
+        free(scheduler->fibers[index]->source);
+        free(scheduler->fibers[index]);
+    }
+    free(scheduler->fibers);
+    pthread_mutex_destroy(&scheduler->lock);
+    pthread_cond_destroy(&scheduler->ready);
+}
@@ -0,0 +1,65 @@
+#ifndef cypsa_fiber_h
+    #define cypsa_fiber_h
+
+    #include <pthread.h>
+    #include "common.h"
+    #include "nugget.h"
+    #include "vm.h"
+
+    /* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+     * Fibers: many independent programs (tenants) multiplexed over a fixed pool of OS threads, so that one long-running
+     * script can't hog a thread while short ones queue up behind it.
+     *
+     * Each fiber is a whole VM of its own - its own heap, globals, stack and interned strings - so fibers share nothing
+     * and never need to lock anything while they run. The scheduler hands fibers out round-robin: a worker thread takes
+     * the fiber at the front of the run queue, swaps its VM in as the thread's vm, runs it for one slice of 'budget'
+     * checkpoints (see VM.budget, vm.h), swaps it back out, and puts it at the back of the queue if it isn't finished.
+     * Fibers can move between threads from one slice to the next.
+     *
+     * struct Fiber:
+     *      vm, nugget:       The fiber's VM while it's parked, and the code it's running.
+     *      source:           The fiber's own copy of its script.
+     *      quota:            Memory quota in bytes for the fiber's VM (0 for none) - see Collector.quota, memory.h.
+     *      started:          Whether the script has been compiled yet. That happens in the fiber's first slice.
+     *      result:           How it finished, once it has.
+     *      submitted, finished: Timestamps (nanoseconds) for latency telemetry.
+     *      slices:           How many slices it took.
+     *
+     * struct Scheduler:
+     *      lock, ready:      Guard the run queue (head, tail) and wake idle workers.
+     *      live:             Fibers not yet finished. Workers exit once this reaches zero.
+     *      budget:           Checkpoints per slice. 0 means no limit: each fiber runs to completion in one go.
+     */
+    typedef struct Fiber {
+        VM vm;
+        Nugget nugget;
+        char* source;
+        size_t quota;
+        bool started;
+        InterpretationResult result;
+        uint64_t submitted;
+        uint64_t finished;
+        int slices;
+        struct Fiber* next;
+    } Fiber;
+
+    typedef struct {
+        pthread_mutex_t lock;
+        pthread_cond_t ready;
+        Fiber* head;
+        Fiber* tail;
+        Fiber** fibers;
+        int fiber_count;
+        int fiber_capacity;
+        int live;
+        uint64_t budget;
+        NuggetEncoding encoding;
+    } Scheduler;
+
+    void init_scheduler(Scheduler* scheduler, uint64_t budget);
+    Fiber* spawn_fiber(Scheduler* scheduler, const char* source, size_t quota);
+    void run_scheduler(Scheduler* scheduler, int threads);
+    void print_fiber_stats(Scheduler* scheduler);
+    void free_scheduler(Scheduler* scheduler);
+
+#endif
@@ -1,11 +1,21 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include "assembler.h"
 #include "common.h"
 #include "compiler.h"
 #include "nugget.h"
 #include "debug.h"
+#include "fiber.h"
+#include "memo.h"
+#include "parallel.h"
+#include "perf.h"
+#include "profile.h"
+#include "serve.h"
+#include "snapshot.h"
 #include "vm.h"
+#include "watch.h"
 
 
 /*
@@ -87,6 +97,249 @@ static void run_from_file(const char* filepath) {
 }
 
 
+/*
+ * --asm and --disassemble: read the script as assembly (assembler.h) rather than source, and/or write its bytecode out
+ * as a listing ('-' for stdout) instead of running it. A listing of source is named "code", and one of assembly keeps
+ * the name its header gave it, so that assembling a listing and disassembling it again gives back the same text.
+ * The source is kept until the end, since function bodies may not have been compiled yet (compiler.c).
+ */
+static bool assembly = false;
+static const char* disassemble_path = NULL;
+
+static void build_from_file(const char* filepath) {
+    char* text = read_file(filepath);
+    char name[ASSEMBLER_NAME_MAX] = "code";
+    Nugget nugget;
+
+    if (assembly) {
+        if (!assemble(text, &nugget, name)) {
+            free(text);
+            exit(65);
+        }
+    } else if (begin_interpret(&nugget, text) == INTERPRETER_COMPILE_ERROR) {
+        free_nugget(&nugget);
+        free(text);
+        exit(65);
+    }
+
+    InterpretationResult result = INTERPRETER_OK;
+    if (disassemble_path != NULL) {
+        FILE* out = (strcmp(disassemble_path, "-") == 0) ? stdout : fopen(disassemble_path, "w");
+        if (out == NULL) {
+            fprintf(stderr, "Error: Could not open '%s' to write the listing to.\n", disassemble_path);
+            exit(74);
+        }
+        fdisassemble_nugget(out, &nugget, name);
+        if (out != stdout) {
+            fclose(out);
+        }
+    } else {
+        result = run_nugget(&nugget);
+    }
+
+    free_nugget(&nugget);
+    vm.nugget = NULL;
+    free(text);
+
+    if (result == INTERPRETER_RUNTIME_ERROR) {
+        exit(70);
+    }
+}
+
+
+/*
+ * --fibers: run every script named on the command line as a fiber of its own (fiber.h), all at once, time-sliced over
+ * fiber_threads worker threads. Exits with 70 if any of them failed.
+ */
+static int fiber_threads = 0;
+static uint64_t fiber_budget = 1000;
+static size_t fiber_quota = 0;
+
+static void run_fibers(int count, char* paths[]) {
+    Scheduler scheduler;
+    init_scheduler(&scheduler, fiber_budget);
+
+    for (int index = 0; index < count; index++) {
+        char* source = read_file(paths[index]);
+        spawn_fiber(&scheduler, source, fiber_quota);
+        free(source);
+    }
+
+    run_scheduler(&scheduler, fiber_threads);
+    print_fiber_stats(&scheduler);
+
+    bool failed = false;
+    for (int index = 0; index < scheduler.fiber_count; index++) {
+        failed = failed || (scheduler.fibers[index]->result != INTERPRETER_OK);
+    }
+    free_scheduler(&scheduler);
+
+    if (failed) {
+        exit(70);
+    }
+}
+
+
+
+/*
+ * Command-line options come before the script path:
+ *      --wide          Compile with the fixed-width 32-bit instruction encoding instead of the byte encoding (nugget.h).
+ *      --gc-stats      Print garbage collector statistics and pause-time percentiles on exit.
+ *      --gc-growth=F   After each collection, let the heap grow to F times the live size before collecting again.
+ *      --quicken-stats Print how often quickened (type-specialized) instructions were hit, and deoptimized, on exit.
+ *      --lex-threads=N Scan large source files with N threads at once (compiler.c). Defaults to one per online core.
+ *      --parallel-threads=N  Run parallel loops (parallel.h) on N threads. Defaults to one per online core.
+ *      --load-snapshot=FILE  Start from the globals saved in a snapshot image (snapshot.h) instead of a bare VM.
+ *      --save-snapshot=FILE  After the script has run, save its globals to a snapshot image - typically for a prelude.
+ *      --fibers=N      Run all the scripts given as fibers, round-robin over N threads (fiber.h), and print latencies.
+ *      --budget=N      With --fibers: loop iterations and native calls per time slice. 0 runs each fiber to completion.
+ *      --quota=BYTES   With --fibers: memory quota for each fiber.
+ *      --eager         Compile every function body where it's declared, rather than on its first call (compiler.c).
+ *      --perf          Print hardware counters (cycles, instructions, branch and cache misses) for scanning, compiling
+ *                      and running the script on exit (perf.h). Counts the main thread only, so not with --fibers.
+ *      --profile       Sample the running script PROFILE_RATE_DEFAULT times a second of CPU time and print its hottest
+ *                      functions and lines on exit (profile.h). Not with --fibers.
+ *      --profile-rate=HZ     Sample HZ times a second instead. Implies --profile.
+ *      --profile-stacks=FILE Also write every sampled stack to FILE, in the collapsed format flame graph tools read.
+ *                      Implies --profile.
+ *      --memo-size=N   Memoize calls to pure functions (memo.h) in a cache of N results per function, instead of
+ *                      MEMO_SIZE_DEFAULT. 0 turns memoization off.
+ *      --memo-evict=POLICY   Which result a full cache pushes out for a new one: lru (the default), fifo or random.
+ *      --memo-stats    Print how many calls to pure functions were answered from their caches, per function, on exit.
+ *                      Counts the main thread's program only, so not the scripts run with --fibers.
+ *      --ic-stats      Print how the property caches (nugget.h) did on exit: hits, misses, and how many instructions saw
+ *                      more than one shape (polymorphic) or more than PROPERTY_CACHE_ENTRIES (megamorphic).
+ *      --asm           The script is bytecode assembly, in the disassembler's format (assembler.h), rather than source.
+ *      --disassemble=FILE    Write the script's bytecode to FILE ('-' for stdout) in the disassembler's format, rather
+ *                      than running it. With --asm, gives back the very text that was assembled.
+ *      --serve         Rather than running a script, treat the first argument as the path of a Unix-domain socket, and
+ *                      run scripts sent to it on a pool of warm workers until interrupted (serve.h). The socket is
+ *                      made with mode 0600: anyone who can connect can run scripts, and read files, as this user.
+ *      --serve-workers=N     With --serve: how many workers. Defaults to one per online core.
+ *      --watch         Run the script, then rerun it every time the file changes, recompiling only the top-level
+ *                      declarations which changed (watch.h), until interrupted with Ctrl-C. Not with --fibers.
+ * Returns the index of the first argument which isn't an option.
+ */
+static bool show_gc_stats = false;
+static bool show_quicken_stats = false;
+static bool show_memo_stats = false;
+static bool show_ic_stats = false;
+static bool show_perf = false;
+static bool profile = false;
+static int profile_rate = PROFILE_RATE_DEFAULT;
+static const char* profile_stacks_path = NULL;
+static bool watch = false;
+static bool serve = false;
+static int serve_workers = 1;
+static const char* load_snapshot_path = NULL;
+static const char* save_snapshot_path = NULL;
+
+static int parse_options(int argc, char* argv[]) {
+    int arg = 1;
+
+    #ifdef _SC_NPROCESSORS_ONLN
+        set_lex_threads((int)sysconf(_SC_NPROCESSORS_ONLN));
+        set_parallel_threads((int)sysconf(_SC_NPROCESSORS_ONLN));
+        serve_workers = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    #endif
+
+    for (; arg < argc && strncmp(argv[arg], "--", 2) == 0; arg++) {
+        if (strcmp(argv[arg], "--wide") == 0) {
+            set_encoding(ENCODING_WIDE);
+        } else if (strcmp(argv[arg], "--gc-stats") == 0) {
+            show_gc_stats = true;
+        } else if (strcmp(argv[arg], "--quicken-stats") == 0) {
+            show_quicken_stats = true;
+        } else if (strcmp(argv[arg], "--memo-stats") == 0) {
+            show_memo_stats = true;
+        } else if (strcmp(argv[arg], "--ic-stats") == 0) {
+            show_ic_stats = true;
+        } else if (strncmp(argv[arg], "--memo-size=", 12) == 0) {
+            int size = atoi(argv[arg] + 12);
+            if (size < 0 || size > (1 << 24)) {
+                fprintf(stderr, "Error: --memo-size must be between 0 and %d.\n", 1 << 24);
+                exit(64);
+            }
+            set_memo_size(size);
+        } else if (strncmp(argv[arg], "--memo-evict=", 13) == 0) {
+            if (!set_memo_eviction(argv[arg] + 13)) {
+                fprintf(stderr, "Error: --memo-evict must be lru, fifo or random.\n");
+                exit(64);
+            }
+        } else if (strcmp(argv[arg], "--eager") == 0) {
+            set_lazy_functions(false);
+        } else if (strcmp(argv[arg], "--perf") == 0) {
+            show_perf = true;
+        } else if (strcmp(argv[arg], "--profile") == 0) {
+            profile = true;
+        } else if (strncmp(argv[arg], "--profile-rate=", 15) == 0) {
+            profile      = true;
+            profile_rate = atoi(argv[arg] + 15);
+            if (profile_rate < 1 || profile_rate > 100000) {
+                fprintf(stderr, "Error: --profile-rate must be between 1 and 100000.\n");
+                exit(64);
+            }
+        } else if (strncmp(argv[arg], "--profile-stacks=", 17) == 0) {
+            profile             = true;
+            profile_stacks_path = argv[arg] + 17;
+        } else if (strcmp(argv[arg], "--asm") == 0) {
+            assembly = true;
+        } else if (strncmp(argv[arg], "--disassemble=", 14) == 0) {
+            disassemble_path = argv[arg] + 14;
+        } else if (strcmp(argv[arg], "--serve") == 0) {
+            serve = true;
+        } else if (strncmp(argv[arg], "--serve-workers=", 16) == 0) {
+            serve_workers = atoi(argv[arg] + 16);
+            if (serve_workers < 1 || serve_workers > 1024) {
+                fprintf(stderr, "Error: --serve-workers must be between 1 and 1024.\n");
+                exit(64);
+            }
+        } else if (strcmp(argv[arg], "--watch") == 0) {
+            watch = true;
+        } else if (strncmp(argv[arg], "--load-snapshot=", 16) == 0) {
+            load_snapshot_path = argv[arg] + 16;
+        } else if (strncmp(argv[arg], "--save-snapshot=", 16) == 0) {
+            save_snapshot_path = argv[arg] + 16;
+        } else if (strncmp(argv[arg], "--fibers=", 9) == 0) {
+            fiber_threads = atoi(argv[arg] + 9);
+            if (fiber_threads < 1) {
+                fprintf(stderr, "Error: --fibers must be at least 1.\n");
+                exit(64);
+            }
+        } else if (strncmp(argv[arg], "--budget=", 9) == 0) {
+            fiber_budget = strtoull(argv[arg] + 9, NULL, 10);
+        } else if (strncmp(argv[arg], "--quota=", 8) == 0) {
+            fiber_quota = (size_t)strtoull(argv[arg] + 8, NULL, 10);
+        } else if (strncmp(argv[arg], "--lex-threads=", 14) == 0) {
+            int threads = atoi(argv[arg] + 14);
+            if (threads < 1) {
+                fprintf(stderr, "Error: --lex-threads must be at least 1.\n");
+                exit(64);
+            }
+            set_lex_threads(threads);
+        } else if (strncmp(argv[arg], "--parallel-threads=", 19) == 0) {
+            int threads = atoi(argv[arg] + 19);
+            if (threads < 1) {
+                fprintf(stderr, "Error: --parallel-threads must be at least 1.\n");
+                exit(64);
+            }
+            set_parallel_threads(threads);
+        } else if (strncmp(argv[arg], "--gc-growth=", 12) == 0) {
+            double growth = strtod(argv[arg] + 12, NULL);
+            if (growth <= 1.0) {
+                fprintf(stderr, "Error: --gc-growth must be greater than 1.\n");
+                exit(64);
+            }
+            vm.gc.growth_factor = growth;
+        } else {
+            fprintf(stderr, "Error: Unknown option '%s'.\n", argv[arg]);
+            exit(64);
+        }
+    }
+
+    return arg;
+}
+
 
 /*
  * GO
@@ -97,9 +350,9 @@ int main(int argc, char* argv[]) {
     Nugget nugget;
     init_nugget(&nugget);
     
-    Value v1 = 1.0;
-    Value v2 = 2.0;
-    Value v3 = 3.0;
+    Value v1 = NUMBER_VAL(1.0);
+    Value v2 = NUMBER_VAL(2.0);
+    Value v3 = NUMBER_VAL(3.0);
 
     write_constant(&nugget, v1, 1);
     write_constant(&nugget, v2, 2);
@@ -107,29 +360,105 @@ int main(int argc, char* argv[]) {
     write_constant(&nugget, v3, 3);
     write_nugget(&nugget, OPCODE_NEGATE, 4); 
 
-    write_constant(&nugget, 123.456789, 3);
-    write_constant(&nugget, 123.456789, 11);
-    write_constant(&nugget, 123.456789, 12);
-    write_constant(&nugget, 123.456789, 13);
-    write_constant(&nugget, 123.456789, 14);
-    write_constant(&nugget, 123.456789, 15);
-    write_constant(&nugget, 123.456789, 16);
-    write_constant(&nugget, 123.456789, 17);
-    write_constant(&nugget, 123.456789, 18);
+    write_constant(&nugget, NUMBER_VAL(123.456789), 3);
+    write_constant(&nugget, NUMBER_VAL(123.456789), 11);
+    write_constant(&nugget, NUMBER_VAL(123.456789), 12);
+    write_constant(&nugget, NUMBER_VAL(123.456789), 13);
+    write_constant(&nugget, NUMBER_VAL(123.456789), 14);
+    write_constant(&nugget, NUMBER_VAL(123.456789), 15);
+    write_constant(&nugget, NUMBER_VAL(123.456789), 16);
+    write_constant(&nugget, NUMBER_VAL(123.456789), 17);
+    write_constant(&nugget, NUMBER_VAL(123.456789), 18);
 
     write_nugget(&nugget, OPCODE_MULTIPLY, 10);
 
     write_nugget(&nugget, OPCODE_RETURN, 20);
 
-    if (argc > 1) {
-        printf("\nRunning from file: %s\n", argv[1]);
-        run_from_file(argv[1]);
+    int arg = parse_options(argc, argv);
+
+    if (load_snapshot_path != NULL && !load_snapshot(load_snapshot_path)) {
+        exit(74);
+    }
+
+    if (watch && fiber_threads > 0) {
+        fprintf(stderr, "Error: --watch can't be used with --fibers.\n");
+        exit(64);
+    }
+    if (serve && (arg >= argc || watch || fiber_threads > 0 || assembly || disassemble_path != NULL || profile ||
+                  show_perf)) {
+        fprintf(stderr, "Error: --serve needs a socket path, and can't be used with --watch, --fibers, --asm, "
+                        "--disassemble, --profile or --perf.\n");
+        exit(64);
+    }
+    if (show_perf && fiber_threads > 0) {
+        fprintf(stderr, "Warning: --perf only counts the main thread, so it is ignored with --fibers.\n");
+        show_perf = false;
+    }
+    if (show_perf) {
+        init_perf();
+    }
+    if (profile && fiber_threads > 0) {
+        fprintf(stderr, "Error: --profile can't be used with --fibers.\n");
+        exit(64);
+    }
+    if (profile) {
+        init_profile(profile_rate, (arg < argc) ? argv[arg] : NULL, profile_stacks_path);
+    }
+
+    if ((assembly || disassemble_path != NULL) && (watch || fiber_threads > 0)) {
+        fprintf(stderr, "Error: --asm and --disassemble can't be used with --watch or --fibers.\n");
+        exit(64);
+    }
+
+    if (serve) {
+        run_server(argv[arg], serve_workers);
+    } else if (fiber_threads > 0 && arg < argc) {
+        run_fibers(argc - arg, &argv[arg]);
+    } else if (watch && arg < argc) {
+        printf("\nWatching file: %s\n", argv[arg]);
+        run_watch(argv[arg]);
+    } else if ((assembly || disassemble_path != NULL) && arg < argc) {
+        build_from_file(argv[arg]);
+    } else if (arg < argc) {
+        printf("\nRunning from file: %s\n", argv[arg]);
+        run_from_file(argv[arg]);
+
+        if (save_snapshot_path != NULL && !save_snapshot(save_snapshot_path)) {
+            exit(74);
+        }
     } else {
         printf("\nEntering REPL...\n\n");
         repl();
     }
 
     free_nugget(&nugget);
+
+    if (show_gc_stats) {
+        print_gc_stats();
+    }
+
+    if (show_quicken_stats) {
+        print_quicken_stats();
+    }
+
+    if (show_memo_stats) {
+        print_memo_stats();
+    }
+    if (show_ic_stats) {
+        print_ic_stats();
+    }
+
+    if (show_perf) {
+        print_perf_report();
+        free_perf();
+    }
+
+    if (profile) {
+        print_profile_report();
+        free_profile();
+    }
+
+    free_parallel();
     free_VM();
 
     return EXIT_SUCCESS;
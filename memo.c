@@ -0,0 +1,374 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "compiler.h"
+#include "memo.h"
+#include "memory.h"
+#include "native.h"
+#include "nugget.h"
+#include "perf.h"
+
+int memo_size = MEMO_SIZE_DEFAULT;
+static MemoEviction eviction = MEMO_EVICT_LRU;
+
+static const char* eviction_names[] = {
+    [MEMO_EVICT_LRU]    = "lru",
+    [MEMO_EVICT_FIFO]   = "fifo",
+    [MEMO_EVICT_RANDOM] = "random"
+};
+
+// For MEMO_EVICT_RANDOM. Fibers on different threads each get their own (fiber.h)
+static _Thread_local uint64_t random_state = 0x9E3779B97F4A7C15ULL;
+
+
+/*
+ * --memo-size=N and --memo-evict=POLICY (main.c). Both are settled before any code runs, and never change afterwards.
+ */
+void set_memo_size(int size) {
+    memo_size = size;
+}
+
+
+bool set_memo_eviction(const char* name) {
+    for (int policy = 0; policy < (int)(sizeof(eviction_names) / sizeof(eviction_names[0])); policy++) {
+        if (strcmp(name, eviction_names[policy]) == 0) {
+            eviction = (MemoEviction)policy;
+            return true;
+        }
+    }
+    return false;
+}
+
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+ * Is a function pure (see memo.h)? The same walk over its code, and everything reachable from it through globals and
+ * nested declarations, as a parallel loop makes before it starts (parallel.c) - except that here a function found on
+ * the way which was declared 'pure' is taken at its word, and reading a global which isn't a function rules the whole
+ * thing out. Functions found on the way are compiled if they haven't been yet, just as for a parallel loop.
+ */
+typedef struct {
+    ObjFunction** functions;
+    int count;
+    int capacity;
+} Visited;
+
+// Add function to the list, unless it's there already. Returns whether it was new
+static bool visit(Visited* visited, ObjFunction* function) {
+    for (int index = 0; index < visited->count; index++) {
+        if (visited->functions[index] == function) {
+            return false;
+        }
+    }
+    if (visited->count == visited->capacity) {
+        visited->capacity  = GROW_CAPACITY(visited->capacity);
+        visited->functions = realloc(visited->functions, sizeof(ObjFunction*) * visited->capacity);
+        check_failure(visited->functions, "Unable to grow the list of functions checked for purity.",
+                      sizeof(ObjFunction*) * visited->capacity);
+    }
+    visited->functions[visited->count++] = function;
+    return true;
+}
+
+static bool pure_function(ObjFunction* function, Visited* visited, bool outermost);
+
+static bool pure_value(Value value, Visited* visited) {
+    if (!IS_FUNCTION(value)) {
+        return false;
+    }
+
+    ObjFunction* function = AS_FUNCTION(value);
+    if (function->declared_pure || !visit(visited, function)) {
+        return true;
+    }
+    return pure_function(function, visited, false);
+}
+
+static bool pure_function(ObjFunction* function, Visited* visited, bool outermost) {
+    if (!function->compiled) {
+        perf_begin(PERF_COMPILE);
+        bool compiled = compile_function(function);
+        perf_end(PERF_COMPILE);
+
+        if (!compiled) {
+            return false;
+        }
+    }
+
+    Nugget* nugget = &function->nugget;
+    for (int offset = 0; offset < nugget->occupied; ) {
+        uint8_t opcode = generic_opcode(read_opcode(nugget, offset));
+
+        switch (opcode) {
+            case OPCODE_SET_GLOBAL:
+            case OPCODE_DEFINE_GLOBAL:
+            case OPCODE_SET_INDEX:
+            case OPCODE_PRINT:
+            case OPCODE_GET_PROPERTY:
+            case OPCODE_SET_PROPERTY:
+            case OPCODE_INVOKE:
+            case OPCODE_TAIL_INVOKE:
+                return false;
+            case OPCODE_CALL_NATIVE:
+                if (!natives[read_operand(nugget, offset)].pure) {
+                    return false;
+                }
+                break;
+            case OPCODE_SET_LOCAL: {
+                uint32_t slot = read_operand(nugget, offset);
+                if (outermost && slot >= 1 && slot <= (uint32_t)function->arity) {
+                    return false;
+                }
+                break;
+            }
+            case OPCODE_GET_GLOBAL:
+                if (!pure_value(vm.globals.values[read_operand(nugget, offset)], visited)) {
+                    return false;
+                }
+                break;
+            default:
+                DO_NOTHING
+        }
+        offset += instruction_size(nugget, read_opcode(nugget, offset));
+    }
+
+    for (int index = 0; index < nugget->constants.occupied; index++) {
+        Value constant = nugget->constants.values[index];
+        if (IS_CLASS(constant) || (IS_FUNCTION(constant) && !pure_value(constant, visited))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+/*
+ * Work out (again, if the globals' functions have changed since last time) whether calls to function are memoized.
+ * Anything cached from before is thrown away. Called by memo_for() from call_value(), with the function on the stack.
+ */
+Memo* decide_purity(ObjFunction* function) {
+    Memo* memo = function->memo;
+
+    if (memo == NULL) {
+        memo  = (Memo*)reallocate(NULL, 0, sizeof(Memo));
+        *memo = (Memo){0};
+        memo->width     = function->arity + 1;
+        function->memo  = memo;
+    } else if (memo->sets > 0) {
+        memset(memo->stamps, 0, sizeof(uint64_t) * memo->sets * MEMO_WAYS);
+    }
+
+    if (function->declared_pure) {
+        memo->pure = true;
+    } else if (function->generator || function->method) {
+        memo->pure = false;
+    } else {
+        // The function itself goes on the list first, so that calling itself doesn't count against it
+        Visited visited = {NULL, 0, 0};
+        visit(&visited, function);
+        memo->pure = pure_function(function, &visited, true);
+        free(visited.functions);
+    }
+
+    memo->epoch = vm.code_epoch;
+    return memo;
+}
+
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+ * The cache itself. A key is the arguments' types and bit patterns - so 0 and -0 are different keys, and a NaN finds
+ * itself - and the hash mixes them all into one number, whose low bits pick the set.
+ */
+static inline bool cacheable(Value value) {
+    return IS_NUMBER(value) || IS_BOOL(value) || IS_NIL(value);
+}
+
+
+static inline uint64_t value_bits(Value value) {
+    uint64_t bits = 0;
+    if (IS_NUMBER(value)) {
+        memcpy(&bits, &AS_NUMBER(value), sizeof(bits));
+    } else if (IS_BOOL(value)) {
+        bits = AS_BOOL(value);
+    }
+    return bits;
+}
+
+
+// Small whole numbers - the usual arguments - only differ in their top bits, so every bit has to be stirred into the low ones
+static inline uint64_t mix_bits(uint64_t bits) {
+    bits ^= bits >> 33;
+    bits *= 0xFF51AFD7ED558CCDULL;
+    bits ^= bits >> 33;
+    bits *= 0xC4CEB9FE1A85EC53ULL;
+    bits ^= bits >> 33;
+    return bits;
+}
+
+
+static bool hash_arguments(const Value* args, int count, uint64_t* hash) {
+    uint64_t mixed = 0x9E3779B97F4A7C15ULL;
+    for (int index = 0; index < count; index++) {
+        if (!cacheable(args[index])) {
+            return false;
+        }
+        mixed = mix_bits(mixed ^ value_bits(args[index]) ^ ((uint64_t)args[index].type << 56)) + (uint64_t)index;
+    }
+    *hash = mixed;
+    return true;
+}
+
+
+static inline bool same_arguments(const Value* entry, const Value* args, int count) {
+    for (int index = 0; index < count; index++) {
+        if (entry[index].type != args[index].type || value_bits(entry[index]) != value_bits(args[index])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+/*
+ * Sets come in a power of two, enough for memo_size results between them. Allocating may set off a collection, which
+ * is fine: the callee and its arguments are on the stack.
+ */
+static void allocate_cache(Memo* memo) {
+    int sets = 1;
+    while (sets * MEMO_WAYS < memo_size) {
+        sets *= 2;
+    }
+
+    memo->stamps  = GROW_ARRAY(uint64_t, NULL, 0, sets * MEMO_WAYS);
+    memo->entries = GROW_ARRAY(Value, NULL, 0, sets * MEMO_WAYS * memo->width);
+    memset(memo->stamps, 0, sizeof(uint64_t) * sets * MEMO_WAYS);
+    memo->sets = sets;
+}
+
+
+/*
+ * Look for the result of calling function (which memo_for() found to be pure) with args. On a hit the result is left
+ * in *result. MEMO_UNCACHED means the arguments can't be a key, so the call should just run and nothing be stored.
+ */
+MemoLookup memo_lookup(ObjFunction* function, const Value* args, Value* result) {
+    Memo* memo = function->memo;
+    int arity  = memo->width - 1;
+    uint64_t hash;
+
+    if (!hash_arguments(args, arity, &hash)) {
+        return MEMO_UNCACHED;
+    }
+
+    if (memo->sets > 0) {
+        int first = (int)(hash & (uint64_t)(memo->sets - 1)) * MEMO_WAYS;
+        for (int entry = first; entry < first + MEMO_WAYS; entry++) {
+            Value* values = &memo->entries[entry * memo->width];
+            if (memo->stamps[entry] != 0 && same_arguments(values, args, arity)) {
+                if (eviction == MEMO_EVICT_LRU) {
+                    memo->stamps[entry] = ++memo->clock;
+                }
+                memo->hits++;
+                vm.memo.hits++;
+                *result = values[arity];
+                return MEMO_HIT;
+            }
+        }
+    } else {
+        allocate_cache(memo);
+    }
+
+    memo->misses++;
+    vm.memo.misses++;
+    return MEMO_MISS;
+}
+
+
+/*
+ * A call which missed has returned result (OPCODE_RETURN, vm.c) - keep it, unless it's something that can't be kept
+ * or the cache was thrown away while the call ran. args are still the ones the call started with, since a function
+ * which assigns to its parameters isn't pure.
+ */
+void memo_store(ObjFunction* function, const Value* args, Value result) {
+    Memo* memo = function->memo;
+    if (!cacheable(result) || !memo->pure || memo->sets == 0 || memo->epoch != vm.code_epoch) {
+        return;
+    }
+
+    int arity = memo->width - 1;
+    uint64_t hash;
+    hash_arguments(args, arity, &hash);
+
+    int first  = (int)(hash & (uint64_t)(memo->sets - 1)) * MEMO_WAYS;
+    int victim = -1;
+    for (int entry = first; entry < first + MEMO_WAYS; entry++) {
+        if (memo->stamps[entry] == 0) {
+            victim = entry;
+            break;
+        }
+    }
+
+    if (victim < 0) {
+        if (eviction == MEMO_EVICT_RANDOM) {
+            random_state ^= random_state << 13;
+            random_state ^= random_state >> 7;
+            random_state ^= random_state << 17;
+            victim = first + (int)(random_state % MEMO_WAYS);
+        } else {
+            victim = first;
+            for (int entry = first + 1; entry < first + MEMO_WAYS; entry++) {
+                if (memo->stamps[entry] < memo->stamps[victim]) {
+                    victim = entry;
+                }
+            }
+        }
+        memo->evictions++;
+        vm.memo.evictions++;
+    }
+
+    Value* values = &memo->entries[victim * memo->width];
+    memcpy(values, args, sizeof(Value) * arity);
+    values[arity]        = result;
+    memo->stamps[victim] = ++memo->clock;
+}
+
+
+void free_memo(ObjFunction* function) {
+    Memo* memo = function->memo;
+    if (memo == NULL) {
+        return;
+    }
+
+    if (memo->sets > 0) {
+        FREE_ARRAY(uint64_t, memo->stamps, memo->sets * MEMO_WAYS);
+        FREE_ARRAY(Value, memo->entries, memo->sets * MEMO_WAYS * memo->width);
+    }
+    reallocate(memo, sizeof(Memo), 0);
+    function->memo = NULL;
+}
+
+
+/*
+ * --memo-stats: the totals, then each pure function still alive which has been called, most recently declared first.
+ */
+void print_memo_stats(void) {
+    uint64_t calls = vm.memo.hits + vm.memo.misses;
+
+    printf("[memo] %llu hits / %llu calls (%.2f%% hit rate), %llu misses, %llu evictions - %d results per function, "
+           "%s eviction\n",
+           (unsigned long long)vm.memo.hits, (unsigned long long)calls,
+           (calls == 0) ? 0.0 : (100.0 * (double)vm.memo.hits / (double)calls),
+           (unsigned long long)vm.memo.misses, (unsigned long long)vm.memo.evictions, memo_size,
+           eviction_names[eviction]);
+
+    for (Obj* object = vm.objects; object != NULL; object = object->next) {
+        if (object->type != OBJECT_FUNCTION) {
+            continue;
+        }
+        ObjFunction* function = (ObjFunction*)object;
+        Memo* memo            = function->memo;
+        if (memo != NULL && memo->pure && memo->hits + memo->misses > 0) {
+            printf("[memo]     %s(): %llu hits, %llu misses, %llu evictions\n", function->name->chars,
+                   (unsigned long long)memo->hits, (unsigned long long)memo->misses,
+                   (unsigned long long)memo->evictions);
+        }
+    }
+}
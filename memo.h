@@ -0,0 +1,110 @@
+#ifndef cypsa_memo_h
+    #define cypsa_memo_h
+
+    #include "common.h"
+    #include "object.h"
+    #include "values.h"
+    #include "vm.h"
+
+    /* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+     * Memoization of pure functions. A function is pure if calling it twice with the same arguments is bound to give the
+     * same result, and to do nothing else - so the second call needn't run at all. Such a function gets a cache of its
+     * own, from arguments to result, which call_function() (vm.c) looks in before pushing a frame: a hit replaces the callee
+     * and arguments with the cached result straight away, and a miss runs the call as usual, with its frame marked so
+     * that OPCODE_RETURN stores the result on the way out. A chain of tail calls (OPCODE_TAIL_CALL, vm.c) stores only the
+     * result of the call which started it: the calls after the first hand their frames, arguments and all, on to the
+     * next, so there's nothing left to store their results under.
+     *
+     * Whether a function is pure is worked out from its bytecode, the first time it's called (so just after it has been
+     * compiled - see compiler.c). It isn't if it:
+     *      - assigns to a global, writes to an array element or prints;
+     *      - calls a native which isn't pure (native.h) - anything which allocates, or runs script code, or reads a file;
+     *      - reads a global which doesn't hold a function, since that could change between calls;
+     *      - reads a global function, or declares one, which isn't pure itself (a function calling itself, directly or
+     *        round a loop of others, is taken to be pure as far as that goes);
+     *      - assigns to one of its own parameters, since they're what its results are cached by;
+     *      - yields - a generator function's call makes a new generator every time;
+     *      - touches a property, since an instance's fields can change between calls without it being a different
+     *        argument - or is a method, whose instance isn't one of the arguments at all;
+     *      - declares a class, since calling one runs its methods and makes a new instance every time.
+     * 'pure func name(...)' declares a function pure outright. The compiler rejects everything on that list but the
+     * globals in the body of one; it may read any global it likes, and call any function, since the programmer is
+     * vouching that it doesn't matter.
+     * What was worked out depends on which functions the globals held, so it's all thrown away - and every cache with
+     * it - when a global that held a function is overwritten (VM.code_epoch, vm.h).
+     *
+     * Only calls whose arguments are all numbers, booleans or nil are cached, by their bit patterns, and only results
+     * which are numbers, booleans or nil are stored. Anything on the heap is left out: arrays can be changed behind the
+     * cache's back, and a cache which held on to objects would have to be traced by the collector. Those calls just run.
+     *
+     * A cache holds memo_size results (--memo-size=N, main.c; 0 turns memoization off), in sets of MEMO_WAYS. A call
+     * hashes to one set and is looked for among its ways; a new result goes into an empty way if the set has one, and
+     * otherwise pushes one out, chosen by the eviction policy (--memo-evict=lru|fifo|random):
+     *      MEMO_EVICT_LRU:     The result which was stored or last hit longest ago.
+     *      MEMO_EVICT_FIFO:    The result which was stored longest ago, however often it has been hit since.
+     *      MEMO_EVICT_RANDOM:  Any of them.
+     * The cache is only allocated on the first miss, so an impure function costs no more than the small Memo.
+     * The workers of a parallel loop (parallel.h) don't use the caches at all, since they mustn't write to the code they
+     * share.
+     *
+     * struct Memo:
+     *      uint32_t epoch:     VM.code_epoch when pure was worked out.
+     *      bool pure:          Whether calls go through the cache.
+     *      int sets:           How many sets of MEMO_WAYS the cache has - 0 until it's allocated.
+     *      int width:          Values per entry: the arguments, then the result.
+     *      uint64_t clock:     Counts stores and hits, to stamp entries with.
+     *      uint64_t* stamps:   For each entry, when it was stored, or for LRU last used - 0 if it's empty.
+     *      Value* entries:     sets * MEMO_WAYS entries of width values each.
+     *      hits, misses, evictions: This function's share of VM.memo.
+     */
+    #define MEMO_WAYS         4
+    #define MEMO_SIZE_DEFAULT 1024
+
+    typedef enum {
+        MEMO_EVICT_LRU,
+        MEMO_EVICT_FIFO,
+        MEMO_EVICT_RANDOM
+    } MemoEviction;
+
+    typedef enum {
+        MEMO_HIT,
+        MEMO_MISS,
+        MEMO_UNCACHED
+    } MemoLookup;
+
+    struct Memo {
+        uint32_t epoch;
+        bool pure;
+        int sets;
+        int width;
+        uint64_t clock;
+        uint64_t* stamps;
+        Value* entries;
+        uint64_t hits;
+        uint64_t misses;
+        uint64_t evictions;
+    };
+
+    extern int memo_size;
+
+    void set_memo_size(int size);
+    bool set_memo_eviction(const char* name);
+    Memo* decide_purity(ObjFunction* function);
+    MemoLookup memo_lookup(ObjFunction* function, const Value* args, Value* result);
+    void memo_store(ObjFunction* function, const Value* args, Value result);
+    void free_memo(ObjFunction* function);
+    void print_memo_stats(void);
+
+    /*
+     * The cache to call function through, or NULL if it isn't pure. Working it out happens once
+     * per function, and again after code_epoch has moved on; after that this is two loads and a compare.
+     */
+    static inline Memo* memo_for(ObjFunction* function) {
+        Memo* memo = function->memo;
+        if (memo == NULL || memo->epoch != vm.code_epoch) {
+            memo = decide_purity(function);
+        }
+        return memo->pure ? memo : NULL;
+    }
+
+#endif
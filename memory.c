@@ -1,5 +1,22 @@
 #include <stdlib.h>
+#include <time.h>
+#include "compiler.h"
 #include "memory.h"
+#include "object.h"
+#include "serve.h"
+#include "watch.h"
+#include "table.h"
+#include "vm.h"
+
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+ * How much collector work one slice is allowed to do - one unit per object traced or swept - and how big the heap is
+ * allowed to get before the very first cycle starts.
+ */
+#define GC_SLICE_WORK   256
+#define GC_FIRST_CYCLE  (1024 * 1024)
+
+static void gc_step(size_t budget);
 
 /* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
  * Ensure memory allocation succeeded. The ASSERT_FORMAT macro simplifies formatted error
@@ -24,8 +41,32 @@ void check_failure(void* pointer, const char* message, size_t requested) {
  * If the old size is 0 and the new size non-zero, then we want to allocate a new block.
  * A non-zero old size with a *smaller* new size indicates we need to shrink the code array.
  * Otherwise (likely the most common case) new_size will be *larger*, which requires growing the code array.
+ * Every allocation passes through here, so this is where the collector keeps count of the heap, and where it gets to
+ * do its work: whenever something grows while a cycle is running (or the heap has got big enough to start one), one
+ * bounded slice of collection happens first. That keeps each pause small no matter how big the heap is, and makes the
+ * collector keep pace with however fast the program is allocating.
+ * With DEBUG_STRESS_GC defined (common.h), every allocation runs a complete collection instead - slow, but it shakes
+ * out anything that forgets to keep its objects reachable. Whole collections never leave the program running in the
+ * middle of a mark phase, though, so they can't catch a missing write barrier. DEBUG_STRESS_INCREMENTAL does the
+ * opposite: every allocation runs a slice which traces or sweeps a single object, so the program spends nearly all its
+ * time in the middle of a cycle, storing into half-marked objects - and the end of every mark phase checks that no
+ * store slipped past the barrier (check_marking()).
  */
 void* reallocate(void* pointer, size_t old_size, size_t new_size) {
+    vm.gc.bytes_allocated += new_size - old_size;
+
+    if (new_size > old_size && vm.gc.paused == 0) {
+        #if defined(DEBUG_STRESS_GC)
+            collect_garbage();
+        #elif defined(DEBUG_STRESS_INCREMENTAL)
+            gc_step(1);
+        #else
+            if (vm.gc.phase != GC_IDLE || vm.gc.bytes_allocated > vm.gc.next_gc) {
+                gc_step(GC_SLICE_WORK);
+            }
+        #endif
+    }
+
     if (new_size == 0) {
         free(pointer);
         return NULL;
@@ -34,4 +75,413 @@ void* reallocate(void* pointer, size_t old_size, size_t new_size) {
     void* resized = realloc(pointer, new_size);
     check_failure(resized, "Unable to reallocate code chunk.", new_size);
     return resized;
+}
+
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+ * Aligned allocations still go through reallocate(), so that everything Cypsa allocates is counted in one place. We ask
+ * for (alignment - 1) spare bytes plus room for one pointer, round the address up to the next multiple of alignment, and
+ * tuck the pointer reallocate() actually gave us into the slot just before the aligned address. free_aligned() reads it
+ * back out so it can hand the original pointer (and the original, padded size) back to reallocate().
+ * alignment must be a power of two.
+ */
+void* allocate_aligned(size_t size, size_t alignment) {
+    size_t padded   = size + alignment - 1 + sizeof(void*);
+    uint8_t* raw    = reallocate(NULL, 0, padded);
+    uintptr_t first = (uintptr_t)(raw + sizeof(void*));
+    uint8_t* start  = (uint8_t*)((first + alignment - 1) & ~(uintptr_t)(alignment - 1));
+
+    ((void**)start)[-1] = raw;
+    return start;
+}
+
+void free_aligned(void* pointer, size_t size, size_t alignment) {
+    if (pointer == NULL) {
+        return;
+    }
+
+    void* raw = ((void**)pointer)[-1];
+    reallocate(raw, size + alignment - 1 + sizeof(void*), 0);
+}
+
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+ * The garbage collector is an incremental, tri-colour mark-sweep collector:
+ *      white:  not marked (Obj.mark != vm.gc.mark_bit). Anything still white when marking finishes is garbage.
+ *      gray:   marked, and sitting on the gray stack waiting for its own references to be traced.
+ *      black:  marked, and off the gray stack - everything it points to is at least gray.
+ * Rather than stopping the world for a whole collection, gc_step() does a slice of at most `budget` units of work and
+ * returns to whatever was running. The roots - the VM stack, the constant pool of the nugget being compiled or run, and
+ * the globals - are marked when a cycle starts and then scanned *again* just before marking finishes, because they
+ * change all the time and don't go through the write barrier. Everything in the heap does go through WRITE_BARRIER
+ * (memory.h), which stops a black object from ever ending up pointing at a white one.
+ * Starting a cycle flips vm.gc.mark_bit, which makes every existing object white in one go. New objects always get the
+ * current bit, so anything allocated mid-cycle survives that cycle.
+ * The intern table (vm.strings) is weak: it doesn't keep strings alive. Each dead string is taken out of the table as
+ * it is swept, and intern lookups in the meantime know how to tell a dead string from a live one (object.c), so there
+ * is never a pass over the whole table - every step of the collector stays bounded by its budget plus the roots.
+ * The gray stack is allocated with plain realloc() - going through reallocate() would mean the collector could end up
+ * running itself.
+ */
+void init_collector(Collector* gc) {
+    gc->phase           = GC_IDLE;
+    gc->mark_bit        = true;
+    gc->bytes_allocated = 0;
+    gc->next_gc         = GC_FIRST_CYCLE;
+    gc->growth_factor   = 2.0;
+    gc->paused          = 0;
+    gc->gray_count      = 0;
+    gc->gray_capacity   = 0;
+    gc->gray_stack      = NULL;
+    gc->sweeping        = NULL;
+    gc->cycles          = 0;
+    gc->slices          = 0;
+    gc->freed_objects   = 0;
+    gc->pauses          = NULL;
+    gc->quota           = 0;
+}
+
+
+void free_collector(Collector* gc) {
+    free(gc->pauses);
+    gc->pauses = NULL;
+    free(gc->gray_stack);
+    gc->gray_stack    = NULL;
+    gc->gray_capacity = 0;
+    gc->gray_count    = 0;
+}
+
+
+void mark_object(Obj* object) {
+    if (object == NULL || IS_MARKED(object)) {
+        return;
+    }
+
+    object->mark = vm.gc.mark_bit;
+
+    if (vm.gc.gray_capacity < vm.gc.gray_count + 1) {
+        vm.gc.gray_capacity = GROW_CAPACITY(vm.gc.gray_capacity);
+        vm.gc.gray_stack    = (Obj**)realloc(vm.gc.gray_stack, sizeof(Obj*) * vm.gc.gray_capacity);
+        check_failure(vm.gc.gray_stack, "Unable to grow the collector's gray stack.", sizeof(Obj*) * vm.gc.gray_capacity);
+    }
+
+    vm.gc.gray_stack[vm.gc.gray_count++] = object;
+}
+
+
+void mark_value(Value value) {
+    if (IS_OBJ(value)) {
+        mark_object(AS_OBJ(value));
+    }
+}
+
+
+/*
+ * The roots: everything on the stack, the constants of the nugget being compiled or run, and the globals. Every key in
+ * vm.global_slots is also in vm.global_names, so marking the names keeps the table's keys alive too. Stores into the
+ * globals (or the stack) don't need a write barrier, because the roots are marked again at the end of the mark phase.
+ * The call frames waiting on a return are roots too - their functions, and the nuggets they'll return into (one of
+ * which is the top-level script's, which belongs to no function). So are functions the compiler is partway through
+ * (mark_compiler_roots(), compiler.c): constants get added to them as it goes, which no barrier would catch. So is
+ * the generator whose body is running, which OPCODE_YIELD will save the frame into. Under --watch, so are the nuggets
+ * of every declaration in the script (mark_watch_roots(), watch.c), and under --serve the nuggets of every script a
+ * worker has cached (mark_serve_roots(), serve.c).
+ * Marking a nugget means its constants and everything its property caches hold (nugget.h): the names, and the shapes
+ * and methods they've seen. The caches get filled in as the code runs, so a running nugget is marked as a root rather
+ * than only traced once through its function.
+ */
+static void mark_pool(ValuePool* pool) {
+    for (int index = 0; index < pool->occupied; index++) {
+        mark_value(pool->values[index]);
+    }
+}
+
+
+void mark_nugget(Nugget* nugget) {
+    mark_pool(&nugget->constants);
+
+    for (int index = 0; index < nugget->cache_count; index++) {
+        PropertyCache* cache = &nugget->caches[index];
+        mark_object((Obj*)cache->name);
+        for (int entry = 0; entry < cache->count; entry++) {
+            mark_object((Obj*)cache->entries[entry].shape);
+            mark_object((Obj*)cache->entries[entry].shape_after);
+            mark_object((Obj*)cache->entries[entry].method);
+        }
+    }
+}
+
+
+static void mark_roots(void) {
+    for (Value* slot = vm.stack; slot < vm.stack_ptr; slot++) {
+        mark_value(*slot);
+    }
+
+    if (vm.nugget != NULL) {
+        mark_nugget(vm.nugget);
+    }
+
+    mark_object((Obj*)vm.function);
+    mark_object((Obj*)vm.generator);
+    for (int index = 0; index < vm.frame_count; index++) {
+        mark_object((Obj*)vm.frames[index].function);
+        mark_nugget(vm.frames[index].nugget);
+    }
+    mark_compiler_roots();
+    mark_watch_roots();
+    mark_serve_roots();
+
+    mark_pool(&vm.globals);
+    mark_pool(&vm.global_names);
+}
+
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+ * Turn a gray object black by marking everything it refers to. Strings and arrays (which only hold numbers) don't refer
+ * to anything. A function refers to its name and to its body's nugget, a generator to its function and its saved frame,
+ * and an iterator to its source and function. A shape refers to its parent and name and the shapes made from it (which
+ * keeps every shape of a class alive as long as the class is), a class to its name, root shape and methods, an instance
+ * to its class, shape and fields, and a bound method to its receiver and method.
+ */
+static void blacken_object(Obj* object) {
+    switch (object->type) {
+        case OBJECT_STRING:
+        case OBJECT_ARRAY:
+            break;
+        case OBJECT_FUNCTION: {
+            ObjFunction* function = (ObjFunction*)object;
+            mark_object((Obj*)function->name);
+            mark_nugget(&function->nugget);
+            break;
+        }
+        case OBJECT_GENERATOR: {
+            ObjGenerator* generator = (ObjGenerator*)object;
+            mark_object((Obj*)generator->function);
+            for (int index = 0; index < generator->slot_count; index++) {
+                mark_value(generator->slots[index]);
+            }
+            break;
+        }
+        case OBJECT_ITERATOR: {
+            ObjIterator* iterator = (ObjIterator*)object;
+            mark_value(iterator->source);
+            mark_value(iterator->function);
+            break;
+        }
+        case OBJECT_SHAPE: {
+            ObjShape* shape = (ObjShape*)object;
+            mark_object((Obj*)shape->parent);
+            mark_object((Obj*)shape->name);
+            for (int index = 0; index < shape->transition_count; index++) {
+                mark_object((Obj*)shape->transitions[index]);
+            }
+            break;
+        }
+        case OBJECT_CLASS: {
+            ObjClass* klass = (ObjClass*)object;
+            mark_object((Obj*)klass->name);
+            mark_object((Obj*)klass->root);
+            mark_object((Obj*)klass->initializer);
+            mark_table(&klass->methods);
+            break;
+        }
+        case OBJECT_INSTANCE: {
+            ObjInstance* instance = (ObjInstance*)object;
+            mark_object((Obj*)instance->klass);
+            mark_object((Obj*)instance->shape);
+            for (int index = 0; index < instance->shape->slot_count; index++) {
+                mark_value(instance->fields[index]);
+            }
+            break;
+        }
+        case OBJECT_BOUND_METHOD: {
+            ObjBoundMethod* bound = (ObjBoundMethod*)object;
+            mark_value(bound->receiver);
+            mark_object((Obj*)bound->method);
+            break;
+        }
+    }
+}
+
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+ * Blacken up to budget gray objects. Returns how much of the budget was used.
+ */
+static size_t trace_references(size_t budget) {
+    size_t work = 0;
+
+    while (vm.gc.gray_count > 0 && work < budget) {
+        blacken_object(vm.gc.gray_stack[--vm.gc.gray_count]);
+        work++;
+    }
+
+    return work;
+}
+
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+ * Free up to budget unmarked objects from the detached sweeping list, and move the survivors back onto vm.objects.
+ * Objects allocated while sweeping are already on vm.objects, so the sweep never sees them. Dead strings are deleted
+ * from the intern table on their way out.
+ */
+static size_t sweep(size_t budget) {
+    size_t work = 0;
+
+    while (vm.gc.sweeping != NULL && work < budget) {
+        Obj* object     = vm.gc.sweeping;
+        vm.gc.sweeping  = object->next;
+
+        if (IS_MARKED(object)) {
+            object->next = vm.objects;
+            vm.objects   = object;
+        } else {
+            if (object->type == OBJECT_STRING) {
+                table_delete(&vm.strings, (ObjString*)object);
+            }
+            free_object(object);
+            vm.gc.freed_objects++;
+        }
+        work++;
+    }
+
+    return work;
+}
+
+
+static uint64_t now_nanoseconds(void) {
+    struct timespec now;
+    timespec_get(&now, TIME_UTC);
+    return (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+}
+
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+ * DEBUG_STRESS_INCREMENTAL only: once marking has finished, nothing marked may still refer to something unmarked - if
+ * it does, a store went into an object the collector had already finished with and skipped WRITE_BARRIER, and the
+ * sweep is about to free something that's still in use. We check by blackening every marked object again: anything
+ * that lands on the gray stack was missed. It's a walk over the whole heap per cycle, so it's for debug builds only.
+ */
+#ifdef DEBUG_STRESS_INCREMENTAL
+static void check_marking(void) {
+    for (Obj* object = vm.objects; object != NULL; object = object->next) {
+        if (!IS_MARKED(object)) {
+            continue;
+        }
+
+        blacken_object(object);
+        if (vm.gc.gray_count > 0) {
+            fprintf(stderr, "[gc] ");
+            print_object(stderr, OBJ_VAL(object));
+            fprintf(stderr, " was traced but refers to ");
+            print_object(stderr, OBJ_VAL(vm.gc.gray_stack[0]));
+            fprintf(stderr, ", which wasn't - a store is missing its WRITE_BARRIER.\n");
+            abort();
+        }
+    }
+}
+#endif
+
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+ * One slice of collection. Moves through the phases as far as budget allows:
+ *      GC_IDLE   -> flip the mark bit, mark the roots, and start marking.
+ *      GC_MARK   -> trace gray objects. Once there are none left, re-scan the roots and trace whatever that turns up
+ *                   (the roots are small, so this final step is short), and detach the whole object list for sweeping.
+ *      GC_SWEEP  -> free dead objects. When the list runs out the cycle is over, and the next one is scheduled for
+ *                   when the live heap has grown by growth_factor.
+ * Each slice's duration is recorded for print_gc_stats().
+ */
+static void gc_step(size_t budget) {
+    uint64_t start = now_nanoseconds();
+    size_t work    = 0;
+
+    if (vm.gc.phase == GC_IDLE) {
+        vm.gc.mark_bit = !vm.gc.mark_bit;
+        vm.gc.phase    = GC_MARK;
+        mark_roots();
+    }
+
+    if (vm.gc.phase == GC_MARK) {
+        work += trace_references(budget);
+
+        if (vm.gc.gray_count == 0) {
+            mark_roots();
+            trace_references(SIZE_MAX);
+            #ifdef DEBUG_STRESS_INCREMENTAL
+                check_marking();
+            #endif
+
+            vm.gc.sweeping = vm.objects;
+            vm.objects     = NULL;
+            vm.gc.phase    = GC_SWEEP;
+        }
+    }
+
+    if (vm.gc.phase == GC_SWEEP && work < budget) {
+        sweep(budget - work);
+
+        if (vm.gc.sweeping == NULL) {
+            vm.gc.phase   = GC_IDLE;
+            vm.gc.next_gc = (size_t)(vm.gc.bytes_allocated * vm.gc.growth_factor);
+            if (vm.gc.next_gc < GC_FIRST_CYCLE) {
+                vm.gc.next_gc = GC_FIRST_CYCLE;
+            }
+            vm.gc.cycles++;
+        }
+    }
+
+    if (vm.gc.pauses == NULL) {
+        vm.gc.pauses = malloc(sizeof(uint64_t) * GC_PAUSE_SAMPLES);
+        check_failure(vm.gc.pauses, "Unable to allocate GC pause samples.", sizeof(uint64_t) * GC_PAUSE_SAMPLES);
+    }
+    vm.gc.pauses[vm.gc.slices % GC_PAUSE_SAMPLES] = now_nanoseconds() - start;
+    vm.gc.slices++;
+}
+
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+ * Finish whatever cycle is in progress (or run a whole new one) right now, without any budget.
+ */
+void collect_garbage(void) {
+    if (vm.gc.phase == GC_IDLE) {
+        gc_step(SIZE_MAX);
+    }
+
+    while (vm.gc.phase != GC_IDLE) {
+        gc_step(SIZE_MAX);
+    }
+}
+
+
+static int compare_pauses(const void* a, const void* b) {
+    uint64_t left  = *(const uint64_t*)a;
+    uint64_t right = *(const uint64_t*)b;
+    return (left > right) - (left < right);
+}
+
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+ * Pause-time telemetry: percentiles over the most recent GC_PAUSE_SAMPLES slices.
+ */
+void print_gc_stats(void) {
+    size_t samples = (vm.gc.slices < GC_PAUSE_SAMPLES) ? vm.gc.slices : GC_PAUSE_SAMPLES;
+
+    printf("[gc] %zu cycles, %zu slices, %zu objects freed, %zu bytes live, next cycle at %zu bytes\n",
+           vm.gc.cycles, vm.gc.slices, vm.gc.freed_objects, vm.gc.bytes_allocated, vm.gc.next_gc);
+
+    if (samples == 0) {
+        return;
+    }
+
+    uint64_t* sorted = malloc(sizeof(uint64_t) * samples);
+    check_failure(sorted, "Unable to allocate memory for GC statistics.", sizeof(uint64_t) * samples);
+    for (size_t index = 0; index < samples; index++) {
+        sorted[index] = vm.gc.pauses[index];
+    }
+    qsort(sorted, samples, sizeof(uint64_t), compare_pauses);
+
+    printf("[gc] pauses (us): p50 %.1f  p90 %.1f  p99 %.1f  max %.1f\n",
+           sorted[(samples * 50) / 100] / 1000.0, sorted[(samples * 90) / 100] / 1000.0,
+           sorted[(samples * 99) / 100] / 1000.0, sorted[samples - 1] / 1000.0);
+    free(sorted);
 }
\ No newline at end of file
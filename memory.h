@@ -2,6 +2,8 @@
     #define cypsa_memory_h
 
     #include "common.h"
+    #include "nugget.h"
+    #include "values.h"
 
     /* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
      * Macro: GROW_CAPACITY gives a starting capacity of 8 for empty nuggets. Otherwise, capacity grows by a factor of
@@ -25,12 +27,89 @@
      */
     #define FREE_ARRAY(type, pointer, old_capacity) (type*)reallocate(pointer, sizeof(type) * (old_capacity), 0)
 
+
+    /* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+     * Macros: ALLOCATE_ALIGNED and FREE_ALIGNED wrap allocate_aligned() / free_aligned() for blocks which need to start on
+     * some boundary larger than whatever malloc() happens to give us - mostly CACHE_LINE_SIZE, so that a hot block begins at
+     * the start of a cache line instead of straddling two of them.
+     */
+    #define CACHE_LINE_SIZE 64
+
+    #define ALLOCATE_ALIGNED(type, count, alignment) (type*)allocate_aligned(sizeof(type) * (count), alignment)
+    #define FREE_ALIGNED(type, pointer, count, alignment) free_aligned(pointer, sizeof(type) * (count), alignment)
+
     
+    /* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+     * State for the incremental garbage collector (see memory.c). It lives inside the VM as vm.gc.
+     *      phase:            GC_IDLE between cycles, GC_MARK while tracing live objects, GC_SWEEP while freeing the rest.
+     *      mark_bit:         An object is marked when its Obj.mark equals this. Flipping it at the start of a cycle
+     *                        unmarks every object at once, without having to visit any of them.
+     *      bytes_allocated:  Everything currently allocated through reallocate().
+     *      next_gc:          Start the next cycle once bytes_allocated goes past this.
+     *      growth_factor:    After a cycle, next_gc = (bytes still alive) * growth_factor. Bigger means fewer, lazier
+     *                        cycles and a bigger heap; closer to 1 means a tighter heap and more collector work.
+     *      gray_*:           Stack of objects which are marked but whose references haven't been traced yet.
+     *      sweeping:         The detached list of objects still waiting to be swept this cycle.
+     *      paused:           While non-zero, allocations don't run the collector (see push(), vm.c).
+     *      pauses:           Ring buffer of the last GC_PAUSE_SAMPLES slice durations, in nanoseconds, for telemetry.
+     *                        Allocated (with plain malloc) by the first slice, so a VM which never collects - most
+     *                        short-lived fibers - never pays for it.
+     *      quota:            Most bytes this VM may keep live, or 0 for no limit. Checked when a fiber yields (vm.c).
+     */
+    #define GC_PAUSE_SAMPLES 4096
+
+    typedef enum {
+        GC_IDLE,
+        GC_MARK,
+        GC_SWEEP
+    } CollectorPhase;
+
+    typedef struct {
+        CollectorPhase phase;
+        bool mark_bit;
+        size_t bytes_allocated;
+        size_t next_gc;
+        double growth_factor;
+        int paused;
+        int gray_count;
+        int gray_capacity;
+        Obj** gray_stack;
+        Obj* sweeping;
+        size_t cycles;
+        size_t slices;
+        size_t freed_objects;
+        uint64_t* pauses;
+        size_t quota;
+    } Collector;
+
+
+    /* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+     * Macro: WRITE_BARRIER must wrap every store of a Value into a heap object (not into the stack, the constant pools,
+     * or globals - those are roots, and get re-scanned before marking finishes). Marking is spread out over time, so
+     * the program can run in between and tuck a not-yet-marked object into one which the collector has already finished
+     * with. The barrier marks the stored value in that case, so it can't be missed. That includes the stores a constructor
+     * makes into the object it has just allocated: new objects are born marked (object.c).
+     */
+    #define IS_MARKED(object) ((object)->mark == vm.gc.mark_bit)
+
+    #define WRITE_BARRIER(owner, value) \
+        do { if (vm.gc.phase == GC_MARK && IS_MARKED((Obj*)(owner))) { mark_value(value); } } while (false)
+
+
     /* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
      * failed(): a simple wrapper around an assert to ensure that memory allocation has not failed / returned NULL.
      * reallocate(): handles allocation, freeing, and resizing of arrays. Based on the free() and realloc() functions. 
      */
     void check_failure(void* pointer, const char* message, size_t requested);
     void* reallocate(void* pointer, size_t old_size, size_t new_size);
+    void* allocate_aligned(size_t size, size_t alignment);
+    void free_aligned(void* pointer, size_t size, size_t alignment);
+    void init_collector(Collector* gc);
+    void free_collector(Collector* gc);
+    void mark_object(Obj* object);
+    void mark_value(Value value);
+    void mark_nugget(Nugget* nugget);
+    void collect_garbage(void);
+    void print_gc_stats(void);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,495 @@
+#include <math.h>
+#include <string.h>
+#include "array.h"
+#include "column.h"
+#include "memory.h"
+#include "native.h"
+#include "object.h"
+#include "vm.h"
+
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+ * The registry. Natives are only ever added at startup (init_natives(), called by init_VM()), and an index into here is
+ * baked into the bytecode by the compiler, so entries never move or go away.
+ */
+Native natives[NATIVES_MAX];
+int native_count = 0;
+const char native_reported[] = "";
+
+
+int register_native(const char* name, int arity, bool pure, NativeArgs takes, NativeFn function,
+                    NativeBatchFn batch) {
+    int existing = find_native(name, (int)strlen(name), arity);
+    if (existing >= 0) {
+        return existing;
+    }
+
+    assert(native_count < NATIVES_MAX);
+    assert(batch == NULL || arity <= NATIVE_ARGS_MAX);
+
+    natives[native_count] = (Native){name, arity, pure, takes, function, batch};
+    return native_count++;
+}
+
+
+/*
+ * Index of the native called name (length characters, not NUL-terminated - straight out of a token) taking arity
+ * arguments, or -1. An arity of -1 matches any arity, for when the compiler just wants to know whether a name is a
+ * native at all. Only the compiler looks natives up, so a linear scan over a couple of dozen names is plenty.
+ */
+int find_native(const char* name, int length, int arity) {
+    for (int index = 0; index < native_count; index++) {
+        Native* native = &natives[index];
+        if (strncmp(native->name, name, length) == 0 && native->name[length] == '\0' &&
+            (arity == -1 || native->arity == arity)) {
+            return index;
+        }
+    }
+    return -1;
+}
+
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+ * Applying a NATIVE_NUMBERS native with a batch version to arrays. All the array arguments must be the same length, and
+ * any numbers among the arguments are broadcast - spread out into a temporary array of that length - so that the batch
+ * version only ever has to deal with arrays. The arguments are still on the VM stack, so they're safe while new_array()
+ * allocates. A strided array (a mapped column, object.h) is gathered ARRAY_BLOCK elements at a time, and the batch
+ * version called a block at a time to match, rather than copying the whole column first.
+ */
+static const char* call_batch(Native* native, Value* args, Value* result) {
+    size_t count = 0;
+    bool sized   = false;
+
+    for (int index = 0; index < native->arity; index++) {
+        if (IS_ARRAY(args[index])) {
+            if (sized && AS_ARRAY(args[index])->count != count) {
+                return "Arrays must be the same length.";
+            }
+            count = AS_ARRAY(args[index])->count;
+            sized = true;
+        }
+    }
+
+    const double* inputs[NATIVE_ARGS_MAX];
+    double* broadcasts[NATIVE_ARGS_MAX] = {NULL};
+    double* blocks[NATIVE_ARGS_MAX]     = {NULL};
+    bool strided = false;
+
+    for (int index = 0; index < native->arity; index++) {
+        if (IS_ARRAY(args[index])) {
+            inputs[index] = AS_ARRAY(args[index])->values;
+            if (AS_ARRAY(args[index])->stride != 1) {
+                blocks[index] = ALLOCATE_ALIGNED(double, ARRAY_BLOCK, CACHE_LINE_SIZE);
+                strided       = true;
+            }
+            continue;
+        }
+
+        broadcasts[index] = ALLOCATE_ALIGNED(double, count, CACHE_LINE_SIZE);
+        for (size_t element = 0; element < count; element++) {
+            broadcasts[index][element] = AS_NUMBER(args[index]);
+        }
+        inputs[index] = broadcasts[index];
+    }
+
+    ObjArray* out = new_array(count);
+    if (!strided) {
+        native->batch(inputs, out->values, count);
+    } else {
+        for (size_t start = 0; start < count; start += ARRAY_BLOCK) {
+            size_t length = (count - start < ARRAY_BLOCK) ? count - start : ARRAY_BLOCK;
+            const double* block_inputs[NATIVE_ARGS_MAX];
+
+            for (int index = 0; index < native->arity; index++) {
+                if (blocks[index] != NULL) {
+                    size_t stride = AS_ARRAY(args[index])->stride;
+                    array_gather(inputs[index] + start * stride, stride, blocks[index], length);
+                    block_inputs[index] = blocks[index];
+                } else {
+                    block_inputs[index] = inputs[index] + start;
+                }
+            }
+            native->batch(block_inputs, out->values + start, length);
+        }
+    }
+    *result = OBJ_VAL(out);
+
+    for (int index = 0; index < native->arity; index++) {
+        FREE_ALIGNED(double, broadcasts[index], count, CACHE_LINE_SIZE);
+        FREE_ALIGNED(double, blocks[index], ARRAY_BLOCK, CACHE_LINE_SIZE);
+    }
+    return NULL;
+}
+
+
+/*
+ * Check the arguments against what the native takes, then call it (or its batch version). Returns an error message or
+ * NULL, just like the natives themselves.
+ */
+const char* call_native(Native* native, Value* args, Value* result) {
+    bool arrays = false;
+
+    for (int index = 0; index < native->arity && native->takes != NATIVE_VALUES; index++) {
+        if (native->takes == NATIVE_ARRAYS) {
+            if (!IS_ARRAY(args[index])) {
+                return "Arguments must be arrays.";
+            }
+        } else if (IS_ARRAY(args[index]) && native->batch != NULL) {
+            arrays = true;
+        } else if (!IS_NUMBER(args[index])) {
+            return (native->batch != NULL) ? "Arguments must be numbers or arrays." : "Arguments must be numbers.";
+        }
+    }
+
+    if (arrays) {
+        return call_batch(native, args, result);
+    }
+    return native->function(args, result);
+}
+
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+ * The maths builtins. Each one is a thin wrapper around <math.h>, written out twice by the macros below: once taking
+ * Values off the stack, and once as a batch loop over arrays of doubles. x (and y) are the arguments in both, so the
+ * expression only has to be written once.
+ */
+#define UNARY_NATIVE(name, expression)                                                  \
+    static const char* name##_native(Value* args, Value* result) {                      \
+        double x = AS_NUMBER(args[0]);                                                  \
+        *result  = NUMBER_VAL(expression);                                              \
+        return NULL;                                                                    \
+    }                                                                                   \
+    static void name##_batch(const double* const* args, double* out, size_t count) {    \
+        const double* xs = args[0];                                                     \
+        for (size_t index = 0; index < count; index++) {                                \
+            double x   = xs[index];                                                     \
+            out[index] = (expression);                                                  \
+        }                                                                               \
+    }
+
+#define BINARY_NATIVE(name, expression)                                                 \
+    static const char* name##_native(Value* args, Value* result) {                      \
+        double x = AS_NUMBER(args[0]);                                                  \
+        double y = AS_NUMBER(args[1]);                                                  \
+        *result  = NUMBER_VAL(expression);                                              \
+        return NULL;                                                                    \
+    }                                                                                   \
+    static void name##_batch(const double* const* args, double* out, size_t count) {    \
+        const double* xs = args[0];                                                     \
+        const double* ys = args[1];                                                     \
+        for (size_t index = 0; index < count; index++) {                                \
+            double x   = xs[index];                                                     \
+            double y   = ys[index];                                                     \
+            out[index] = (expression);                                                  \
+        }                                                                               \
+    }
+
+UNARY_NATIVE(sqrt, sqrt(x))
+UNARY_NATIVE(exp, exp(x))
+UNARY_NATIVE(log, log(x))
+UNARY_NATIVE(sin, sin(x))
+BINARY_NATIVE(pow, pow(x, y))
+BINARY_NATIVE(min, fmin(x, y))
+BINARY_NATIVE(max, fmax(x, y))
+
+#undef UNARY_NATIVE
+#undef BINARY_NATIVE
+
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+ * Array builtins. The reductions hand straight off to the kernels in array.c.
+ *      range(n)    [0, 1, ..., n - 1]
+ *      fill(n, x)  n copies of x
+ *      len(a)      Number of elements
+ *      sum(a), dot(a, b), min(a), max(a)
+ *      scan(a)     Running totals - scan([1, 2, 3]) is [1, 3, 6]
+ *      map_column(path), map_column(path, offset, stride, count)
+ *                  A column of doubles mapped from a file (column.h)
+ */
+static const char* array_length(double count, size_t* length) {
+    if (count < 0 || count != floor(count) || count > (double)(SIZE_MAX / sizeof(double))) {
+        return "Array length must be a non-negative whole number.";
+    }
+    // A VM with a memory quota (fiber.h) mustn't be able to grab a huge block before anything gets a chance to check.
+    if (vm.gc.quota != 0 && count * sizeof(double) > (double)vm.gc.quota) {
+        return "Array too large for this VM's memory quota.";
+    }
+    *length = (size_t)count;
+    return NULL;
+}
+
+
+static const char* range_native(Value* args, Value* result) {
+    size_t count;
+    const char* error = array_length(AS_NUMBER(args[0]), &count);
+    if (error != NULL) {
+        return error;
+    }
+
+    ObjArray* array = new_array(count);
+    for (size_t index = 0; index < count; index++) {
+        array->values[index] = (double)index;
+    }
+    *result = OBJ_VAL(array);
+    return NULL;
+}
+
+
+static const char* fill_native(Value* args, Value* result) {
+    size_t count;
+    const char* error = array_length(AS_NUMBER(args[0]), &count);
+    if (error != NULL) {
+        return error;
+    }
+
+    double value    = AS_NUMBER(args[1]);
+    ObjArray* array = new_array(count);
+    for (size_t index = 0; index < count; index++) {
+        array->values[index] = value;
+    }
+    *result = OBJ_VAL(array);
+    return NULL;
+}
+
+
+static const char* map_column_native(Value* args, Value* result) {
+    if (!IS_STRING(args[0])) {
+        return "Path must be a string.";
+    }
+    return map_column(AS_CSTRING(args[0]), 0, 1, -1, result);
+}
+
+
+static const char* map_column_slice_native(Value* args, Value* result) {
+    if (!IS_STRING(args[0]) || !IS_NUMBER(args[1]) || !IS_NUMBER(args[2]) || !IS_NUMBER(args[3])) {
+        return "Arguments must be a path and three numbers.";
+    }
+    return map_column(AS_CSTRING(args[0]), AS_NUMBER(args[1]), AS_NUMBER(args[2]), AS_NUMBER(args[3]), result);
+}
+
+
+static const char* len_native(Value* args, Value* result) {
+    *result = NUMBER_VAL((double)AS_ARRAY(args[0])->count);
+    return NULL;
+}
+
+
+static const char* sum_native(Value* args, Value* result) {
+    ObjArray* array = AS_ARRAY(args[0]);
+    *result = NUMBER_VAL(array_sum(array->values, array->stride, array->count));
+    return NULL;
+}
+
+
+static const char* dot_native(Value* args, Value* result) {
+    ObjArray* a = AS_ARRAY(args[0]);
+    ObjArray* b = AS_ARRAY(args[1]);
+
+    if (a->count != b->count) {
+        return "Arrays must be the same length.";
+    }
+    *result = NUMBER_VAL(array_dot(a->values, a->stride, b->values, b->stride, a->count));
+    return NULL;
+}
+
+
+static const char* array_min_native(Value* args, Value* result) {
+    ObjArray* array = AS_ARRAY(args[0]);
+
+    if (array->count == 0) {
+        return "Can't take the minimum of an empty array.";
+    }
+    *result = NUMBER_VAL(array_min(array->values, array->stride, array->count));
+    return NULL;
+}
+
+
+static const char* array_max_native(Value* args, Value* result) {
+    ObjArray* array = AS_ARRAY(args[0]);
+
+    if (array->count == 0) {
+        return "Can't take the maximum of an empty array.";
+    }
+    *result = NUMBER_VAL(array_max(array->values, array->stride, array->count));
+    return NULL;
+}
+
+
+static const char* scan_native(Value* args, Value* result) {
+    ObjArray* array = AS_ARRAY(args[0]);
+    ObjArray* out   = new_array(array->count);
+    array_scan(array->values, array->stride, out->values, array->count);
+    *result = OBJ_VAL(out);
+    return NULL;
+}
+
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+ * Lazy sequences (object.h). The first three only build another stage onto a chain, and run nothing; the last two pull
+ * the whole chain through, one element at a time, with iterator_next() (vm.h).
+ *      map(seq, f)             f(x) for each x in seq
+ *      filter(seq, f)          Each x in seq for which f(x) is truthy
+ *      take(seq, n)            The first n elements of seq, and no more are asked for
+ *      collect(seq)            A new array of seq's elements, which must be numbers
+ *      reduce(seq, f, initial) f(...f(f(initial, x1), x2)..., xn)
+ * seq can be an array, a generator or another lazy sequence. The pulling natives keep track of their arguments by stack
+ * offset rather than by args, since the code they run can move the stack.
+ */
+static const char* as_sequence(Value* value) {
+    if (IS_ARRAY(*value)) {
+        *value = OBJ_VAL(new_iterator(ITERATOR_ARRAY, *value, NIL_VAL, 0));
+    } else if (!IS_GENERATOR(*value) && !IS_ITERATOR(*value)) {
+        return "Expected an array, a generator or an iterator.";
+    }
+    return NULL;
+}
+
+
+static const char* stage(IteratorKind kind, Value* args, Value* result) {
+    if (!IS_FUNCTION(args[1]) || AS_FUNCTION(args[1])->arity != 1) {
+        return "Expected a function taking one argument.";
+    }
+
+    const char* error = as_sequence(&args[0]);
+    if (error != NULL) {
+        return error;
+    }
+    *result = OBJ_VAL(new_iterator(kind, args[0], args[1], 0));
+    return NULL;
+}
+
+
+static const char* map_native(Value* args, Value* result) {
+    return stage(ITERATOR_MAP, args, result);
+}
+
+
+static const char* filter_native(Value* args, Value* result) {
+    return stage(ITERATOR_FILTER, args, result);
+}
+
+
+static const char* take_native(Value* args, Value* result) {
+    double count = IS_NUMBER(args[1]) ? AS_NUMBER(args[1]) : -1;
+    if (count < 0 || count != floor(count) || count > (double)SIZE_MAX) {
+        return "Expected a non-negative whole number of elements to take.";
+    }
+
+    const char* error = as_sequence(&args[0]);
+    if (error != NULL) {
+        return error;
+    }
+    *result = OBJ_VAL(new_iterator(ITERATOR_TAKE, args[0], NIL_VAL, (size_t)count));
+    return NULL;
+}
+
+
+static const char* collect_native(Value* args, Value* result) {
+    const char* error = as_sequence(&args[0]);
+    if (error != NULL) {
+        return error;
+    }
+
+    int sequence     = (int)(args - vm.stack);
+    double* elements = NULL;
+    size_t count     = 0;
+    size_t capacity  = 0;
+
+    LOOP {
+        bool done;
+        if (iterator_next(vm.stack[sequence], &done) != INTERPRETER_OK) {
+            error = native_reported;
+            break;
+        }
+        if (done) {
+            break;
+        }
+
+        Value element = pop();
+        if (!IS_NUMBER(element)) {
+            error = "Elements must be numbers to collect them into an array.";
+            break;
+        }
+        if (count == capacity) {
+            size_t grown = GROW_CAPACITY(capacity);
+            elements     = GROW_ARRAY(double, elements, capacity, grown);
+            capacity     = grown;
+        }
+        elements[count++] = AS_NUMBER(element);
+    }
+
+    if (error == NULL) {
+        ObjArray* array = new_array(count);
+        if (count > 0) {
+            memcpy(array->values, elements, sizeof(double) * count);
+        }
+        *result = OBJ_VAL(array);
+    }
+    FREE_ARRAY(double, elements, capacity);
+    return error;
+}
+
+
+// [sequence, f, accumulator, f, accumulator, element] -> [sequence, f, accumulator, f(accumulator, element)]
+static const char* reduce_native(Value* args, Value* result) {
+    if (!IS_FUNCTION(args[1]) || AS_FUNCTION(args[1])->arity != 2) {
+        return "Expected a function taking two arguments.";
+    }
+
+    const char* error = as_sequence(&args[0]);
+    if (error != NULL) {
+        return error;
+    }
+
+    int base = (int)(args - vm.stack);
+    LOOP {
+        bool done;
+        if (iterator_next(vm.stack[base], &done) != INTERPRETER_OK) {
+            return native_reported;
+        }
+        if (done) {
+            break;
+        }
+
+        Value element = pop();
+        push(vm.stack[base + 1]);
+        push(vm.stack[base + 2]);
+        push(element);
+        if (call_nested(2) != INTERPRETER_OK) {
+            return native_reported;
+        }
+        vm.stack[base + 2] = pop();
+    }
+
+    *result = vm.stack[base + 2];
+    return NULL;
+}
+
+
+void init_natives(void) {
+    register_native("sqrt",  1, true,  NATIVE_NUMBERS, sqrt_native,      sqrt_batch);
+    register_native("exp",   1, true,  NATIVE_NUMBERS, exp_native,       exp_batch);
+    register_native("log",   1, true,  NATIVE_NUMBERS, log_native,       log_batch);
+    register_native("sin",   1, true,  NATIVE_NUMBERS, sin_native,       sin_batch);
+    register_native("pow",   2, true,  NATIVE_NUMBERS, pow_native,       pow_batch);
+    register_native("min",   2, true,  NATIVE_NUMBERS, min_native,       min_batch);
+    register_native("max",   2, true,  NATIVE_NUMBERS, max_native,       max_batch);
+
+    register_native("range", 1, false, NATIVE_NUMBERS, range_native,     NULL);
+    register_native("fill",  2, false, NATIVE_NUMBERS, fill_native,      NULL);
+    register_native("len",   1, true,  NATIVE_ARRAYS,  len_native,       NULL);
+    register_native("sum",   1, true,  NATIVE_ARRAYS,  sum_native,       NULL);
+    register_native("dot",   2, true,  NATIVE_ARRAYS,  dot_native,       NULL);
+    register_native("min",   1, true,  NATIVE_ARRAYS,  array_min_native, NULL);
+    register_native("max",   1, true,  NATIVE_ARRAYS,  array_max_native, NULL);
+    register_native("scan",  1, false, NATIVE_ARRAYS,  scan_native,      NULL);
+
+    register_native("map_column", 1, false, NATIVE_VALUES, map_column_native,       NULL);
+    register_native("map_column", 4, false, NATIVE_VALUES, map_column_slice_native, NULL);
+
+    register_native("map",     2, false, NATIVE_VALUES, map_native,     NULL);
+    register_native("filter",  2, false, NATIVE_VALUES, filter_native,  NULL);
+    register_native("take",    2, false, NATIVE_VALUES, take_native,    NULL);
+    register_native("collect", 1, false, NATIVE_VALUES, collect_native, NULL);
+    register_native("reduce",  3, false, NATIVE_VALUES, reduce_native,  NULL);
+}
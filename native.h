@@ -0,0 +1,66 @@
+#ifndef cypsa_native_h
+    #define cypsa_native_h
+
+    #include "common.h"
+    #include "values.h"
+
+    /* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+     * Native functions - builtins written in C. They aren't values and never go through any generic call machinery:
+     * the compiler looks a native up by name in the registry while it compiles the call, and emits OPCODE_CALL_NATIVE
+     * with the native's index in the registry as its operand. run() then calls straight through the function pointer,
+     * with the arguments sitting right where the compiler left them on the stack.
+     *
+     * struct Native:
+     *      const char* name:   What scripts call it by. Locals and globals of the same name take precedence. Two natives
+     *                          may share a name if their arities differ - min(a, b) and min(array), say - and the
+     *                          compiler picks the one matching the number of arguments in the call.
+     *      int arity:          Exactly how many arguments it takes - checked by the compiler, so run() never has to.
+     *      bool pure:          The result depends only on the arguments, and calling it has no side effects. The compiler
+     *                          constant-folds calls to pure natives whose arguments are all constant numbers. Natives which
+     *                          build a new array aren't marked pure, so that no array ever ends up in a constant pool.
+     *      NativeArgs takes:   NATIVE_NUMBERS - every argument must be a number, or, if the native has a batch version,
+     *                          an array, in which case the batch version is applied elementwise (see call_native()).
+     *                          NATIVE_ARRAYS - every argument must be an array.
+     *                          NATIVE_VALUES - anything goes, and the native checks its own arguments.
+     *      NativeFn function:  The implementation. args points at the first of 'arity' arguments on the stack, already
+     *                          type-checked as above. Returns NULL on success, with the result in *result, or else an
+     *                          error message for run() to report. A native which runs script code - pulling elements out
+     *                          of a generator, say (iterator_next(), vm.h) - returns native_reported if that code failed,
+     *                          since the error has been reported already; it must also stop using args once the code
+     *                          has run, since the stack may have been reallocated.
+     *      NativeBatchFn batch: Optional (may be NULL). The same function applied elementwise over 'count' doubles:
+     *                          args[n] is the array for argument n, and results go in out. Written as plain loops the C
+     *                          compiler can vectorize.
+     */
+    typedef const char* (*NativeFn)(Value* args, Value* result);
+    typedef void (*NativeBatchFn)(const double* const* args, double* out, size_t count);
+
+    typedef enum {
+        NATIVE_NUMBERS,
+        NATIVE_ARRAYS,
+        NATIVE_VALUES
+    } NativeArgs;
+
+    typedef struct {
+        const char* name;
+        int arity;
+        bool pure;
+        NativeArgs takes;
+        NativeFn function;
+        NativeBatchFn batch;
+    } Native;
+
+    #define NATIVES_MAX     256
+    #define NATIVE_ARGS_MAX 8
+
+    extern Native natives[NATIVES_MAX];
+    extern int native_count;
+    extern const char native_reported[];
+
+    void init_natives(void);
+    int register_native(const char* name, int arity, bool pure, NativeArgs takes, NativeFn function,
+                        NativeBatchFn batch);
+    int find_native(const char* name, int length, int arity);
+    const char* call_native(Native* native, Value* args, Value* result);
+
+#endif
@@ -1,12 +1,68 @@
 #include <stdlib.h>
+#include <string.h>
 #include "nugget.h"
 #include "memory.h"
+#include "vm.h"
 
 #define HIGH_BYTE(x) (((x) & 0xFF000000) >> 24)
 #define HMID_BYTE(x) (((x) & 0x00FF0000) >> 16)
 #define LMID_BYTE(x) (((x) & 0x0000FF00) >> 8)
 #define LOW_BYTE(x)  (((x) & 0x000000FF))
 
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+ * Number of operand bytes following each opcode in ENCODING_BYTE. Wide instructions always carry their operand in the
+ * top 24 bits of the instruction word, so this table is only consulted for byte-encoded nuggets.
+ */
+static const uint8_t operand_widths[] = {
+    [OPCODE_CONSTANT]         = 1,
+    [OPCODE_CONSTANT_LONG]    = 3,
+    [OPCODE_NIL]              = 0,
+    [OPCODE_TRUE]             = 0,
+    [OPCODE_FALSE]            = 0,
+    [OPCODE_EQUAL]            = 0,
+    [OPCODE_GREATER]          = 0,
+    [OPCODE_LESS]             = 0,
+    [OPCODE_NOT]              = 0,
+    [OPCODE_NEGATE]           = 0,
+    [OPCODE_ADD]              = 0,
+    [OPCODE_SUBTRACT]         = 0,
+    [OPCODE_MULTIPLY]         = 0,
+    [OPCODE_DIVIDE]           = 0,
+    [OPCODE_POP]              = 0,
+    [OPCODE_PRINT]            = 0,
+    [OPCODE_GET_LOCAL]        = 1,
+    [OPCODE_SET_LOCAL]        = 1,
+    [OPCODE_DEFINE_GLOBAL]    = 2,
+    [OPCODE_GET_GLOBAL]       = 2,
+    [OPCODE_SET_GLOBAL]       = 2,
+    [OPCODE_CALL_NATIVE]      = 1,
+    [OPCODE_ARRAY]            = 2,
+    [OPCODE_GET_INDEX]        = 0,
+    [OPCODE_SET_INDEX]        = 0,
+    [OPCODE_JUMP]             = 2,
+    [OPCODE_JUMP_IF_FALSE]    = 2,
+    [OPCODE_LOOP]             = 2,
+    [OPCODE_CALL]             = 1,
+    [OPCODE_TAIL_CALL]        = 1,
+    [OPCODE_PARALLEL]         = 1,
+    [OPCODE_ITERATE]          = 0,
+    [OPCODE_FOR_ITER]         = 2,
+    [OPCODE_YIELD]            = 0,
+    [OPCODE_GET_PROPERTY]     = 2,
+    [OPCODE_SET_PROPERTY]     = 2,
+    [OPCODE_INVOKE]           = 2,
+    [OPCODE_TAIL_INVOKE]      = 2,
+    [OPCODE_RETURN]           = 0,
+    [OPCODE_ADD_NUM_NUM]      = 0,
+    [OPCODE_ADD_STR_STR]      = 0,
+    [OPCODE_SUBTRACT_NUM_NUM] = 0,
+    [OPCODE_MULTIPLY_NUM_NUM] = 0,
+    [OPCODE_DIVIDE_NUM_NUM]   = 0,
+    [OPCODE_GREATER_NUM_NUM]  = 0,
+    [OPCODE_LESS_NUM_NUM]     = 0,
+};
+
 /* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
  * Set the given code nugget back to a fresh empty state
  */
@@ -16,6 +72,15 @@ void init_nugget(Nugget* nugget) {
     nugget->code     = NULL;
     nugget->lines    = NULL;
     init_valuepool(&nugget->constants);
+    nugget->line_runs      = NULL;
+    nugget->line_run_count = 0;
+    nugget->block          = NULL;
+    nugget->block_size     = 0;
+    nugget->finalized      = false;
+    nugget->encoding       = ENCODING_BYTE;
+    nugget->caches         = NULL;
+    nugget->cache_count    = 0;
+    nugget->cache_capacity = 0;
 }
 
 
@@ -26,8 +91,18 @@ void init_nugget(Nugget* nugget) {
  * init_nugget() is then called which zeroes the fields and pointer, so nugget is in a known-fresh state
  * constants, the pool of constant values, is a struct which also contains its own array. When we free the
  * code array, we also need to ensure the constant values are freed by calling free_valuepool
+ * A finalized nugget doesn't own any of those arrays any more - everything lives in the one block. Except for the property
+ * caches, which are never packed in there (nugget.h).
  */
 void free_nugget(Nugget* nugget) {
+    FREE_ARRAY(PropertyCache, nugget->caches, nugget->cache_capacity);
+
+    if (nugget->finalized) {
+        FREE_ALIGNED(uint8_t, nugget->block, nugget->block_size, CACHE_LINE_SIZE);
+        init_nugget(nugget);
+        return;
+    }
+
     FREE_ARRAY(uint8_t, nugget->code, nugget->capacity);
     FREE_ARRAY(size_t, nugget->lines, nugget->capacity);
     free_valuepool(&nugget->constants);
@@ -41,8 +116,11 @@ void free_nugget(Nugget* nugget) {
  * by 2x using the GROW_CAPACITY macro, and then reallocate the code to a 2x larger array using the
  * GROW_ARRAY macro. Then, stick the new byte onto the end of the list and increment the occupied
  * count. If we don't need to do any of the growing and reallocation, we'll just push and increment
+ * Finalized nuggets are read-only, so writing to one is always a bug.
  */
 void write_nugget(Nugget* nugget, uint8_t byte, size_t line) {
+    assert(!nugget->finalized);
+
     if (nugget->capacity < (nugget->occupied + 1)) {
         int prev_capacity = nugget->capacity;
         nugget->capacity  = GROW_CAPACITY(nugget->capacity);
@@ -59,13 +137,119 @@ void write_nugget(Nugget* nugget, uint8_t byte, size_t line) {
 /* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
  * Helper function around write_valuepool (values.c) to put constant values into the Value pool. write_valuepool 
  * increments the occupied value, so return (occupied - 1) which is the index of this particular value.
+ * Growing the pool can run the garbage collector, so the value waits on the VM stack while that happens.
  */
 int add_constant(Nugget* nugget, Value value) {
+    assert(!nugget->finalized);
+    push(value);
     write_valuepool(&nugget->constants, value);
+    pop();
     return (nugget->constants.occupied - 1);
 }
 
 
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+ * Append one whole instruction - opcode plus operand - in whichever encoding the nugget uses.
+ * ENCODING_BYTE writes the opcode and then operand_widths[opcode] bytes of the operand, most significant first.
+ * ENCODING_WIDE packs both into a single InstructionWord and writes its four bytes in host order, which is what lets
+ * run() read it straight back out with one 32-bit load. occupied is always a multiple of 4 in a wide nugget, and the
+ * code array comes from malloc(), so every word lands on a 4-byte boundary.
+ */
+void write_instruction(Nugget* nugget, uint8_t opcode, uint32_t operand, size_t line) {
+    if (nugget->encoding == ENCODING_WIDE) {
+        assert(operand <= WIDE_OPERAND_MAX);
+        InstructionWord word = ((InstructionWord)operand << 8) | opcode;
+        uint8_t bytes[sizeof(InstructionWord)];
+        memcpy(bytes, &word, sizeof(word));
+        for (size_t index = 0; index < sizeof(word); index++) {
+            write_nugget(nugget, bytes[index], line);
+        }
+        return;
+    }
+
+    write_nugget(nugget, opcode, line);
+    switch (operand_widths[opcode]) {
+        case 3:
+            write_nugget(nugget, HMID_BYTE(operand), line);
+            // Fall through
+        case 2:
+            write_nugget(nugget, LMID_BYTE(operand), line);
+            // Fall through
+        case 1:
+            write_nugget(nugget, LOW_BYTE(operand), line);
+            // Fall through
+        default:
+            break;
+    }
+}
+
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+ * Decode the operand of the instruction starting at offset - the mirror image of write_instruction(). For byte-encoded
+ * nuggets the operand bytes are stitched back together from most to least significant; for wide ones it's just the top
+ * 24 bits of the word.
+ */
+uint32_t read_operand(Nugget* nugget, int offset) {
+    if (nugget->encoding == ENCODING_WIDE) {
+        InstructionWord word;
+        memcpy(&word, &nugget->code[offset], sizeof(word));
+        return WIDE_OPERAND(word);
+    }
+
+    uint32_t operand = 0;
+    for (int index = 1; index <= operand_widths[nugget->code[offset]]; index++) {
+        operand = (operand << 8) | nugget->code[offset + index];
+    }
+    return operand;
+}
+
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+ * Opcode of the instruction starting at offset. For a wide nugget this is the low 8 bits of the word, which is not
+ * necessarily the first byte in memory, so always go through the word.
+ */
+uint8_t read_opcode(Nugget* nugget, int offset) {
+    if (nugget->encoding == ENCODING_WIDE) {
+        InstructionWord word;
+        memcpy(&word, &nugget->code[offset], sizeof(word));
+        return WIDE_OPCODE(word);
+    }
+    return nugget->code[offset];
+}
+
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+ * Total size in bytes of an instruction with the given opcode, operands included.
+ */
+int instruction_size(Nugget* nugget, uint8_t opcode) {
+    if (nugget->encoding == ENCODING_WIDE) {
+        return (int)sizeof(InstructionWord);
+    }
+    return (1 + operand_widths[opcode]);
+}
+
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+ * A new, empty property cache for a GET_PROPERTY, SET_PROPERTY or INVOKE of name, and its index. As with constants, the
+ * name waits on the VM stack in case growing the array runs the collector.
+ */
+int add_property_cache(Nugget* nugget, ObjString* name, int arg_count) {
+    if (nugget->cache_capacity < nugget->cache_count + 1) {
+        int prev_capacity      = nugget->cache_capacity;
+        nugget->cache_capacity = GROW_CAPACITY(nugget->cache_capacity);
+        push(OBJ_VAL(name));
+        nugget->caches = GROW_ARRAY(PropertyCache, nugget->caches, prev_capacity, nugget->cache_capacity);
+        pop();
+    }
+
+    PropertyCache* cache = &nugget->caches[nugget->cache_count];
+    memset(cache, 0, sizeof(PropertyCache));
+    cache->name      = name;
+    cache->arg_count = arg_count;
+    return nugget->cache_count++;
+}
+
+
 /* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
  * Have a look at debug.c->constant_instruction. OPCODE_CONSTANT only uses a single byte for its operand (constant
  * location), which means that a nugget is restricted to storing and indexing only 256 unique constant values. This
@@ -76,25 +260,205 @@ int add_constant(Nugget* nugget, Value value) {
  * The first byte is the opcode itself. If add_constant() returns a value below 255, then we are in the first 256 indices
  * of the valuepool and we can simply write the operand (the index byte) as-is.
  * If it's above this, then we need a larger index, which will be the remaining 24 bits in size. Write an OPCODE_LONG_CONSTANT
- * instead, and then pull out the first, second, and third bytes of the index and write them to the nugget's code separately.
+ * instead, and write_instruction() splits the index into its high, middle, and low bytes.
  * During disassembly and running, this index will be stitched back together from these three bytes.
+ * Wide nuggets have a 24-bit operand on every instruction anyway, so they only ever need plain OPCODE_CONSTANT.
  */
 void write_constant(Nugget* nugget, Value value, int line) {
-    printf("\nAdding value %g (from line %d)", value, line);
+    printf("\nAdding value ");
+    print_value(value);
+    printf(" (from line %d)", line);
     int at_index = add_constant(nugget, value);
 
-    if (at_index <= 255) {
-        // An hour of debugging to realize this should have been LOW_BYTE instead of HIGH_BYTE. Fucking hell, wine please.
-        uint8_t operand = LOW_BYTE(at_index);
-        write_nugget(nugget, OPCODE_CONSTANT, line);
-        write_nugget(nugget, operand, line);
+    if (at_index <= 255 || nugget->encoding == ENCODING_WIDE) {
+        write_instruction(nugget, OPCODE_CONSTANT, at_index, line);
     } else {
-        uint8_t high_byte = HMID_BYTE(at_index);
-        uint8_t mid_byte  = LMID_BYTE(at_index);
-        uint8_t low_byte  = LOW_BYTE(at_index);
-        write_nugget(nugget, OPCODE_CONSTANT_LONG, line);
-        write_nugget(nugget, high_byte, line);
-        write_nugget(nugget, mid_byte, line);
-        write_nugget(nugget, low_byte, line);
+        write_instruction(nugget, OPCODE_CONSTANT_LONG, at_index, line);
+    }
+}
+
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+ * Rounds size up to the next multiple of 8, so that whatever gets packed in after it is suitably aligned for Values.
+ */
+static size_t align_up(size_t size) {
+    return ((size + 7) & ~(size_t)7);
+}
+
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+ * Pack a fully-compiled nugget into a single block. While compiling, code, lines, and constants.values are three separate
+ * allocations, each with up to 2x slack left over from GROW_CAPACITY, and one size_t of line number for every single
+ * byte of bytecode. Once nothing else is going to be written, that's a lot of wasted space spread over three places.
+ * The finalized block is laid out hottest-first, starting on a cache line:
+ *      [ code (occupied bytes) | pad to 8 | constants (occupied Values) | line runs ]
+ * Line numbers are squashed into runs - a new LineRun only starts when the line changes - so straight-line code from
+ * a single source line costs 8 bytes total instead of 8 bytes per bytecode byte. get_line() turns an offset back into
+ * a line number.
+ * After this the old arrays are freed and the nugget's pointers are redirected into the block. capacity is set to
+ * occupied so nobody mistakes the block for something with room left in it.
+ */
+void finalize_nugget(Nugget* nugget) {
+    if (nugget->finalized) {
+        return;
+    }
+
+    int run_count = 0;
+    for (int offset = 0; offset < nugget->occupied; offset++) {
+        if (offset == 0 || nugget->lines[offset] != nugget->lines[offset - 1]) {
+            run_count++;
+        }
+    }
+
+    size_t code_size     = align_up(sizeof(uint8_t) * nugget->occupied);
+    size_t constant_size = sizeof(Value) * nugget->constants.occupied;
+    size_t run_size      = sizeof(LineRun) * run_count;
+    size_t block_size    = code_size + constant_size + run_size;
+
+    uint8_t* block     = ALLOCATE_ALIGNED(uint8_t, block_size, CACHE_LINE_SIZE);
+    uint8_t* code      = block;
+    Value* constants   = (Value*)(block + code_size);
+    LineRun* line_runs = (LineRun*)(block + code_size + constant_size);
+
+    for (int offset = 0, run = 0; offset < nugget->occupied; offset++) {
+        code[offset] = nugget->code[offset];
+        if (offset == 0 || nugget->lines[offset] != nugget->lines[offset - 1]) {
+            line_runs[run].offset = offset;
+            line_runs[run].line   = (int)nugget->lines[offset];
+            run++;
+        }
+    }
+
+    for (int index = 0; index < nugget->constants.occupied; index++) {
+        constants[index] = nugget->constants.values[index];
+    }
+
+    #ifdef DEBUG_NUGGET_FOOTPRINT
+        size_t before = (sizeof(uint8_t) + sizeof(size_t)) * nugget->capacity + sizeof(Value) * nugget->constants.capacity;
+        printf("\nFinalized nugget: %zu bytes in 3 blocks -> %zu bytes in 1 block (%d line runs)\n",
+               before, block_size, run_count);
+    #endif
+
+    FREE_ARRAY(uint8_t, nugget->code, nugget->capacity);
+    FREE_ARRAY(size_t, nugget->lines, nugget->capacity);
+    free_valuepool(&nugget->constants);
+
+    nugget->code                 = code;
+    nugget->lines                = NULL;
+    nugget->capacity             = nugget->occupied;
+    nugget->constants.values     = constants;
+    nugget->constants.occupied   = (int)(constant_size / sizeof(Value));
+    nugget->constants.capacity   = nugget->constants.occupied;
+    nugget->line_runs            = line_runs;
+    nugget->line_run_count       = run_count;
+    nugget->block                = block;
+    nugget->block_size           = block_size;
+    nugget->finalized            = true;
+}
+
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+ * Source line for the instruction at offset. Before finalizing, this is just a lookup in the per-byte lines array.
+ * Afterwards, binary search for the last LineRun which starts at or before offset.
+ */
+int get_line(Nugget* nugget, int offset) {
+    if (!nugget->finalized) {
+        return (int)nugget->lines[offset];
+    }
+
+    int low  = 0;
+    int high = nugget->line_run_count - 1;
+
+    while (low < high) {
+        int middle = low + (high - low + 1) / 2;
+        if (nugget->line_runs[middle].offset <= offset) {
+            low = middle;
+        } else {
+            high = middle - 1;
+        }
+    }
+
+    return nugget->line_runs[low].line;
+}
+
+
+/*
+ * Move every line number in the nugget by delta - its code came from source which has since moved (see nugget.h).
+ */
+void shift_lines(Nugget* nugget, int delta) {
+    if (!nugget->finalized) {
+        for (int offset = 0; offset < nugget->occupied; offset++) {
+            nugget->lines[offset] += delta;
+        }
+        return;
+    }
+
+    for (int run = 0; run < nugget->line_run_count; run++) {
+        nugget->line_runs[run].line += delta;
+    }
+}
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+ * Quickening support (see nugget.h). generic_opcode() maps a quickened opcode back to the generic one it stands in for,
+ * and leaves every other opcode alone.
+ */
+uint8_t generic_opcode(uint8_t opcode) {
+    switch (opcode) {
+        case OPCODE_ADD_NUM_NUM:
+        case OPCODE_ADD_STR_STR:
+            return OPCODE_ADD;
+        case OPCODE_SUBTRACT_NUM_NUM:
+            return OPCODE_SUBTRACT;
+        case OPCODE_MULTIPLY_NUM_NUM:
+            return OPCODE_MULTIPLY;
+        case OPCODE_DIVIDE_NUM_NUM:
+            return OPCODE_DIVIDE;
+        case OPCODE_GREATER_NUM_NUM:
+            return OPCODE_GREATER;
+        case OPCODE_LESS_NUM_NUM:
+            return OPCODE_LESS;
+        default:
+            return opcode;
+    }
+}
+
+
+/*
+ * Overwrite the operand of the instruction starting at offset, keeping its opcode - how the compiler fills in a forward
+ * jump once it knows how far to jump. Only for nuggets still being compiled.
+ */
+void patch_operand(Nugget* nugget, int offset, uint32_t operand) {
+    if (nugget->encoding == ENCODING_WIDE) {
+        assert(operand <= WIDE_OPERAND_MAX);
+        InstructionWord word;
+        memcpy(&word, &nugget->code[offset], sizeof(word));
+        word = ((InstructionWord)operand << 8) | WIDE_OPCODE(word);
+        memcpy(&nugget->code[offset], &word, sizeof(word));
+        return;
     }
+
+    for (int index = operand_widths[nugget->code[offset]]; index >= 1; index--) {
+        nugget->code[offset + index] = LOW_BYTE(operand);
+        operand >>= 8;
+    }
+}
+
+
+/*
+ * Swap the opcode of the instruction starting at offset, keeping its operand. Both forms must be the same size, which
+ * they are, since only operand-less opcodes are quickened. In a wide nugget the opcode is the low 8 bits of the word,
+ * so the word is loaded, patched, and stored back.
+ */
+void rewrite_opcode(Nugget* nugget, int offset, uint8_t opcode) {
+    assert(instruction_size(nugget, opcode) == instruction_size(nugget, read_opcode(nugget, offset)));
+
+    if (nugget->encoding == ENCODING_WIDE) {
+        InstructionWord word;
+        memcpy(&word, &nugget->code[offset], sizeof(word));
+        word = (word & ~(InstructionWord)0xFF) | opcode;
+        memcpy(&nugget->code[offset], &word, sizeof(word));
+        return;
+    }
+
+    nugget->code[offset] = opcode;
 }
\ No newline at end of file
@@ -14,6 +14,41 @@
  *      int occupied:   The number of bytecode positions in the array currently occupied.
  *      int capacity:   The total current capacity of the bytecode array.
  * 
+ * Once the compiler is done with a nugget it is finalized (finalize_nugget()). Finalizing packs the constants, a compact
+ * run-length copy of the line numbers, and the bytecode into one right-sized, cache-line-aligned block, and frees the
+ * three growable arrays. A finalized nugget must not be written to again (quickening aside - see below), so it can be
+ * handed to as many readers (threads included) as we like.
+ *      LineRun* line_runs:  [offset, line] pairs - one per run of bytecode coming from the same source line.
+ *      void* block:         The single allocation backing a finalized nugget (NULL until then).
+ * 
+ * Instructions come in one of two encodings, chosen per nugget (Nugget.encoding):
+ *      ENCODING_BYTE:  The compact default. A one-byte opcode followed by 0-3 operand bytes, big-endian. How many operand
+ *                      bytes an opcode has is looked up in operand_widths[] (nugget.c).
+ *      ENCODING_WIDE:  Every instruction is one 32-bit InstructionWord - the opcode in the low 8 bits and a 24-bit operand
+ *                      in the high 24 bits. Always 4 bytes and always 4-byte aligned, so decoding is a single aligned load
+ *                      and a shift, and instruction n lives at byte n * 4 without decoding anything before it.
+ * Use write_instruction() / read_operand() / instruction_size() rather than poking at the encoding directly.
+ * 
+ * Quickening: the opcodes after OPCODE_RETURN are type-specialized versions of generic arithmetic and comparison opcodes
+ * (OPCODE_ADD_NUM_NUM and friends). The compiler never emits them. Instead, run() rewrites a generic instruction into
+ * its specialized form in place the first time it executes (rewrite_opcode()), and back again if the specialization's
+ * type guard ever fails. Only the opcode changes - never the size of the instruction or its operand - so this is the one
+ * write a finalized nugget allows, and every reader sees either a valid generic or a valid specialized instruction.
+ * Nothing writes out a nugget which has run - snapshots hold globals only, and --disassemble lists the code instead of
+ * running it - so a specialized opcode is never saved or listed.
+ * 
+ * Property caches: every GET_PROPERTY, SET_PROPERTY and INVOKE the compiler emits gets a PropertyCache of its own, and
+ * the instruction's operand is its index in Nugget.caches. The cache holds the property's name (and for INVOKE, how
+ * many arguments are passed), and remembers up to PROPERTY_CACHE_ENTRIES shapes of instance it has seen at that site,
+ * with where the property turned out to be for each. A site which has only ever seen one shape is monomorphic, up to
+ * PROPERTY_CACHE_ENTRIES polymorphic; one that sees more than that is megamorphic, and from then on looks every
+ * property up the slow way, since it'd only keep throwing entries out. The caches are written to while the code runs
+ * (by run(), never by the workers of a parallel loop), so they live in an array of their own rather than in the
+ * finalized block. They hold their shapes and methods strongly (mark_nugget(), memory.c) - a shape which was freed and
+ * had its address reused by another would otherwise look like a hit.
+ * The only other change a finalized nugget takes is shift_lines(), which moves its line numbers when --watch keeps the
+ * nugget across an edit that moved its source up or down the file (watch.c) - while nothing is running.
+ * 
  * The Nugget.occupied and .capacity values are signed instead of unsigned to avoid any unusual sign-removal rules a compiler
  * might implement when handling arithmetic between signed and unsigned types, as explained in Expert C Programming: Deep C
  * Secrets (2nd Ed.) - it's around page 40 or so, I can't exactly remember to be honest.
@@ -32,20 +67,112 @@
     typedef enum {
         OPCODE_CONSTANT,
         OPCODE_CONSTANT_LONG,
+        OPCODE_NIL,
+        OPCODE_TRUE,
+        OPCODE_FALSE,
+        OPCODE_EQUAL,
+        OPCODE_GREATER,
+        OPCODE_LESS,
+        OPCODE_NOT,
         OPCODE_NEGATE,
         OPCODE_ADD,
         OPCODE_SUBTRACT,
         OPCODE_MULTIPLY,
         OPCODE_DIVIDE,
-        OPCODE_RETURN
+        OPCODE_POP,
+        OPCODE_PRINT,
+        OPCODE_GET_LOCAL,
+        OPCODE_SET_LOCAL,
+        OPCODE_DEFINE_GLOBAL,
+        OPCODE_GET_GLOBAL,
+        OPCODE_SET_GLOBAL,
+        OPCODE_CALL_NATIVE,
+        OPCODE_ARRAY,
+        OPCODE_GET_INDEX,
+        OPCODE_SET_INDEX,
+        OPCODE_JUMP,
+        OPCODE_JUMP_IF_FALSE,
+        OPCODE_LOOP,
+        OPCODE_CALL,
+        OPCODE_TAIL_CALL,
+        OPCODE_PARALLEL,
+        OPCODE_ITERATE,
+        OPCODE_FOR_ITER,
+        OPCODE_YIELD,
+        OPCODE_GET_PROPERTY,
+        OPCODE_SET_PROPERTY,
+        OPCODE_INVOKE,
+        OPCODE_TAIL_INVOKE,
+        OPCODE_RETURN,
+        // Quickened forms - only ever written by run(), see above
+        OPCODE_ADD_NUM_NUM,
+        OPCODE_ADD_STR_STR,
+        OPCODE_SUBTRACT_NUM_NUM,
+        OPCODE_MULTIPLY_NUM_NUM,
+        OPCODE_DIVIDE_NUM_NUM,
+        OPCODE_GREATER_NUM_NUM,
+        OPCODE_LESS_NUM_NUM
     } OpCode;
 
+    typedef enum {
+        ENCODING_BYTE,
+        ENCODING_WIDE
+    } NuggetEncoding;
+
+    typedef uint32_t InstructionWord;
+
+    #define WIDE_OPCODE(word)   ((uint8_t)((word) & 0xFF))
+    #define WIDE_OPERAND(word)  ((uint32_t)((word) >> 8))
+    #define WIDE_OPERAND_MAX    0xFFFFFF
+
+    typedef struct {
+        int offset;
+        int line;
+    } LineRun;
+
+    /*
+     * Inline caches for property access (see below). Each entry is one shape the site has seen, and what to do about it:
+     *      shape:          The receiver's shape (object.h).
+     *      slot:           GET_PROPERTY / SET_PROPERTY / INVOKE of a field: which of the instance's slots it's in. -1 for a
+     *                      method, which is in method instead.
+     *      shape_after:    SET_PROPERTY: the shape the instance has once the field is set - shape itself if the field
+     *                      was there already, or the shape it moves on to if this adds the field.
+     */
+    #define PROPERTY_CACHE_ENTRIES 4
+
+    typedef struct ObjShape ObjShape;
+    typedef struct ObjFunction ObjFunction;
+
+    typedef struct {
+        ObjShape* shape;
+        ObjShape* shape_after;
+        ObjFunction* method;
+        int slot;
+    } CacheEntry;
+
+    typedef struct {
+        ObjString* name;
+        int arg_count;
+        int count;
+        bool megamorphic;
+        CacheEntry entries[PROPERTY_CACHE_ENTRIES];
+    } PropertyCache;
+
     typedef struct {
         int occupied;
         int capacity;
         uint8_t* code;
         size_t* lines;
         ValuePool constants;
+        LineRun* line_runs;
+        int line_run_count;
+        void* block;
+        size_t block_size;
+        bool finalized;
+        NuggetEncoding encoding;
+        PropertyCache* caches;
+        int cache_count;
+        int cache_capacity;
     } Nugget;
 
     typedef uint32_t LongConstant;
@@ -58,6 +185,17 @@
     void free_nugget(Nugget* nugget);
     void write_nugget(Nugget* nugget, uint8_t byte, size_t line);
     int add_constant(Nugget* nugget, Value value);
+    int add_property_cache(Nugget* nugget, ObjString* name, int arg_count);
     void write_constant(Nugget* nugget, Value value, int line);
+    void write_instruction(Nugget* nugget, uint8_t opcode, uint32_t operand, size_t line);
+    uint8_t read_opcode(Nugget* nugget, int offset);
+    uint32_t read_operand(Nugget* nugget, int offset);
+    int instruction_size(Nugget* nugget, uint8_t opcode);
+    void finalize_nugget(Nugget* nugget);
+    uint8_t generic_opcode(uint8_t opcode);
+    void patch_operand(Nugget* nugget, int offset, uint32_t operand);
+    void rewrite_opcode(Nugget* nugget, int offset, uint8_t opcode);
+    int get_line(Nugget* nugget, int offset);
+    void shift_lines(Nugget* nugget, int delta);
 
 #endif
\ No newline at end of file
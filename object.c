@@ -0,0 +1,506 @@
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include "memory.h"
+#include "memo.h"
+#include "object.h"
+#include "profile.h"
+#include "table.h"
+#include "values.h"
+#include "vm.h"
+
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+ * Allocate a new object of the given size (which includes whatever trails the Obj header), fill in the header, and push
+ * it onto the front of the VM's list of every object.
+ * New objects are given the current mark bit. While the collector is marking or sweeping that makes them black, so a
+ * cycle which is partway through never frees something that didn't exist when it started; the next cycle flips the
+ * bit, which turns them white along with everything else. The bit is read *after* reallocate(), because the
+ * allocation itself may well have started a new cycle.
+ * Being born black means the collector will never trace a new object, so whatever its constructor stores in it has to
+ * go through WRITE_BARRIER like any other store into a marked object - otherwise an object which only the new one
+ * refers to (the receiver of a bound method whose field was overwritten, say) is left white and swept from under it.
+ * DEBUG_STRESS_INCREMENTAL (memory.c) catches any that don't.
+ */
+static Obj* allocate_object(size_t size, ObjType type) {
+    Obj* object       = (Obj*)reallocate(NULL, 0, size);
+    object->type      = type;
+    object->mark      = vm.gc.mark_bit;
+    object->next      = vm.objects;
+    vm.objects   = object;
+    return object;
+}
+
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+ * 32-bit FNV-1a. Simple, quick, and spreads short identifier-like strings around the table well enough.
+ */
+uint32_t hash_string(const char* chars, int length) {
+    uint32_t hash = 2166136261u;
+
+    for (int index = 0; index < length; index++) {
+        hash ^= (uint8_t)chars[index];
+        hash *= 16777619;
+    }
+
+    return hash;
+}
+
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+ * Look for an existing interned string, minding the collector. The intern table doesn't keep strings alive, so a string
+ * found here may be one that the collector hasn't reached (marking) or has already decided is dead (sweeping):
+ *      GC_MARK:   It's about to be used again, so mark it now - it's alive.
+ *      GC_SWEEP:  Everything alive was marked, and everything made since was born marked, so an unmarked string is
+ *                 garbage waiting for the sweep to get round to it. Take it out of the table and treat it as missing.
+ */
+static ObjString* find_interned(const char* chars, int length, uint32_t hash) {
+    ObjString* interned = table_find_string(&vm.strings, chars, length, hash);
+
+    if (interned != NULL && !IS_MARKED((Obj*)interned)) {
+        if (vm.gc.phase == GC_MARK) {
+            mark_object((Obj*)interned);
+        } else if (vm.gc.phase == GC_SWEEP) {
+            table_delete(&vm.strings, interned);
+            return NULL;
+        }
+    }
+
+    return interned;
+}
+
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+ * Build a brand-new ObjString with room for length characters, and register it in the intern table. The caller is
+ * responsible for filling in chars[] (and for making sure there isn't already an identical string).
+ */
+static ObjString* allocate_string(int length, uint32_t hash) {
+    ObjString* string = (ObjString*)allocate_object(sizeof(ObjString) + length + 1, OBJECT_STRING);
+    string->length    = length;
+    string->hash      = hash;
+    return string;
+}
+
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+ * Get the one-and-only ObjString for these characters. chars doesn't need to be NUL-terminated or owned by us - the
+ * compiler hands us a slice straight out of the source code (Token.start), and it's hashed and looked up in place. Only
+ * if the string has never been seen before do the characters get copied, directly into the new object.
+ * Adding it to vm.strings can allocate, which can run the collector, and the intern table doesn't keep anything alive
+ * by itself - so the new string sits on the VM stack, where the collector can see it, until it's safely in.
+ */
+ObjString* intern_string(const char* chars, int length) {
+    uint32_t hash       = hash_string(chars, length);
+    ObjString* interned = find_interned(chars, length, hash);
+
+    if (interned != NULL) {
+        return interned;
+    }
+
+    ObjString* string = allocate_string(length, hash);
+    memcpy(string->chars, chars, length);
+    string->chars[length] = '\0';
+
+    push(OBJ_VAL(string));
+    table_set(&vm.strings, string, NIL_VAL);
+    pop();
+    return string;
+}
+
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+ * a + b. The result might already exist, so hash the two halves as if they were one string and check the intern table
+ * before allocating anything. FNV-1a works a byte at a time, so hashing b's characters carries straight on from a's hash.
+ */
+ObjString* concatenate_strings(ObjString* a, ObjString* b) {
+    int length    = a->length + b->length;
+    uint32_t hash = a->hash;
+
+    for (int index = 0; index < b->length; index++) {
+        hash ^= (uint8_t)b->chars[index];
+        hash *= 16777619;
+    }
+
+    ObjString* string = allocate_string(length, hash);
+    memcpy(string->chars, a->chars, a->length);
+    memcpy(string->chars + a->length, b->chars, b->length);
+    string->chars[length] = '\0';
+
+    ObjString* interned = find_interned(string->chars, length, hash);
+    if (interned != NULL) {
+        vm.objects = string->obj.next;
+        free_object((Obj*)string);
+        return interned;
+    }
+
+    push(OBJ_VAL(string));
+    table_set(&vm.strings, string, NIL_VAL);
+    pop();
+    return string;
+}
+
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+ * A new array of count elements, which the caller fills in. The elements are allocated first: that can run the
+ * collector, but there's no half-built object around yet for it to trip over.
+ */
+ObjArray* new_array(size_t count) {
+    double* values  = ALLOCATE_ALIGNED(double, count, CACHE_LINE_SIZE);
+    ObjArray* array = (ObjArray*)allocate_object(sizeof(ObjArray), OBJECT_ARRAY);
+    array->count        = count;
+    array->stride       = 1;
+    array->values       = values;
+    array->mapping      = NULL;
+    array->mapping_size = 0;
+    return array;
+}
+
+
+/*
+ * A new array over elements which are already in memory mapped from a file (column.c). The array takes the mapping
+ * over and unmaps it when it's freed. Only the header counts towards the collector's tally - the pages are the file's,
+ * and the kernel drops them whenever it needs to.
+ */
+ObjArray* new_mapped_array(void* mapping, size_t mapping_size, double* values, size_t stride, size_t count) {
+    ObjArray* array     = (ObjArray*)allocate_object(sizeof(ObjArray), OBJECT_ARRAY);
+    array->count        = count;
+    array->stride       = stride;
+    array->values       = values;
+    array->mapping      = mapping;
+    array->mapping_size = mapping_size;
+    return array;
+}
+
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+ * A new function with no name, no source and no code yet - the compiler fills all of those in. It's up to the caller
+ * to keep the function reachable (on the VM stack, say) while it does, since filling them in allocates.
+ */
+ObjFunction* new_function(void) {
+    ObjFunction* function   = (ObjFunction*)allocate_object(sizeof(ObjFunction), OBJECT_FUNCTION);
+    function->arity         = 0;
+    function->compiled      = false;
+    function->generator     = false;
+    function->declared_pure = false;
+    function->method        = false;
+    function->memo          = NULL;
+    function->name          = NULL;
+    function->source        = NULL;
+    function->source_length = 0;
+    function->line          = 0;
+    init_nugget(&function->nugget);
+    return function;
+}
+
+
+/*
+ * Give the function its own copy of its source text. It needs one because the buffer the script came in is long gone
+ * by the time most functions are first called (and the REPL reuses its buffer for every line).
+ */
+void set_function_source(ObjFunction* function, const char* source, int length, int line) {
+    char* copy = (char*)reallocate(NULL, 0, length + 1);
+    memcpy(copy, source, length);
+    copy[length] = '\0';
+
+    function->source        = copy;
+    function->source_length = length;
+    function->line          = line;
+}
+
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+ * A new generator for a call to function, not started yet: slots are the call's frame as it would have been - the
+ * callee and its arguments - which the caller keeps on the VM stack until this returns. As with arrays, the record is
+ * allocated before the object, so a collection it sets off doesn't find a generator with no frame.
+ */
+ObjGenerator* new_generator(ObjFunction* function, Value* slots, int slot_count) {
+    Value* saved = GROW_ARRAY(Value, NULL, 0, slot_count);
+    memcpy(saved, slots, sizeof(Value) * slot_count);
+
+    ObjGenerator* generator  = (ObjGenerator*)allocate_object(sizeof(ObjGenerator), OBJECT_GENERATOR);
+    WRITE_BARRIER(generator, OBJ_VAL(function));
+    for (int index = 0; index < slot_count; index++) {
+        WRITE_BARRIER(generator, saved[index]);
+    }
+    generator->function      = function;
+    generator->state         = GENERATOR_SUSPENDED;
+    generator->offset        = 0;
+    generator->slots         = saved;
+    generator->slot_count    = slot_count;
+    generator->slot_capacity = slot_count;
+    return generator;
+}
+
+
+/*
+ * Copy a frame's slots into the generator, growing its record if the frame is deeper than any it's saved before. The
+ * slots are still on the VM stack while the record grows, so nothing in them can be collected meanwhile - but they're
+ * stored into an object the collector may have finished with, hence the barrier.
+ */
+void save_generator_slots(ObjGenerator* generator, Value* slots, int slot_count) {
+    if (slot_count > generator->slot_capacity) {
+        int capacity             = slot_count;
+        generator->slots         = GROW_ARRAY(Value, generator->slots, generator->slot_capacity, capacity);
+        generator->slot_capacity = capacity;
+    }
+
+    for (int index = 0; index < slot_count; index++) {
+        WRITE_BARRIER(generator, slots[index]);
+        generator->slots[index] = slots[index];
+    }
+    generator->slot_count = slot_count;
+}
+
+
+ObjIterator* new_iterator(IteratorKind kind, Value source, Value function, size_t position) {
+    ObjIterator* iterator = (ObjIterator*)allocate_object(sizeof(ObjIterator), OBJECT_ITERATOR);
+    WRITE_BARRIER(iterator, source);
+    WRITE_BARRIER(iterator, function);
+    iterator->kind        = kind;
+    iterator->source      = source;
+    iterator->function    = function;
+    iterator->position    = position;
+    return iterator;
+}
+
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+ * Shapes (object.h). The caller keeps parent and name reachable.
+ */
+static ObjShape* new_shape(ObjShape* parent, ObjString* name) {
+    ObjShape* shape            = (ObjShape*)allocate_object(sizeof(ObjShape), OBJECT_SHAPE);
+    WRITE_BARRIER(shape, OBJ_VAL(parent));
+    WRITE_BARRIER(shape, OBJ_VAL(name));
+    shape->parent              = parent;
+    shape->name                = name;
+    shape->slot_count          = (parent == NULL) ? 0 : parent->slot_count + 1;
+    shape->transitions         = NULL;
+    shape->transition_count    = 0;
+    shape->transition_capacity = 0;
+    return shape;
+}
+
+
+/*
+ * Which slot the field called name is in for instances of this shape, or -1 if they haven't got it. Fields are found
+ * by walking back up the shape's ancestors - each one adds a single field - which is the slow path the inline caches
+ * (vm.c) are there to skip.
+ */
+int shape_slot(ObjShape* shape, ObjString* name) {
+    for (; shape->parent != NULL; shape = shape->parent) {
+        if (shape->name == name) {
+            return shape->slot_count - 1;
+        }
+    }
+    return -1;
+}
+
+
+/*
+ * The shape an instance of this one moves on to when it gets the field called name, made the first time it's needed.
+ * The new shape rides on the stack while the list of transitions grows, and goes into a shape the collector may have
+ * finished with, hence the barrier.
+ */
+ObjShape* shape_transition(ObjShape* shape, ObjString* name) {
+    for (int index = 0; index < shape->transition_count; index++) {
+        if (shape->transitions[index]->name == name) {
+            return shape->transitions[index];
+        }
+    }
+
+    ObjShape* child = new_shape(shape, name);
+    push(OBJ_VAL(child));
+    if (shape->transition_count == shape->transition_capacity) {
+        int capacity               = GROW_CAPACITY(shape->transition_capacity);
+        shape->transitions         = GROW_ARRAY(ObjShape*, shape->transitions, shape->transition_capacity, capacity);
+        shape->transition_capacity = capacity;
+    }
+    WRITE_BARRIER(shape, OBJ_VAL(child));
+    shape->transitions[shape->transition_count++] = child;
+    pop();
+    return child;
+}
+
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+ * A new class with no methods yet - the compiler adds them. The root shape rides on the stack while the class is made.
+ * It's up to the caller to keep name reachable, and the class too, while its methods go in.
+ */
+ObjClass* new_class(ObjString* name) {
+    ObjShape* root = new_shape(NULL, NULL);
+    push(OBJ_VAL(root));
+
+    ObjClass* klass    = (ObjClass*)allocate_object(sizeof(ObjClass), OBJECT_CLASS);
+    WRITE_BARRIER(klass, OBJ_VAL(name));
+    WRITE_BARRIER(klass, OBJ_VAL(root));
+    klass->name        = name;
+    klass->root        = root;
+    klass->initializer = NULL;
+    klass->slot_hint   = 0;
+    init_table(&klass->methods);
+
+    pop();
+    return klass;
+}
+
+
+/*
+ * A new instance of klass, on its root shape, with room for as many fields as its class's instances have needed so far.
+ * The slots are allocated before the object, as for generators.
+ */
+ObjInstance* new_instance(ObjClass* klass) {
+    Value* fields = GROW_ARRAY(Value, NULL, 0, klass->slot_hint);
+
+    ObjInstance* instance = (ObjInstance*)allocate_object(sizeof(ObjInstance), OBJECT_INSTANCE);
+    WRITE_BARRIER(instance, OBJ_VAL(klass));
+    WRITE_BARRIER(instance, OBJ_VAL(klass->root));
+    instance->klass       = klass;
+    instance->shape       = klass->root;
+    instance->fields      = fields;
+    instance->capacity    = klass->slot_hint;
+    return instance;
+}
+
+
+/*
+ * Make room for slot_count fields - at least double what there was, so that adding fields one at a time doesn't mean
+ * growing every time - and let the class know, so its next instances start out big enough.
+ */
+void grow_instance(ObjInstance* instance, int slot_count) {
+    if (slot_count > instance->klass->slot_hint) {
+        instance->klass->slot_hint = slot_count;
+    }
+    if (slot_count <= instance->capacity) {
+        return;
+    }
+
+    int capacity = GROW_CAPACITY(instance->capacity);
+    if (capacity < slot_count) {
+        capacity = slot_count;
+    }
+    instance->fields   = GROW_ARRAY(Value, instance->fields, instance->capacity, capacity);
+    instance->capacity = capacity;
+}
+
+
+ObjBoundMethod* new_bound_method(Value receiver, ObjFunction* method) {
+    ObjBoundMethod* bound = (ObjBoundMethod*)allocate_object(sizeof(ObjBoundMethod), OBJECT_BOUND_METHOD);
+    WRITE_BARRIER(bound, receiver);
+    WRITE_BARRIER(bound, OBJ_VAL(method));
+    bound->receiver       = receiver;
+    bound->method         = method;
+    return bound;
+}
+
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+ * Give an object's memory back. Objects don't get unlinked from vm.objects here - whoever is walking the list does that.
+ */
+void free_object(Obj* object) {
+    switch (object->type) {
+        case OBJECT_STRING: {
+            ObjString* string = (ObjString*)object;
+            reallocate(object, sizeof(ObjString) + string->length + 1, 0);
+            break;
+        }
+        case OBJECT_ARRAY: {
+            ObjArray* array = (ObjArray*)object;
+            if (array->mapping != NULL) {
+                munmap(array->mapping, array->mapping_size);
+            } else {
+                FREE_ALIGNED(double, array->values, array->count, CACHE_LINE_SIZE);
+            }
+            reallocate(object, sizeof(ObjArray), 0);
+            break;
+        }
+        case OBJECT_FUNCTION: {
+            ObjFunction* function = (ObjFunction*)object;
+            profile_forget(function);
+            free_memo(function);
+            free_nugget(&function->nugget);
+            if (function->source != NULL) {
+                reallocate(function->source, function->source_length + 1, 0);
+            }
+            reallocate(object, sizeof(ObjFunction), 0);
+            break;
+        }
+        case OBJECT_GENERATOR: {
+            ObjGenerator* generator = (ObjGenerator*)object;
+            FREE_ARRAY(Value, generator->slots, generator->slot_capacity);
+            reallocate(object, sizeof(ObjGenerator), 0);
+            break;
+        }
+        case OBJECT_ITERATOR:
+            reallocate(object, sizeof(ObjIterator), 0);
+            break;
+        case OBJECT_SHAPE: {
+            ObjShape* shape = (ObjShape*)object;
+            FREE_ARRAY(ObjShape*, shape->transitions, shape->transition_capacity);
+            reallocate(object, sizeof(ObjShape), 0);
+            break;
+        }
+        case OBJECT_CLASS:
+            free_table(&((ObjClass*)object)->methods);
+            reallocate(object, sizeof(ObjClass), 0);
+            break;
+        case OBJECT_INSTANCE: {
+            ObjInstance* instance = (ObjInstance*)object;
+            FREE_ARRAY(Value, instance->fields, instance->capacity);
+            reallocate(object, sizeof(ObjInstance), 0);
+            break;
+        }
+        case OBJECT_BOUND_METHOD:
+            reallocate(object, sizeof(ObjBoundMethod), 0);
+            break;
+    }
+}
+
+
+/*
+ * Arrays print like [1, 2, 3]. Big ones are cut short after ARRAY_PRINT_MAX elements, with the full count at the end.
+ */
+#define ARRAY_PRINT_MAX 16
+
+static void print_array(FILE* out, ObjArray* array) {
+    fprintf(out, "[");
+    for (size_t index = 0; index < array->count && index < ARRAY_PRINT_MAX; index++) {
+        fprintf(out, (index == 0) ? "%g" : ", %g", array_element(array, index));
+    }
+    if (array->count > ARRAY_PRINT_MAX) {
+        fprintf(out, ", ... (%zu elements)", array->count);
+    }
+    fprintf(out, "]");
+}
+
+
+void print_object(FILE* out, Value value) {
+    switch (OBJ_TYPE(value)) {
+        case OBJECT_STRING:
+            fprintf(out, "%s", AS_CSTRING(value));
+            break;
+        case OBJECT_ARRAY:
+            print_array(out, AS_ARRAY(value));
+            break;
+        case OBJECT_FUNCTION:
+            fprintf(out, "<func %s>", (AS_FUNCTION(value)->name != NULL) ? AS_FUNCTION(value)->name->chars : "?");
+            break;
+        case OBJECT_GENERATOR:
+            fprintf(out, "<generator %s>", AS_GENERATOR(value)->function->name->chars);
+            break;
+        case OBJECT_ITERATOR:
+            fprintf(out, "<iterator>");
+            break;
+        case OBJECT_SHAPE:
+            fprintf(out, "<shape>");
+            break;
+        case OBJECT_CLASS:
+            fprintf(out, "<class %s>", AS_CLASS(value)->name->chars);
+            break;
+        case OBJECT_INSTANCE:
+            fprintf(out, "<%s instance>", AS_INSTANCE(value)->klass->name->chars);
+            break;
+        case OBJECT_BOUND_METHOD:
+            fprintf(out, "<method %s>", AS_BOUND_METHOD(value)->method->name->chars);
+            break;
+    }
+}
@@ -0,0 +1,260 @@
+#ifndef cypsa_object_h
+    #define cypsa_object_h
+
+    #include "common.h"
+    #include "nugget.h"
+    #include "table.h"
+    #include "values.h"
+
+    /* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+     * Heap-allocated Cypsa values. Every object starts with an Obj header, so a pointer to any object can be safely cast
+     * to an Obj* to look at its type, and back again once we know what it is. Every object the VM allocates is threaded
+     * onto the vm.objects list through Obj.next, so that the garbage collector (memory.c) and free_VM() can find all of
+     * them. Obj.mark is the collector's mark bit - an object counts as marked when it equals vm.gc.mark_bit (memory.h).
+     * 
+     * struct ObjString:
+     *      int length:     Number of characters, not counting the NUL terminator.
+     *      uint32_t hash:  FNV-1a hash of the characters, worked out once when the string is created.
+     *      char chars[]:   The characters themselves, NUL-terminated, in the same allocation as the header.
+     * 
+     * All strings are interned: there is only ever one ObjString with any given sequence of characters, which lives in
+     * the vm.strings table (table.h). Creating a string means first looking for an existing one, so string equality is
+     * just pointer equality.
+     * 
+     * struct ObjArray:
+     *      size_t count:       Number of elements.
+     *      size_t stride:      How far apart the elements are, in doubles: element i is values[i * stride]. Always 1,
+     *                          except for a mapped array.
+     *      double* values:     The elements, contiguous and starting on a 64-byte boundary (ALLOCATE_ALIGNED, memory.h),
+     *                          so the SIMD kernels in array.c never straddle a cache line on their first load. A separate
+     *                          allocation from the header, since the header has to be an ordinary object on vm.objects.
+     *      void* mapping:      NULL, except for an array made by map_column() (column.h), whose elements are a column
+     *      size_t mapping_size:    of a file mapped read-only into memory - this is the mapping, to unmap when the array
+     *                          is freed, and values points somewhere inside it. A mapped array can't be written to.
+     * Arrays only ever hold numbers. Two arrays are equal only if they're the same array. array_element() reads one
+     * element whichever kind of array it is.
+     *
+     * struct ObjFunction:
+     *      int arity:          How many parameters it takes. Known from the declaration, before the body is compiled.
+     *      bool compiled:      Whether nugget holds the compiled body yet.
+     *      bool generator:     Whether the body yields - known once it's compiled. Calling a generator function doesn't
+     *                          run its body; it makes an ObjGenerator, which runs it a piece at a time.
+     *      bool declared_pure: Whether it was declared 'pure func' - memoized without having to be proven pure.
+     *      bool method:        Whether it's a method of a class, whose slot 0 is 'this' rather than the callee.
+     *      Memo* memo:         Whether calls to it can be memoized, and if so the cache of their results (memo.h). NULL
+     *                          until its first call works that out.
+     *      ObjString* name:    What it was declared as, for error messages.
+     *      Nugget nugget:      The body's bytecode, once compiled. Empty until the function is first called.
+     *      char* source:       The function's own copy of its source text, from the '(' of the parameter list to the
+     *                          closing '}', and the line that starts on. This is all a function is until it's called
+     *                          for the first time - see compile_function() (compiler.c).
+     *
+     * struct ObjGenerator:     A call to a generator function, suspended (or not yet started). Resuming it runs the body
+     *                          until its next yield, whose value is the generator's next element; running off the end
+     *                          of the body (or returning) finishes it. See resume_generator() (vm.c).
+     *      ObjFunction* function:  The generator function.
+     *      GeneratorState state:   SUSPENDED between resumes, RUNNING while its body is on the VM's stack, DONE for good.
+     *      int offset:             Where in the body's code to carry on from.
+     *      Value* slots:           The suspended call frame - the callee slot, the locals and whatever temporaries were
+     *      int slot_count:         on the stack at the yield - copied off the VM stack, and back on again to resume.
+     *                              Right-sized to the deepest frame the generator has yielded from so far, and freed
+     *                              as soon as it's done.
+     *
+     * struct ObjIterator:      A lazy sequence: map(seq, f), filter(seq, f), take(seq, n), or simply an array being
+     *                          looped over. Nothing is worked out until somebody asks for the next element, which is
+     *                          pulled through every stage of a chain in turn - see iterator_next() (vm.c).
+     *      IteratorKind kind:      Which of the above.
+     *      Value source:           Where the elements come from - an array, a generator or another iterator.
+     *      Value function:         The function map and filter call on each element. nil otherwise.
+     *      size_t position:        ITERATOR_ARRAY: the next element's index. ITERATOR_TAKE: how many are left to take.
+     *
+     * Classes and instances. An instance keeps its fields in a plain array of slots, and which field is in which slot is
+     * kept by its shape (a hidden class), which is shared with every other instance that got the same fields in the same
+     * order. A class starts its instances off on its root shape, with no fields; setting a field the instance hasn't got
+     * moves it on to the shape with that field added, which is made the first time any instance of the class needs it
+     * and reused for all the rest. So shapes make a tree, one per class, and an instance's shape says everything about
+     * where its fields are: code which has seen that shape before knows the slot without looking (inline caches,
+     * nugget.h). Methods are the class's, not the instance's, and fields shadow methods.
+     *
+     * struct ObjShape:
+     *      ObjShape* parent:       The shape this one adds a field to. NULL for a root shape.
+     *      ObjString* name:        The field it adds, which goes in slot slot_count - 1. NULL for a root shape.
+     *      int slot_count:         How many fields an instance of this shape has.
+     *      ObjShape** transitions: The shapes made by adding one more field to this one, each of which knows its name.
+     *
+     * struct ObjClass:
+     *      ObjString* name:        What it was declared as.
+     *      ObjShape* root:         The shape of a new instance.
+     *      ObjFunction* initializer:   Its 'init' method, called on every new instance, or NULL if it hasn't got one.
+     *      Table methods:          Name -> ObjFunction, for every method (the initializer included).
+     *      int slot_hint:          The most fields any of its instances has had - new instances get room for that many
+     *                              straight away, rather than growing their slots one field at a time.
+     *
+     * struct ObjInstance:
+     *      ObjClass* klass, ObjShape* shape:   Its class, and its shape now.
+     *      Value* fields:          Its slots - shape->slot_count of them are in use, out of capacity.
+     *
+     * struct ObjBoundMethod:   instance.method, read without calling it: the method, and the instance to call it on.
+     */
+    typedef enum {
+        OBJECT_STRING,
+        OBJECT_ARRAY,
+        OBJECT_FUNCTION,
+        OBJECT_GENERATOR,
+        OBJECT_ITERATOR,
+        OBJECT_SHAPE,
+        OBJECT_CLASS,
+        OBJECT_INSTANCE,
+        OBJECT_BOUND_METHOD
+    } ObjType;
+
+    struct Obj {
+        ObjType type;
+        bool mark;
+        struct Obj* next;
+    };
+
+    struct ObjString {
+        Obj obj;
+        int length;
+        uint32_t hash;
+        char chars[];
+    };
+
+    typedef struct {
+        Obj obj;
+        size_t count;
+        size_t stride;
+        double* values;
+        void* mapping;
+        size_t mapping_size;
+    } ObjArray;
+
+    typedef struct Memo Memo;
+
+    struct ObjFunction {
+        Obj obj;
+        int arity;
+        bool compiled;
+        bool generator;
+        bool declared_pure;
+        bool method;
+        Memo* memo;
+        ObjString* name;
+        Nugget nugget;
+        char* source;
+        int source_length;
+        int line;
+    };
+
+    typedef enum {
+        GENERATOR_SUSPENDED,
+        GENERATOR_RUNNING,
+        GENERATOR_DONE
+    } GeneratorState;
+
+    typedef struct {
+        Obj obj;
+        ObjFunction* function;
+        GeneratorState state;
+        int offset;
+        Value* slots;
+        int slot_count;
+        int slot_capacity;
+    } ObjGenerator;
+
+    typedef enum {
+        ITERATOR_ARRAY,
+        ITERATOR_MAP,
+        ITERATOR_FILTER,
+        ITERATOR_TAKE
+    } IteratorKind;
+
+    typedef struct {
+        Obj obj;
+        IteratorKind kind;
+        Value source;
+        Value function;
+        size_t position;
+    } ObjIterator;
+
+    struct ObjShape {
+        Obj obj;
+        ObjShape* parent;
+        ObjString* name;
+        int slot_count;
+        ObjShape** transitions;
+        int transition_count;
+        int transition_capacity;
+    };
+
+    typedef struct {
+        Obj obj;
+        ObjString* name;
+        ObjShape* root;
+        ObjFunction* initializer;
+        Table methods;
+        int slot_hint;
+    } ObjClass;
+
+    typedef struct {
+        Obj obj;
+        ObjClass* klass;
+        ObjShape* shape;
+        Value* fields;
+        int capacity;
+    } ObjInstance;
+
+    typedef struct {
+        Obj obj;
+        Value receiver;
+        ObjFunction* method;
+    } ObjBoundMethod;
+
+    #define OBJ_TYPE(value)     (AS_OBJ(value)->type)
+    #define IS_STRING(value)    is_object_type(value, OBJECT_STRING)
+    #define IS_ARRAY(value)     is_object_type(value, OBJECT_ARRAY)
+    #define IS_FUNCTION(value)  is_object_type(value, OBJECT_FUNCTION)
+    #define IS_GENERATOR(value) is_object_type(value, OBJECT_GENERATOR)
+    #define IS_ITERATOR(value)  is_object_type(value, OBJECT_ITERATOR)
+    #define IS_CLASS(value)     is_object_type(value, OBJECT_CLASS)
+    #define IS_INSTANCE(value)  is_object_type(value, OBJECT_INSTANCE)
+    #define IS_BOUND_METHOD(value)  is_object_type(value, OBJECT_BOUND_METHOD)
+    #define AS_STRING(value)    ((ObjString*)AS_OBJ(value))
+    #define AS_CSTRING(value)   (((ObjString*)AS_OBJ(value))->chars)
+    #define AS_ARRAY(value)     ((ObjArray*)AS_OBJ(value))
+    #define AS_FUNCTION(value)  ((ObjFunction*)AS_OBJ(value))
+    #define AS_GENERATOR(value) ((ObjGenerator*)AS_OBJ(value))
+    #define AS_ITERATOR(value)  ((ObjIterator*)AS_OBJ(value))
+    #define AS_CLASS(value)     ((ObjClass*)AS_OBJ(value))
+    #define AS_INSTANCE(value)  ((ObjInstance*)AS_OBJ(value))
+    #define AS_BOUND_METHOD(value)  ((ObjBoundMethod*)AS_OBJ(value))
+
+    static inline bool is_object_type(Value value, ObjType type) {
+        return IS_OBJ(value) && AS_OBJ(value)->type == type;
+    }
+
+    static inline double array_element(const ObjArray* array, size_t index) {
+        return array->values[index * array->stride];
+    }
+
+    uint32_t hash_string(const char* chars, int length);
+    ObjString* intern_string(const char* chars, int length);
+    ObjString* concatenate_strings(ObjString* a, ObjString* b);
+    ObjArray* new_array(size_t count);
+    ObjArray* new_mapped_array(void* mapping, size_t mapping_size, double* values, size_t stride, size_t count);
+    ObjFunction* new_function(void);
+    void set_function_source(ObjFunction* function, const char* source, int length, int line);
+    ObjGenerator* new_generator(ObjFunction* function, Value* slots, int slot_count);
+    void save_generator_slots(ObjGenerator* generator, Value* slots, int slot_count);
+    ObjIterator* new_iterator(IteratorKind kind, Value source, Value function, size_t position);
+    ObjClass* new_class(ObjString* name);
+    ObjInstance* new_instance(ObjClass* klass);
+    ObjBoundMethod* new_bound_method(Value receiver, ObjFunction* method);
+    int shape_slot(ObjShape* shape, ObjString* name);
+    ObjShape* shape_transition(ObjShape* shape, ObjString* name);
+    void grow_instance(ObjInstance* instance, int slot_count);
+    void free_object(Obj* object);
+    void print_object(FILE* out, Value value);
+
+#endif
@@ -0,0 +1,504 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include "compiler.h"
+#include "memory.h"
+#include "nugget.h"
+#include "parallel.h"
+#include "profile.h"
+#include "vm.h"
+
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+ * One parallel loop (see parallel.h).
+ *      Share:            The chunks one worker still has to do, first up to end. Its owner takes them from the front,
+ *                        thieves from the back, each under the share's lock - one lock per chunk of work, so it's
+ *                        never held for long or fought over much.
+ *      chunk_size:       Elements per chunk. Depends only on count (see chunking()).
+ *      out:              PARALLEL_MAP: the new array's elements, each written by whichever worker did its chunk.
+ *      partials:         The reductions: each chunk's own result, combined in chunk order at the end.
+ *      globals, names:   The program's globals, which the workers' VMs borrow to read.
+ *      failed, failed_at: Set by the first worker whose body goes wrong, to stop the rest, and the element it was on.
+ *      not_number:       Whether that was because the body gave back something other than a number.
+ */
+typedef struct {
+    pthread_mutex_t lock;
+    int first;
+    int end;
+} Share;
+
+typedef struct {
+    ParallelKind kind;
+    ObjFunction* body;
+    const double* values;
+    size_t stride;
+    double* out;
+    double* partials;
+    size_t count;
+    size_t chunk_size;
+    int chunk_count;
+    int workers;
+    Share shares[PARALLEL_THREADS_MAX];
+    ValuePool globals;
+    ValuePool names;
+    atomic_bool failed;
+    pthread_mutex_t failure_lock;
+    size_t failed_at;
+    bool not_number;
+} Job;
+
+
+static const char* kind_names[PARALLEL_KINDS] = {"map", "sum", "min", "max"};
+
+int find_parallel_kind(const char* name, int length) {
+    for (int kind = 0; kind < PARALLEL_KINDS; kind++) {
+        if ((int)strlen(kind_names[kind]) == length && memcmp(kind_names[kind], name, length) == 0) {
+            return kind;
+        }
+    }
+    return -1;
+}
+
+const char* parallel_kind_name(ParallelKind kind) {
+    return (kind < PARALLEL_KINDS) ? kind_names[kind] : "?";
+}
+
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+ * The pool: threads - 1 helper threads (the program's own thread makes up the numbers), started the first time a
+ * parallel loop runs and kept until free_parallel(). A loop is handed out by bumping generation; every helper works
+ * on it until there's nothing left to take or steal, and the last to finish wakes the program's thread back up.
+ * There's one pool for the whole process, but fibers on different threads (fiber.h) can each run a loop at once - and
+ * the pool can only work on one. Whichever loop gets hold of pool_owner has it to itself until it's finished; a loop
+ * which finds it taken doesn't wait, but runs on its own thread alone.
+ */
+static int threads = 1;
+static int helper_count = 0;
+static pthread_t helpers[PARALLEL_THREADS_MAX];
+static pthread_mutex_t pool_owner = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t pool_lock  = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_wake   = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t pool_done   = PTHREAD_COND_INITIALIZER;
+static Job* posted = NULL;
+static uint64_t generation = 0;
+static int busy = 0;
+static bool stopping = false;
+
+void set_parallel_threads(int count) {
+    threads = (count < 1) ? 1 : (count > PARALLEL_THREADS_MAX) ? PARALLEL_THREADS_MAX : count;
+}
+
+
+/*
+ * Chunks are at least PARALLEL_CHUNK_MIN elements, so a cheap body still gets a decent run between visits to the
+ * shares, and there are at most PARALLEL_CHUNKS_MAX of them, so that stealing has plenty to go at without the chunk
+ * results getting big.
+ */
+#define PARALLEL_CHUNK_MIN  256
+#define PARALLEL_CHUNKS_MAX 4096
+
+static size_t chunking(size_t count) {
+    size_t size = (count + PARALLEL_CHUNKS_MAX - 1) / PARALLEL_CHUNKS_MAX;
+    return (size < PARALLEL_CHUNK_MIN) ? PARALLEL_CHUNK_MIN : size;
+}
+
+
+static int take_chunk(Job* job, int worker) {
+    for (int turn = 0; turn < job->workers; turn++) {
+        Share* share = &job->shares[(worker + turn) % job->workers];
+        int chunk    = -1;
+
+        pthread_mutex_lock(&share->lock);
+        if (share->first < share->end) {
+            chunk = (turn == 0) ? share->first++ : --share->end;
+        }
+        pthread_mutex_unlock(&share->lock);
+
+        if (chunk != -1) {
+            return chunk;
+        }
+    }
+    return -1;
+}
+
+
+static void fail(Job* job, size_t element, bool not_number) {
+    pthread_mutex_lock(&job->failure_lock);
+    if (!atomic_load(&job->failed) || element < job->failed_at) {
+        job->failed_at  = element;
+        job->not_number = not_number;
+    }
+    atomic_store(&job->failed, true);
+    pthread_mutex_unlock(&job->failure_lock);
+}
+
+
+static void run_chunk(Job* job, int chunk) {
+    size_t first   = (size_t)chunk * job->chunk_size;
+    size_t end     = (first + job->chunk_size < job->count) ? first + job->chunk_size : job->count;
+    double partial = 0.0;
+
+    for (size_t element = first; element < end; element++) {
+        Value args[2] = {NUMBER_VAL(job->values[element * job->stride]), NUMBER_VAL((double)element)};
+        Value value;
+
+        if (run_function(job->body, args, job->body->arity, &value) != INTERPRETER_OK) {
+            fail(job, element, false);
+            return;
+        }
+        if (!IS_NUMBER(value)) {
+            fail(job, element, true);
+            return;
+        }
+
+        double number = AS_NUMBER(value);
+        switch (job->kind) {
+            case PARALLEL_MAP:
+                job->out[element] = number;
+                break;
+            case PARALLEL_SUM:
+                partial += number;
+                break;
+            case PARALLEL_MIN:
+                partial = (element == first || number < partial) ? number : partial;
+                break;
+            case PARALLEL_MAX:
+                partial = (element == first || number > partial) ? number : partial;
+                break;
+            default:
+                DO_NOTHING
+        }
+    }
+
+    if (job->kind != PARALLEL_MAP) {
+        job->partials[chunk] = partial;
+    }
+}
+
+
+/*
+ * One worker's part in a loop, in a VM of its own for the duration. The program's thread saves its own VM around this.
+ */
+static void work(Job* job, int worker) {
+    init_VM();
+    vm.globals      = job->globals;
+    vm.global_names = job->names;
+    vm.shared_code  = true;
+    vm.gc.paused++;
+
+    int chunk;
+    while (!atomic_load_explicit(&job->failed, memory_order_relaxed) && (chunk = take_chunk(job, worker)) != -1) {
+        run_chunk(job, chunk);
+    }
+
+    init_valuepool(&vm.globals);
+    init_valuepool(&vm.global_names);
+    free_VM();
+}
+
+
+static void* helper(void* argument) {
+    int worker    = (int)(intptr_t)argument;
+    uint64_t seen = 0;
+
+    pthread_mutex_lock(&pool_lock);
+    LOOP {
+        while (generation == seen && !stopping) {
+            pthread_cond_wait(&pool_wake, &pool_lock);
+        }
+        if (stopping) {
+            break;
+        }
+        seen     = generation;
+        Job* job = posted;
+        pthread_mutex_unlock(&pool_lock);
+
+        if (worker < job->workers) {
+            work(job, worker);
+        }
+
+        pthread_mutex_lock(&pool_lock);
+        if (--busy == 0) {
+            pthread_cond_signal(&pool_done);
+        }
+    }
+    pthread_mutex_unlock(&pool_lock);
+    return NULL;
+}
+
+
+static void start_helpers(void) {
+    while (helper_count < threads - 1) {
+        int worker = helper_count + 1;
+        if (pthread_create(&helpers[helper_count], NULL, helper, (void*)(intptr_t)worker) != 0) {
+            break;
+        }
+        helper_count++;
+    }
+}
+
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+ * Before any worker starts: make sure every function the body might call is compiled, and doesn't write to anything
+ * the workers share. "Might call" means any function reachable through the globals its code reads, or declared inside
+ * it, and so on down. A function only passed around in a local can't be found this way, and a worker which calls one
+ * that isn't compiled yet stops with an error (call_value(), vm.c), since compiling it would mean writing to it. A
+ * generator or iterator in a global is off limits too: taking an element from one changes it.
+ * Calling a class runs its methods, so a class is checked by checking every one of them - and an instance (in a global,
+ * or in a field of one) or a bound method by checking its class, and what the instance's fields hold.
+ */
+typedef struct {
+    Obj** objects;
+    int count;
+    int capacity;
+} Visited;
+
+static _Thread_local char message[256];
+
+static const char* check_function(ObjFunction* function, Visited* visited);
+
+static const char* check_value(Value value, Visited* visited) {
+    if (IS_GENERATOR(value) || IS_ITERATOR(value)) {
+        return "A parallel loop can't use a generator or iterator from a global - its workers would all advance it.";
+    }
+    if (!IS_FUNCTION(value) && !IS_CLASS(value) && !IS_INSTANCE(value) && !IS_BOUND_METHOD(value)) {
+        return NULL;
+    }
+
+    Obj* object = AS_OBJ(value);
+    for (int index = 0; index < visited->count; index++) {
+        if (visited->objects[index] == object) {
+            return NULL;
+        }
+    }
+    if (visited->count == visited->capacity) {
+        visited->capacity = GROW_CAPACITY(visited->capacity);
+        visited->objects  = realloc(visited->objects, sizeof(Obj*) * visited->capacity);
+        check_failure(visited->objects, "Unable to grow the parallel loop's call list.",
+                      sizeof(Obj*) * visited->capacity);
+    }
+    visited->objects[visited->count++] = object;
+
+    if (IS_BOUND_METHOD(value)) {
+        return check_value(AS_BOUND_METHOD(value)->receiver, visited);
+    }
+    if (IS_INSTANCE(value)) {
+        ObjInstance* instance = AS_INSTANCE(value);
+        for (int slot = 0; slot < instance->shape->slot_count; slot++) {
+            const char* error = check_value(instance->fields[slot], visited);
+            if (error != NULL) {
+                return error;
+            }
+        }
+        return check_value(OBJ_VAL(instance->klass), visited);
+    }
+    if (IS_CLASS(value)) {
+        Table* methods = &AS_CLASS(value)->methods;
+        for (int index = table_next(methods, -1); index != -1; index = table_next(methods, index)) {
+            const char* error = check_value(methods->entries[index].value, visited);
+            if (error != NULL) {
+                return error;
+            }
+        }
+        return NULL;
+    }
+    return check_function(AS_FUNCTION(value), visited);
+}
+
+static const char* check_function(ObjFunction* function, Visited* visited) {
+    if (!function->compiled && !compile_function(function)) {
+        snprintf(message, sizeof(message), "Could not compile %s().", function->name->chars);
+        return message;
+    }
+
+    Nugget* nugget = &function->nugget;
+    for (int offset = 0; offset < nugget->occupied; ) {
+        uint8_t opcode = generic_opcode(read_opcode(nugget, offset));
+
+        switch (opcode) {
+            case OPCODE_SET_GLOBAL:
+            case OPCODE_DEFINE_GLOBAL:
+            case OPCODE_SET_INDEX:
+            case OPCODE_SET_PROPERTY:
+            case OPCODE_PRINT:
+                snprintf(message, sizeof(message), "%s() can't be called from a parallel loop, since it %s.",
+                         function->name->chars, (opcode == OPCODE_PRINT) ? "prints" : "writes to shared state");
+                return message;
+            case OPCODE_PARALLEL:
+                snprintf(message, sizeof(message), "%s() can't be called from a parallel loop, since it has a parallel "
+                         "loop of its own.", function->name->chars);
+                return message;
+            case OPCODE_GET_GLOBAL: {
+                const char* error = check_value(vm.globals.values[read_operand(nugget, offset)], visited);
+                if (error != NULL) {
+                    return error;
+                }
+                break;
+            }
+            default:
+                DO_NOTHING
+        }
+        offset += instruction_size(nugget, read_opcode(nugget, offset));
+    }
+
+    for (int index = 0; index < nugget->constants.occupied; index++) {
+        const char* error = check_value(nugget->constants.values[index], visited);
+        if (error != NULL) {
+            return error;
+        }
+    }
+    return NULL;
+}
+
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+ * Run the loop, leaving what it comes to in *result. Returns NULL, or an error message for run() to report - in which
+ * case a worker may already have reported what went wrong inside the body.
+ * A map's new array rides on the stack while the workers fill it in, though nothing can collect it meanwhile: the
+ * program's own VM is set aside while its thread works on the loop too.
+ */
+const char* run_parallel(ParallelKind kind, ObjFunction* body, ObjArray* array, Value* result) {
+    Visited visited = {NULL, 0, 0};
+    const char* error = check_value(OBJ_VAL(body), &visited);
+    free(visited.objects);
+    if (error != NULL) {
+        return error;
+    }
+
+    size_t count = array->count;
+    if (count == 0) {
+        if (kind == PARALLEL_MAP) {
+            *result = OBJ_VAL(new_array(0));
+            return NULL;
+        }
+        if (kind == PARALLEL_SUM) {
+            *result = NUMBER_VAL(0);
+            return NULL;
+        }
+        snprintf(message, sizeof(message), "Can't take the %s of an empty array.", kind_names[kind]);
+        return message;
+    }
+
+    Job* job = malloc(sizeof(Job));
+    check_failure(job, "Unable to allocate a parallel loop.", sizeof(Job));
+    job->kind        = kind;
+    job->body        = body;
+    job->values      = array->values;
+    job->stride      = array->stride;
+    job->out         = NULL;
+    job->count       = count;
+    job->chunk_size  = chunking(count);
+    job->chunk_count = (int)((count + job->chunk_size - 1) / job->chunk_size);
+    job->workers     = (threads < job->chunk_count) ? threads : job->chunk_count;
+    bool owner       = job->workers > 1 && pthread_mutex_trylock(&pool_owner) == 0;
+    if (!owner) {
+        job->workers = 1;
+    }
+    job->globals     = vm.globals;
+    job->names       = vm.global_names;
+    job->failed_at   = 0;
+    job->not_number  = false;
+    atomic_init(&job->failed, false);
+    pthread_mutex_init(&job->failure_lock, NULL);
+
+    job->partials = malloc(sizeof(double) * job->chunk_count);
+    check_failure(job->partials, "Unable to allocate a parallel loop.", sizeof(double) * job->chunk_count);
+
+    ObjArray* out = NULL;
+    if (kind == PARALLEL_MAP) {
+        out      = new_array(count);
+        job->out = out->values;
+        push(OBJ_VAL(out));
+    }
+
+    for (int worker = 0; worker < job->workers; worker++) {
+        pthread_mutex_init(&job->shares[worker].lock, NULL);
+        job->shares[worker].first = (int)((int64_t)job->chunk_count * worker / job->workers);
+        job->shares[worker].end   = (int)((int64_t)job->chunk_count * (worker + 1) / job->workers);
+    }
+
+    int posted_to = 0;
+    if (owner) {
+        pthread_mutex_lock(&pool_lock);
+        start_helpers();
+        posted    = job;
+        posted_to = helper_count;
+        busy      = helper_count;
+        generation++;
+        pthread_cond_broadcast(&pool_wake);
+        pthread_mutex_unlock(&pool_lock);
+    }
+
+    VM program = vm;
+    profile_redirect(&program);
+    work(job, 0);
+    vm = program;
+    profile_redirect(NULL);
+
+    if (posted_to > 0) {
+        pthread_mutex_lock(&pool_lock);
+        while (busy > 0) {
+            pthread_cond_wait(&pool_done, &pool_lock);
+        }
+        posted = NULL;
+        pthread_mutex_unlock(&pool_lock);
+    }
+    if (owner) {
+        pthread_mutex_unlock(&pool_owner);
+    }
+
+    if (out != NULL) {
+        pop();
+    }
+
+    if (atomic_load(&job->failed)) {
+        snprintf(message, sizeof(message), job->not_number
+                     ? "The body of a parallel loop must give a number (element %zu didn't)."
+                     : "Parallel loop stopped at element %zu.", job->failed_at);
+        error = message;
+    } else if (kind == PARALLEL_MAP) {
+        *result = OBJ_VAL(out);
+    } else {
+        double total = job->partials[0];
+        for (int chunk = 1; chunk < job->chunk_count; chunk++) {
+            double partial = job->partials[chunk];
+            switch (kind) {
+                case PARALLEL_SUM:
+                    total += partial;
+                    break;
+                case PARALLEL_MIN:
+                    total = (partial < total) ? partial : total;
+                    break;
+                case PARALLEL_MAX:
+                    total = (partial > total) ? partial : total;
+                    break;
+                default:
+                    DO_NOTHING
+            }
+        }
+        *result = NUMBER_VAL(total);
+    }
+
+    for (int worker = 0; worker < job->workers; worker++) {
+        pthread_mutex_destroy(&job->shares[worker].lock);
+    }
+    pthread_mutex_destroy(&job->failure_lock);
+    free(job->partials);
+    free(job);
+    return error;
+}
+
+
+void free_parallel(void) {
+    pthread_mutex_lock(&pool_lock);
+    stopping = true;
+    pthread_cond_broadcast(&pool_wake);
+    pthread_mutex_unlock(&pool_lock);
+
+    for (int index = 0; index < helper_count; index++) {
+        pthread_join(helpers[index], NULL);
+    }
+    helper_count = 0;
+    stopping     = false;
+}
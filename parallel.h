@@ -0,0 +1,50 @@
+#ifndef cypsa_parallel_h
+    #define cypsa_parallel_h
+
+    #include "common.h"
+    #include "object.h"
+    #include "values.h"
+
+    /* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+     * Parallel loops over arrays:
+     *      parallel map (x in xs) x * x            A new array, the body's value for each element.
+     *      parallel sum (x, i in xs) x * w[i]      The body's values added up. Likewise min and max.
+     *      parallel sum (x in xs) { var y = f(x); return y * y; }
+     * The body is an expression, or a block which returns its value, and must come out as a number. The compiler turns
+     * it into a function of the element (and, if asked for, its index), which is compiled on the spot and never changes
+     * afterwards. OPCODE_PARALLEL then hands it and the array to run_parallel().
+     *
+     * The array is cut into chunks, and the chunks dealt out evenly across a pool of worker threads - the thread running
+     * the program counts as one of them. Each worker takes chunks from the front of its own share; one which runs out
+     * steals chunks from the back of somebody else's, so an uneven body doesn't leave threads idle. Every worker runs
+     * the body in a VM of its own (vm.h) on the very same nugget, which is only ever read, and with the program's globals
+     * to read as well. The workers' own VMs don't collect garbage: the heap they share with the program isn't theirs to
+     * mark, and whatever they allocate is freed in one go when the loop is over.
+     *
+     * How the array is cut up depends only on its length, never on how many threads there are, and a reduction adds up
+     * each chunk left to right and then the chunks' results in order. So the answer is the same to the last bit on one
+     * thread or sixty-four, however the chunks got shared out.
+     *
+     * Since the workers run at the same time, a body mustn't touch anything they share. The compiler rejects a body
+     * which assigns to a global, writes to an array element, prints, declares a function or has a parallel loop of its
+     * own. Functions the body calls are compiled lazily (compiler.c), so they're checked for the same when the loop
+     * starts, before any worker does - along with everything they call in turn, through globals, and the methods of any
+     * class or instance they can reach. Setting a field counts as writing to shared state, even an instance's own.
+     */
+    typedef enum {
+        PARALLEL_MAP,
+        PARALLEL_SUM,
+        PARALLEL_MIN,
+        PARALLEL_MAX,
+        PARALLEL_KINDS
+    } ParallelKind;
+
+    #define PARALLEL_THREADS_MAX 64
+
+    int find_parallel_kind(const char* name, int length);
+    const char* parallel_kind_name(ParallelKind kind);
+    void set_parallel_threads(int threads);
+    const char* run_parallel(ParallelKind kind, ObjFunction* body, ObjArray* array, Value* result);
+    void free_parallel(void);
+
+#endif
@@ -0,0 +1,275 @@
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include "perf.h"
+
+#ifdef __linux__
+    #include <linux/perf_event.h>
+    #include <sys/ioctl.h>
+    #include <sys/syscall.h>
+    #include <unistd.h>
+#endif
+
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+ * The counters, in the order they're added to the group. A counter's slot in a group read is its position among the
+ * counters which actually opened, so each one remembers that (-1 if it didn't open).
+ */
+typedef enum {
+    COUNTER_CYCLES,
+    COUNTER_INSTRUCTIONS,
+    COUNTER_BRANCH_MISSES,
+    COUNTER_L1D_MISSES,
+    COUNTERS
+} Counter;
+
+static const char* counter_names[COUNTERS] = {"cycles", "instructions", "branch-misses", "L1d-misses"};
+
+/*
+ * A reading of every counter at one moment. enabled / running are the group's times in nanoseconds - if the kernel had
+ * to multiplex the group with other users of the PMU they differ, and counts are scaled up by enabled / running.
+ */
+typedef struct {
+    uint64_t values[COUNTERS];
+    uint64_t enabled;
+    uint64_t running;
+    uint64_t wall;
+} PerfReading;
+
+typedef struct {
+    double counts[COUNTERS];
+    uint64_t wall;
+    uint64_t entries;
+} PerfTotals;
+
+#define PERF_DEPTH_MAX 8
+
+bool perf_on       = false;
+bool perf_tracking = false;
+volatile sig_atomic_t perf_phase   = PERF_PHASES;
+volatile sig_atomic_t perf_running = 0;
+
+static int leader = -1;
+static int descriptors[COUNTERS] = {-1, -1, -1, -1};
+static int slots[COUNTERS]       = {-1, -1, -1, -1};
+static int opened = 0;
+
+static PerfTotals totals[PERF_PHASES];
+static PerfPhase active[PERF_DEPTH_MAX];
+static int depth = 0;
+static PerfReading last;
+
+static const char* phase_names[PERF_PHASES] = {"scan", "compile", "run"};
+
+
+static uint64_t now_nanoseconds(void) {
+    struct timespec now;
+    timespec_get(&now, TIME_UTC);
+    return (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+}
+
+
+#ifdef __linux__
+    static int open_counter(uint32_t type, uint64_t config, int group) {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size           = sizeof(attr);
+        attr.type           = type;
+        attr.config         = config;
+        attr.disabled       = (group == -1);
+        attr.exclude_kernel = 1;
+        attr.exclude_hv     = 1;
+        attr.read_format    = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+        return (int)syscall(SYS_perf_event_open, &attr, 0, -1, group, 0);
+    }
+#endif
+
+
+/*
+ * Open the counter group. The cycle counter leads it; if even that won't open there's nothing to be had from the PMU,
+ * and we fall back to timing alone.
+ */
+void init_perf(void) {
+    perf_on = true;
+    track_perf_phases();
+    memset(totals, 0, sizeof(totals));
+
+    #ifdef __linux__
+        static const struct { uint32_t type; uint64_t config; } events[COUNTERS] = {
+            [COUNTER_CYCLES]        = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+            [COUNTER_INSTRUCTIONS]  = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+            [COUNTER_BRANCH_MISSES] = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+            [COUNTER_L1D_MISSES]    = {PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D |
+                                                           (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                                                           (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)},
+        };
+
+        for (int counter = 0; counter < COUNTERS; counter++) {
+            int descriptor = open_counter(events[counter].type, events[counter].config, leader);
+
+            if (descriptor < 0) {
+                if (counter == COUNTER_CYCLES) {
+                    fprintf(stderr, "[perf] Hardware counters unavailable (%s) - reporting wall-clock time only.\n",
+                            strerror(errno));
+                    break;
+                }
+                continue;
+            }
+
+            if (leader == -1) {
+                leader = descriptor;
+            }
+            descriptors[counter] = descriptor;
+            slots[counter]       = opened++;
+        }
+
+        if (leader != -1) {
+            ioctl(leader, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+            ioctl(leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+        }
+    #else
+        fprintf(stderr, "[perf] Hardware counters are only supported on Linux - reporting wall-clock time only.\n");
+    #endif
+}
+
+
+void track_perf_phases(void) {
+    perf_tracking = true;
+}
+
+
+static void read_counters(PerfReading* reading) {
+    memset(reading, 0, sizeof(*reading));
+    reading->wall = now_nanoseconds();
+
+    #ifdef __linux__
+        if (leader == -1) {
+            return;
+        }
+
+        uint64_t buffer[3 + COUNTERS];
+        if (read(leader, buffer, sizeof(buffer)) < (ssize_t)(sizeof(uint64_t) * 3)) {
+            return;
+        }
+
+        reading->enabled = buffer[1];
+        reading->running = buffer[2];
+        for (int counter = 0; counter < COUNTERS; counter++) {
+            if (slots[counter] >= 0 && (uint64_t)slots[counter] < buffer[0]) {
+                reading->values[counter] = buffer[3 + slots[counter]];
+            }
+        }
+    #endif
+}
+
+
+/*
+ * Charge everything since the last reading to whichever phase is innermost right now.
+ */
+static void charge(const PerfReading* now) {
+    if (depth == 0) {
+        return;
+    }
+
+    PerfTotals* phase = &totals[active[depth - 1]];
+    uint64_t enabled  = now->enabled - last.enabled;
+    uint64_t running  = now->running - last.running;
+    double scale      = (running == 0) ? 1.0 : (double)enabled / (double)running;
+
+    for (int counter = 0; counter < COUNTERS; counter++) {
+        phase->counts[counter] += (double)(now->values[counter] - last.values[counter]) * scale;
+    }
+    phase->wall += now->wall - last.wall;
+}
+
+
+void perf_switch(PerfPhase phase, bool begin) {
+    PerfReading now;
+    if (perf_on) {
+        read_counters(&now);
+        charge(&now);
+    }
+
+    if (begin) {
+        if (depth < PERF_DEPTH_MAX) {
+            active[depth++] = phase;
+            totals[phase].entries++;
+            perf_running   += (phase == PERF_RUN);
+        }
+    } else if (depth > 0) {
+        perf_running -= (active[--depth] == PERF_RUN);
+    }
+    perf_phase = (depth > 0) ? active[depth - 1] : PERF_PHASES;
+
+    if (perf_on) {
+        last = now;
+    }
+}
+
+
+/*
+ * Totals for each phase, then the ratios that say what kind of slow it is: instructions per cycle, and branch and L1d
+ * misses per thousand instructions.
+ */
+void print_perf_report(void) {
+    if (!perf_on) {
+        return;
+    }
+
+    printf("[perf] %-8s %10s %9s", "phase", "wall ms", "entries");
+    for (int counter = 0; counter < COUNTERS; counter++) {
+        if (slots[counter] >= 0) {
+            printf(" %15s", counter_names[counter]);
+        }
+    }
+    printf("\n");
+
+    for (int phase = 0; phase < PERF_PHASES; phase++) {
+        PerfTotals* total = &totals[phase];
+        printf("[perf] %-8s %10.3f %9llu", phase_names[phase], total->wall / 1e6, (unsigned long long)total->entries);
+        for (int counter = 0; counter < COUNTERS; counter++) {
+            if (slots[counter] >= 0) {
+                printf(" %15.0f", total->counts[counter]);
+            }
+        }
+        printf("\n");
+    }
+
+    if (slots[COUNTER_INSTRUCTIONS] < 0) {
+        return;
+    }
+
+    for (int phase = 0; phase < PERF_PHASES; phase++) {
+        PerfTotals* total   = &totals[phase];
+        double instructions = total->counts[COUNTER_INSTRUCTIONS];
+        if (instructions == 0) {
+            continue;
+        }
+
+        printf("[perf] %-8s IPC %.2f", phase_names[phase], instructions / total->counts[COUNTER_CYCLES]);
+        if (slots[COUNTER_BRANCH_MISSES] >= 0) {
+            printf("  branch-misses/1k-instr %.2f", 1000.0 * total->counts[COUNTER_BRANCH_MISSES] / instructions);
+        }
+        if (slots[COUNTER_L1D_MISSES] >= 0) {
+            printf("  L1d-misses/1k-instr %.2f", 1000.0 * total->counts[COUNTER_L1D_MISSES] / instructions);
+        }
+        printf("\n");
+    }
+}
+
+
+void free_perf(void) {
+    #ifdef __linux__
+        for (int counter = 0; counter < COUNTERS; counter++) {
+            if (descriptors[counter] >= 0) {
+                close(descriptors[counter]);
+                descriptors[counter] = -1;
+            }
+            slots[counter] = -1;
+        }
+        leader = -1;
+        opened = 0;
+    #endif
+    perf_on = false;
+}
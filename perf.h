@@ -0,0 +1,57 @@
+#ifndef cypsa_perf_h
+    #define cypsa_perf_h
+
+    #include <signal.h>
+    #include "common.h"
+
+    /* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+     * --perf: hardware performance counters for each phase of a run, so that a slow run can be pinned on scanning,
+     * compiling or executing - and on cache misses or mispredicted branches within that phase. On Linux the counters
+     * come from one perf_event_open() group (cycles, instructions, branch misses, L1d read misses), read at every
+     * phase boundary; wall-clock time is always recorded alongside.
+     *
+     * Phases nest: perf_begin(PERF_SCAN) while PERF_COMPILE is running pauses the compile phase until the matching
+     * perf_end(), so every event is counted against exactly one phase - the innermost. While --perf is on, compile()
+     * scans the whole source up front on the calling thread rather than interleaving the two, so that the scanner's
+     * share can be measured at all (see compiler.c).
+     *
+     * If the counters can't be opened - no permission (perf_event_paranoid), no PMU in a VM, not Linux - init_perf()
+     * says so once and the report carries on with wall-clock times alone. Any single counter the hardware doesn't have
+     * is just left out. perf_begin() and perf_end() cost nothing but a flag check when --perf is off.
+     *
+     * The sampling profiler (profile.h) needs to know which phase it has interrupted, but not the counters, so it can
+     * turn on tracking the phases alone (track_perf_phases()). perf_phase is the innermost phase right now, or
+     * PERF_PHASES outside all of them, and perf_running how many PERF_RUN phases are open - lazily compiling a function
+     * (vm.c) is a compile phase inside a run.
+     */
+    typedef enum {
+        PERF_SCAN,
+        PERF_COMPILE,
+        PERF_RUN,
+        PERF_PHASES
+    } PerfPhase;
+
+    extern bool perf_on;
+    extern bool perf_tracking;
+    extern volatile sig_atomic_t perf_phase;
+    extern volatile sig_atomic_t perf_running;
+
+    void init_perf(void);
+    void track_perf_phases(void);
+    void perf_switch(PerfPhase phase, bool begin);
+    void print_perf_report(void);
+    void free_perf(void);
+
+    static inline void perf_begin(PerfPhase phase) {
+        if (perf_tracking) {
+            perf_switch(phase, true);
+        }
+    }
+
+    static inline void perf_end(PerfPhase phase) {
+        if (perf_tracking) {
+            perf_switch(phase, false);
+        }
+    }
+
+#endif
@@ -0,0 +1,715 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+#include "memory.h"
+#include "nugget.h"
+#include "perf.h"
+#include "profile.h"
+
+#ifdef __linux__
+    #include <sys/syscall.h>
+    #ifndef sigev_notify_thread_id
+        #define sigev_notify_thread_id _sigev_un._tid
+    #endif
+#endif
+
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+ * Functions by number. The first few numbers are the pseudo-functions samples are put down to when there's no script
+ * code to blame, and the rest are handed out by the signal handler as it meets functions (function_id()). slot_functions /
+ * slot_ids is an open-addressed table from function pointer to number, written only by the handler - except that a freed function's
+ * slot is overwritten with FORGOTTEN, which never matches, and is never reused either.
+ */
+typedef enum {
+    ID_OTHER,
+    ID_SCAN,
+    ID_COMPILE,
+    ID_SCRIPT,
+    ID_UNKNOWN,
+    ID_TRUNCATED,
+    IDS_RESERVED
+} ReservedId;
+
+#define PROFILE_FUNCTIONS_MAX  8192
+#define PROFILE_FUNCTION_SLOTS 16384
+#define PROFILE_NAME_MAX       48
+
+typedef struct {
+    char name[PROFILE_NAME_MAX];
+    int line;
+} FunctionName;
+
+static const char* reserved_names[IDS_RESERVED] = {"(other)", "(scan)", "(compile)", "<script>", "(unknown)",
+                                                   "[truncated]"};
+
+static ObjFunction forgotten;
+#define FORGOTTEN (&forgotten)
+
+static FunctionName* names                      = NULL;
+static uint32_t name_count                      = 0;
+static _Atomic(ObjFunction*)* slot_functions    = NULL;
+static uint32_t* slot_ids                       = NULL;
+
+
+/*
+ * Samples go from the handler to the drain thread through a ring of 32-bit words, one record per sample: a header word
+ * (how many levels follow, the sample's weight, and the top bit set if the stack was cut short), then a function number
+ * and line for each level, innermost first. Only the handler moves head, and only the drain thread moves tail.
+ * The kernel only checks CPU-time timers on its scheduler tick, so asking for more samples than there are ticks a
+ * second gets one signal per tick with the rest counted as overruns. Rather than under-report the time, a sample is
+ * weighted by how many periods it stands for.
+ */
+#define PROFILE_RING_WORDS  (1u << 20)
+#define PROFILE_RING_MASK   (PROFILE_RING_WORDS - 1)
+#define PROFILE_RECORD_MAX  (1 + 2 * (PROFILE_DEPTH_MAX + 1))
+#define PROFILE_TRUNCATED   0x80000000u
+#define PROFILE_LEVELS_MASK 0xFFu
+#define PROFILE_WEIGHT_MAX  0x7FFFFFu
+#define PROFILE_DRAIN_NS    10000000
+
+static uint32_t* ring = NULL;
+static _Atomic(uint64_t) ring_head;
+static _Atomic(uint64_t) ring_tail;
+
+bool profile_on = false;
+_Thread_local volatile sig_atomic_t profile_held = 0;
+
+static _Thread_local bool sampling_thread          = false;
+static _Thread_local const VM* volatile redirected = NULL;
+static volatile uint64_t samples                   = 0;
+static volatile uint64_t dropped                   = 0;
+
+static int rate;
+static const char* script_path;
+static const char* stacks_path;
+
+static struct sigaction previous_action;
+static pthread_t drain_thread;
+static atomic_bool stopping;
+
+#ifdef __linux__
+    static timer_t timer;
+    static bool timer_made = false;
+#endif
+
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+ * Everything from here to take_sample() runs inside the signal handler, so it may only read the VM, write to memory
+ * set aside beforehand, and use atomics.
+ */
+static uint32_t function_slot(ObjFunction* function) {
+    uint64_t hash = ((uint64_t)(uintptr_t)function >> 4) * 0x9E3779B97F4A7C15u;
+    return (uint32_t)(hash >> 40) & (PROFILE_FUNCTION_SLOTS - 1);
+}
+
+
+static void copy_name(FunctionName* entry, ObjFunction* function) {
+    int length = 0;
+    if (function->name != NULL) {
+        const char* chars = function->name->chars;
+        while (length < PROFILE_NAME_MAX - 1 && length < function->name->length) {
+            entry->name[length] = chars[length];
+            length++;
+        }
+    }
+    entry->name[length] = '\0';
+    entry->line         = function->line;
+}
+
+
+static uint32_t function_id(ObjFunction* function) {
+    if (function == NULL) {
+        return ID_SCRIPT;
+    }
+
+    uint32_t slot = function_slot(function);
+    for (uint32_t probe = 0; probe < PROFILE_FUNCTION_SLOTS; probe++) {
+        ObjFunction* found = atomic_load_explicit(&slot_functions[slot], memory_order_relaxed);
+
+        if (found == function) {
+            return slot_ids[slot];
+        }
+        if (found == NULL) {
+            if (name_count == PROFILE_FUNCTIONS_MAX) {
+                return ID_UNKNOWN;
+            }
+            uint32_t id = name_count++;
+            copy_name(&names[id], function);
+            slot_ids[slot] = id;
+            atomic_store_explicit(&slot_functions[slot], function, memory_order_relaxed);
+            return id;
+        }
+        slot = (slot + 1) & (PROFILE_FUNCTION_SLOTS - 1);
+    }
+    return ID_UNKNOWN;
+}
+
+
+/*
+ * The line of the instruction iptr has just fetched (or, for a caller, of the call it's waiting on). A nugget which
+ * isn't finalized is still being compiled, and an iptr outside the code means the VM was caught halfway through
+ * switching between functions - there's no line to be had from either.
+ */
+static uint32_t line_at(Nugget* nugget, const uint8_t* iptr) {
+    if (nugget == NULL || !nugget->finalized || iptr <= nugget->code || iptr > nugget->code + nugget->occupied) {
+        return 0;
+    }
+    return (uint32_t)get_line(nugget, (int)(iptr - nugget->code) - 1);
+}
+
+
+static void push_record(const uint32_t* record, uint32_t length, uint32_t weight) {
+    uint64_t head = atomic_load_explicit(&ring_head, memory_order_relaxed);
+    uint64_t tail = atomic_load_explicit(&ring_tail, memory_order_acquire);
+
+    if (head - tail + length > PROFILE_RING_WORDS) {
+        dropped += weight;
+        return;
+    }
+    for (uint32_t word = 0; word < length; word++) {
+        ring[(head + word) & PROFILE_RING_MASK] = record[word];
+    }
+    atomic_store_explicit(&ring_head, head + length, memory_order_release);
+}
+
+
+static void take_sample(int signal_number, siginfo_t* info, void* context) {
+    (void)signal_number;
+    (void)context;
+
+    if (!sampling_thread) {
+        return;
+    }
+    int saved_errno = errno;
+    uint32_t weight = 1;
+    #ifdef __linux__
+        if (info != NULL && info->si_code == SI_TIMER && info->si_overrun > 0) {
+            weight += (info->si_overrun < (int)PROFILE_WEIGHT_MAX) ? (uint32_t)info->si_overrun : PROFILE_WEIGHT_MAX - 1;
+        }
+    #endif
+    samples += weight;
+
+    if (profile_held) {
+        dropped += weight;
+        errno = saved_errno;
+        return;
+    }
+
+    uint32_t record[PROFILE_RECORD_MAX];
+    uint32_t levels = 0;
+    bool truncated  = false;
+    int phase       = perf_phase;
+
+    if (phase != PERF_RUN) {
+        record[1] = (phase == PERF_SCAN) ? ID_SCAN : (phase == PERF_COMPILE) ? ID_COMPILE : ID_OTHER;
+        record[2] = 0;
+        levels    = 1;
+    }
+
+    if (perf_running > 0) {
+        const VM* target = (redirected != NULL) ? redirected : &vm;
+
+        record[1 + 2 * levels] = function_id(target->function);
+        record[2 + 2 * levels] = line_at(target->nugget, target->iptr);
+        levels++;
+
+        int frame = target->frame_count - 1;
+        for (; frame >= 0 && levels <= PROFILE_DEPTH_MAX; frame--, levels++) {
+            const CallFrame* caller = &target->frames[frame];
+            record[1 + 2 * levels]  = function_id(caller->function);
+            record[2 + 2 * levels]  = line_at(caller->nugget, caller->iptr);
+        }
+        truncated = (frame >= 0);
+    }
+
+    record[0] = levels | (weight << 8) | (truncated ? PROFILE_TRUNCATED : 0);
+    push_record(record, 1 + 2 * levels, weight);
+    errno = saved_errno;
+}
+
+
+/*
+ * A function is being freed: from now on its address could belong to another one.
+ */
+void forget_profiled_function(ObjFunction* function) {
+    uint32_t slot = function_slot(function);
+    for (uint32_t probe = 0; probe < PROFILE_FUNCTION_SLOTS; probe++) {
+        ObjFunction* found = atomic_load_explicit(&slot_functions[slot], memory_order_relaxed);
+        if (found == function) {
+            atomic_store_explicit(&slot_functions[slot], FORGOTTEN, memory_order_relaxed);
+            return;
+        }
+        if (found == NULL) {
+            return;
+        }
+        slot = (slot + 1) & (PROFILE_FUNCTION_SLOTS - 1);
+    }
+}
+
+
+/*
+ * While the main thread works on a parallel loop it runs a worker's VM, and its own is set aside in 'program' - which
+ * is what the samples should describe. NULL goes back to sampling vm. Like vm itself this is per thread: a fiber's
+ * thread running its own parallel loop only changes its own copy, and only the main thread's is ever sampled.
+ */
+void profile_redirect(const VM* program) {
+    redirected = program;
+}
+
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+ * The tallies, owned by the drain thread until it's stopped. Each is keyed by a short run of words: a function number,
+ * a function number and line, or a whole stack of function numbers (outermost first). self and total are in weighted
+ * samples. stamp is the number of the last sample which counted towards total, so that a recursive function or line is
+ * only counted once per sample.
+ * Functions are tallied under the first number handed out for the same name and line ('canonical'), so a function
+ * which was freed and compiled again - as --watch does - still adds up as one.
+ */
+typedef struct {
+    uint32_t* key;
+    uint32_t length;
+    uint32_t hash;
+    uint64_t self;
+    uint64_t total;
+    uint64_t stamp;
+} Tally;
+
+typedef struct {
+    Tally* tallies;
+    uint32_t count;
+    uint32_t capacity;
+} TallyMap;
+
+static TallyMap functions_map;
+static TallyMap lines_map;
+static TallyMap stacks_map;
+static uint32_t* canonical = NULL;
+static uint64_t tallied    = 0;
+static uint64_t weighed    = 0;
+
+
+static uint32_t hash_key(const uint32_t* key, uint32_t length) {
+    uint32_t hash = 2166136261u;
+    for (uint32_t word = 0; word < length; word++) {
+        hash = (hash ^ key[word]) * 16777619u;
+    }
+    return hash;
+}
+
+
+static Tally* find_tally(Tally* tallies, uint32_t capacity, const uint32_t* key, uint32_t length, uint32_t hash) {
+    uint32_t index = hash & (capacity - 1);
+    LOOP {
+        Tally* tally = &tallies[index];
+        if (tally->key == NULL || (tally->hash == hash && tally->length == length &&
+                                   memcmp(tally->key, key, sizeof(uint32_t) * length) == 0)) {
+            return tally;
+        }
+        index = (index + 1) & (capacity - 1);
+    }
+}
+
+
+static Tally* tally(TallyMap* map, const uint32_t* key, uint32_t length) {
+    if (map->count + 1 > map->capacity * 3 / 4) {
+        uint32_t capacity = (map->capacity < 64) ? 64 : map->capacity * 2;
+        Tally* tallies    = calloc(capacity, sizeof(Tally));
+        check_failure(tallies, "Unable to grow the profile.", sizeof(Tally) * capacity);
+
+        for (uint32_t index = 0; index < map->capacity; index++) {
+            Tally* old = &map->tallies[index];
+            if (old->key != NULL) {
+                *find_tally(tallies, capacity, old->key, old->length, old->hash) = *old;
+            }
+        }
+        free(map->tallies);
+        map->tallies  = tallies;
+        map->capacity = capacity;
+    }
+
+    uint32_t hash = hash_key(key, length);
+    Tally* found  = find_tally(map->tallies, map->capacity, key, length, hash);
+    if (found->key == NULL) {
+        found->key = malloc(sizeof(uint32_t) * length);
+        check_failure(found->key, "Unable to grow the profile.", sizeof(uint32_t) * length);
+        memcpy(found->key, key, sizeof(uint32_t) * length);
+        found->length = length;
+        found->hash   = hash;
+        map->count++;
+    }
+    return found;
+}
+
+
+static void free_tallies(TallyMap* map) {
+    for (uint32_t index = 0; index < map->capacity; index++) {
+        free(map->tallies[index].key);
+    }
+    free(map->tallies);
+    *map = (TallyMap){NULL, 0, 0};
+}
+
+
+static uint32_t canonical_id(uint32_t id) {
+    if (id < IDS_RESERVED) {
+        return id;
+    }
+    if (canonical[id] == UINT32_MAX) {
+        canonical[id] = id;
+        for (uint32_t other = IDS_RESERVED; other < id; other++) {
+            if (canonical[other] == other && names[other].line == names[id].line &&
+                strcmp(names[other].name, names[id].name) == 0) {
+                canonical[id] = other;
+                break;
+            }
+        }
+    }
+    return canonical[id];
+}
+
+
+static void count_towards(Tally* tally, bool self, uint32_t weight) {
+    tally->self += self ? weight : 0;
+    if (tally->stamp != tallied) {
+        tally->stamp  = tallied;
+        tally->total += weight;
+    }
+}
+
+
+/*
+ * One sample: levels is (function, line) pairs, innermost first. There's always at least one - a sample with no script
+ * code to blame has a pseudo-function.
+ */
+static void tally_sample(uint32_t* levels, uint32_t count, uint32_t weight, bool truncated) {
+    uint32_t stack[PROFILE_DEPTH_MAX + 2];
+    uint32_t depth = 0;
+    tallied++;
+    weighed += weight;
+
+    if (truncated) {
+        stack[depth++] = ID_TRUNCATED;
+    }
+    for (uint32_t level = 0; level < count; level++) {
+        uint32_t id   = canonical_id(levels[2 * level]);
+        uint32_t line = levels[2 * level + 1];
+        bool self     = (level == 0);
+
+        count_towards(tally(&functions_map, &id, 1), self, weight);
+        if (line != 0) {
+            uint32_t key[2] = {id, line};
+            count_towards(tally(&lines_map, key, 2), self, weight);
+        }
+        stack[depth + count - 1 - level] = id;
+    }
+    tally(&stacks_map, stack, depth + count)->self += weight;
+}
+
+
+static void drain(void) {
+    uint64_t tail = atomic_load_explicit(&ring_tail, memory_order_relaxed);
+    uint64_t head = atomic_load_explicit(&ring_head, memory_order_acquire);
+
+    while (tail < head) {
+        uint32_t header = ring[tail & PROFILE_RING_MASK];
+        uint32_t count  = header & PROFILE_LEVELS_MASK;
+        uint32_t levels[2 * (PROFILE_DEPTH_MAX + 1)];
+
+        for (uint32_t word = 0; word < 2 * count; word++) {
+            levels[word] = ring[(tail + 1 + word) & PROFILE_RING_MASK];
+        }
+        tally_sample(levels, count, (header & ~PROFILE_TRUNCATED) >> 8, (header & PROFILE_TRUNCATED) != 0);
+        tail += 1 + 2 * count;
+    }
+    atomic_store_explicit(&ring_tail, tail, memory_order_release);
+}
+
+
+static void* drain_loop(void* unused) {
+    (void)unused;
+    struct timespec pause = {0, PROFILE_DRAIN_NS};
+
+    while (!atomic_load(&stopping)) {
+        nanosleep(&pause, NULL);
+        drain();
+    }
+    return NULL;
+}
+
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+ * Set everything up and start the timer, on the thread which is going to run the script. The drain thread is started
+ * with SIGPROF blocked, so that where the timer falls back to setitimer() - which signals the whole process - only
+ * the sampled thread can take it.
+ */
+static void start_timer(void) {
+    long interval = 1000000000L / rate;
+
+    #ifdef __linux__
+        struct sigevent event;
+        memset(&event, 0, sizeof(event));
+        event.sigev_notify           = SIGEV_THREAD_ID;
+        event.sigev_signo            = SIGPROF;
+        event.sigev_notify_thread_id = (pid_t)syscall(SYS_gettid);
+
+        if (timer_create(CLOCK_THREAD_CPUTIME_ID, &event, &timer) == 0) {
+            struct itimerspec period = {{interval / 1000000000L, interval % 1000000000L},
+                                        {interval / 1000000000L, interval % 1000000000L}};
+            timer_settime(timer, 0, &period, NULL);
+            timer_made = true;
+            return;
+        }
+    #endif
+
+    struct itimerval period = {{interval / 1000000000L, (interval % 1000000000L) / 1000},
+                               {interval / 1000000000L, (interval % 1000000000L) / 1000}};
+    setitimer(ITIMER_PROF, &period, NULL);
+}
+
+
+static void stop_timer(void) {
+    #ifdef __linux__
+        if (timer_made) {
+            timer_delete(timer);
+            timer_made = false;
+            return;
+        }
+    #endif
+
+    struct itimerval off = {{0, 0}, {0, 0}};
+    setitimer(ITIMER_PROF, &off, NULL);
+}
+
+
+void init_profile(int sample_rate, const char* script, const char* stacks) {
+    rate        = sample_rate;
+    script_path = script;
+    stacks_path = stacks;
+
+    names          = calloc(PROFILE_FUNCTIONS_MAX, sizeof(FunctionName));
+    slot_functions = calloc(PROFILE_FUNCTION_SLOTS, sizeof(_Atomic(ObjFunction*)));
+    slot_ids       = calloc(PROFILE_FUNCTION_SLOTS, sizeof(uint32_t));
+    canonical      = malloc(sizeof(uint32_t) * PROFILE_FUNCTIONS_MAX);
+    ring           = malloc(sizeof(uint32_t) * PROFILE_RING_WORDS);
+    if (names == NULL || slot_functions == NULL || slot_ids == NULL || canonical == NULL || ring == NULL) {
+        fprintf(stderr, "[profile] Unable to allocate the profiler - running without it.\n");
+        free_profile();
+        return;
+    }
+
+    for (uint32_t id = 0; id < IDS_RESERVED; id++) {
+        snprintf(names[id].name, PROFILE_NAME_MAX, "%s", reserved_names[id]);
+    }
+    name_count = IDS_RESERVED;
+    memset(canonical, 0xFF, sizeof(uint32_t) * PROFILE_FUNCTIONS_MAX);
+    atomic_init(&ring_head, 0);
+    atomic_init(&ring_tail, 0);
+    atomic_init(&stopping, false);
+
+    track_perf_phases();
+    sampling_thread = true;
+    profile_on      = true;
+
+    sigset_t block, saved;
+    sigemptyset(&block);
+    sigaddset(&block, SIGPROF);
+    pthread_sigmask(SIG_BLOCK, &block, &saved);
+    if (pthread_create(&drain_thread, NULL, drain_loop, NULL) != 0) {
+        fprintf(stderr, "[profile] Unable to start the profiler's thread - running without it.\n");
+        pthread_sigmask(SIG_SETMASK, &saved, NULL);
+        free_profile();
+        return;
+    }
+    pthread_sigmask(SIG_SETMASK, &saved, NULL);
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_sigaction = take_sample;
+    action.sa_flags     = SA_SIGINFO | SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGPROF, &action, &previous_action);
+
+    start_timer();
+}
+
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+ * The report. Tallies are listed hottest first - by self, then by total.
+ */
+#define PROFILE_FUNCTIONS_SHOWN 15
+#define PROFILE_LINES_SHOWN     20
+
+static int hottest_first(const void* a, const void* b) {
+    const Tally* left  = *(const Tally* const*)a;
+    const Tally* right = *(const Tally* const*)b;
+
+    if (left->self != right->self) {
+        return (left->self < right->self) ? 1 : -1;
+    }
+    if (left->total != right->total) {
+        return (left->total < right->total) ? 1 : -1;
+    }
+    return 0;
+}
+
+
+static Tally** sorted_tallies(TallyMap* map) {
+    Tally** sorted = malloc(sizeof(Tally*) * (map->count + 1));
+    check_failure(sorted, "Unable to sort the profile.", sizeof(Tally*) * (map->count + 1));
+
+    uint32_t count = 0;
+    for (uint32_t index = 0; index < map->capacity; index++) {
+        if (map->tallies[index].key != NULL) {
+            sorted[count++] = &map->tallies[index];
+        }
+    }
+    qsort(sorted, count, sizeof(Tally*), hottest_first);
+    return sorted;
+}
+
+
+/*
+ * The script's source, read again for the lines report - by now it may well have been freed. Returns NULL (and the
+ * report does without) if it can't be read.
+ */
+static char* read_script(void) {
+    if (script_path == NULL) {
+        return NULL;
+    }
+    FILE* file = fopen(script_path, "rb");
+    if (file == NULL) {
+        return NULL;
+    }
+
+    fseek(file, 0L, SEEK_END);
+    long size = ftell(file);
+    rewind(file);
+
+    char* source = (size < 0) ? NULL : malloc((size_t)size + 1);
+    if (source != NULL) {
+        size_t read = fread(source, 1, (size_t)size, file);
+        source[read] = '\0';
+    }
+    fclose(file);
+    return source;
+}
+
+
+static void print_source_line(const char* source, uint32_t line) {
+    if (source == NULL) {
+        printf("\n");
+        return;
+    }
+
+    const char* start = source;
+    for (uint32_t at = 1; at < line && start != NULL; at++) {
+        start = strchr(start, '\n');
+        start = (start == NULL) ? NULL : start + 1;
+    }
+    if (start == NULL) {
+        printf("\n");
+        return;
+    }
+    while (*start == ' ' || *start == '\t') {
+        start++;
+    }
+    const char* end = strchr(start, '\n');
+    int length      = (end == NULL) ? (int)strlen(start) : (int)(end - start);
+    printf("  | %.*s\n", (length > 60) ? 60 : length, start);
+}
+
+
+static void write_stacks(void) {
+    FILE* file = fopen(stacks_path, "w");
+    if (file == NULL) {
+        fprintf(stderr, "[profile] Could not write the stacks to \"%s\": %s.\n", stacks_path, strerror(errno));
+        return;
+    }
+
+    for (uint32_t index = 0; index < stacks_map.capacity; index++) {
+        Tally* stack = &stacks_map.tallies[index];
+        if (stack->key == NULL) {
+            continue;
+        }
+        for (uint32_t level = 0; level < stack->length; level++) {
+            fprintf(file, (level == 0) ? "%s" : ";%s", names[stack->key[level]].name);
+        }
+        fprintf(file, " %llu\n", (unsigned long long)stack->self);
+    }
+    fclose(file);
+    printf("[profile] Wrote %u distinct stacks to %s.\n", stacks_map.count, stacks_path);
+}
+
+
+void print_profile_report(void) {
+    if (!profile_on) {
+        return;
+    }
+
+    stop_timer();
+    sigaction(SIGPROF, &previous_action, NULL);
+    atomic_store(&stopping, true);
+    pthread_join(drain_thread, NULL);
+    drain();
+
+    printf("[profile] %llu samples, one per %.3f ms of main-thread CPU time (%.2f s), %llu dropped\n",
+           (unsigned long long)samples, 1000.0 / rate, (double)samples / rate, (unsigned long long)dropped);
+    if (weighed == 0) {
+        return;
+    }
+
+    Tally** functions = sorted_tallies(&functions_map);
+    printf("[profile] %6s %7s  function\n", "self%", "total%");
+    for (uint32_t index = 0; index < functions_map.count && index < PROFILE_FUNCTIONS_SHOWN; index++) {
+        FunctionName* name = &names[functions[index]->key[0]];
+        printf("[profile] %6.1f %7.1f  %s", 100.0 * functions[index]->self / weighed,
+               100.0 * functions[index]->total / weighed, name->name);
+        if (functions[index]->key[0] >= IDS_RESERVED) {
+            printf(" (line %d)", name->line);
+        }
+        printf("\n");
+    }
+    free(functions);
+
+    char* source = read_script();
+    Tally** lines = sorted_tallies(&lines_map);
+    if (lines_map.count > 0) {
+        printf("[profile] %6s %7s  %5s  %-16s\n", "self%", "total%", "line", "function");
+    }
+    for (uint32_t index = 0; index < lines_map.count && index < PROFILE_LINES_SHOWN; index++) {
+        printf("[profile] %6.1f %7.1f  %5u  %-16s", 100.0 * lines[index]->self / weighed,
+               100.0 * lines[index]->total / weighed, lines[index]->key[1], names[lines[index]->key[0]].name);
+        print_source_line(source, lines[index]->key[1]);
+    }
+    free(lines);
+    free(source);
+
+    if (stacks_path != NULL) {
+        write_stacks();
+    }
+}
+
+
+void free_profile(void) {
+    free_tallies(&functions_map);
+    free_tallies(&lines_map);
+    free_tallies(&stacks_map);
+
+    free(names);
+    free((void*)slot_functions);
+    free(slot_ids);
+    free(canonical);
+    free(ring);
+    names          = NULL;
+    slot_functions = NULL;
+    slot_ids       = NULL;
+    canonical      = NULL;
+    ring           = NULL;
+    profile_on     = false;
+}
@@ -0,0 +1,55 @@
+#ifndef cypsa_profile_h
+    #define cypsa_profile_h
+
+    #include <signal.h>
+    #include "common.h"
+    #include "object.h"
+    #include "vm.h"
+
+    /* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+     * --profile: a sampling profiler which says which lines and functions of a script its time goes on.
+     *
+     * An interval timer on the main thread's CPU clock (timer_create() on Linux, setitimer(ITIMER_PROF) elsewhere)
+     * sends it SIGPROF, by default PROFILE_RATE_DEFAULT times a second - an odd rate, so it doesn't fall into step with
+     * anything periodic in the program. The signal handler walks the VM it interrupted: the running function and line
+     * (from vm.iptr and the nugget's line runs), then each CallFrame's, outermost last. It only reads the VM, never
+     * allocates, and never takes a lock; what it writes is one record into a ring buffer, which a helper thread drains
+     * every few milliseconds into the tallies the report is made from. So a sample costs a microsecond or so however
+     * long the program runs.
+     *
+     * Functions are named in a sample by a small number rather than by pointer, since the function may be collected
+     * long before the report is printed: the first time the handler meets a function it copies its name and line into
+     * a table of its own, and the collector tells it when a function is freed (profile_forget()), so that a new one at
+     * the same address isn't mistaken for it. A sample taken while no script is running, or while it's being compiled
+     * or scanned (perf.h tracks which), is put down to (other), (compile) or (scan) - a lazily compiled function counts
+     * as (compile) on top of the stack that called it.
+     *
+     * On exit the report gives each function's and each line's share of the samples: self, where the program was when
+     * the sample was taken, and total, anywhere on the stack. With --profile-stacks=FILE every distinct stack is also
+     * written out with its count, one per line in the "collapsed" format flame graph tools read (outermost;...;innermost
+     * count).
+     *
+     * Only the main thread is sampled. The share of a parallel loop (parallel.h) which the main thread works on is put
+     * down to the line with the loop on it, via profile_redirect(); the helper threads' shares aren't counted. Stacks
+     * deeper than PROFILE_DEPTH_MAX calls keep their innermost frames, under a [truncated] root. While profile_held is
+     * non-zero, samples are dropped rather than taken - for the moment the VM's frames are being moved (vm.c).
+     */
+    #define PROFILE_RATE_DEFAULT 997
+    #define PROFILE_DEPTH_MAX    64
+
+    extern bool profile_on;
+    extern _Thread_local volatile sig_atomic_t profile_held;
+
+    void init_profile(int rate, const char* script_path, const char* stacks_path);
+    void profile_redirect(const VM* program);
+    void forget_profiled_function(ObjFunction* function);
+    void print_profile_report(void);
+    void free_profile(void);
+
+    static inline void profile_forget(ObjFunction* function) {
+        if (profile_on) {
+            forget_profiled_function(function);
+        }
+    }
+
+#endif
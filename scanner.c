@@ -1,27 +1,45 @@
+#include <sched.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include "common.h"
+#include "memory.h"
 #include "scanner.h"
 
 /*
  * The scanner scans through the source code, identifying tokens. 
  * char ptr start - Points to the beginning of the current token.
  * char ptr current - Points to the current character being processed (probably in the middle of a token).
+ * char ptr end - One past the last character to scan. Normally the source's NUL terminator, but the parallel lexer
+ *                (scan_parallel()) points a scanner at just one slice of the source, which it must not wander out of.
  * int line - Counts the line of source code currently being processed. 
+ * char ptr unterminated - If the scanner ran off the end in the middle of a string, where that string started.
+ * 
+ * Each thread gets its own scanner (_Thread_local), so that the parallel lexer's workers can all scan at once without
+ * any of the functions below having to pass a Scanner around.
  */
 typedef struct {
     const char* start;
     const char* current;
+    const char* end;
     int line;
+    const char* unterminated;
 } Scanner;
 
-Scanner scanner;
+static _Thread_local Scanner scanner;
+
+
+void init_scanner_range(const char* start, const char* end, int line) {
+    scanner.start        = start;
+    scanner.current      = start;
+    scanner.end          = end;
+    scanner.line         = line;
+    scanner.unterminated = NULL;
+}
 
 
 void init_scanner(const char* source) {
-    scanner.start = source;
-    scanner.current = source;
-    scanner.line = 1;
+    init_scanner_range(source, source + strlen(source), 1);
 }
 
 
@@ -38,7 +56,7 @@ static bool char_alpha(char ch) {
 
 
 static bool at_file_end() {
-    return (*scanner.current == '\0');
+    return (scanner.current >= scanner.end);
 }
 
 
@@ -49,12 +67,15 @@ static char advance() {
 
 
 static char peek() {
+    if (at_file_end()) {
+        return '\0';
+    }
     return (*scanner.current);
 }
 
 
 static char peek_ahead() {
-    if (at_file_end()) {
+    if (scanner.current + 1 >= scanner.end) {
         return '\0';
     }
     return scanner.current[1];
@@ -83,6 +104,8 @@ static Token create_token(TokenType of_type) {
 }
 
 
+static const char unterminated_message[] = "Error: Unterminated string-literal!";
+
 static Token error_token(const char* error_message) {
     Token token;
     token.type = TOKEN_ERROR;
@@ -124,6 +147,7 @@ static void skip_whitespace() {
                     while ((peek() != '\n') && (!at_file_end())) {
                         advance();
                     }
+                    break;
                 } else {
                     return;
                 }
@@ -188,8 +212,6 @@ static TokenType typeof_identifier() {
             return check_keyword(1, 2, "il", TOKEN_NIL);
         case 'o':
             return check_keyword(1, 1, "r", TOKEN_OR);
-        case 'p':
-            return check_keyword(1, 4, "rint", TOKEN_PRINT);
         case 'r':
             return check_keyword(1, 5, "eturn", TOKEN_RETURN);
         case 's':
@@ -198,6 +220,8 @@ static TokenType typeof_identifier() {
             return check_keyword(1, 2, "ar", TOKEN_VAR);
         case 'w':
             return check_keyword(1, 4, "hile", TOKEN_WHILE);
+        case 'y':
+            return check_keyword(1, 4, "ield", TOKEN_YIELD);
         
         // Checks for branching keywords
         case 'f':
@@ -213,6 +237,19 @@ static TokenType typeof_identifier() {
             }
             break;
         
+        case 'p':
+            if (scanner.current - scanner.start > 1) {
+                switch (scanner.start[1]) {
+                    case 'a':
+                        return check_keyword(2, 6, "rallel", TOKEN_PARALLEL);
+                    case 'r':
+                        return check_keyword(2, 3, "int", TOKEN_PRINT);
+                    case 'u':
+                        return check_keyword(2, 2, "re", TOKEN_PURE);
+                }
+            }
+            break;
+
         case 't':
             if (scanner.current - scanner.start > 1) {
                 switch (scanner.start[1]) {
@@ -274,7 +311,8 @@ static Token string() {
     }
 
     if (at_file_end()) {
-        return error_token("Error: Unterminated string-literal!");
+        scanner.unterminated = scanner.start;
+        return error_token(unterminated_message);
     }
 
     advance();
@@ -310,6 +348,10 @@ Token scan_token() {
             return create_token(TOKEN_LEFTCURLY);
         case '}':
             return create_token(TOKEN_RIGHTCURLY);
+        case '[':
+            return create_token(TOKEN_LEFTSQUARE);
+        case ']':
+            return create_token(TOKEN_RIGHTSQUARE);
         case ';':
             return create_token(TOKEN_SEMICOLON);
         case ',':
@@ -354,3 +396,316 @@ Token scan_token() {
     return error_token("Something else went wrong!");
 }
 
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+ * Scanning a whole source file into a TokenList, rather than handing the compiler one token at a time.
+ */
+static void reserve_tokens(TokenList* list, size_t capacity) {
+    Token* tokens = realloc(list->tokens, sizeof(Token) * capacity);
+    check_failure(tokens, "Unable to grow token list.", sizeof(Token) * capacity);
+    list->tokens   = tokens;
+    list->capacity = capacity;
+}
+
+
+static void append_token(TokenList* list, Token token) {
+    if (list->count == list->capacity) {
+        reserve_tokens(list, GROW_CAPACITY(list->capacity));
+    }
+    list->tokens[list->count++] = token;
+}
+
+
+void free_token_list(TokenList* list) {
+    free(list->tokens);
+    list->tokens   = NULL;
+    list->count    = 0;
+    list->capacity = 0;
+}
+
+
+/*
+ * Scan from start up to end with this thread's scanner, appending everything but the final TOKEN_EOF to list. When
+ * strings_may_continue is set (any slice of the source but the last), running out of range inside a string isn't an
+ * error yet - the string may well be closed in the next slice - so instead of an error token, this returns where the
+ * open string started. Otherwise it returns NULL.
+ */
+static const char* scan_range(const char* start, const char* end, int line, bool strings_may_continue,
+                              TokenList* list) {
+    init_scanner_range(start, end, line);
+
+    LOOP {
+        Token token = scan_token();
+
+        if (token.type == TOKEN_EOF) {
+            break;
+        }
+        if (scanner.unterminated != NULL && strings_may_continue) {
+            break;
+        }
+        append_token(list, token);
+    }
+    return strings_may_continue ? scanner.unterminated : NULL;
+}
+
+
+void scan_all(const char* source, size_t length, TokenList* list) {
+    init_scanner_range(source, source + length, 1);
+
+    LOOP {
+        Token token = scan_token();
+        append_token(list, token);
+
+        if (token.type == TOKEN_EOF) {
+            break;
+        }
+    }
+}
+
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+ * Speculative parallel lexing. The source is cut into one slice per thread, each cut made just after a newline, and
+ * every slice is scanned at once on its own thread as though it started at the top of a file, on line 1.
+ * Cutting after a newline means no slice can start inside a // comment (those always stop at the newline) or inside
+ * a token, except for one: a string-literal, which may run over several lines. So the guess each worker makes - that
+ * its slice starts out in plain code - is right unless a string was still open at the end of the slice before.
+ *
+ * Stitching the slices back together happens on the calling thread, in order, and is where the guesses get checked:
+ *      - If the previous slice ended cleanly, the worker's tokens are right, and only need their line numbers shifting
+ *        down by the number of lines in the slices before.
+ *      - If a string was left open, the worker's tokens are thrown away. The rest of the string runs up to the first
+ *        '"' in this slice, and the code after that is scanned again, serially. (If there's no '"' at all then the
+ *        whole slice is part of the string, which carries on into the next.)
+ * Either way the stitched tokens are exactly what scan_all() would have produced, lines and all. The worst case - a
+ * string literal left open at the top of the file - degrades to a serial scan plus the wasted parallel work.
+ */
+typedef struct {
+    const char* start;
+    const char* end;
+    bool last;
+    TokenList tokens;
+    const char* open_string;
+    int newlines;
+} LexSlice;
+
+
+static int count_newlines(const char* start, const char* end) {
+    int newlines = 0;
+    for (const char* ch = start; (ch = memchr(ch, '\n', end - ch)) != NULL; ch++) {
+        newlines++;
+    }
+    return newlines;
+}
+
+
+static void* lex_slice(void* argument) {
+    LexSlice* slice    = argument;
+    slice->open_string = scan_range(slice->start, slice->end, 1, !slice->last, &slice->tokens);
+    slice->newlines    = count_newlines(slice->start, slice->end);
+    return NULL;
+}
+
+
+/*
+ * Close a string which was left open by an earlier slice, if this slice closes it. Appends the whole string-literal as
+ * one token, just as string() would have made it, and returns where the code after it starts - or NULL if the string
+ * carries on through the whole slice.
+ */
+static const char* close_string(const char* open_string, LexSlice* slice, int line, TokenList* list, int* close_line) {
+    const char* quote = memchr(slice->start, '"', slice->end - slice->start);
+
+    if (quote == NULL) {
+        return NULL;
+    }
+
+    *close_line = line + count_newlines(slice->start, quote);
+    append_token(list, (Token){TOKEN_STRING, open_string, (int)(quote + 1 - open_string), *close_line});
+    return quote + 1;
+}
+
+
+void scan_parallel(const char* source, size_t length, int threads, TokenList* list) {
+    LexSlice* slices = malloc(sizeof(LexSlice) * threads);
+    pthread_t* ids   = malloc(sizeof(pthread_t) * threads);
+    check_failure(slices, "Unable to allocate lexer slices.", sizeof(LexSlice) * threads);
+    check_failure(ids, "Unable to allocate lexer threads.", sizeof(pthread_t) * threads);
+
+    const char* end  = source + length;
+    const char* from = source;
+    int count        = 0;
+
+    while (from < end && count < threads) {
+        const char* to = from + (size_t)(end - from) / (size_t)(threads - count);
+        const char* newline = (count == threads - 1) ? NULL : memchr(to, '\n', end - to);
+        to = (newline == NULL) ? end : newline + 1;
+
+        slices[count] = (LexSlice){from, to, to == end, {NULL, 0, 0}, NULL, 0};
+        count++;
+        from = to;
+    }
+
+    // The first slice runs on this thread, so one-thread-per-slice never leaves it sitting idle.
+    int started = 1;
+    for (; started < count; started++) {
+        if (pthread_create(&ids[started], NULL, lex_slice, &slices[started]) != 0) {
+            break;
+        }
+    }
+    if (count > 0) {
+        lex_slice(&slices[0]);
+    }
+    for (int index = started; index < count; index++) {
+        lex_slice(&slices[index]);
+    }
+    for (int index = 1; index < started; index++) {
+        pthread_join(ids[index], NULL);
+    }
+
+    // Room for every token the workers found, plus the EOF. Re-scanned slices may still add a few more.
+    size_t total = list->count + 2;
+    for (int index = 0; index < count; index++) {
+        total += slices[index].tokens.count;
+    }
+    if (total > list->capacity) {
+        reserve_tokens(list, total);
+    }
+
+    const char* open_string = NULL;
+    int line = 1;
+
+    for (int index = 0; index < count; index++) {
+        LexSlice* slice = &slices[index];
+
+        if (open_string == NULL) {
+            Token* shifted = &list->tokens[list->count];
+            memcpy(shifted, slice->tokens.tokens, sizeof(Token) * slice->tokens.count);
+            for (size_t token = 0; token < slice->tokens.count; token++) {
+                shifted[token].line += line - 1;
+            }
+            list->count += slice->tokens.count;
+            open_string = slice->open_string;
+        } else {
+            int close_line;
+            const char* after = close_string(open_string, slice, line, list, &close_line);
+
+            if (after != NULL) {
+                open_string = scan_range(after, slice->end, close_line, !slice->last, list);
+            }
+        }
+
+        line += slice->newlines;
+        free_token_list(&slice->tokens);
+    }
+
+    if (open_string != NULL) {
+        append_token(list, (Token){TOKEN_ERROR, unterminated_message, (int)strlen(unterminated_message), line});
+    }
+    append_token(list, (Token){TOKEN_EOF, end, 0, line});
+
+    free(slices);
+    free(ids);
+}
+
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+ * Pipelined scanning. start_token_queue() spins up a thread which scans the whole source into a TokenQueue, while the
+ * compiler takes tokens back out with take_token() and gets on with parsing and emitting code at the same time.
+ * Both sides batch up their trips to the shared indices:
+ *      - The producer writes tokens into the ring as it scans, but only publishes them (a release store of head) every
+ *        TOKEN_QUEUE_BATCH tokens, and once more at the end.
+ *      - The consumer takes everything published so far in one go (an acquire load of head), then works through it
+ *        without any further synchronization. Only when it has run dry does it hand the used slots back (a release
+ *        store of tail) and look for more.
+ * When either side finds the ring full or empty it yields its core rather than spinning on it, which keeps the
+ * pipeline moving even when both threads end up sharing a single core.
+ * The queue is allocated on a cache line boundary (ALLOCATE_ALIGNED, memory.h) - malloc() only promises 16 bytes, which
+ * would leave head, tail and read sharing lines after all. Only the compiling thread allocates and frees it, so it can
+ * go through reallocate() like everything else; the scanner thread never allocates.
+ */
+static void* produce_tokens(void* argument) {
+    TokenQueue* queue = argument;
+    size_t head       = 0;
+    size_t tail       = 0;
+
+    init_scanner(queue->source);
+
+    LOOP {
+        Token token = scan_token();
+
+        while (head - tail == TOKEN_QUEUE_SIZE) {
+            atomic_store_explicit(&queue->head, head, memory_order_release);
+            tail = atomic_load_explicit(&queue->tail, memory_order_acquire);
+            if (head - tail == TOKEN_QUEUE_SIZE) {
+                sched_yield();
+            }
+        }
+
+        queue->tokens[head % TOKEN_QUEUE_SIZE] = token;
+        head++;
+
+        if (token.type == TOKEN_EOF) {
+            break;
+        }
+        if (head % TOKEN_QUEUE_BATCH == 0) {
+            atomic_store_explicit(&queue->head, head, memory_order_release);
+        }
+    }
+
+    atomic_store_explicit(&queue->head, head, memory_order_release);
+    return NULL;
+}
+
+
+TokenQueue* start_token_queue(const char* source) {
+    TokenQueue* queue = ALLOCATE_ALIGNED(TokenQueue, 1, CACHE_LINE_SIZE);
+
+    atomic_init(&queue->head, 0);
+    atomic_init(&queue->tail, 0);
+    queue->read      = 0;
+    queue->available = 0;
+    queue->source    = source;
+
+    if (pthread_create(&queue->producer, NULL, produce_tokens, queue) != 0) {
+        FREE_ALIGNED(TokenQueue, queue, 1, CACHE_LINE_SIZE);
+        return NULL;
+    }
+    return queue;
+}
+
+
+/*
+ * The next token, waiting for the scanner thread if it hasn't got that far yet. The scanner thread stops after
+ * TOKEN_EOF, which is left sitting in its slot, so from then on this keeps handing that back - just like scan_token().
+ */
+Token take_token(TokenQueue* queue) {
+    if (queue->read > 0) {
+        Token* last = &queue->tokens[(queue->read - 1) % TOKEN_QUEUE_SIZE];
+        if (last->type == TOKEN_EOF) {
+            return *last;
+        }
+    }
+
+    if (queue->read == queue->available) {
+        atomic_store_explicit(&queue->tail, queue->read, memory_order_release);
+
+        LOOP {
+            queue->available = atomic_load_explicit(&queue->head, memory_order_acquire);
+            if (queue->available != queue->read) {
+                break;
+            }
+            sched_yield();
+        }
+    }
+
+    return queue->tokens[queue->read++ % TOKEN_QUEUE_SIZE];
+}
+
+
+/*
+ * Wait for the scanner thread to finish and free the queue. The tokens point into the source rather than the queue,
+ * so any the compiler is still holding on to stay valid.
+ */
+void finish_token_queue(TokenQueue* queue) {
+    pthread_join(queue->producer, NULL);
+    FREE_ALIGNED(TokenQueue, queue, 1, CACHE_LINE_SIZE);
+}
@@ -1,6 +1,10 @@
 #ifndef cypsa_scanner_h
     #define cypsa_scanner_h
 
+    #include <pthread.h>
+    #include <stdatomic.h>
+    #include "common.h"
+
     /*
      * Tokens, special characters, and keywords that the scanner will recognize as tokens.
      * To avoid each token having a unique string representing it, all tokens in the program will point
@@ -9,13 +13,14 @@
      * need to free the original source string once at the end of program execution.
      */
     typedef enum {
-        TOKEN_LEFTPAREN, TOKEN_RIGHTPAREN, TOKEN_LEFTCURLY, TOKEN_RIGHTCURLY,
+        TOKEN_LEFTPAREN, TOKEN_RIGHTPAREN, TOKEN_LEFTCURLY, TOKEN_RIGHTCURLY, TOKEN_LEFTSQUARE, TOKEN_RIGHTSQUARE,
         TOKEN_COMMA, TOKEN_DOT, TOKEN_MINUS, TOKEN_PLUS, TOKEN_SEMICOLON, TOKEN_SLASH, TOKEN_STAR,
         TOKEN_EXCLAMATION, TOKEN_NOTEQUAL, TOKEN_EQUAL, TOKEN_EXACTEQUAL, TOKEN_GREATER, TOKEN_GREATEREQUAL,
         TOKEN_LESS, TOKEN_LESSEQUAL,
         TOKEN_IDENTIFIER, TOKEN_STRING, TOKEN_NUMBER,
         TOKEN_AND, TOKEN_CLASS, TOKEN_ELSE, TOKEN_FALSE, TOKEN_FOR, TOKEN_FUNC, TOKEN_IF, TOKEN_NIL, TOKEN_OR,
-        TOKEN_PRINT, TOKEN_RETURN, TOKEN_SUPER, TOKEN_THIS, TOKEN_TRUE, TOKEN_VAR, TOKEN_WHILE,
+        TOKEN_PARALLEL, TOKEN_PRINT, TOKEN_PURE, TOKEN_RETURN, TOKEN_SUPER, TOKEN_THIS, TOKEN_TRUE, TOKEN_VAR, TOKEN_WHILE,
+        TOKEN_YIELD,
         TOKEN_ERROR, TOKEN_EOF 
     } TokenType;
 
@@ -28,7 +33,50 @@
     } Token;
 
 
+    /*
+     * A whole source file's worth of tokens, scanned up front rather than one at a time - see scan_parallel(). Always
+     * ends with the TOKEN_EOF token. Allocated with plain malloc() rather than reallocate() (memory.c), because worker
+     * threads fill these in and must never poke the garbage collector.
+     */
+    typedef struct {
+        Token* tokens;
+        size_t count;
+        size_t capacity;
+    } TokenList;
+
+
+    /*
+     * A bounded, lock-free, single-producer/single-consumer ring of tokens, for pipelined compiles: a scanner thread
+     * pushes tokens in at head while the compiler takes them out at tail (see scanner.c). The two indices only ever
+     * grow, and each is written by just one side, so neither side ever needs a lock - only atomic loads and stores.
+     * They sit on separate cache lines so that the two threads aren't constantly stealing one line back and forth.
+     *      read / available: The consumer's own view. Tokens from read up to available are known to be published, so
+     *                        it can take those without touching the shared indices at all.
+     */
+    #define TOKEN_QUEUE_SIZE  4096
+    #define TOKEN_QUEUE_BATCH 256
+
+    typedef struct {
+        Token tokens[TOKEN_QUEUE_SIZE];
+        _Alignas(64) _Atomic size_t head;
+        _Alignas(64) _Atomic size_t tail;
+        _Alignas(64) size_t read;
+        size_t available;
+        const char* source;
+        pthread_t producer;
+    } TokenQueue;
+
+
     void init_scanner(const char* source);
+    void init_scanner_range(const char* start, const char* end, int line);
     Token scan_token();
 
+    void scan_all(const char* source, size_t length, TokenList* list);
+    void scan_parallel(const char* source, size_t length, int threads, TokenList* list);
+    void free_token_list(TokenList* list);
+
+    TokenQueue* start_token_queue(const char* source);
+    Token take_token(TokenQueue* queue);
+    void finish_token_queue(TokenQueue* queue);
+
 #endif
\ No newline at end of file
@@ -0,0 +1,564 @@
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+    #define _GNU_SOURCE
+#endif
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "compiler.h"
+#include "memory.h"
+#include "serve.h"
+#include "vm.h"
+
+#ifdef __linux__
+    #include <errno.h>
+    #include <poll.h>
+    #include <sys/socket.h>
+    #include <sys/stat.h>
+    #include <sys/un.h>
+    #include <sys/wait.h>
+    #include <unistd.h>
+#endif
+
+
+/*
+ * This worker's compiled scripts (see serve.h), which the collector needs to know about (mark_serve_roots()).
+ * first_global: globals from here on are the scripts' - the ones before came from a snapshot, and are left alone.
+ * stopping:     Set by SIGINT or SIGTERM. Those are blocked except while the process is waiting for something to happen
+ *               (ppoll() and sigsuspend() with waiting_mask), so one can't slip in between checking stopping and going
+ *               to sleep - and a script is never interrupted halfway through.
+ */
+static Script scripts[SERVE_CACHE_MAX];
+static int script_count      = 0;
+static uint64_t request_count = 0;
+static uint64_t compile_count = 0;
+static int first_global       = 0;
+static volatile sig_atomic_t stopping = 0;
+#ifdef __linux__
+    static sigset_t waiting_mask;
+#endif
+
+
+void mark_serve_roots(void) {
+    for (int index = 0; index < script_count; index++) {
+        mark_nugget(&scripts[index].nugget);
+    }
+}
+
+
+#ifdef __linux__
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+ * Frames (see serve.h). A Stream is what a FILE made by fopencookie() writes through: every write it's given goes out
+ * as one frame with its tag. Nothing comes of a write to a client that has gone away, but the script carries on
+ * regardless - SIGPIPE is ignored.
+ */
+typedef struct {
+    int socket;
+    char tag;
+} Stream;
+
+static bool write_all(int socket, const char* bytes, size_t length) {
+    while (length > 0) {
+        ssize_t written = write(socket, bytes, length);
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            return false;
+        }
+        bytes  += written;
+        length -= (size_t)written;
+    }
+    return true;
+}
+
+
+static bool send_frame(int socket, char tag, const char* bytes, uint32_t length) {
+    char header[5] = {tag, (char)(length >> 24), (char)(length >> 16), (char)(length >> 8), (char)length};
+    return write_all(socket, header, sizeof(header)) && write_all(socket, bytes, length);
+}
+
+
+static ssize_t write_stream(void* cookie, const char* bytes, size_t length) {
+    Stream* stream = (Stream*)cookie;
+    return send_frame(stream->socket, stream->tag, bytes, (uint32_t)length) ? (ssize_t)length : -1;
+}
+
+
+static void send_status(int socket, int status) {
+    char bytes[4] = {(char)(status >> 24), (char)(status >> 16), (char)(status >> 8), (char)status};
+    send_frame(socket, 'x', bytes, sizeof(bytes));
+}
+
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+ * Reading requests off a connection, through a buffer so that a line doesn't cost a read() per byte.
+ */
+typedef struct {
+    int socket;
+    char buffer[SERVE_BUFFER];
+    size_t start;
+    size_t end;
+} Reader;
+
+// Wait until socket has something to read, or the server is stopping.
+static bool wait_readable(int socket) {
+    struct pollfd ready = {socket, POLLIN, 0};
+    while (!stopping) {
+        if (ppoll(&ready, 1, NULL, &waiting_mask) > 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+
+static bool fill(Reader* reader) {
+    reader->start = 0;
+    reader->end   = 0;
+
+    ssize_t got;
+    do {
+        if (!wait_readable(reader->socket)) {
+            return false;
+        }
+        got = read(reader->socket, reader->buffer, sizeof(reader->buffer));
+    } while (got < 0 && (errno == EINTR || errno == EAGAIN));
+
+    if (got <= 0) {
+        return false;
+    }
+    reader->end = (size_t)got;
+    return true;
+}
+
+
+// A line, without its '\n'. A line too long for the buffer is an error, like the end of the connection.
+static bool read_line(Reader* reader, char line[SERVE_REQUEST_MAX]) {
+    size_t length = 0;
+
+    LOOP {
+        if (reader->start == reader->end && !fill(reader)) {
+            return false;
+        }
+        char next = reader->buffer[reader->start++];
+        if (next == '\n') {
+            line[length] = '\0';
+            return true;
+        }
+        if (length == SERVE_REQUEST_MAX - 1) {
+            return false;
+        }
+        line[length++] = next;
+    }
+}
+
+
+static bool read_exactly(Reader* reader, char* bytes, size_t length) {
+    while (length > 0) {
+        if (reader->start == reader->end && !fill(reader)) {
+            return false;
+        }
+        size_t available = reader->end - reader->start;
+        size_t taking    = (available < length) ? available : length;
+
+        memcpy(bytes, reader->buffer + reader->start, taking);
+        reader->start += taking;
+        bytes         += taking;
+        length        -= taking;
+    }
+    return true;
+}
+
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+ * The cache. find_script() looks a key up; take_script() gives back a slot to compile a new script into - an empty one
+ * if there's room, otherwise the least recently run one, emptied first. The slot is in the cache before the compile
+ * starts, so that everything the compiler puts in its nugget is safe from the collector from the outset.
+ */
+static Script* find_script(const char* key, bool eval) {
+    for (int index = 0; index < script_count; index++) {
+        if (scripts[index].eval == eval && strcmp(scripts[index].key, key) == 0) {
+            return &scripts[index];
+        }
+    }
+    return NULL;
+}
+
+
+static void empty_script(Script* script) {
+    free(script->key);
+    free_nugget(&script->nugget);
+    script->key = NULL;
+}
+
+
+static Script* take_script(void) {
+    if (script_count < SERVE_CACHE_MAX) {
+        Script* script = &scripts[script_count++];
+        init_nugget(&script->nugget);
+        return script;
+    }
+
+    Script* oldest = &scripts[0];
+    for (int index = 1; index < script_count; index++) {
+        if (scripts[index].used < oldest->used) {
+            oldest = &scripts[index];
+        }
+    }
+    empty_script(oldest);
+    return oldest;
+}
+
+
+// Drop a script which failed to compile, or whose file has changed. The last slot moves into its place.
+static void drop_script(Script* script) {
+    empty_script(script);
+    *script = scripts[--script_count];
+}
+
+
+static bool compile_script(Script* script, char* key, bool eval, const char* source) {
+    script->key  = key;
+    script->eval = eval;
+    script->nugget.encoding = vm.encoding;
+    vm.nugget = &script->nugget;
+
+    compile_count++;
+    bool compiled = compile(&script->nugget, source);
+    vm.nugget = NULL;
+
+    if (!compiled) {
+        drop_script(script);
+        return false;
+    }
+    finalize_nugget(&script->nugget);
+    return true;
+}
+
+
+/*
+ * Read the whole file, or return NULL if it can't be read.
+ */
+static char* read_source(const char* path, size_t size) {
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) {
+        return NULL;
+    }
+
+    char* source = malloc(size + 1);
+    size_t got   = (source == NULL) ? 0 : fread(source, 1, size, file);
+    fclose(file);
+
+    if (source == NULL || got != size) {
+        free(source);
+        return NULL;
+    }
+    source[size] = '\0';
+    return source;
+}
+
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+ * Requests. Each comes down to a cached script to run, or an exit status for why there isn't one; errors are printed
+ * to stderr, which by now is the client's.
+ */
+static int script_for_path(const char* path, Script** found) {
+    struct stat status;
+    if (stat(path, &status) != 0 || !S_ISREG(status.st_mode)) {
+        fprintf(stderr, "Error: Could not open file at location '%s'.\nCheck path and retry.\n", path);
+        return 74;
+    }
+
+    Script* script = find_script(path, false);
+    if (script != NULL && script->size == status.st_size && script->modified.tv_sec == status.st_mtim.tv_sec &&
+        script->modified.tv_nsec == status.st_mtim.tv_nsec) {
+        *found = script;
+        return 0;
+    }
+    if (script != NULL) {
+        drop_script(script);
+    }
+
+    char* source = read_source(path, (size_t)status.st_size);
+    if (source == NULL) {
+        fprintf(stderr, "Error: Could not read file '%s'.\n", path);
+        return 74;
+    }
+
+    script = take_script();
+    bool compiled = compile_script(script, strdup(path), false, source);
+    free(source);
+    if (!compiled) {
+        return 65;
+    }
+
+    script->modified = status.st_mtim;
+    script->size     = status.st_size;
+    *found           = script;
+    return 0;
+}
+
+
+// Takes ownership of source.
+static int script_for_source(char* source, Script** found) {
+    Script* script = find_script(source, true);
+    if (script != NULL) {
+        free(source);
+        *found = script;
+        return 0;
+    }
+
+    script = take_script();
+    if (!compile_script(script, source, true, source)) {
+        return 65;
+    }
+    *found = script;
+    return 0;
+}
+
+
+static int run_script(Script* script) {
+    script->used = ++request_count;
+
+    for (int slot = first_global; slot < vm.globals.occupied; slot++) {
+        vm.globals.values[slot] = UNDEFINED_VAL;
+    }
+    vm.code_epoch++;
+
+    InterpretationResult result = run_nugget(&script->nugget);
+    if (result == INTERPRETER_RUNTIME_ERROR) {
+        return 70;
+    }
+    return 0;
+}
+
+
+/*
+ * Serve requests on a connection until the client closes it (or sends something that can't be made sense of, or the
+ * server is stopping). stdout and stderr are the connection's while each request runs.
+ */
+static void serve_connection(int socket) {
+    Reader* reader = malloc(sizeof(Reader));
+    char line[SERVE_REQUEST_MAX];
+    reader->socket = socket;
+    reader->start  = 0;
+    reader->end    = 0;
+
+    Stream output = {socket, 'o'};
+    Stream errors = {socket, 'e'};
+    cookie_io_functions_t functions = {.read = NULL, .write = write_stream, .seek = NULL, .close = NULL};
+    FILE* client_output = fopencookie(&output, "w", functions);
+    FILE* client_errors = fopencookie(&errors, "w", functions);
+    setvbuf(client_output, NULL, _IOFBF, SERVE_BUFFER);
+    setvbuf(client_errors, NULL, _IONBF, 0);
+
+    FILE* own_output = stdout;
+    FILE* own_errors = stderr;
+
+    while (!stopping && read_line(reader, line)) {
+        Script* script = NULL;
+        int status;
+        fflush(own_output);
+        stdout = client_output;
+        stderr = client_errors;
+
+        long length;
+        char* end;
+        if (strncmp(line, "run ", 4) == 0) {
+            status = script_for_path(line + 4, &script);
+        } else if (strncmp(line, "eval ", 5) == 0 && (length = strtol(line + 5, &end, 10)) >= 0 && *end == '\0' &&
+                   length <= SERVE_SOURCE_MAX) {
+            char* source = malloc((size_t)length + 1);
+            if (source == NULL || !read_exactly(reader, source, (size_t)length)) {
+                free(source);
+                stdout = own_output;
+                stderr = own_errors;
+                break;
+            }
+            source[length] = '\0';
+            status = script_for_source(source, &script);
+        } else {
+            fprintf(stderr, "Error: Expected 'run PATH' or 'eval LENGTH' (at most %d bytes), not '%s'.\n",
+                    SERVE_SOURCE_MAX, line);
+            status = 64;
+        }
+
+        if (script != NULL) {
+            status = run_script(script);
+        }
+
+        fflush(client_output);
+        stdout = own_output;
+        stderr = own_errors;
+        send_status(socket, status);
+    }
+
+    fclose(client_output);
+    fclose(client_errors);
+    free(reader);
+    close(socket);
+}
+
+
+static void stop(int signal) {
+    (void)signal;
+    stopping = 1;
+}
+
+
+// SIGCHLD only has to wake the server from sigsuspend() - the workers are reaped afterwards.
+static void child_exited(int signal) {
+    (void)signal;
+}
+
+
+/*
+ * A worker: take connections until told to stop, then say how it got on and exit. The listening socket is non-blocking,
+ * since every idle worker wakes up for a new connection and all but one of them find it gone.
+ */
+static void run_worker(int listener, int number) {
+    signal(SIGCHLD, SIG_DFL);
+
+    uint64_t connections = 0;
+    while (wait_readable(listener)) {
+        int socket = accept4(listener, NULL, NULL, SOCK_CLOEXEC);
+        if (socket < 0) {
+            continue;
+        }
+        connections++;
+        serve_connection(socket);
+    }
+
+    printf("[serve] Worker %d: %llu connections, %llu requests, %llu compiles, %d scripts cached.\n", number,
+           (unsigned long long)connections, (unsigned long long)request_count, (unsigned long long)compile_count,
+           script_count);
+    fflush(stdout);
+    exit(EXIT_SUCCESS);
+}
+
+
+static pid_t spawn_worker(int listener, int number) {
+    fflush(stdout);
+    fflush(stderr);
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        run_worker(listener, number);
+    }
+    if (pid < 0) {
+        fprintf(stderr, "Error: Could not start a worker (%s).\n", strerror(errno));
+    }
+    return pid;
+}
+
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+ * Listen on path with a pool of workers, until interrupted (Ctrl-C or SIGTERM), which returns - so main() still gets to
+ * tidy up. A socket file already at path, left by a server that didn't get to remove it, is replaced.
+ * Whoever can connect gets to run scripts as us - reading files included - so the socket is made with mode 0600, for
+ * our user only: the umask is tightened for the bind(), so that it never exists with any wider permissions.
+ */
+void run_server(const char* path, int workers) {
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+
+    if (strlen(path) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "Error: The socket path '%s' is too long - at most %d bytes.\n", path,
+                (int)sizeof(address.sun_path) - 1);
+        exit(64);
+    }
+    strcpy(address.sun_path, path);
+
+    struct stat existing;
+    if (lstat(path, &existing) == 0 && S_ISSOCK(existing.st_mode)) {
+        unlink(path);
+    }
+
+    int listener   = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+    mode_t umasked = umask(0177);
+    int bound      = (listener < 0) ? -1 : bind(listener, (struct sockaddr*)&address, sizeof(address));
+    umask(umasked);
+
+    if (bound != 0 || listen(listener, SOMAXCONN) != 0) {
+        fprintf(stderr, "Error: Could not listen on '%s' (%s).\n", path, strerror(errno));
+        exit(74);
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    first_global = vm.globals.occupied;
+
+    sigset_t blocked;
+    sigemptyset(&blocked);
+    sigaddset(&blocked, SIGINT);
+    sigaddset(&blocked, SIGTERM);
+    sigaddset(&blocked, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &blocked, &waiting_mask);
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = stop;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    action.sa_handler = child_exited;
+    sigaction(SIGCHLD, &action, NULL);
+
+    pid_t* pids = malloc(sizeof(pid_t) * workers);
+    check_failure(pids, "Unable to allocate the server's worker list.", sizeof(pid_t) * workers);
+
+    printf("[serve] Listening on %s with %d workers - Ctrl-C to stop.\n", path, workers);
+    for (int worker = 0; worker < workers; worker++) {
+        pids[worker] = spawn_worker(listener, worker);
+    }
+
+    while (!stopping) {
+        sigsuspend(&waiting_mask);
+
+        int status;
+        pid_t pid;
+        while (!stopping && (pid = waitpid(-1, &status, WNOHANG)) > 0) {
+            for (int worker = 0; worker < workers; worker++) {
+                if (pids[worker] == pid) {
+                    fprintf(stderr, "[serve] Worker %d %s %d - starting another.\n", worker,
+                            WIFSIGNALED(status) ? "was killed by signal" : "exited with",
+                            WIFSIGNALED(status) ? WTERMSIG(status) : WEXITSTATUS(status));
+                    pids[worker] = spawn_worker(listener, worker);
+                }
+            }
+        }
+    }
+
+    for (int worker = 0; worker < workers; worker++) {
+        if (pids[worker] > 0) {
+            kill(pids[worker], SIGTERM);
+        }
+    }
+    for (int worker = 0; worker < workers; worker++) {
+        if (pids[worker] > 0) {
+            waitpid(pids[worker], NULL, 0);
+        }
+    }
+
+    free(pids);
+    close(listener);
+    unlink(path);
+    signal(SIGINT, SIG_DFL);
+    signal(SIGTERM, SIG_DFL);
+    signal(SIGCHLD, SIG_DFL);
+    sigprocmask(SIG_SETMASK, &waiting_mask, NULL);
+    printf("[serve] Stopped.\n");
+}
+
+#else
+
+void run_server(const char* path, int workers) {
+    (void)path;
+    (void)workers;
+    fprintf(stderr, "Error: --serve needs fopencookie(), so it's only supported on Linux.\n");
+    exit(64);
+}
+
+#endif
@@ -0,0 +1,65 @@
+#ifndef cypsa_serve_h
+    #define cypsa_serve_h
+
+    #include <stdint.h>
+    #include <time.h>
+    #include "common.h"
+    #include "nugget.h"
+
+    /* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+     * --serve: a resident server which runs scripts sent to it over a Unix-domain socket, so that running a short script
+     * doesn't cost a process, init_VM() and a cold compile every time (Linux and other POSIX systems only).
+     *
+     * The server is a pool of worker processes, forked once at start-up from a VM that's already warm - anything loaded
+     * with --load-snapshot is in every worker from the beginning, shared copy-on-write. The workers all wait in accept()
+     * on the one listening socket and the kernel hands each connection to one of them, which serves it to the end. A
+     * worker that dies (a crash in a script, say) is replaced; Ctrl-C or SIGTERM stops them all and removes the socket.
+     * Processes rather than threads, because print writes to stdout and there's only one of those per process: a worker
+     * points stdout and stderr at the connection for as long as a request runs (fopencookie()), so everything the VM
+     * prints, errors included, goes back to the client without the VM knowing.
+     * A script sent to the server runs as the server's user, and can read whatever files that user can (map_column(),
+     * say), so the socket is only for that user: it's created with mode 0600.
+     *
+     * Each worker keeps the scripts it has compiled - up to SERVE_CACHE_MAX of them, least recently run pushed out first
+     * - and runs them again without compiling anything: a path is looked up by name, and recompiled if the file's
+     * modification time or size has changed; source sent in the request is looked up by its text. Function bodies that
+     * were compiled lazily on an earlier run (compiler.c) stay compiled, and quickened instructions stay quickened.
+     * The cache can't be shared between workers, since compiled code lives in its VM's heap and its global slots are that
+     * VM's (vm.h); with few scripts on the go, each worker soon has them all. Every run starts from a clean slate of globals,
+     * as under --watch (watch.h): whatever the last request defined is set back to undefined, and code_epoch moves on.
+     *
+     * The protocol. A connection carries any number of requests, one after another, each a line of text:
+     *      run PATH\n          Run the script at PATH. A relative path is relative to the server's working directory.
+     *      eval LENGTH\n       Run the LENGTH bytes of source which follow the line.
+     * The response to each is a sequence of frames, each a one-byte tag, a 32-bit big-endian length and that many bytes:
+     *      'o':    Output - what the script printed. Buffered like a pipe is, SERVE_BUFFER bytes at a time.
+     *      'e':    Errors, unbuffered.
+     *      'x':    The end of the response. Its four bytes are the exit status, big-endian: what running the script with
+     *              cypsa from the command line would have exited with (0, or 65 for a compile error, 70 for a runtime
+     *              error, 74 if the file couldn't be read), or 64 for a request the server didn't understand.
+     *
+     * struct Script:
+     *      key:            The path, or for eval the source itself.
+     *      eval:           Which of the two key is.
+     *      modified, size: For a path, the file's as of when it was compiled.
+     *      used:           When it was last run, counted in requests, for picking which script to push out.
+     *      nugget:         The compiled top-level code.
+     */
+    #define SERVE_CACHE_MAX     64
+    #define SERVE_BUFFER        8192
+    #define SERVE_REQUEST_MAX   4096
+    #define SERVE_SOURCE_MAX    (64 << 20)
+
+    typedef struct {
+        char* key;
+        bool eval;
+        struct timespec modified;
+        int64_t size;
+        uint64_t used;
+        Nugget nugget;
+    } Script;
+
+    void run_server(const char* path, int workers);
+    void mark_serve_roots(void);
+
+#endif
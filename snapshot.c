@@ -0,0 +1,490 @@
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "array.h"
+#include "memory.h"
+#include "object.h"
+#include "snapshot.h"
+#include "vm.h"
+
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+ * The image layout. Everything is 8-byte aligned, in native byte order - an image is a cache for one build of cypsa on
+ * one machine, not an interchange format, so the header records enough to reject an image from anywhere else.
+ *
+ *      SnapshotHeader
+ *      SnapshotObject[object_count]   Each one followed directly by its payload, padded to a multiple of 8 bytes:
+ *                                     a string's characters, an array's doubles, or a function's SnapshotFunction
+ *                                     and then its source text.
+ *      SnapshotValue[global_count]    Global slot n is entry n.
+ *
+ * Objects refer to each other, and globals refer to objects, by index into the object list - never by address - which is
+ * what makes the image relocatable. Sharing survives the round trip: two globals holding the same array still hold the
+ * same array after loading. (Strings are interned all over again as they're loaded, so they're shared regardless.)
+ *
+ * Compiled nuggets aren't written out. Top-level code is finished with once it has run, so after the prelude nothing
+ * refers to its nugget any more; anything that outlives it is a global and gets saved as one. Functions are saved as
+ * the source text they were declared with, compiled or not, and come back uncompiled - they're compiled on their first
+ * call, like any other function (compiler.c) - except for whether it was declared 'pure', which its flags keep, since
+ * that comes before the text (memo.h). A function's name is always numbered before the function itself, so it
+ * has been rebuilt by the time the function is.
+ *
+ * Generators and iterators aren't saved either: they're a computation caught halfway, whose state is only meaningful in
+ * the run that made it. A global holding one comes back as nil. Classes, instances and bound methods can't be saved
+ * yet - a class's methods are compiled with the class around them, and an instance's fields are laid out by shapes
+ * which only its class knows about (object.h), so there's no text to save them as - and nor can they be left out, since
+ * code that calls a class which has turned into nil fails far from the cause. A global holding one stops the snapshot
+ * from being written at all, with an error naming it.
+ */
+#define SNAPSHOT_MAGIC   "CYPSNAP"
+#define SNAPSHOT_VERSION 2
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t value_size;
+    uint32_t object_count;
+    uint32_t global_count;
+    uint64_t size;
+} SnapshotHeader;
+
+typedef struct {
+    uint32_t type;
+    uint32_t reserved;
+    uint64_t length;
+} SnapshotObject;
+
+#define SNAPSHOT_FUNCTION_PURE 1
+
+typedef struct {
+    uint32_t name;
+    uint32_t arity;
+    uint32_t line;
+    uint32_t flags;
+} SnapshotFunction;
+
+typedef struct {
+    uint32_t name;
+    uint32_t type;
+    union {
+        double number;
+        uint64_t bits;
+    } as;
+} SnapshotValue;
+
+#define PADDED(size) (((size) + 7) & ~(size_t)7)
+
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+ * Saving. Objects are numbered in the order they're first seen, using a small open-addressing map from object address
+ * to index (ObjectIndex) so that an object reachable from several globals is written once.
+ */
+typedef struct {
+    Obj** objects;
+    uint32_t* indices;
+    Obj** order;
+    uint32_t count;
+    uint32_t capacity;
+} ObjectIndex;
+
+
+static uint32_t hash_pointer(Obj* object, uint32_t capacity) {
+    uint64_t bits = (uint64_t)(uintptr_t)object;
+    bits ^= bits >> 33;
+    bits *= 0xff51afd7ed558ccdULL;
+    bits ^= bits >> 33;
+    return (uint32_t)bits & (capacity - 1);
+}
+
+
+static void grow_object_index(ObjectIndex* index) {
+    uint32_t capacity = (index->capacity == 0) ? 64 : index->capacity * 2;
+    Obj** objects     = calloc(capacity, sizeof(Obj*));
+    uint32_t* indices = malloc(sizeof(uint32_t) * capacity);
+    Obj** order       = realloc(index->order, sizeof(Obj*) * capacity);
+    check_failure(objects, "Unable to allocate snapshot object index.", sizeof(Obj*) * capacity);
+    check_failure(indices, "Unable to allocate snapshot object index.", sizeof(uint32_t) * capacity);
+    check_failure(order, "Unable to allocate snapshot object index.", sizeof(Obj*) * capacity);
+
+    for (uint32_t slot = 0; slot < index->capacity; slot++) {
+        if (index->objects[slot] == NULL) {
+            continue;
+        }
+        uint32_t moved = hash_pointer(index->objects[slot], capacity);
+        while (objects[moved] != NULL) {
+            moved = (moved + 1) & (capacity - 1);
+        }
+        objects[moved] = index->objects[slot];
+        indices[moved] = index->indices[slot];
+    }
+
+    free(index->objects);
+    free(index->indices);
+    index->objects  = objects;
+    index->indices  = indices;
+    index->order    = order;
+    index->capacity = capacity;
+}
+
+
+static uint32_t object_number(ObjectIndex* index, Obj* object) {
+    if ((index->count + 1) * 2 > index->capacity) {
+        grow_object_index(index);
+    }
+
+    uint32_t slot = hash_pointer(object, index->capacity);
+    while (index->objects[slot] != NULL) {
+        if (index->objects[slot] == object) {
+            return index->indices[slot];
+        }
+        slot = (slot + 1) & (index->capacity - 1);
+    }
+
+    index->objects[slot] = object;
+    index->indices[slot] = index->count;
+    index->order[index->count] = object;
+    return index->count++;
+}
+
+
+static void free_object_index(ObjectIndex* index) {
+    free(index->objects);
+    free(index->indices);
+    free(index->order);
+}
+
+
+static SnapshotValue snapshot_value(ObjectIndex* index, Value value) {
+    SnapshotValue saved;
+    saved.name    = 0;
+    saved.type    = (uint32_t)value.type;
+    saved.as.bits = 0;
+
+    switch (value.type) {
+        case VALUE_BOOL:
+            saved.as.bits = AS_BOOL(value);
+            break;
+        case VALUE_NUMBER:
+            saved.as.number = AS_NUMBER(value);
+            break;
+        case VALUE_OBJ:
+            if (IS_GENERATOR(value) || IS_ITERATOR(value)) {
+                saved.type = VALUE_NIL;
+                break;
+            }
+            if (IS_FUNCTION(value)) {
+                object_number(index, (Obj*)AS_FUNCTION(value)->name);
+            }
+            saved.as.bits = object_number(index, AS_OBJ(value));
+            break;
+        default:
+            break;
+    }
+    return saved;
+}
+
+
+static size_t payload_size(Obj* object) {
+    switch (object->type) {
+        case OBJECT_STRING:
+            return (size_t)((ObjString*)object)->length;
+        case OBJECT_ARRAY:
+            return sizeof(double) * ((ObjArray*)object)->count;
+        case OBJECT_FUNCTION:
+            return sizeof(SnapshotFunction) + (size_t)((ObjFunction*)object)->source_length;
+        case OBJECT_GENERATOR:
+        case OBJECT_ITERATOR:
+        case OBJECT_SHAPE:
+        case OBJECT_CLASS:
+        case OBJECT_INSTANCE:
+        case OBJECT_BOUND_METHOD:
+            break;
+    }
+    return 0;
+}
+
+
+static bool write_all(FILE* file, const void* data, size_t size) {
+    static const char padding[8] = {0};
+    size_t padded = PADDED(size);
+
+    return fwrite(data, 1, size, file) == size &&
+           fwrite(padding, 1, padded - size, file) == padded - size;
+}
+
+
+/*
+ * An array's elements, which for a mapped column (column.h) means gathering them up a block at a time - it comes back
+ * from the image as an ordinary array, with its own copy of the elements.
+ */
+static bool write_array(FILE* file, ObjArray* array) {
+    if (array->stride == 1) {
+        return write_all(file, array->values, sizeof(double) * array->count);
+    }
+
+    double block[ARRAY_BLOCK];
+    for (size_t start = 0; start < array->count; start += ARRAY_BLOCK) {
+        size_t length = (array->count - start < ARRAY_BLOCK) ? array->count - start : ARRAY_BLOCK;
+        array_gather(array->values + start * array->stride, array->stride, block, length);
+        if (!write_all(file, block, sizeof(double) * length)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+bool save_snapshot(const char* path) {
+    ObjectIndex index = {NULL, NULL, NULL, 0, 0};
+    int global_count  = vm.globals.occupied;
+
+    for (int slot = 0; slot < global_count; slot++) {
+        Value value = vm.globals.values[slot];
+        if (IS_CLASS(value) || IS_INSTANCE(value) || IS_BOUND_METHOD(value)) {
+            fprintf(stderr, "Error: Could not create snapshot '%s' - global '%s' holds a%s, which can't be saved yet.\n",
+                    path, AS_STRING(vm.global_names.values[slot])->chars,
+                    IS_CLASS(value) ? " class" : (IS_INSTANCE(value) ? "n instance" : " bound method"));
+            return false;
+        }
+    }
+
+    SnapshotValue* globals = malloc(sizeof(SnapshotValue) * (global_count + 1));
+    check_failure(globals, "Unable to allocate snapshot globals.", sizeof(SnapshotValue) * (global_count + 1));
+
+    // Number every object first - the header needs the count, and objects have to be written before the globals.
+    for (int slot = 0; slot < global_count; slot++) {
+        globals[slot]      = snapshot_value(&index, vm.globals.values[slot]);
+        globals[slot].name = object_number(&index, AS_OBJ(vm.global_names.values[slot]));
+    }
+
+    FILE* file = fopen(path, "wb");
+    if (file == NULL) {
+        fprintf(stderr, "Error: Could not create snapshot '%s'.\n", path);
+        free(globals);
+        free_object_index(&index);
+        return false;
+    }
+
+    SnapshotHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+    header.version      = SNAPSHOT_VERSION;
+    header.value_size   = sizeof(Value);
+    header.object_count = index.count;
+    header.global_count = (uint32_t)global_count;
+    header.size         = sizeof(SnapshotHeader) + sizeof(SnapshotValue) * (size_t)global_count;
+
+    for (uint32_t number = 0; number < index.count; number++) {
+        header.size += sizeof(SnapshotObject) + PADDED(payload_size(index.order[number]));
+    }
+
+    bool written = write_all(file, &header, sizeof(header));
+
+    for (uint32_t number = 0; written && number < index.count; number++) {
+        Obj* object = index.order[number];
+        SnapshotObject saved = {(uint32_t)object->type, 0, 0};
+
+        if (object->type == OBJECT_STRING) {
+            ObjString* string = (ObjString*)object;
+            saved.length = (uint64_t)string->length;
+            written = write_all(file, &saved, sizeof(saved)) && write_all(file, string->chars, string->length);
+        } else if (object->type == OBJECT_FUNCTION) {
+            // Written in one piece, so that the padding only comes after the source text
+            ObjFunction* function = (ObjFunction*)object;
+            size_t size           = payload_size(object);
+            uint8_t* payload      = malloc(size);
+            check_failure(payload, "Unable to allocate snapshot function.", size);
+
+            SnapshotFunction header = {object_number(&index, (Obj*)function->name), (uint32_t)function->arity,
+                                       (uint32_t)function->line,
+                                       function->declared_pure ? SNAPSHOT_FUNCTION_PURE : 0};
+            memcpy(payload, &header, sizeof(header));
+            memcpy(payload + sizeof(header), function->source, function->source_length);
+
+            saved.length = (uint64_t)function->source_length;
+            written = write_all(file, &saved, sizeof(saved)) && write_all(file, payload, size);
+            free(payload);
+        } else {
+            ObjArray* array = (ObjArray*)object;
+            saved.length = array->count;
+            written = write_all(file, &saved, sizeof(saved)) && write_array(file, array);
+        }
+    }
+
+    written = written && write_all(file, globals, sizeof(SnapshotValue) * global_count);
+    written = (fclose(file) == 0) && written;
+
+    if (!written) {
+        fprintf(stderr, "Error: Could not write snapshot '%s'.\n", path);
+        remove(path);
+    }
+
+    free(globals);
+    free_object_index(&index);
+    return written;
+}
+
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+ * Loading. The image is mmap()ed rather than read, so the kernel pages it in straight from the page cache, and every
+ * offset and index in it is checked against the mapping before being followed - a truncated or corrupt image is
+ * rejected rather than trusted. The collector is paused while the objects are rebuilt, since none of them are
+ * reachable from a root until the globals are filled in at the very end.
+ */
+static bool restore_value(SnapshotValue* saved, Obj** objects, uint32_t object_count, Value* value) {
+    switch (saved->type) {
+        case VALUE_NIL:
+            *value = NIL_VAL;
+            return true;
+        case VALUE_BOOL:
+            *value = BOOL_VAL(saved->as.bits != 0);
+            return true;
+        case VALUE_NUMBER:
+            *value = NUMBER_VAL(saved->as.number);
+            return true;
+        case VALUE_UNDEFINED:
+            *value = UNDEFINED_VAL;
+            return true;
+        case VALUE_OBJ:
+            if (saved->as.bits >= object_count) {
+                return false;
+            }
+            *value = OBJ_VAL(objects[saved->as.bits]);
+            return true;
+        default:
+            return false;
+    }
+}
+
+
+static bool restore_snapshot(const uint8_t* image, size_t size) {
+    const SnapshotHeader* header = (const SnapshotHeader*)image;
+
+    if (size < sizeof(SnapshotHeader) || memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) != 0 ||
+        header->version != SNAPSHOT_VERSION || header->value_size != sizeof(Value) || header->size != size) {
+        return false;
+    }
+
+    Obj** objects = malloc(sizeof(Obj*) * (header->object_count + 1));
+    check_failure(objects, "Unable to allocate snapshot objects.", sizeof(Obj*) * (header->object_count + 1));
+
+    size_t offset = sizeof(SnapshotHeader);
+    bool valid    = true;
+
+    for (uint32_t number = 0; number < header->object_count; number++) {
+        if (size - offset < sizeof(SnapshotObject)) {
+            valid = false;
+            break;
+        }
+
+        const SnapshotObject* saved = (const SnapshotObject*)(image + offset);
+        offset += sizeof(SnapshotObject);
+
+        if ((saved->type != OBJECT_STRING && saved->type != OBJECT_ARRAY && saved->type != OBJECT_FUNCTION) ||
+            saved->length > size - offset || (saved->type != OBJECT_ARRAY && saved->length > INT32_MAX)) {
+            valid = false;
+            break;
+        }
+
+        size_t payload = (saved->type == OBJECT_ARRAY)    ? sizeof(double) * saved->length :
+                         (saved->type == OBJECT_FUNCTION) ? sizeof(SnapshotFunction) + saved->length : saved->length;
+        if (PADDED(payload) > size - offset) {
+            valid = false;
+            break;
+        }
+
+        if (saved->type == OBJECT_STRING) {
+            objects[number] = (Obj*)intern_string((const char*)(image + offset), (int)saved->length);
+        } else if (saved->type == OBJECT_FUNCTION) {
+            SnapshotFunction header;
+            memcpy(&header, image + offset, sizeof(header));
+
+            if (header.name >= number || objects[header.name]->type != OBJECT_STRING || header.arity > UINT8_MAX) {
+                valid = false;
+                break;
+            }
+
+            ObjFunction* function   = new_function();
+            function->name          = (ObjString*)objects[header.name];
+            function->arity         = (int)header.arity;
+            function->declared_pure = (header.flags & SNAPSHOT_FUNCTION_PURE) != 0;
+            set_function_source(function, (const char*)(image + offset + sizeof(header)), (int)saved->length,
+                                (int)header.line);
+            objects[number] = (Obj*)function;
+        } else {
+            ObjArray* array = new_array(saved->length);
+            memcpy(array->values, image + offset, payload);
+            objects[number] = (Obj*)array;
+        }
+        offset += PADDED(payload);
+    }
+
+    valid = valid && (size - offset) / sizeof(SnapshotValue) >= header->global_count;
+
+    if (valid) {
+        const SnapshotValue* saved = (const SnapshotValue*)(image + offset);
+        for (uint32_t slot = 0; valid && slot < header->global_count; slot++) {
+            SnapshotValue entry = saved[slot];
+            Value value;
+            valid = entry.name < header->object_count && objects[entry.name]->type == OBJECT_STRING &&
+                    restore_value(&entry, objects, header->object_count, &value);
+        }
+    }
+
+    // Only touch the globals once the whole image has checked out, so that a bad one leaves the VM untouched.
+    if (valid) {
+        const SnapshotValue* saved = (const SnapshotValue*)(image + offset);
+        for (uint32_t slot = 0; slot < header->global_count; slot++) {
+            SnapshotValue entry = saved[slot];
+            ObjString* name     = (ObjString*)objects[entry.name];
+            Value existing;
+            Value value;
+
+            restore_value(&entry, objects, header->object_count, &value);
+
+            int global = table_get(&vm.global_slots, name, &existing) ? (int)AS_NUMBER(existing) : add_global(name);
+            vm.globals.values[global] = value;
+        }
+    }
+
+    free(objects);
+    return valid;
+}
+
+
+bool load_snapshot(const char* path) {
+    int descriptor = open(path, O_RDONLY);
+    struct stat status;
+
+    if (descriptor < 0 || fstat(descriptor, &status) != 0 || status.st_size == 0) {
+        fprintf(stderr, "Error: Could not open snapshot '%s'.\n", path);
+        if (descriptor >= 0) {
+            close(descriptor);
+        }
+        return false;
+    }
+
+    size_t size = (size_t)status.st_size;
+    void* image = mmap(NULL, size, PROT_READ, MAP_PRIVATE, descriptor, 0);
+    close(descriptor);
+
+    if (image == MAP_FAILED) {
+        fprintf(stderr, "Error: Could not map snapshot '%s'.\n", path);
+        return false;
+    }
+    madvise(image, size, MADV_SEQUENTIAL);
+
+    vm.gc.paused++;
+    bool loaded = restore_snapshot(image, size);
+    vm.gc.paused--;
+
+    munmap(image, size);
+
+    if (!loaded) {
+        fprintf(stderr, "Error: '%s' is not a valid snapshot for this build of cypsa.\n", path);
+    }
+    return loaded;
+}
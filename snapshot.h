@@ -0,0 +1,20 @@
+#ifndef cypsa_snapshot_h
+    #define cypsa_snapshot_h
+
+    #include "common.h"
+
+    /* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+     * Snapshots of an initialized interpreter. After a prelude script has run, save_snapshot() writes out every global
+     * - its name, its value, and every heap object reachable from it - to a binary image. A later run calls
+     * load_snapshot() on that image instead of compiling and running the prelude all over again, and starts out with
+     * exactly the same globals, slot for slot. Classes, instances and bound methods can't be saved yet, so a global
+     * holding one makes save_snapshot() fail without writing anything.
+     *
+     * The image holds no pointers, only offsets and indices, so it can be mapped in at any address (see snapshot.c for
+     * the layout). Both functions print what went wrong to stderr and return false if they fail; a failed load leaves
+     * the globals as they were.
+     */
+    bool save_snapshot(const char* path);
+    bool load_snapshot(const char* path);
+
+#endif
@@ -0,0 +1,303 @@
+#include <stdio.h>
+#include <string.h>
+#include "memory.h"
+#include "object.h"
+#include "table.h"
+#include "values.h"
+
+#if defined(__SSE2__) || defined(_M_X64)
+    #include <emmintrin.h>
+    #define TABLE_USE_SSE2
+#endif
+
+#define CONTROL_EMPTY   0x80
+#define CONTROL_DELETED 0xFE
+#define TABLE_MAX_LOAD  0.75
+
+#define CONTROL_HASH(hash) ((uint8_t)((hash) >> 25))
+
+
+void init_table(Table* table) {
+    table->count      = 0;
+    table->tombstones = 0;
+    table->capacity   = 0;
+    table->control    = NULL;
+    table->entries    = NULL;
+    table->lookups    = 0;
+    table->hits       = 0;
+    table->probes     = 0;
+}
+
+
+void free_table(Table* table) {
+    FREE_ARRAY(uint8_t, table->control, table->capacity);
+    FREE_ARRAY(Entry, table->entries, table->capacity);
+    init_table(table);
+}
+
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+ * Compare all 16 control bytes of a group against byte, and return a bitmask with bit i set if control byte i matched.
+ * With SSE2 this is one load, one compare, and one movemask. Without it, the plain loop does the same job.
+ */
+static inline uint32_t match_group(const uint8_t* group, uint8_t byte) {
+    #ifdef TABLE_USE_SSE2
+        __m128i control = _mm_loadu_si128((const __m128i*)group);
+        return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(control, _mm_set1_epi8((char)byte)));
+    #else
+        uint32_t mask = 0;
+        for (int index = 0; index < TABLE_GROUP_WIDTH; index++) {
+            mask |= (uint32_t)(group[index] == byte) << index;
+        }
+        return mask;
+    #endif
+}
+
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+ * Bitmask of the slots in a group which are free to be written to (empty or deleted). Both of those control bytes have
+ * their top bit set and full slots never do, so with SSE2 the top bits are exactly the movemask.
+ */
+static inline uint32_t match_free(const uint8_t* group) {
+    #ifdef TABLE_USE_SSE2
+        return (uint32_t)_mm_movemask_epi8(_mm_loadu_si128((const __m128i*)group));
+    #else
+        uint32_t mask = 0;
+        for (int index = 0; index < TABLE_GROUP_WIDTH; index++) {
+            mask |= (uint32_t)(group[index] >> 7) << index;
+        }
+        return mask;
+    #endif
+}
+
+
+static inline int lowest_bit(uint32_t mask) {
+    return __builtin_ctz(mask);
+}
+
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+ * Probing. The low bits of the hash choose the first group and the top 7 bits are what gets stored in the control bytes,
+ * so the two don't tell us the same thing. If the key isn't in a group and the group has at least one never-used slot,
+ * the key can't be anywhere further along either. Otherwise move on to the next group, stepping 1, 2, 3, ... groups at
+ * a time - with a power-of-two number of groups that visits every group exactly once before wrapping.
+ * The load factor guarantees there is always an empty slot somewhere, so the loop always ends.
+ * find_slot() is the pointer-keyed version used by get / set / delete: key is interned, so comparing pointers is enough.
+ */
+static int find_slot(Table* table, ObjString* key) {
+    int group_mask = (table->capacity / TABLE_GROUP_WIDTH) - 1;
+    int group      = (int)(key->hash & group_mask);
+    uint8_t wanted = CONTROL_HASH(key->hash);
+
+    for (int step = 1; ; step++) {
+        const uint8_t* control = &table->control[group * TABLE_GROUP_WIDTH];
+        table->probes++;
+
+        for (uint32_t mask = match_group(control, wanted); mask != 0; mask &= mask - 1) {
+            int slot = group * TABLE_GROUP_WIDTH + lowest_bit(mask);
+            if (table->entries[slot].key == key) {
+                return slot;
+            }
+        }
+
+        if (match_group(control, CONTROL_EMPTY) != 0) {
+            return -1;
+        }
+
+        group = (group + step) & group_mask;
+    }
+}
+
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+ * First slot along key's probe sequence which can be written to, reusing a tombstone if one comes first.
+ */
+static int find_free_slot(Table* table, uint32_t hash) {
+    int group_mask = (table->capacity / TABLE_GROUP_WIDTH) - 1;
+    int group      = (int)(hash & group_mask);
+
+    for (int step = 1; ; step++) {
+        uint32_t mask = match_free(&table->control[group * TABLE_GROUP_WIDTH]);
+        if (mask != 0) {
+            return group * TABLE_GROUP_WIDTH + lowest_bit(mask);
+        }
+        group = (group + step) & group_mask;
+    }
+}
+
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+ * Resize to capacity slots and re-insert everything. Tombstones are dropped along the way. Capacity starts at one group
+ * and doubles, like GROW_CAPACITY, so the number of groups is always a power of two.
+ */
+static void adjust_capacity(Table* table, int capacity) {
+    uint8_t* control = GROW_ARRAY(uint8_t, NULL, 0, capacity);
+    Entry* entries   = GROW_ARRAY(Entry, NULL, 0, capacity);
+    memset(control, CONTROL_EMPTY, capacity);
+
+    uint8_t* old_control = table->control;
+    Entry* old_entries   = table->entries;
+    int old_capacity     = table->capacity;
+
+    table->control    = control;
+    table->entries    = entries;
+    table->capacity   = capacity;
+    table->count      = 0;
+    table->tombstones = 0;
+
+    for (int index = 0; index < old_capacity; index++) {
+        if (old_control[index] & 0x80) {
+            continue;
+        }
+
+        ObjString* key = old_entries[index].key;
+        int slot       = find_free_slot(table, key->hash);
+        control[slot]  = CONTROL_HASH(key->hash);
+        entries[slot]  = old_entries[index];
+        table->count++;
+    }
+
+    FREE_ARRAY(uint8_t, old_control, old_capacity);
+    FREE_ARRAY(Entry, old_entries, old_capacity);
+}
+
+
+bool table_get(Table* table, ObjString* key, Value* value) {
+    table->lookups++;
+
+    if (table->count == 0) {
+        return false;
+    }
+
+    int slot = find_slot(table, key);
+    if (slot < 0) {
+        return false;
+    }
+
+    table->hits++;
+    *value = table->entries[slot].value;
+    return true;
+}
+
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+ * Insert or overwrite. Returns true if key wasn't in the table before.
+ */
+bool table_set(Table* table, ObjString* key, Value value) {
+    if (table->count + table->tombstones + 1 > table->capacity * TABLE_MAX_LOAD) {
+        int capacity = (table->capacity < TABLE_GROUP_WIDTH) ? TABLE_GROUP_WIDTH : table->capacity * 2;
+        adjust_capacity(table, capacity);
+    }
+
+    int slot = find_slot(table, key);
+    if (slot >= 0) {
+        table->entries[slot].value = value;
+        return false;
+    }
+
+    slot = find_free_slot(table, key->hash);
+    if (table->control[slot] == CONTROL_DELETED) {
+        table->tombstones--;
+    }
+
+    table->control[slot]       = CONTROL_HASH(key->hash);
+    table->entries[slot].key   = key;
+    table->entries[slot].value = value;
+    table->count++;
+    return true;
+}
+
+
+bool table_delete(Table* table, ObjString* key) {
+    if (table->count == 0) {
+        return false;
+    }
+
+    int slot = find_slot(table, key);
+    if (slot < 0) {
+        return false;
+    }
+
+    table->control[slot]     = CONTROL_DELETED;
+    table->entries[slot].key = NULL;
+    table->count--;
+    table->tombstones++;
+    return true;
+}
+
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+ * The one place where strings get compared by their characters: looking for an existing interned string before a new
+ * one is made (intern_string(), object.c). chars is whatever slice the caller has - it doesn't need to be an ObjString
+ * or NUL-terminated. The control byte and then the cached hash and length filter out nearly every candidate, so
+ * memcmp() is only reached for what is almost certainly the right string.
+ */
+ObjString* table_find_string(Table* table, const char* chars, int length, uint32_t hash) {
+    table->lookups++;
+
+    if (table->count == 0) {
+        return NULL;
+    }
+
+    int group_mask = (table->capacity / TABLE_GROUP_WIDTH) - 1;
+    int group      = (int)(hash & group_mask);
+    uint8_t wanted = CONTROL_HASH(hash);
+
+    for (int step = 1; ; step++) {
+        const uint8_t* control = &table->control[group * TABLE_GROUP_WIDTH];
+        table->probes++;
+
+        for (uint32_t mask = match_group(control, wanted); mask != 0; mask &= mask - 1) {
+            ObjString* key = table->entries[group * TABLE_GROUP_WIDTH + lowest_bit(mask)].key;
+            if (key->hash == hash && key->length == length && memcmp(key->chars, chars, length) == 0) {
+                table->hits++;
+                return key;
+            }
+        }
+
+        if (match_group(control, CONTROL_EMPTY) != 0) {
+            return NULL;
+        }
+
+        group = (group + step) & group_mask;
+    }
+}
+
+
+/*
+ * Mark every key and value in a table which belongs to an object (a class's methods, object.h), for the collector.
+ */
+void mark_table(Table* table) {
+    for (int index = table_next(table, -1); index != -1; index = table_next(table, index)) {
+        mark_object((Obj*)table->entries[index].key);
+        mark_value(table->entries[index].value);
+    }
+}
+
+
+/*
+ * Walk a table's entries: the index of the first full slot after index (-1 to start from the beginning), or -1 once
+ * there are no more. Full slots are the ones whose control byte has its top bit clear.
+ */
+int table_next(Table* table, int index) {
+    for (index++; index < table->capacity; index++) {
+        if (!(table->control[index] & 0x80)) {
+            return index;
+        }
+    }
+    return -1;
+}
+
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+ * Summary of how a table has been used: how full it is, how many lookups found what they were after, and how many
+ * groups an average lookup had to look at (1.00 is perfect).
+ */
+void print_table_stats(Table* table, const char* name) {
+    double hit_rate  = (table->lookups == 0) ? 0.0 : (100.0 * table->hits) / table->lookups;
+    double per_probe = (table->lookups == 0) ? 0.0 : (double)table->probes / table->lookups;
+    double load      = (table->capacity == 0) ? 0.0 : (100.0 * table->count) / table->capacity;
+
+    printf("[%s] %d entries / %d slots (%.1f%% full), %zu lookups, %.1f%% hits, %.2f groups probed per lookup\n",
+           name, table->count, table->capacity, load, table->lookups, hit_rate, per_probe);
+}
@@ -0,0 +1,51 @@
+#ifndef cypsa_table_h
+    #define cypsa_table_h
+
+    #include "common.h"
+    #include "values.h"
+
+    /* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+     * A hash table from interned strings to Values, using open addressing. Alongside the entries array there is a
+     * parallel array of one control byte per slot:
+     *      CONTROL_EMPTY    (0x80):  Never used. A probe that finds one of these can stop - the key isn't here.
+     *      CONTROL_DELETED  (0xFE):  Used to be full (a tombstone). Probes have to carry on past it.
+     *      0x00 - 0x7F:              Full. The byte holds the top 7 bits of the key's hash.
+     * Slots are grouped into runs of TABLE_GROUP_WIDTH (16). A lookup hashes to a group, compares all 16 control bytes
+     * in that group against the wanted 7 bits at once (one SSE2 compare where available, see table.c), and only looks at
+     * the entries whose control byte matched. It almost never has to touch an entry that isn't the one it wants, and
+     * never has to chase down the table a slot at a time.
+     * 
+     * int count:       Number of full slots.
+     * int tombstones:  Number of deleted slots (they still count towards the load factor).
+     * int capacity:    Number of slots, always a multiple of TABLE_GROUP_WIDTH.
+     * lookups / hits / probes: running totals for how the table is being used - see print_table_stats().
+     */
+    #define TABLE_GROUP_WIDTH 16
+
+    typedef struct {
+        ObjString* key;
+        Value value;
+    } Entry;
+
+    typedef struct {
+        int count;
+        int tombstones;
+        int capacity;
+        uint8_t* control;
+        Entry* entries;
+        size_t lookups;
+        size_t hits;
+        size_t probes;
+    } Table;
+
+    void init_table(Table* table);
+    void free_table(Table* table);
+    bool table_get(Table* table, ObjString* key, Value* value);
+    bool table_set(Table* table, ObjString* key, Value value);
+    bool table_delete(Table* table, ObjString* key);
+    ObjString* table_find_string(Table* table, const char* chars, int length, uint32_t hash);
+    void mark_table(Table* table);
+    int table_next(Table* table, int index);
+    void print_table_stats(Table* table, const char* name);
+
+#endif
@@ -1,8 +1,33 @@
 #include <stdio.h>
 #include "memory.h"
+#include "object.h"
 #include "values.h"
 
 
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+ * Two Values are equal if they have the same type and the same contents. Strings are interned (object.c), so two strings
+ * with the same characters are always the same object - comparing the pointers is enough, no memcmp() needed.
+ */
+bool values_equal(Value a, Value b) {
+    if (a.type != b.type) {
+        return false;
+    }
+
+    switch (a.type) {
+        case VALUE_NIL:
+            return true;
+        case VALUE_BOOL:
+            return AS_BOOL(a) == AS_BOOL(b);
+        case VALUE_NUMBER:
+            return AS_NUMBER(a) == AS_NUMBER(b);
+        case VALUE_OBJ:
+            return AS_OBJ(a) == AS_OBJ(b);
+        default:
+            return false;
+    }
+}
+
+
 /* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
  * Mirrors init_nugget() (nugget.c) - zero out the capacity and occupied count, and set the pointer to NULL
  */
@@ -42,7 +67,30 @@ void free_valuepool(ValuePool* pool) {
  * Prints out one of Cypsa's Value types. %g prints either in exponential scientific format (like %e), or in
  * normal decimal format (like %f, up to 6 decimal places) depending upon which is the shorter representation.
  * NOTE: I might just change this to %f or %lf because usually I'm not really keen on exponential formatting.
+ * Heap objects know how to print themselves (print_object(), object.c). fprint_value() prints to any stream - the
+ * disassembler (debug.c) writes to a file as well as to stdout.
  */
 void print_value(Value value) {
-    printf("%g", value);
+    fprint_value(stdout, value);
+}
+
+
+void fprint_value(FILE* out, Value value) {
+    switch (value.type) {
+        case VALUE_NIL:
+            fprintf(out, "nil");
+            break;
+        case VALUE_BOOL:
+            fprintf(out, AS_BOOL(value) ? "true" : "false");
+            break;
+        case VALUE_NUMBER:
+            fprintf(out, "%g", AS_NUMBER(value));
+            break;
+        case VALUE_OBJ:
+            print_object(out, value);
+            break;
+        case VALUE_UNDEFINED:
+            fprintf(out, "<undefined>");
+            break;
+    }
 }
\ No newline at end of file
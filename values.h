@@ -4,12 +4,52 @@
     #include "common.h"
 
     /* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
-     * All values in Cypsa are real, double-precision floating-point numbers. 
+     * Values in Cypsa are small tagged unions: a ValueType saying what kind of thing it is, and the thing itself. nil,
+     * booleans, and double-precision numbers live directly inside the Value. Anything bigger (strings, to start with)
+     * lives on the heap as an Obj (object.h), and the Value just carries a pointer to it.
+     * The IS_ macros check the tag, the AS_ macros pull the C value back out (check first!), and the _VAL macros wrap a
+     * C value up as a Cypsa Value.
+     * VALUE_UNDEFINED never reaches a Cypsa program: it marks a global slot which has been handed out by the compiler but
+     * not yet defined by a 'var' (see vm.h).
      * The ValuePool struct stores Cypsa Values in a dynamic array whose implementation almost exactly mirrors that of the
      * nugget code dynamic array. It makes use of the same GROW_CAPACITY, GROW_ARRAY, and FREE_ARRAY macros that nugget does.
      * capacity stores the current total size of the values array, while occupied, obviously, stores the number which are in use.
      */ 
-    typedef double Value;
+    typedef struct Obj Obj;
+    typedef struct ObjString ObjString;
+
+    typedef enum {
+        VALUE_NIL,
+        VALUE_BOOL,
+        VALUE_NUMBER,
+        VALUE_OBJ,
+        VALUE_UNDEFINED
+    } ValueType;
+
+    typedef struct {
+        ValueType type;
+        union {
+            bool boolean;
+            double number;
+            Obj* obj;
+        } as;
+    } Value;
+
+    #define IS_NIL(value)       ((value).type == VALUE_NIL)
+    #define IS_BOOL(value)      ((value).type == VALUE_BOOL)
+    #define IS_NUMBER(value)    ((value).type == VALUE_NUMBER)
+    #define IS_OBJ(value)       ((value).type == VALUE_OBJ)
+    #define IS_UNDEFINED(value) ((value).type == VALUE_UNDEFINED)
+
+    #define AS_BOOL(value)      ((value).as.boolean)
+    #define AS_NUMBER(value)    ((value).as.number)
+    #define AS_OBJ(value)       ((value).as.obj)
+
+    #define NIL_VAL             ((Value){VALUE_NIL, {.number = 0}})
+    #define BOOL_VAL(value)     ((Value){VALUE_BOOL, {.boolean = value}})
+    #define NUMBER_VAL(value)   ((Value){VALUE_NUMBER, {.number = value}})
+    #define OBJ_VAL(object)     ((Value){VALUE_OBJ, {.obj = (Obj*)object}})
+    #define UNDEFINED_VAL       ((Value){VALUE_UNDEFINED, {.number = 0}})
 
     typedef struct {
         int capacity;
@@ -17,9 +57,11 @@
         Value* values;
     } ValuePool;
 
+    bool values_equal(Value a, Value b);
     void init_valuepool(ValuePool* pool);
     void write_valuepool(ValuePool* pool, Value value);
     void free_valuepool(ValuePool* pool);
     void print_value(Value value);
+    void fprint_value(FILE* out, Value value);
 
 #endif
\ No newline at end of file
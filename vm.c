@@ -1,8 +1,19 @@
+#include <math.h>
+#include <stdarg.h>
+#include <stdatomic.h>
 #include <stdio.h>
+#include <string.h>
+#include "array.h"
 #include "compiler.h"
 #include "common.h"
 #include "debug.h"
 #include "memory.h"
+#include "memo.h"
+#include "native.h"
+#include "object.h"
+#include "parallel.h"
+#include "perf.h"
+#include "profile.h"
 #include "values.h"
 #include "vm.h"
 
@@ -15,18 +26,54 @@
  * stack_offset() - The difference between the bottom of the stack and the stack slot to be written to next. Useful when
  *                  shuffling pointers around during reallocation. 
  */
-VM vm;
+_Thread_local VM vm;
 
 static void rewind_stack() {
-    vm.stack_ptr = vm.stack;
+    vm.stack_ptr   = vm.stack;
+    vm.function    = NULL;
+    vm.frame_base  = 0;
+    vm.frame_count = 0;
+    vm.stop_depth  = 0;
+    vm.generator   = NULL;
 }
 
 
 void init_VM(void) {
+    init_collector(&vm.gc);
+    init_natives();
+    vm.nugget = NULL;
+    vm.iptr = NULL;
+    vm.function = NULL;
+    vm.frame_base = 0;
+    vm.frames = NULL;
+    vm.frame_count = 0;
+    vm.frame_capacity = 0;
+    vm.stop_depth = 0;
+    vm.generator = NULL;
     vm.stack_capacity = 0;
     vm.stack = NULL;
     vm.stack_ptr = vm.stack;
     vm.stack_top = vm.stack;
+    vm.encoding = ENCODING_BYTE;
+    vm.objects = NULL;
+    vm.quicken = (QuickenStats){0};
+    vm.memo = (MemoStats){0};
+    vm.ic = (InlineCacheStats){0};
+    vm.code_epoch = 0;
+    vm.budget = UINT64_MAX;
+    vm.shared_code = false;
+    init_table(&vm.strings);
+    init_table(&vm.global_slots);
+    init_valuepool(&vm.globals);
+    init_valuepool(&vm.global_names);
+}
+
+
+/* 
+ * Which instruction encoding interpret() compiles new nuggets with (see nugget.h). Byte encoding unless asked otherwise.
+ */
+void set_encoding(NuggetEncoding encoding) {
+    vm.encoding = encoding;
 }
 
 
@@ -35,8 +82,68 @@ static inline int stack_offset(void) {
 }
 
 
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+ * Walk the list of every object the VM ever allocated and free each one, then the intern table and the stack.
+ */
+static void free_objects_list(Obj* object) {
+    while (object != NULL) {
+        Obj* next = object->next;
+        free_object(object);
+        object = next;
+    }
+}
+
+static void free_objects(void) {
+    free_objects_list(vm.objects);
+    vm.objects = NULL;
+}
+
+
 void free_VM(void) {
+    #ifdef DEBUG_TABLE_STATS
+        print_table_stats(&vm.strings, "interned strings");
+    #endif
 
+    free_table(&vm.strings);
+    free_table(&vm.global_slots);
+    free_valuepool(&vm.globals);
+    free_valuepool(&vm.global_names);
+    free_objects();
+    free_objects_list(vm.gc.sweeping);
+    vm.gc.sweeping = NULL;
+    free_collector(&vm.gc);
+    FREE_ARRAY(Value, vm.stack, vm.stack_capacity);
+    FREE_ARRAY(CallFrame, vm.frames, vm.frame_capacity);
+    init_VM();
+}
+
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+ * Global slots (see vm.h). add_global() is called by the compiler the first time it sees a global name, and returns the
+ * new slot. The name rides on the stack while the arrays grow, in case that runs the collector.
+ * discard_globals() forgets every slot from first onwards - used when a compile fails, since the code which would have
+ * defined those globals is never going to run.
+ */
+int add_global(ObjString* name) {
+    int slot = vm.globals.occupied;
+
+    push(OBJ_VAL(name));
+    write_valuepool(&vm.globals, UNDEFINED_VAL);
+    write_valuepool(&vm.global_names, OBJ_VAL(name));
+    table_set(&vm.global_slots, name, NUMBER_VAL(slot));
+    pop();
+
+    return slot;
+}
+
+
+void discard_globals(int first) {
+    for (int slot = first; slot < vm.global_names.occupied; slot++) {
+        table_delete(&vm.global_slots, AS_STRING(vm.global_names.values[slot]));
+    }
+
+    vm.globals.occupied      = first;
+    vm.global_names.occupied = first;
 }
 
 
@@ -46,15 +153,19 @@ void free_VM(void) {
  * resized array, incase the whole thing gets reallocated and moved. Grow the capacity and stack itself, move the stack_top
  * pointer to the very top of the new stack, and then point the stack_ptr back into it at the current index.
  * Stick in the incoming value and increment.
+ * Growing the stack doesn't run the garbage collector: value isn't on the stack yet, so nothing would be keeping it
+ * alive if the collector ran right now. The next allocation will pick up the slack.
  */
 void push(Value value) {
     if (vm.stack_ptr == vm.stack_top) {
+        vm.gc.paused++;
         int stack_current = stack_offset();
         int prev_capacity = vm.stack_capacity;
         vm.stack_capacity = GROW_CAPACITY(vm.stack_capacity);
         vm.stack          = GROW_ARRAY(Value, vm.stack, prev_capacity, vm.stack_capacity);
         vm.stack_top      = &(vm.stack[vm.stack_capacity]);
         vm.stack_ptr      = &(vm.stack[stack_current]);
+        vm.gc.paused--;
     }
 
     *vm.stack_ptr = value;
@@ -66,6 +177,399 @@ Value pop() {
     return (*vm.stack_ptr);
 }
 
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+ * Look at a value on the stack without popping it. distance is how far down from the top - peek(0) is the top value.
+ */
+static Value peek(int distance) {
+    return vm.stack_ptr[-1 - distance];
+}
+
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+ * nil and false are falsey, and everything else is truthy.
+ */
+static bool is_falsey(Value value) {
+    return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
+}
+
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+ * Report a runtime error with the source line of the instruction that caused it, and throw the stack away.
+ * vm.iptr has already moved past the instruction, but every byte of an instruction (in either encoding) has the same
+ * line number, so the byte just behind vm.iptr is good enough to find it. The same goes for each caller's saved iptr,
+ * which sits just past its CALL, so the line of every call on the way down is printed after it, innermost first. Only
+ * the innermost TRACE_CALLS_MAX calls are listed (runaway recursion would otherwise print a thousand identical lines),
+ * followed by the outermost one.
+ */
+#define TRACE_CALLS_MAX 16
+
+static void print_location(ObjFunction* function, Nugget* nugget, uint8_t* iptr) {
+    int offset = (int)(iptr - nugget->code - 1);
+
+    if (function == NULL) {
+        fprintf(stderr, "[line %d] in script\n", get_line(nugget, offset));
+    } else {
+        fprintf(stderr, "[line %d] in %s()\n", get_line(nugget, offset), function->name->chars);
+    }
+}
+
+
+static void runtime_error(const char* format, ...) {
+    va_list args;
+    va_start(args, format);
+    vfprintf(stderr, format, args);
+    va_end(args);
+    fputs("\n", stderr);
+
+    print_location(vm.function, vm.nugget, vm.iptr);
+    for (int index = vm.frame_count - 1; index >= 0; index--) {
+        if (index == vm.frame_count - 1 - TRACE_CALLS_MAX && index > 0) {
+            fprintf(stderr, "[... %d more calls]\n", index);
+            index = 0;
+        }
+        CallFrame* frame = &vm.frames[index];
+        print_location(frame->function, frame->nugget, frame->iptr);
+    }
+    rewind_stack();
+}
+
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+ * Save the running function's state in the next CallFrame, ready to switch to another one, and the other way round.
+ */
+static inline bool push_frame(void) {
+    if (vm.frame_count == vm.frame_capacity) {
+        if (vm.frame_capacity >= FRAMES_MAX) {
+            runtime_error("Stack overflow.");
+            return false;
+        }
+        int capacity      = GROW_CAPACITY(vm.frame_capacity);
+        profile_held++;
+        vm.frames         = GROW_ARRAY(CallFrame, vm.frames, vm.frame_capacity, capacity);
+        vm.frame_capacity = capacity;
+        profile_held--;
+    }
+
+    // The profiler's signal handler may read frames up to frame_count at any moment (profile.h) - fill the frame in first
+    vm.frames[vm.frame_count] = (CallFrame){
+        .function = vm.function,
+        .nugget   = vm.nugget,
+        .iptr     = vm.iptr,
+        .base     = vm.frame_base,
+        .memoized = false,
+        .tail     = false
+    };
+    atomic_signal_fence(memory_order_release);
+    vm.frame_count++;
+    return true;
+}
+
+
+static inline void pop_frame(void) {
+    CallFrame* frame = &vm.frames[--vm.frame_count];
+
+    vm.stack_ptr  = vm.stack + vm.frame_base;
+    vm.function   = frame->function;
+    vm.nugget     = frame->nugget;
+    vm.iptr       = frame->iptr;
+    vm.frame_base = frame->base;
+}
+
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+ * Call function, whose frame - the callee slot and the arguments above it - is the top arg_count + 1 slots of the
+ * stack. A function which has never been called before is compiled first - it's been nothing but source text since it
+ * was declared (compile_function(), compiler.c). If that fails, the errors have been reported and the program stops as
+ * if the whole script had failed to compile. Except in the workers of a parallel loop, which mustn't compile anything
+ * (see VM.shared_code).
+ * Calling a generator function runs nothing: the callee and arguments are replaced by a new generator, holding them.
+ */
+static InterpretationResult call_function(ObjFunction* function, int arg_count) {
+    if (arg_count != function->arity) {
+        runtime_error("%s() expected %d argument%s but got %d.", function->name->chars, function->arity,
+                      (function->arity == 1) ? "" : "s", arg_count);
+        return INTERPRETER_RUNTIME_ERROR;
+    }
+
+    if (!function->compiled && vm.shared_code) {
+        runtime_error("%s() can't be compiled inside a parallel loop - call it once beforehand.", function->name->chars);
+        return INTERPRETER_RUNTIME_ERROR;
+    }
+    if (!function->compiled) {
+        perf_begin(PERF_COMPILE);
+        bool compiled = compile_function(function);
+        perf_end(PERF_COMPILE);
+
+        if (!compiled) {
+            runtime_error("Could not compile %s().", function->name->chars);
+            return INTERPRETER_COMPILE_ERROR;
+        }
+    }
+
+    // A generator function's call is put away in a generator instead of being run (see resume_generator())
+    if (function->generator) {
+        Value* frame            = vm.stack_ptr - arg_count - 1;
+        ObjGenerator* generator = new_generator(function, frame, arg_count + 1);
+        vm.stack_ptr            = frame;
+        push(OBJ_VAL(generator));
+        return INTERPRETER_OK;
+    }
+
+    // A pure function may have been called with these arguments already (memo.h) - if so, that's the whole call
+    bool memoized = false;
+    if (memo_size > 0 && !vm.shared_code && memo_for(function) != NULL) {
+        Value result;
+        MemoLookup lookup = memo_lookup(function, vm.stack_ptr - arg_count, &result);
+        if (lookup == MEMO_HIT) {
+            vm.stack_ptr -= arg_count + 1;
+            push(result);
+            return INTERPRETER_OK;
+        }
+        memoized = (lookup == MEMO_MISS);
+    }
+
+    if (!push_frame()) {
+        return INTERPRETER_RUNTIME_ERROR;
+    }
+
+    vm.frames[vm.frame_count - 1].memoized = memoized;
+    vm.function   = function;
+    vm.nugget     = &function->nugget;
+    vm.iptr       = function->nugget.code;
+    vm.frame_base = stack_offset() - arg_count - 1;
+    return INTERPRETER_OK;
+}
+
+
+/*
+ * Call the value sitting arg_count slots below the top of the stack, with the arguments above it (natives have
+ * CALL_NATIVE all to themselves). Besides functions:
+ *      A class:        Makes a new instance, which takes the class's place on the stack - so it's 'this' - and calls
+ *                      the class's initializer on it, if it has one. Either way, the call's result is the instance.
+ *      A bound method: Its receiver takes its place, and then its method is called.
+ */
+static InterpretationResult call_value(Value callee, int arg_count) {
+    if (IS_FUNCTION(callee)) {
+        return call_function(AS_FUNCTION(callee), arg_count);
+    }
+
+    if (IS_BOUND_METHOD(callee)) {
+        ObjBoundMethod* bound        = AS_BOUND_METHOD(callee);
+        vm.stack_ptr[-arg_count - 1] = bound->receiver;
+        return call_function(bound->method, arg_count);
+    }
+
+    if (IS_CLASS(callee)) {
+        ObjClass* klass              = AS_CLASS(callee);
+        vm.stack_ptr[-arg_count - 1] = OBJ_VAL(new_instance(klass));
+        if (klass->initializer != NULL) {
+            return call_function(klass->initializer, arg_count);
+        }
+        if (arg_count != 0) {
+            runtime_error("%s() expected 0 arguments but got %d.", klass->name->chars, arg_count);
+            return INTERPRETER_RUNTIME_ERROR;
+        }
+        return INTERPRETER_OK;
+    }
+
+    runtime_error("Can only call functions and classes.");
+    return INTERPRETER_RUNTIME_ERROR;
+}
+
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+ * Tail calls (TAIL_CALL and TAIL_INVOKE). Before the call, take_over_frame() slides the callee and arguments down to
+ * where this function's frame starts and pops the frame, so that the call is made from the caller's - as if it had made
+ * the call itself, and this function had never been there.
+ * Not from the bottom of a parallel worker (frame_count 0, see run_function()) or from a generator, whose frame belongs
+ * to the generator - those make an ordinary call, and the RETURN after the instruction does the rest. Nor, at first,
+ * from a pure function whose result is to be memoized (memo.h), since its arguments would be gone by the time there's a
+ * result to store under them: that makes an ordinary call too, but tail_call_stopped() marks the callee's frame as a
+ * tail call's. A frame so marked is taken over regardless, and the mark passed on, so a chain of tail calls memoizes
+ * the result of the call it started from and nothing in between.
+ * depth is frame_count just before the call. tail_call_stopped() returns true if taking the frame over has left run()
+ * below the frame it was started to run (VM.stop_depth), so it has to stop.
+ */
+static inline void take_over_frame(int arg_count) {
+    if (vm.frame_count > 0 && !vm.function->generator &&
+        (!vm.frames[vm.frame_count - 1].memoized || vm.frames[vm.frame_count - 1].tail)) {
+        Value* frame = vm.stack_ptr - arg_count - 1;
+        memmove(vm.stack + vm.frame_base, frame, sizeof(Value) * (arg_count + 1));
+        pop_frame();
+        vm.stack_ptr += arg_count + 1;
+    }
+}
+
+
+static inline bool tail_call_stopped(int depth) {
+    if (vm.frame_count > depth) {
+        vm.frames[vm.frame_count - 1].tail = true;
+    }
+    return vm.frame_count < vm.stop_depth;
+}
+
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+ * Property access through a site's inline cache (nugget.h). probe_cache() looks for the instance's shape among the
+ * shapes the site has seen; on a miss, the property is looked up the slow way (find_property()) and the answer put in
+ * the cache for next time (cache_property()). A site with no room left for another shape goes megamorphic instead, and
+ * is never probed or filled in again.
+ * Neither the workers of a parallel loop (VM.shared_code), which share their code, nor anything else running with
+ * shared code writes to a cache. What goes into one has to be kept alive by it (mark_nugget(), memory.c), and the
+ * nugget may belong to a function the collector has already traced, so while it's marking, the new entry's shapes and
+ * method are marked on the way in.
+ */
+static inline CacheEntry* probe_cache(PropertyCache* cache, ObjShape* shape) {
+    for (int index = 0; index < cache->count; index++) {
+        if (cache->entries[index].shape == shape) {
+            vm.ic.hits++;
+            return &cache->entries[index];
+        }
+    }
+    return NULL;
+}
+
+
+static void cache_property(PropertyCache* cache, CacheEntry* entry) {
+    if (cache->megamorphic) {
+        vm.ic.megamorphic_lookups++;
+        return;
+    }
+    vm.ic.misses++;
+    if (vm.shared_code) {
+        return;
+    }
+
+    if (cache->count == PROPERTY_CACHE_ENTRIES) {
+        cache->megamorphic = true;
+        cache->count       = 0;
+        vm.ic.megamorphic++;
+        return;
+    }
+    if (cache->count == 1) {
+        vm.ic.polymorphic++;
+    }
+
+    if (vm.gc.phase == GC_MARK) {
+        mark_object((Obj*)entry->shape);
+        mark_object((Obj*)entry->shape_after);
+        mark_object((Obj*)entry->method);
+    }
+    cache->entries[cache->count++] = *entry;
+}
+
+
+/*
+ * Where the property called name is for this instance: a field's slot, or failing that one of its class's methods - so
+ * fields shadow methods. Returns false if it's neither.
+ */
+static bool find_property(ObjInstance* instance, ObjString* name, CacheEntry* entry) {
+    entry->shape       = instance->shape;
+    entry->shape_after = instance->shape;
+    entry->method      = NULL;
+    entry->slot        = shape_slot(instance->shape, name);
+
+    if (entry->slot >= 0) {
+        return true;
+    }
+
+    Value method;
+    if (table_get(&instance->klass->methods, name, &method)) {
+        entry->method = AS_FUNCTION(method);
+        return true;
+    }
+    return false;
+}
+
+
+/*
+ * Where setting the field called name puts it: in its slot if the instance has it already, or else in a new slot at
+ * the end, which moves the instance on to the shape with that field added.
+ */
+static void find_field(ObjInstance* instance, ObjString* name, CacheEntry* entry) {
+    entry->shape       = instance->shape;
+    entry->shape_after = instance->shape;
+    entry->method      = NULL;
+    entry->slot        = shape_slot(instance->shape, name);
+
+    if (entry->slot < 0) {
+        entry->shape_after = shape_transition(instance->shape, name);
+        entry->slot        = entry->shape_after->slot_count - 1;
+    }
+}
+
+
+/*
+ * Hit rate of the property caches, and how many sites went polymorphic or megamorphic.
+ */
+void print_ic_stats(void) {
+    uint64_t lookups = vm.ic.hits + vm.ic.misses + vm.ic.megamorphic_lookups;
+
+    printf("[ic] %llu hits / %llu lookups (%.2f%% hit rate), %llu misses, %llu megamorphic lookups; "
+           "%llu sites went polymorphic, %llu megamorphic\n",
+           (unsigned long long)vm.ic.hits, (unsigned long long)lookups,
+           (lookups == 0) ? 0.0 : (100.0 * (double)vm.ic.hits / (double)lookups),
+           (unsigned long long)vm.ic.misses, (unsigned long long)vm.ic.megamorphic_lookups,
+           (unsigned long long)vm.ic.polymorphic, (unsigned long long)vm.ic.megamorphic);
+}
+
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+ * Arrays (object.h). Arithmetic with an array on either side is elementwise: array op array needs two arrays of the
+ * same length, and array op number (or number op array) applies the number to every element. Either way the result is
+ * a new array, worked out by the SIMD kernels in array.c. Both operands stay on the stack until the result exists, so
+ * the collector can't take them away while new_array() allocates.
+ */
+static bool array_arithmetic(ArrayOp op) {
+    Value right = peek(0);
+    Value left  = peek(1);
+
+    if ((!IS_ARRAY(left) && !IS_NUMBER(left)) || (!IS_ARRAY(right) && !IS_NUMBER(right))) {
+        runtime_error("Operands must be numbers or arrays.");
+        return false;
+    }
+
+    ObjArray* a = IS_ARRAY(left) ? AS_ARRAY(left) : NULL;
+    ObjArray* b = IS_ARRAY(right) ? AS_ARRAY(right) : NULL;
+
+    if (a != NULL && b != NULL && a->count != b->count) {
+        runtime_error("Arrays must be the same length (%zu and %zu).", a->count, b->count);
+        return false;
+    }
+
+    ObjArray* out = new_array((a != NULL) ? a->count : b->count);
+    array_elementwise(op, (a != NULL) ? a->values : NULL, (a != NULL) ? a->stride : 0,
+                          (a != NULL) ? 0.0 : AS_NUMBER(left),
+                          (b != NULL) ? b->values : NULL, (b != NULL) ? b->stride : 0,
+                          (b != NULL) ? 0.0 : AS_NUMBER(right), out->values, out->count);
+
+    vm.stack_ptr[-2] = OBJ_VAL(out);
+    vm.stack_ptr--;
+    return true;
+}
+
+
+/*
+ * Check that index is a whole number which is in bounds for array, and convert it.
+ */
+static bool array_index(ObjArray* array, Value index, size_t* position) {
+    if (!IS_NUMBER(index) || AS_NUMBER(index) != floor(AS_NUMBER(index))) {
+        runtime_error("Array index must be a whole number.");
+        return false;
+    }
+
+    double at = AS_NUMBER(index);
+    if (at < 0 || at >= (double)array->count) {
+        runtime_error("Array index %g is out of bounds (length %zu).", at, array->count);
+        return false;
+    }
+
+    *position = (size_t)at;
+    return true;
+}
+
+
 /* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
  * Where the bulk of the processing time will be spent. The FETCH_BYTE macro dereferences the current byte from the instruction
  * pointer and then increments it. The VM loop switches on the first byte of the instruction, which is always its OPCODE.
@@ -88,16 +592,90 @@ Value pop() {
  * in the same scope, and that the preprocessor replaces them in the code correctly. Making the condition 'false' ensures it
  * only run once, but that everything inside the block is in the same scope.
  * It saves writing a separate function with the logic to handle building and evaluating each expression, but I don't like it.
+ * 
+ * The loop body is written once for both instruction encodings. 'wide' is always a literal true or false at the call site
+ * in run(), so the compiler folds every 'wide ?' away and we get two specialized copies of the loop without writing it
+ * twice. In a wide nugget the whole instruction is fetched up front as one aligned 32-bit load (FETCH_WORD); the opcode is
+ * its low byte and FETCH_OPERAND just shifts the word. In a byte nugget FETCH_OPERAND reads 'width' bytes, big-endian.
+ * 
+ * Quickening (nugget.h): a generic arithmetic or comparison instruction checks its operand types, rewrites itself into
+ * the specialized form for those types (QUICKEN), and does the work. The specialized form only has to check that the
+ * types are still the ones it was made for. If they aren't, it rewrites itself back to the generic form (DEOPTIMIZE),
+ * backs vm.iptr up to the start of the instruction and goes round the loop again, so the generic version deals with it.
+ * Quickened instructions have no operands, so the start of the current one is always INSTRUCTION_START.
+ * The workers of a parallel loop share their code (VM.shared_code), so they never rewrite it: they don't quicken, and
+ * a specialized instruction whose types don't hold just dispatches straight to the generic one instead.
+ * ARITHMETIC_OPERATION is BINARY_OPERATION plus arrays: if either operand is an array, the operation is done elementwise
+ * (array_arithmetic()) instead. Array arithmetic is never quickened - one instruction's work is a whole loop over the
+ * elements, so one extra type check doesn't matter.
  */
-static InterpretationResult run() {
-    // Some helpful macros, for this scope only - definitions are removed at the end of run()
+static inline InstructionWord load_word(const uint8_t* at) {
+    InstructionWord word;
+    memcpy(&word, at, sizeof(word));
+    return word;
+}
+
+static inline InterpretationResult run_encoded(const bool wide) {
+    // Some helpful macros, for this scope only - definitions are removed at the end of run_encoded()
     #define FETCH_BYTE() (*vm.iptr++)
-    #define FETCH_CONSTANT() (vm.nugget->constants.values[FETCH_BYTE()])
-    #define BINARY_OPERATION(operation) \
-        do {                            \
-            double r = pop();           \
-            double l = pop();           \
-            push(l operation r);        \
+    #define FETCH_WORD() (vm.iptr += sizeof(InstructionWord), load_word(vm.iptr - sizeof(InstructionWord)))
+    #define FETCH_SHORT() (vm.iptr += 2, (uint32_t)((vm.iptr[-2] << 8) | vm.iptr[-1]))
+    #define FETCH_LONG() (vm.iptr += 3, (uint32_t)((vm.iptr[-3] << 16) | (vm.iptr[-2] << 8) | vm.iptr[-1]))
+    #define FETCH_OPERAND(width) (wide ? WIDE_OPERAND(word) :                      \
+                                  ((width) == 1 ? FETCH_BYTE() : ((width) == 2 ? FETCH_SHORT() : FETCH_LONG())))
+    #define INSTRUCTION_START() ((int)(vm.iptr - vm.nugget->code) - (wide ? (int)sizeof(InstructionWord) : 1))
+    #define QUICKEN(opcode)                                             \
+        do {                                                            \
+            if (!vm.shared_code) {                                      \
+                rewrite_opcode(vm.nugget, INSTRUCTION_START(), opcode); \
+                vm.quicken.quickened++;                                 \
+            }                                                           \
+        } while (false)
+    #define DEOPTIMIZE(opcode)                                          \
+        do {                                                            \
+            if (vm.shared_code) {                                       \
+                instruction = (opcode);                                 \
+                goto dispatch;                                          \
+            }                                                           \
+            int start = INSTRUCTION_START();                            \
+            rewrite_opcode(vm.nugget, start, opcode);                   \
+            vm.quicken.deopts++;                                        \
+            vm.iptr = vm.nugget->code + start;                          \
+        } while (false)
+    #define BINARY_OPERATION(value_type, operation, quickened)          \
+        do {                                                            \
+            if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) {           \
+                runtime_error("Operands must be numbers.");             \
+                return INTERPRETER_RUNTIME_ERROR;                       \
+            }                                                           \
+            vm.quicken.generic++;                                       \
+            QUICKEN(quickened);                                         \
+            double r = AS_NUMBER(pop());                                \
+            double l = AS_NUMBER(pop());                                \
+            push(value_type(l operation r));                            \
+        } while (false)
+    #define ARITHMETIC_OPERATION(operation, quickened, array_op)        \
+        do {                                                            \
+            if (IS_ARRAY(peek(0)) || IS_ARRAY(peek(1))) {               \
+                vm.quicken.generic++;                                   \
+                if (!array_arithmetic(array_op)) {                      \
+                    return INTERPRETER_RUNTIME_ERROR;                   \
+                }                                                       \
+                break;                                                  \
+            }                                                           \
+            BINARY_OPERATION(NUMBER_VAL, operation, quickened);         \
+        } while (false)
+    #define NUMBER_OPERATION(value_type, operation, generic)            \
+        do {                                                            \
+            if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) {           \
+                DEOPTIMIZE(generic);                                    \
+                break;                                                  \
+            }                                                           \
+            vm.quicken.specialized++;                                   \
+            double r = AS_NUMBER(vm.stack_ptr[-1]);                     \
+            double l = AS_NUMBER(vm.stack_ptr[-2]);                     \
+            vm.stack_ptr[-2] = value_type(l operation r);               \
+            vm.stack_ptr--;                                             \
         } while (false)
 
 
@@ -117,41 +695,551 @@ static InterpretationResult run() {
 
         // Opcode matching
         uint8_t instruction;
-        
-        switch (instruction = FETCH_BYTE()) {
+        InstructionWord word = 0;
+
+        if (wide) {
+            word        = FETCH_WORD();
+            instruction = WIDE_OPCODE(word);
+        } else {
+            instruction = FETCH_BYTE();
+        }
+
+        dispatch:
+        switch (instruction) {
+            // Top-level code just stops. A function's result replaces its whole frame, callee and all
             case OPCODE_RETURN: {
+                if (vm.frame_count == 0) {
+                    return INTERPRETER_OK;
+                }
+
+                Value result = pop();
+                if (vm.frames[vm.frame_count - 1].memoized) {
+                    memo_store(vm.function, vm.stack + vm.frame_base + 1, result);
+                }
+                pop_frame();
+                push(result);
+
+                if (vm.frame_count < vm.stop_depth) {
+                    return INTERPRETER_OK;
+                }
+                break;
+            }
+
+            // Suspend the running generator (vm.generator): everything from its frame's base up goes into the generator,
+            // and the value is handed back to whoever resumed it - see resume_generator()
+            case OPCODE_YIELD: {
+                ObjGenerator* generator = vm.generator;
+                save_generator_slots(generator, vm.stack + vm.frame_base, stack_offset() - 1 - vm.frame_base);
+                generator->offset = (int)(vm.iptr - vm.nugget->code);
+                generator->state  = GENERATOR_SUSPENDED;
+
+                Value value = pop();
+                pop_frame();
+                push(value);
+                return INTERPRETER_OK;
+            }
+
+            // [sequence] -> [iterator]. Generators and iterators already are; an array gets an iterator over it
+            case OPCODE_ITERATE: {
+                Value sequence = peek(0);
+                if (IS_ARRAY(sequence)) {
+                    vm.stack_ptr[-1] = OBJ_VAL(new_iterator(ITERATOR_ARRAY, sequence, NIL_VAL, 0));
+                } else if (!IS_GENERATOR(sequence) && !IS_ITERATOR(sequence)) {
+                    runtime_error("Can only loop over arrays, generators and iterators.");
+                    return INTERPRETER_RUNTIME_ERROR;
+                }
+                break;
+            }
+
+            // [iterator, element] - the next element replaces the last one, or the loop is over
+            case OPCODE_FOR_ITER: {
+                uint32_t distance = FETCH_OPERAND(2);
+                bool done;
+
+                InterpretationResult result = iterator_next(peek(1), &done);
+                if (result != INTERPRETER_OK) {
+                    return result;
+                }
+
+                if (done) {
+                    vm.iptr += distance;
+                } else {
+                    vm.stack_ptr[-2] = vm.stack_ptr[-1];
+                    vm.stack_ptr--;
+                }
+                break;
+            }
+
+            // [array, body] - see parallel.h
+            case OPCODE_PARALLEL: {
+                ParallelKind kind = (ParallelKind)FETCH_OPERAND(1);
+                if (!IS_ARRAY(peek(1))) {
+                    runtime_error("A parallel loop can only go over an array.");
+                    return INTERPRETER_RUNTIME_ERROR;
+                }
+
+                Value result;
+                const char* error = run_parallel(kind, AS_FUNCTION(peek(0)), AS_ARRAY(peek(1)), &result);
+                if (error != NULL) {
+                    runtime_error("%s", error);
+                    return INTERPRETER_RUNTIME_ERROR;
+                }
+
+                pop();
+                pop();
+                push(result);
+                break;
+            }
+
+            // [callee, arguments...] - a call is a checkpoint, like a loop, since recursion can go on just as long
+            case OPCODE_CALL: {
+                int arg_count = (int)FETCH_OPERAND(1);
+                InterpretationResult result = call_value(peek(arg_count), arg_count);
+                if (result != INTERPRETER_OK) {
+                    return result;
+                }
+
+                if (--vm.budget == 0) {
+                    return INTERPRETER_YIELD;
+                }
+                break;
+            }
+
+            // [callee, arguments...] as the last thing before a RETURN: the call takes over this function's frame
+            // (see take_over_frame())
+            case OPCODE_TAIL_CALL: {
+                int arg_count = (int)FETCH_OPERAND(1);
+                take_over_frame(arg_count);
+
+                int depth = vm.frame_count;
+                InterpretationResult result = call_value(peek(arg_count), arg_count);
+                if (result != INTERPRETER_OK) {
+                    return result;
+                }
+                if (tail_call_stopped(depth)) {
+                    return INTERPRETER_OK;
+                }
+
+                if (--vm.budget == 0) {
+                    return INTERPRETER_YIELD;
+                }
+                break;
+            }
+
+            // [instance] -> [value]. A method read without being called comes out bound to the instance
+            case OPCODE_GET_PROPERTY: {
+                PropertyCache* cache = &vm.nugget->caches[FETCH_OPERAND(2)];
+                if (!IS_INSTANCE(peek(0))) {
+                    runtime_error("Only instances have properties.");
+                    return INTERPRETER_RUNTIME_ERROR;
+                }
+
+                ObjInstance* instance = AS_INSTANCE(peek(0));
+                CacheEntry* entry     = probe_cache(cache, instance->shape);
+                CacheEntry found;
+                if (entry == NULL) {
+                    if (!find_property(instance, cache->name, &found)) {
+                        runtime_error("Undefined property '%s'.", cache->name->chars);
+                        return INTERPRETER_RUNTIME_ERROR;
+                    }
+                    cache_property(cache, &found);
+                    entry = &found;
+                }
+
+                if (entry->slot >= 0) {
+                    vm.stack_ptr[-1] = instance->fields[entry->slot];
+                } else {
+                    ObjBoundMethod* bound = new_bound_method(peek(0), entry->method);
+                    vm.stack_ptr[-1]      = OBJ_VAL(bound);
+                }
+                break;
+            }
+
+            // [instance, value] -> [value]
+            case OPCODE_SET_PROPERTY: {
+                PropertyCache* cache = &vm.nugget->caches[FETCH_OPERAND(2)];
+                if (!IS_INSTANCE(peek(1))) {
+                    runtime_error("Only instances have fields.");
+                    return INTERPRETER_RUNTIME_ERROR;
+                }
+                if (vm.shared_code) {
+                    runtime_error("Can't set a field inside a parallel loop - every worker shares the instance.");
+                    return INTERPRETER_RUNTIME_ERROR;
+                }
+
+                ObjInstance* instance = AS_INSTANCE(peek(1));
+                CacheEntry* entry     = probe_cache(cache, instance->shape);
+                CacheEntry found;
+                if (entry == NULL) {
+                    find_field(instance, cache->name, &found);
+                    cache_property(cache, &found);
+                    entry = &found;
+                }
+
+                if (entry->shape_after != instance->shape) {
+                    grow_instance(instance, entry->shape_after->slot_count);
+                    WRITE_BARRIER(instance, OBJ_VAL(entry->shape_after));
+                }
+                WRITE_BARRIER(instance, peek(0));
+                instance->fields[entry->slot] = peek(0);
+                instance->shape               = entry->shape_after;
+
+                vm.stack_ptr[-2] = peek(0);
+                vm.stack_ptr--;
+                break;
+            }
+
+            // [instance, arguments...] - instance.name(arguments) in one go, without making a bound method. A field
+            // holding something callable is called instead, in the instance's place. TAIL_INVOKE is the same as the
+            // last thing before a RETURN, and takes this function's frame over like TAIL_CALL
+            case OPCODE_INVOKE:
+            case OPCODE_TAIL_INVOKE: {
+                PropertyCache* cache = &vm.nugget->caches[FETCH_OPERAND(2)];
+                int arg_count        = cache->arg_count;
+                if (!IS_INSTANCE(peek(arg_count))) {
+                    runtime_error("Only instances have methods.");
+                    return INTERPRETER_RUNTIME_ERROR;
+                }
+
+                ObjInstance* instance = AS_INSTANCE(peek(arg_count));
+                CacheEntry* entry     = probe_cache(cache, instance->shape);
+                CacheEntry found;
+                if (entry == NULL) {
+                    if (!find_property(instance, cache->name, &found)) {
+                        runtime_error("Undefined property '%s'.", cache->name->chars);
+                        return INTERPRETER_RUNTIME_ERROR;
+                    }
+                    cache_property(cache, &found);
+                    entry = &found;
+                }
+
+                if (entry->slot >= 0) {
+                    vm.stack_ptr[-arg_count - 1] = instance->fields[entry->slot];
+                }
+                if (instruction == OPCODE_TAIL_INVOKE) {
+                    take_over_frame(arg_count);
+                }
+
+                int depth = vm.frame_count;
+                InterpretationResult result;
+                if (entry->slot >= 0) {
+                    result = call_value(peek(arg_count), arg_count);
+                } else {
+                    result = call_function(entry->method, arg_count);
+                }
+                if (result != INTERPRETER_OK) {
+                    return result;
+                }
+                if (instruction == OPCODE_TAIL_INVOKE && tail_call_stopped(depth)) {
+                    return INTERPRETER_OK;
+                }
+
+                if (--vm.budget == 0) {
+                    return INTERPRETER_YIELD;
+                }
+                break;
+            }
+
+            // The elements are the top 'count' values on the stack, first element deepest
+            case OPCODE_ARRAY: {
+                uint32_t count  = FETCH_OPERAND(2);
+                Value* elements = vm.stack_ptr - count;
+
+                for (uint32_t index = 0; index < count; index++) {
+                    if (!IS_NUMBER(elements[index])) {
+                        runtime_error("Array elements must be numbers.");
+                        return INTERPRETER_RUNTIME_ERROR;
+                    }
+                }
+
+                ObjArray* array = new_array(count);
+                for (uint32_t index = 0; index < count; index++) {
+                    array->values[index] = AS_NUMBER(elements[index]);
+                }
+
+                vm.stack_ptr = elements;
+                push(OBJ_VAL(array));
+                break;
+            }
+
+            case OPCODE_GET_INDEX: {
+                if (!IS_ARRAY(peek(1))) {
+                    runtime_error("Only arrays can be indexed.");
+                    return INTERPRETER_RUNTIME_ERROR;
+                }
+
+                ObjArray* array = AS_ARRAY(peek(1));
+                size_t position;
+                if (!array_index(array, peek(0), &position)) {
+                    return INTERPRETER_RUNTIME_ERROR;
+                }
+
+                vm.stack_ptr[-2] = NUMBER_VAL(array_element(array, position));
+                vm.stack_ptr--;
+                break;
+            }
+
+            // [array, index, value] -> [value]
+            case OPCODE_SET_INDEX: {
+                if (!IS_ARRAY(peek(2))) {
+                    runtime_error("Only arrays can be indexed.");
+                    return INTERPRETER_RUNTIME_ERROR;
+                }
+                if (!IS_NUMBER(peek(0))) {
+                    runtime_error("Array elements must be numbers.");
+                    return INTERPRETER_RUNTIME_ERROR;
+                }
+
+                ObjArray* array = AS_ARRAY(peek(2));
+                size_t position;
+                if (array->mapping != NULL) {
+                    runtime_error("Can't write to an array mapped from a file.");
+                    return INTERPRETER_RUNTIME_ERROR;
+                }
+                if (!array_index(array, peek(1), &position)) {
+                    return INTERPRETER_RUNTIME_ERROR;
+                }
+
+                array->values[position] = AS_NUMBER(peek(0));
+                vm.stack_ptr[-3]        = peek(0);
+                vm.stack_ptr -= 2;
+                break;
+            }
+
+            // No frame, no callee on the stack: the arguments are already in place, and the result replaces them
+            case OPCODE_CALL_NATIVE: {
+                Native* native = &natives[FETCH_OPERAND(1)];
+                int args       = stack_offset() - native->arity;
+                Value result;
+
+                // A native which runs script code (native.h) may grow the stack out from under a pointer into it
+                const char* error = call_native(native, vm.stack + args, &result);
+                if (error == native_reported) {
+                    return INTERPRETER_RUNTIME_ERROR;
+                }
+                if (error != NULL) {
+                    runtime_error("%s(): %s", native->name, error);
+                    return INTERPRETER_RUNTIME_ERROR;
+                }
+
+                vm.stack_ptr = vm.stack + args;
+                push(result);
+
+                if (--vm.budget == 0) {
+                    return INTERPRETER_YIELD;
+                }
+                break;
+            }
+
+            // Jump distances are in bytes, counted from the end of the jump instruction
+            case OPCODE_JUMP: {
+                uint32_t distance = FETCH_OPERAND(2);
+                vm.iptr += distance;
+                break;
+            }
+
+            case OPCODE_JUMP_IF_FALSE: {
+                uint32_t distance = FETCH_OPERAND(2);
+                if (is_falsey(peek(0))) {
+                    vm.iptr += distance;
+                }
+                break;
+            }
+
+            case OPCODE_LOOP: {
+                uint32_t distance = FETCH_OPERAND(2);
+                vm.iptr -= distance;
+
+                if (--vm.budget == 0) {
+                    return INTERPRETER_YIELD;
+                }
+                break;
+            }
+
+            case OPCODE_POP: {
+                pop();
+                break;
+            }
+
+            case OPCODE_PRINT: {
                 print_value(pop());
                 printf("\n");
-                return INTERPRETER_OK;
+                break;
+            }
+
+            // Locals live on the stack; the operand is the slot, counted from the start of the current frame
+            case OPCODE_GET_LOCAL: {
+                push(vm.stack[vm.frame_base + FETCH_OPERAND(1)]);
+                break;
+            }
+
+            case OPCODE_SET_LOCAL: {
+                vm.stack[vm.frame_base + FETCH_OPERAND(1)] = peek(0);
+                break;
+            }
+
+            // Globals live in vm.globals; the operand is the slot the compiler gave the name. Replacing a function
+            // moves code_epoch on (vm.h)
+            case OPCODE_DEFINE_GLOBAL: {
+                uint32_t slot = FETCH_OPERAND(2);
+                if (IS_FUNCTION(vm.globals.values[slot])) {
+                    vm.code_epoch++;
+                }
+                vm.globals.values[slot] = pop();
+                break;
+            }
+
+            case OPCODE_GET_GLOBAL: {
+                uint32_t slot = FETCH_OPERAND(2);
+                Value value   = vm.globals.values[slot];
+                if (IS_UNDEFINED(value)) {
+                    runtime_error("Undefined variable '%s'.", AS_CSTRING(vm.global_names.values[slot]));
+                    return INTERPRETER_RUNTIME_ERROR;
+                }
+                push(value);
+                break;
+            }
+
+            case OPCODE_SET_GLOBAL: {
+                uint32_t slot = FETCH_OPERAND(2);
+                if (IS_UNDEFINED(vm.globals.values[slot])) {
+                    runtime_error("Undefined variable '%s'.", AS_CSTRING(vm.global_names.values[slot]));
+                    return INTERPRETER_RUNTIME_ERROR;
+                }
+                if (IS_FUNCTION(vm.globals.values[slot])) {
+                    vm.code_epoch++;
+                }
+                vm.globals.values[slot] = peek(0);
+                break;
+            }
+
+            case OPCODE_NIL: {
+                push(NIL_VAL);
+                break;
+            }
+
+            case OPCODE_TRUE: {
+                push(BOOL_VAL(true));
+                break;
+            }
+
+            case OPCODE_FALSE: {
+                push(BOOL_VAL(false));
+                break;
+            }
+
+            case OPCODE_EQUAL: {
+                Value r = pop();
+                Value l = pop();
+                push(BOOL_VAL(values_equal(l, r)));
+                break;
+            }
+
+            case OPCODE_GREATER: {
+                BINARY_OPERATION(BOOL_VAL, >, OPCODE_GREATER_NUM_NUM);
+                break;
+            }
+
+            case OPCODE_LESS: {
+                BINARY_OPERATION(BOOL_VAL, <, OPCODE_LESS_NUM_NUM);
+                break;
+            }
+
+            case OPCODE_NOT: {
+                push(BOOL_VAL(is_falsey(pop())));
+                break;
             }
 
             case OPCODE_NEGATE: {
-                *(vm.stack_ptr - 1) = 0 - (*(vm.stack_ptr - 1));
+                if (!IS_NUMBER(peek(0))) {
+                    runtime_error("Operand must be a number.");
+                    return INTERPRETER_RUNTIME_ERROR;
+                }
+                *(vm.stack_ptr - 1) = NUMBER_VAL(-AS_NUMBER(*(vm.stack_ptr - 1)));
                 break;
             }
 
+            // Two strings are joined together; anything else has to be two numbers
             case OPCODE_ADD: {
-                BINARY_OPERATION(+);
+                if (IS_STRING(peek(0)) && IS_STRING(peek(1))) {
+                    vm.quicken.generic++;
+                    QUICKEN(OPCODE_ADD_STR_STR);
+                    ObjString* joined = concatenate_strings(AS_STRING(peek(1)), AS_STRING(peek(0)));
+                    pop();
+                    pop();
+                    push(OBJ_VAL(joined));
+                } else {
+                    ARITHMETIC_OPERATION(+, OPCODE_ADD_NUM_NUM, ARRAY_ADD);
+                }
                 break;
             }
 
             case OPCODE_SUBTRACT: {
-                BINARY_OPERATION(-);
+                ARITHMETIC_OPERATION(-, OPCODE_SUBTRACT_NUM_NUM, ARRAY_SUBTRACT);
                 break;
             }
 
             case OPCODE_DIVIDE: {
-                BINARY_OPERATION(/);
+                ARITHMETIC_OPERATION(/, OPCODE_DIVIDE_NUM_NUM, ARRAY_DIVIDE);
                 break;
             }
 
             case OPCODE_MULTIPLY: {
-                BINARY_OPERATION(*);
+                ARITHMETIC_OPERATION(*, OPCODE_MULTIPLY_NUM_NUM, ARRAY_MULTIPLY);
+                break;
+            }
+
+            // Quickened forms of the above - guard, then go straight to the arithmetic
+            case OPCODE_ADD_NUM_NUM: {
+                NUMBER_OPERATION(NUMBER_VAL, +, OPCODE_ADD);
+                break;
+            }
+
+            case OPCODE_ADD_STR_STR: {
+                if (!IS_STRING(peek(0)) || !IS_STRING(peek(1))) {
+                    DEOPTIMIZE(OPCODE_ADD);
+                    break;
+                }
+                vm.quicken.specialized++;
+                ObjString* joined = concatenate_strings(AS_STRING(peek(1)), AS_STRING(peek(0)));
+                vm.stack_ptr[-2]  = OBJ_VAL(joined);
+                vm.stack_ptr--;
+                break;
+            }
+
+            case OPCODE_SUBTRACT_NUM_NUM: {
+                NUMBER_OPERATION(NUMBER_VAL, -, OPCODE_SUBTRACT);
+                break;
+            }
+
+            case OPCODE_MULTIPLY_NUM_NUM: {
+                NUMBER_OPERATION(NUMBER_VAL, *, OPCODE_MULTIPLY);
+                break;
+            }
+
+            case OPCODE_DIVIDE_NUM_NUM: {
+                NUMBER_OPERATION(NUMBER_VAL, /, OPCODE_DIVIDE);
+                break;
+            }
+
+            case OPCODE_GREATER_NUM_NUM: {
+                NUMBER_OPERATION(BOOL_VAL, >, OPCODE_GREATER);
+                break;
+            }
+
+            case OPCODE_LESS_NUM_NUM: {
+                NUMBER_OPERATION(BOOL_VAL, <, OPCODE_LESS);
                 break;
             }
 
             case OPCODE_CONSTANT: {
-                Value constant = FETCH_CONSTANT();
+                Value constant = vm.nugget->constants.values[FETCH_OPERAND(1)];
+                push(constant);
+                break;
+            }
+
+            case OPCODE_CONSTANT_LONG: {
+                Value constant = vm.nugget->constants.values[FETCH_OPERAND(3)];
                 push(constant);
                 break;
             }
@@ -159,30 +1247,305 @@ static InterpretationResult run() {
     }
 
     #undef FETCH_BYTE
-    #undef FETCH_CONSTANT
+    #undef FETCH_WORD
+    #undef FETCH_SHORT
+    #undef FETCH_LONG
+    #undef FETCH_OPERAND
+    #undef INSTRUCTION_START
+    #undef QUICKEN
+    #undef DEOPTIMIZE
     #undef BINARY_OPERATION
+    #undef ARITHMETIC_OPERATION
+    #undef NUMBER_OPERATION
+}
+
+/*
+ * Hit rate of the quickened instructions, and how often they had to fall back to the generic ones.
+ */
+void print_quicken_stats(void) {
+    uint64_t executed = vm.quicken.specialized + vm.quicken.generic;
+
+    printf("[quicken] %llu specialized / %llu executed (%.2f%% hit rate), %llu rewrites, %llu deopts\n",
+           (unsigned long long)vm.quicken.specialized, (unsigned long long)executed,
+           (executed == 0) ? 0.0 : (100.0 * (double)vm.quicken.specialized / (double)executed),
+           (unsigned long long)vm.quicken.quickened, (unsigned long long)vm.quicken.deopts);
+}
+
+
+static InterpretationResult run() {
+    if (vm.nugget->encoding == ENCODING_WIDE) {
+        return run_encoded(true);
+    }
+    return run_encoded(false);
+}
+
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+ * Generators and iterators (object.h). Getting the next element out of either may mean running script code - a
+ * generator's body up to its next yield, the function of a map or filter - in the middle of an instruction (FOR_ITER,
+ * or a native like reduce()). That code runs in a nested run(), on top of the same stack and frames: run_nested()
+ * starts it with a frame already pushed, and it comes back as soon as that frame returns or yields (VM.stop_depth), with
+ * the result on top of the stack and the VM just as it was before. A runtime error in there has already been reported
+ * (and the stack thrown away) by the time it gets back, so all the caller has to do is pass the result on.
+ * The nested run has all the budget it wants, so a fiber (fiber.h) can't be swapped out partway through one element -
+ * only between elements, at the loop's checkpoint.
+ */
+static InterpretationResult run_nested(void) {
+    int stop_depth  = vm.stop_depth;
+    uint64_t budget = vm.budget;
+    vm.stop_depth   = vm.frame_count;
+    vm.budget       = UINT64_MAX;
+
+    InterpretationResult result = run();
+
+    vm.budget = budget;
+    if (result == INTERPRETER_OK) {
+        vm.stop_depth = stop_depth;
+    }
+    return result;
+}
+
+
+/*
+ * Call the callee sitting arg_count slots below the top of the stack, with the arguments above it, and run it to the
+ * end. Its result replaces them, just as if OPCODE_CALL had called it and it had returned.
+ */
+InterpretationResult call_nested(int arg_count) {
+    int frame_count = vm.frame_count;
+
+    InterpretationResult result = call_value(peek(arg_count), arg_count);
+    if (result == INTERPRETER_OK && vm.frame_count > frame_count) {
+        result = run_nested();
+    }
+    return result;
+}
+
+
+/*
+ * Run the generator's body from where it left off to its next yield, and push the value it yields. Its saved frame goes
+ * back on the stack above everything else, and comes off again into the generator at the yield (OPCODE_YIELD). If the
+ * body finishes instead, the generator is done for good, and whatever it returned is dropped, along with its frame.
+ */
+static InterpretationResult resume_generator(ObjGenerator* generator, bool* done) {
+    if (generator->state == GENERATOR_DONE) {
+        *done = true;
+        return INTERPRETER_OK;
+    }
+    if (generator->state == GENERATOR_RUNNING) {
+        runtime_error("%s() is already running - a generator can't ask itself for its next element.",
+                      generator->function->name->chars);
+        return INTERPRETER_RUNTIME_ERROR;
+    }
+    if (!push_frame()) {
+        return INTERPRETER_RUNTIME_ERROR;
+    }
+
+    vm.frame_base = stack_offset();
+    for (int index = 0; index < generator->slot_count; index++) {
+        push(generator->slots[index]);
+    }
+    vm.function = generator->function;
+    vm.nugget   = &generator->function->nugget;
+    vm.iptr     = vm.nugget->code + generator->offset;
+
+    ObjGenerator* resumer = vm.generator;
+    vm.generator          = generator;
+    generator->state      = GENERATOR_RUNNING;
+
+    InterpretationResult result = run_nested();
+    if (result != INTERPRETER_OK) {
+        generator->state = GENERATOR_DONE;
+        return result;
+    }
+    vm.generator = resumer;
+
+    *done = (generator->state == GENERATOR_RUNNING);
+    if (*done) {
+        pop();
+        generator->state = GENERATOR_DONE;
+        FREE_ARRAY(Value, generator->slots, generator->slot_capacity);
+        generator->slots         = NULL;
+        generator->slot_count    = 0;
+        generator->slot_capacity = 0;
+    }
+    return INTERPRETER_OK;
+}
+
+
+/*
+ * Push the next element of sequence - a generator or an iterator, which the caller keeps on the stack - or set *done
+ * if there are none left. A chain of iterators is pulled from the outside in, so each element makes its way through
+ * every stage before the next one is even asked for, and nothing is ever gathered up in between.
+ */
+InterpretationResult iterator_next(Value sequence, bool* done) {
+    if (IS_GENERATOR(sequence)) {
+        return resume_generator(AS_GENERATOR(sequence), done);
+    }
+
+    ObjIterator* iterator = AS_ITERATOR(sequence);
+    InterpretationResult result;
+
+    switch (iterator->kind) {
+        case ITERATOR_ARRAY: {
+            ObjArray* array = AS_ARRAY(iterator->source);
+            *done = (iterator->position >= array->count);
+            if (!*done) {
+                push(NUMBER_VAL(array_element(array, iterator->position++)));
+            }
+            return INTERPRETER_OK;
+        }
+
+        // [element] -> [f, element] -> [f(element)]
+        case ITERATOR_MAP: {
+            result = iterator_next(iterator->source, done);
+            if (result != INTERPRETER_OK || *done) {
+                return result;
+            }
+            Value element = pop();
+            push(iterator->function);
+            push(element);
+            return call_nested(1);
+        }
+
+        // [element] -> [element, f, element] -> [element, keep] -> [element], or on to the next one
+        case ITERATOR_FILTER:
+            LOOP {
+                result = iterator_next(iterator->source, done);
+                if (result != INTERPRETER_OK || *done) {
+                    return result;
+                }
+                push(iterator->function);
+                push(peek(1));
+                result = call_nested(1);
+                if (result != INTERPRETER_OK) {
+                    return result;
+                }
+                if (!is_falsey(pop())) {
+                    return INTERPRETER_OK;
+                }
+                pop();
+            }
+
+        // Stops asking its source once it's taken enough, so it can take the start of an endless generator
+        case ITERATOR_TAKE:
+            if (iterator->position == 0) {
+                *done = true;
+                return INTERPRETER_OK;
+            }
+            result = iterator_next(iterator->source, done);
+            if (result == INTERPRETER_OK && !*done) {
+                iterator->position--;
+            }
+            return result;
+    }
+    return INTERPRETER_OK;
 }
 
 
 /* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
  * Begin interpreting and running the given code nugget. Returns the status 
+ * vm.nugget points at the nugget from the start, so that its constants count as garbage collector roots while it is
+ * still being compiled, as well as while it runs.
+ * Once compile() is finished with the nugget it gets finalized (nugget.c) - packed into a single read-only block, so that
+ * run() only ever has to walk one allocation.
  */
 InterpretationResult interpret(const char* source) {
     Nugget nugget;
-    init_nugget(&nugget);
+    InterpretationResult interp_result = begin_interpret(&nugget, source);
+
+    while (interp_result == INTERPRETER_YIELD) {
+        interp_result = resume_interpret(UINT64_MAX);
+    }
+
+    free_nugget(&nugget);
+    vm.nugget = NULL;
+
+    return interp_result;
+}
+
 
-    if (!compile(&nugget, source)) {
-        free_nugget(&nugget);
+/*
+ * interpret() in two halves, for callers which want to run a program a slice at a time (fiber.c). begin_interpret()
+ * compiles the source into nugget - which must then outlive the run - and returns INTERPRETER_YIELD if the program is
+ * ready to go, or INTERPRETER_COMPILE_ERROR. Each resume_interpret() then runs it for up to 'budget' checkpoints (see
+ * vm.h), returning INTERPRETER_YIELD if it ran out of budget before finishing. Freeing the nugget is up to the caller.
+ * A VM with a memory quota is held to it whenever it yields: if it's over, a full collection gets one chance to bring it
+ * back under before the program is stopped with a runtime error.
+ */
+InterpretationResult begin_interpret(Nugget* nugget, const char* source) {
+    init_nugget(nugget);
+    nugget->encoding = vm.encoding;
+    vm.nugget = nugget;
+
+    perf_begin(PERF_COMPILE);
+    bool compiled = compile(nugget, source);
+    perf_end(PERF_COMPILE);
+
+    if (!compiled) {
         return INTERPRETER_COMPILE_ERROR;
     }
 
-    vm.nugget = &nugget;
-    vm.iptr   = vm.nugget->code;
+    finalize_nugget(nugget);
+    vm.iptr = vm.nugget->code;
+    return INTERPRETER_YIELD;
+}
 
-    InterpretationResult interp_result = run();
 
-    free_nugget(&nugget);
+InterpretationResult resume_interpret(uint64_t budget) {
+    vm.budget = budget;
+    perf_begin(PERF_RUN);
+    InterpretationResult result = run();
+    perf_end(PERF_RUN);
 
-    return interp_result;
+    if (result == INTERPRETER_YIELD && vm.gc.quota != 0 && vm.gc.bytes_allocated > vm.gc.quota) {
+        collect_garbage();
+        if (vm.gc.bytes_allocated > vm.gc.quota) {
+            runtime_error("Memory quota exceeded (%zu bytes live, quota %zu).", vm.gc.bytes_allocated, vm.gc.quota);
+            return INTERPRETER_RUNTIME_ERROR;
+        }
+    }
+    return result;
 }
 
+
+/*
+ * Run a nugget which has already been compiled and finalized, from the top and to the end. --watch keeps a script's
+ * nuggets from one run to the next rather than compiling them all again (watch.c).
+ */
+InterpretationResult run_nugget(Nugget* nugget) {
+    vm.nugget = nugget;
+    vm.iptr   = nugget->code;
+
+    InterpretationResult result = resume_interpret(UINT64_MAX);
+    while (result == INTERPRETER_YIELD) {
+        result = resume_interpret(UINT64_MAX);
+    }
+
+    vm.nugget = NULL;
+    return result;
+}
+
+
+/*
+ * Call function with the given arguments straight from C, as the outermost call, and run it to completion. The workers
+ * of a parallel loop run its body this way, once for each element (parallel.c). Its return value is left in *result.
+ */
+InterpretationResult run_function(ObjFunction* function, Value* args, int arg_count, Value* result) {
+    rewind_stack();
+    push(OBJ_VAL(function));
+    for (int index = 0; index < arg_count; index++) {
+        push(args[index]);
+    }
+
+    vm.function   = function;
+    vm.nugget     = &function->nugget;
+    vm.iptr       = function->nugget.code;
+    vm.frame_base = 0;
+    vm.budget     = UINT64_MAX;
+
+    InterpretationResult interp_result = run();
+    if (interp_result == INTERPRETER_OK) {
+        *result = pop();
+    }
+    return interp_result;
+}
@@ -1,10 +1,14 @@
 #ifndef cypsa_vm_h
     #define cypsa_vm_h
 
+    #include "memory.h"
     #include "nugget.h"
+    #include "object.h"
+    #include "table.h"
     #include "values.h"
 
     #define STACK_MAXSIZE 8
+    #define FRAMES_MAX    1024
     
 
     /* This is what the old stack looked like - advantages being that it had a known size at compile-time, and the
@@ -18,24 +22,143 @@
      *     Value* stack_top;
      * } VM; */
     
+    /*
+     * Quickening counters (see nugget.h). specialized and generic count executions of quickened and generic
+     * arithmetic / comparison instructions, so specialized / (specialized + generic) is the hit rate. quickened counts
+     * rewrites to a specialized form, deopts the rewrites back when a type guard failed.
+     */
     typedef struct {
+        uint64_t specialized;
+        uint64_t generic;
+        uint64_t quickened;
+        uint64_t deopts;
+    } QuickenStats;
+
+    /*
+     * Memoization counters (see memo.h), over every pure function: calls answered from a cache, calls that had to run
+     * (and whose results were stored), and stored results which pushed out an older one.
+     */
+    typedef struct {
+        uint64_t hits;
+        uint64_t misses;
+        uint64_t evictions;
+    } MemoStats;
+
+    /*
+     * Inline cache counters (see nugget.h), over every GET_PROPERTY, SET_PROPERTY and INVOKE: lookups a site's cache
+     * answered, lookups it didn't (and which were then cached), and lookups at sites gone megamorphic, which aren't
+     * cached at all. polymorphic and megamorphic count the sites which have gone that way.
+     */
+    typedef struct {
+        uint64_t hits;
+        uint64_t misses;
+        uint64_t megamorphic_lookups;
+        uint64_t polymorphic;
+        uint64_t megamorphic;
+    } InlineCacheStats;
+
+    /*
+     * Calls. The function running right now is described by the VM itself - vm.function (NULL for top-level code),
+     * vm.nugget, vm.iptr, and vm.frame_base, the stack slot where its frame starts: the callee (for a method, the
+     * instance it was called on), then its arguments, which are its first locals, then the rest of its locals.
+     * GET_LOCAL / SET_LOCAL count slots from frame_base. A frame is a base index rather than a pointer because the stack
+     * can be reallocated out from under it.
+     * A call saves the caller's four in the next CallFrame and switches to the callee; a return pops the callee's frame
+     * off the stack and restores the caller. frames grows as needed, up to FRAMES_MAX calls deep.
+     * memoized is set in the frame of a call to a pure function whose result wasn't in its cache yet, so that returning
+     * from it stores the result there (memo.h).
+     * A call in tail position (OPCODE_TAIL_CALL, or OPCODE_TAIL_INVOKE for a method) doesn't push a frame at all: the
+     * callee takes over the frame of the function making the call, so that recursion in tail position runs in constant
+     * space. tail is set in the frame of a call made that way, in which case that frame can be taken over in turn even
+     * if it's memoized - see vm.c.
+     */
+    typedef struct {
+        ObjFunction* function;
         Nugget* nugget;
         uint8_t* iptr;
+        int base;
+        bool memoized;
+        bool tail;
+    } CallFrame;
+
+    /*
+     * Global variables are stored by slot rather than by name. The compiler gives each global name the next free index
+     * in globals (recording it in global_slots, name -> NUMBER_VAL(slot), and in global_names, slot -> name), so at
+     * runtime reading a global is one indexed load. A slot holds UNDEFINED_VAL until its 'var' has run.
+     *
+     * budget: How many more checkpoints run() may pass before it stops and returns INTERPRETER_YIELD. The checkpoints are
+     * the places where a program can go on for a long time - backward jumps (OPCODE_LOOP) and native calls - so
+     * counting costs one decrement on those and nothing at all on straight-line code. Everything run() needs in order
+     * to carry on is in the VM (iptr included), so resume_interpret() picks up exactly where it left off. This is what
+     * lets the fiber scheduler (fiber.h) time-slice many programs fairly; interpret() just hands out an endless budget.
+     *
+     * stop_depth, generator: While run() is nested inside an instruction to get the next element of a generator or
+     * iterator (see run_nested(), vm.c), it returns as soon as frame_count drops below stop_depth - 0 the rest of the time,
+     * which it never does. generator is the generator whose body is running at the moment (for OPCODE_YIELD), or NULL.
+     *
+     * code_epoch: Goes up by one whenever a global which held a function is overwritten, so that whatever was worked out
+     * from which functions the globals held - whether a function is pure, and the results memoized on the strength of
+     * it (memo.h) - can tell it's out of date.
+     *
+     * shared_code: Set in the workers of a parallel loop (parallel.h), whose code belongs to the program's VM. They may
+     * run it, but mustn't compile anything into it, so calling a function which isn't compiled yet is an error there.
+     *
+     * There is one VM per thread (_Thread_local), and a fiber owns a whole VM struct of its own, which the scheduler
+     * swaps in to the running thread's vm for each slice. Nothing in a VM points back into the struct itself, so it can
+     * be copied around freely.
+     */
+    typedef struct {
+        Nugget* nugget;
+        uint8_t* iptr;
+        ObjFunction* function;
+        int frame_base;
+        CallFrame* frames;
+        int frame_count;
+        int frame_capacity;
+        int stop_depth;
+        ObjGenerator* generator;
         Value* stack;
         Value* stack_ptr;
         Value* stack_top;
         int stack_capacity;
+        NuggetEncoding encoding;
+        Table strings;
+        Table global_slots;
+        ValuePool globals;
+        ValuePool global_names;
+        Obj* objects;
+        Collector gc;
+        QuickenStats quicken;
+        MemoStats memo;
+        InlineCacheStats ic;
+        uint32_t code_epoch;
+        uint64_t budget;
+        bool shared_code;
     } VM;
 
     typedef enum {
         INTERPRETER_OK,
         INTERPRETER_COMPILE_ERROR,
-        INTERPRETER_RUNTIME_ERROR
+        INTERPRETER_RUNTIME_ERROR,
+        INTERPRETER_YIELD
     } InterpretationResult;
 
+    extern _Thread_local VM vm;
+
     void init_VM(void);
+    void set_encoding(NuggetEncoding encoding);
     void free_VM(void);
+    int add_global(ObjString* name);
+    void discard_globals(int first);
+    void print_quicken_stats(void);
+    void print_ic_stats(void);
     InterpretationResult interpret(const char* source);
+    InterpretationResult begin_interpret(Nugget* nugget, const char* source);
+    InterpretationResult resume_interpret(uint64_t budget);
+    InterpretationResult run_nugget(Nugget* nugget);
+    InterpretationResult run_function(ObjFunction* function, Value* args, int arg_count, Value* result);
+    InterpretationResult call_nested(int arg_count);
+    InterpretationResult iterator_next(Value sequence, bool* done);
     void push(Value value);
     Value pop();
 
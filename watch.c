@@ -0,0 +1,648 @@
+#include <errno.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "compiler.h"
+#include "memory.h"
+#include "object.h"
+#include "perf.h"
+#include "scanner.h"
+#include "vm.h"
+#include "watch.h"
+
+#ifdef __linux__
+    #include <poll.h>
+    #include <sys/inotify.h>
+    #include <unistd.h>
+#endif
+
+
+/*
+ * live:     The version of the script that ran last.
+ * pending:  The version being put together by a reload, until it's known to compile.
+ * Both hold nuggets the collector needs to know about (mark_watch_roots()). One of each per thread, like the compiler's
+ * state, although only the main thread ever watches anything.
+ */
+static _Thread_local Program live;
+static _Thread_local Program pending;
+static int first_global = 0;
+static volatile sig_atomic_t interrupted = 0;
+
+// How long the file has to be quiet after a change before it's reloaded - editors often save in more than one write.
+#define WATCH_SETTLE_MS 50
+
+// Two versions of the source are compared this many bytes at a time, with memcmp(), before going byte by byte.
+#define WATCH_COMPARE_BLOCK 256
+
+
+static uint64_t now_nanoseconds(void) {
+    struct timespec now;
+    timespec_get(&now, TIME_UTC);
+    return (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+}
+
+
+/*
+ * FNV-1a, 64 bits.
+ */
+static uint64_t hash_text(const char* text, int length) {
+    uint64_t hash = 14695981039346656037u;
+    for (int index = 0; index < length; index++) {
+        hash ^= (uint8_t)text[index];
+        hash *= 1099511628211u;
+    }
+    return hash;
+}
+
+
+/*
+ * Read the whole file, or return NULL if it can't be read right now - in the middle of an editor's save, say. Units
+ * point into the source (watch.h), so it lives exactly as long as its Program.
+ */
+static char* read_source(const char* path) {
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) {
+        return NULL;
+    }
+
+    fseek(file, 0L, SEEK_END);
+    long size = ftell(file);
+    rewind(file);
+
+    char* source = (size < 0) ? NULL : malloc((size_t)size + 1);
+    if (source != NULL) {
+        size_t bytes_read = fread(source, sizeof(char), (size_t)size, file);
+        source[bytes_read] = '\0';
+    }
+
+    fclose(file);
+    return source;
+}
+
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+ * Programs. The unit arrays are plain malloc() - they're the host's bookkeeping, not part of the VM's heap - but each
+ * unit's nugget belongs to the VM as usual.
+ */
+static void init_program(Program* program, char* source) {
+    program->source        = source;
+    program->units         = NULL;
+    program->unit_count    = 0;
+    program->unit_capacity = 0;
+}
+
+
+static void free_program(Program* program) {
+    for (int index = 0; index < program->unit_count; index++) {
+        free_nugget(&program->units[index].nugget);
+    }
+    free(program->units);
+    free(program->source);
+    init_program(program, NULL);
+}
+
+
+static Unit* add_unit(Program* program, const char* start, int length, int line, uint64_t hash) {
+    if (program->unit_count == program->unit_capacity) {
+        program->unit_capacity = GROW_CAPACITY(program->unit_capacity);
+        program->units         = realloc(program->units, sizeof(Unit) * program->unit_capacity);
+    }
+
+    Unit* unit      = &program->units[program->unit_count++];
+    unit->start     = start;
+    unit->length    = length;
+    unit->line      = line;
+    unit->hash      = hash;
+    unit->kept_from = -1;
+    init_nugget(&unit->nugget);
+    return unit;
+}
+
+
+/*
+ * Keep a unit of the last version which the edit didn't touch, at its new place in the source.
+ */
+static void keep_unit(Program* program, Program* last, int from, ptrdiff_t offset, int lines) {
+    Unit* old  = &last->units[from];
+    Unit* unit = add_unit(program, program->source + (old->start - last->source) + offset, old->length,
+                          old->line + lines, old->hash);
+    unit->kept_from = from;
+}
+
+
+static void scanned_unit(Program* program, Token first, const char* end) {
+    int length = (int)(end - first.start);
+    add_unit(program, first.start, length, first.line, hash_text(first.start, length));
+}
+
+
+/*
+ * The unit of the last version which starts exactly at the given offset into its source, or -1.
+ */
+static int unit_at(Program* last, ptrdiff_t offset) {
+    int low  = 0;
+    int high = last->unit_count - 1;
+
+    while (low <= high) {
+        int middle      = low + (high - low) / 2;
+        ptrdiff_t start = last->units[middle].start - last->source;
+        if (start == offset) {
+            return middle;
+        }
+        if (start < offset) {
+            low = middle + 1;
+        } else {
+            high = middle - 1;
+        }
+    }
+    return -1;
+}
+
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+ * Cut the new source up into top-level declarations. A declaration ends with a ';' or a '}' that isn't inside any
+ * brackets, unless an 'else' follows - the if statement isn't over yet. This doesn't need to understand anything more
+ * than that: whatever it cuts out gets compiled properly afterwards, and anything malformed is reported then.
+ *
+ * Scanning a big script takes about as long as compiling it (function bodies are only skipped, after all), so the
+ * source isn't scanned again where it hasn't changed. Comparing the two versions byte by byte finds the unchanged
+ * stretches at the start and the end of the file, which is what a typical edit leaves:
+ *      - Units of the last version lying wholly in the unchanged start are kept as they are, except the last of them,
+ *        since whether a unit ends where it does depends on the token after it. Scanning carries on from there.
+ *      - As soon as a new unit would start at a token inside the unchanged end, where a unit of the last version
+ *        started too, the scanner would only find the same units all over again - so those are kept instead, moved
+ *        by however many bytes and lines the edit added or removed.
+ */
+static void split_units(Program* program, Program* last) {
+    size_t length      = strlen(program->source);
+    size_t last_length = (last->source == NULL) ? 0 : strlen(last->source);
+    size_t shortest    = (length < last_length) ? length : last_length;
+    size_t prefix      = 0;
+    size_t suffix      = 0;
+
+    while (prefix + WATCH_COMPARE_BLOCK <= shortest &&
+           memcmp(program->source + prefix, last->source + prefix, WATCH_COMPARE_BLOCK) == 0) {
+        prefix += WATCH_COMPARE_BLOCK;
+    }
+    while (prefix < shortest && program->source[prefix] == last->source[prefix]) {
+        prefix++;
+    }
+    while (suffix + WATCH_COMPARE_BLOCK <= shortest - prefix &&
+           memcmp(program->source + length - suffix - WATCH_COMPARE_BLOCK,
+                  last->source + last_length - suffix - WATCH_COMPARE_BLOCK, WATCH_COMPARE_BLOCK) == 0) {
+        suffix += WATCH_COMPARE_BLOCK;
+    }
+    while (suffix < shortest - prefix &&
+           program->source[length - 1 - suffix] == last->source[last_length - 1 - suffix]) {
+        suffix++;
+    }
+
+    int head = 0;
+    while (head + 1 < last->unit_count &&
+           (size_t)(last->units[head + 1].start + last->units[head + 1].length - last->source) <= prefix) {
+        keep_unit(program, last, head, 0, 0);
+        head++;
+    }
+
+    const char* from = program->source;
+    int line         = 1;
+    if (head > 0) {
+        from = program->source + (last->units[head].start - last->source);
+        line = last->units[head].line;
+    }
+
+    ptrdiff_t offset = (ptrdiff_t)length - (ptrdiff_t)last_length;
+    Token first      = {TOKEN_EOF, NULL, 0, 0};
+    Token previous   = first;
+    bool open        = false;
+    bool ended       = false;
+    int depth        = 0;
+
+    init_scanner_range(from, program->source + length, line);
+
+    LOOP {
+        Token token = scan_token();
+
+        if (ended && token.type != TOKEN_ELSE) {
+            scanned_unit(program, first, previous.start + previous.length);
+            open = false;
+        }
+        ended = false;
+
+        if (token.type == TOKEN_EOF) {
+            break;
+        }
+        if (token.type == TOKEN_ERROR) {
+            // Points at a message rather than the source - leave the rest of the file to the compiler to complain about
+            if (!open) {
+                first = (Token){TOKEN_ERROR, (previous.start == NULL) ? from : previous.start + previous.length, 0,
+                                token.line};
+            }
+            scanned_unit(program, first, program->source + length);
+            open = false;
+            break;
+        }
+
+        if (!open) {
+            ptrdiff_t at = token.start - program->source;
+            int old      = (at >= (ptrdiff_t)(length - suffix) && depth == 0) ? unit_at(last, at - offset) : -1;
+
+            if (old != -1) {
+                int lines = token.line - last->units[old].line;
+                for (; old < last->unit_count; old++) {
+                    keep_unit(program, last, old, offset, lines);
+                }
+                return;
+            }
+
+            first = token;
+            open  = true;
+        }
+        previous = token;
+
+        switch (token.type) {
+            case TOKEN_LEFTPAREN:
+            case TOKEN_LEFTCURLY:
+            case TOKEN_LEFTSQUARE:
+                depth++;
+                break;
+            case TOKEN_RIGHTPAREN:
+            case TOKEN_RIGHTCURLY:
+            case TOKEN_RIGHTSQUARE:
+                depth = (depth > 0) ? depth - 1 : 0;
+                ended = (depth == 0 && token.type == TOKEN_RIGHTCURLY);
+                break;
+            case TOKEN_SEMICOLON:
+                ended = (depth == 0);
+                break;
+            default:
+                DO_NOTHING
+        }
+    }
+
+    if (open) {
+        scanned_unit(program, first, previous.start + previous.length);
+    }
+}
+
+
+/*
+ * The rest of the new units were in the middle of the edit. They might just have been moved, though, so look each one
+ * up by its text among the units of the last version not already claimed, through an open-addressed index by hash.
+ * Returns how many units of the new version are kept altogether.
+ */
+static int match_units(Program* next, Program* last) {
+    int kept = 0;
+    for (int unit = 0; unit < next->unit_count; unit++) {
+        kept += (next->units[unit].kept_from != -1);
+    }
+    if (last->unit_count == 0 || kept == next->unit_count) {
+        return kept;
+    }
+
+    int capacity = 8;
+    while (capacity < last->unit_count * 2) {
+        capacity *= 2;
+    }
+
+    int* index  = malloc(sizeof(int) * capacity);
+    bool* taken = calloc((size_t)last->unit_count, sizeof(bool));
+    for (int slot = 0; slot < capacity; slot++) {
+        index[slot] = -1;
+    }
+    for (int unit = 0; unit < next->unit_count; unit++) {
+        if (next->units[unit].kept_from != -1) {
+            taken[next->units[unit].kept_from] = true;
+        }
+    }
+    for (int old = 0; old < last->unit_count; old++) {
+        int slot = (int)(last->units[old].hash & (uint64_t)(capacity - 1));
+        while (index[slot] != -1) {
+            slot = (slot + 1) & (capacity - 1);
+        }
+        index[slot] = old;
+    }
+
+    for (int unit = 0; unit < next->unit_count; unit++) {
+        Unit* wanted = &next->units[unit];
+        int slot     = (int)(wanted->hash & (uint64_t)(capacity - 1));
+        if (wanted->kept_from != -1) {
+            continue;
+        }
+
+        for (; index[slot] != -1; slot = (slot + 1) & (capacity - 1)) {
+            Unit* candidate = &last->units[index[slot]];
+            if (!taken[index[slot]] && candidate->hash == wanted->hash && candidate->length == wanted->length &&
+                memcmp(candidate->start, wanted->start, (size_t)wanted->length) == 0) {
+                taken[index[slot]] = true;
+                wanted->kept_from  = index[slot];
+                kept++;
+                break;
+            }
+        }
+    }
+
+    free(index);
+    free(taken);
+    return kept;
+}
+
+
+/*
+ * A kept unit whose text moved up or down the file: move the line numbers in its nugget, and in any function declared
+ * in it - those have their own nuggets (once compiled), functions of their own inside, and a starting line which their
+ * body is compiled from later.
+ */
+static void shift_constants(ValuePool* constants, int delta);
+
+static void shift_function(ObjFunction* function, int delta) {
+    function->line += delta;
+    if (function->compiled) {
+        shift_lines(&function->nugget, delta);
+        shift_constants(&function->nugget.constants, delta);
+    }
+}
+
+static void shift_constants(ValuePool* constants, int delta) {
+    for (int index = 0; index < constants->occupied; index++) {
+        if (IS_FUNCTION(constants->values[index])) {
+            shift_function(AS_FUNCTION(constants->values[index]), delta);
+        }
+    }
+}
+
+
+/*
+ * The top-level functions declared in the units a reload kept, whose bodies are compiled already.
+ */
+static int compiled_functions(Program* program, ObjFunction*** functions) {
+    int count    = 0;
+    int capacity = 0;
+    *functions   = NULL;
+
+    for (int unit = 0; unit < program->unit_count; unit++) {
+        if (program->units[unit].kept_from == -1) {
+            continue;
+        }
+
+        ValuePool* constants = &program->units[unit].nugget.constants;
+        for (int index = 0; index < constants->occupied; index++) {
+            // A parallel loop's body has no source of its own: it's compiled along with the unit (compiler.c).
+            if (IS_FUNCTION(constants->values[index]) && AS_FUNCTION(constants->values[index])->compiled &&
+                AS_FUNCTION(constants->values[index])->source != NULL) {
+                if (count == capacity) {
+                    capacity   = GROW_CAPACITY(capacity);
+                    *functions = realloc(*functions, sizeof(ObjFunction*) * capacity);
+                }
+                (*functions)[count++] = AS_FUNCTION(constants->values[index]);
+            }
+        }
+    }
+    return count;
+}
+
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+ * What a cold start would have spent compiling: the whole source in one go into a throwaway nugget, and - separately,
+ * since a cold start would only get to them on their first call - fresh copies of the function bodies the reload kept.
+ */
+static uint64_t cold_compile_time(Program* program) {
+    Nugget nugget;
+    init_nugget(&nugget);
+    nugget.encoding = vm.encoding;
+    vm.nugget = &nugget;
+
+    uint64_t start = now_nanoseconds();
+    compile(&nugget, program->source);
+    uint64_t elapsed = now_nanoseconds() - start;
+
+    free_nugget(&nugget);
+    vm.nugget = NULL;
+    return elapsed;
+}
+
+static uint64_t body_compile_time(ObjFunction** functions, int count) {
+    uint64_t elapsed = 0;
+
+    for (int index = 0; index < count; index++) {
+        ObjFunction* copy = new_function();
+        push(OBJ_VAL(copy));
+        copy->name = functions[index]->name;
+        set_function_source(copy, functions[index]->source, functions[index]->source_length, functions[index]->line);
+
+        uint64_t start = now_nanoseconds();
+        compile_function(copy);
+        elapsed += now_nanoseconds() - start;
+        pop();
+    }
+    return elapsed;
+}
+
+
+/*
+ * Run every unit in order, from a clean slate of globals (see watch.h).
+ */
+static InterpretationResult run_program(Program* program) {
+    for (int slot = first_global; slot < vm.globals.occupied; slot++) {
+        vm.globals.values[slot] = UNDEFINED_VAL;
+    }
+    vm.code_epoch++;
+
+    for (int unit = 0; unit < program->unit_count; unit++) {
+        InterpretationResult result = run_nugget(&program->units[unit].nugget);
+        if (result != INTERPRETER_OK) {
+            return result;
+        }
+    }
+    return INTERPRETER_OK;
+}
+
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+ * Load a new version of the script (taking ownership of source), compile whatever changed, and run it. The first load
+ * is just a reload against an empty last version, so everything gets compiled.
+ */
+static int reload_count = 0;
+
+static void reload(char* source) {
+    if (live.source != NULL && strcmp(live.source, source) == 0) {
+        free(source);
+        return;
+    }
+
+    perf_begin(PERF_COMPILE);
+    uint64_t start = now_nanoseconds();
+    bool compiled  = true;
+
+    init_program(&pending, source);
+    split_units(&pending, &live);
+    int kept = match_units(&pending, &live);
+
+    for (int index = 0; index < pending.unit_count; index++) {
+        Unit* unit = &pending.units[index];
+        if (unit->kept_from != -1) {
+            continue;
+        }
+
+        unit->nugget.encoding = vm.encoding;
+        if (compile_unit(&unit->nugget, unit->start, unit->start + unit->length, unit->line)) {
+            finalize_nugget(&unit->nugget);
+        } else {
+            compiled = false;
+        }
+    }
+
+    uint64_t compile_time = now_nanoseconds() - start;
+    perf_end(PERF_COMPILE);
+
+    if (!compiled) {
+        printf("[watch] Not reloaded - fix the errors above and save again.\n");
+        fflush(stdout);
+        free_program(&pending);
+        return;
+    }
+
+    for (int index = 0; index < pending.unit_count; index++) {
+        Unit* unit = &pending.units[index];
+        if (unit->kept_from == -1) {
+            continue;
+        }
+
+        Unit* old    = &live.units[unit->kept_from];
+        unit->nugget = old->nugget;
+        init_nugget(&old->nugget);
+
+        if (unit->line != old->line) {
+            shift_lines(&unit->nugget, unit->line - old->line);
+            shift_constants(&unit->nugget.constants, unit->line - old->line);
+        }
+    }
+
+    int removed = live.unit_count - kept;
+    bool first  = (live.source == NULL);
+    free_program(&live);
+    live = pending;
+    init_program(&pending, NULL);
+
+    ObjFunction** bodies = NULL;
+    int body_count       = first ? 0 : compiled_functions(&live, &bodies);
+
+    start = now_nanoseconds();
+    InterpretationResult result = run_program(&live);
+    uint64_t run_time = now_nanoseconds() - start;
+
+    if (first) {
+        printf("[watch] Loaded %d declarations: compiled in %.3f ms, ran in %.3f ms%s\n", live.unit_count,
+               compile_time / 1e6, run_time / 1e6, (result == INTERPRETER_OK) ? "." : " (stopped at a runtime error).");
+    } else {
+        uint64_t cold  = cold_compile_time(&live);
+        uint64_t saved = body_compile_time(bodies, body_count);
+
+        printf("[watch] Reload %d: %d of %d declarations recompiled, %d removed, in %.3f ms "
+               "(cold full recompile %.3f ms, %.1fx); %d function bodies kept compiled (%.3f ms saved); "
+               "ran in %.3f ms%s\n",
+               ++reload_count, live.unit_count - kept, live.unit_count, removed, compile_time / 1e6, cold / 1e6,
+               (compile_time == 0) ? 0.0 : (double)cold / (double)compile_time, body_count, saved / 1e6,
+               run_time / 1e6, (result == INTERPRETER_OK) ? "." : " (stopped at a runtime error).");
+    }
+    fflush(stdout);
+    free(bodies);
+}
+
+
+/*
+ * The collector's view of both versions of the script (memory.c). pending's constant pools grow while a reload
+ * compiles into them, so they're marked directly, like the compiler's own.
+ */
+void mark_watch_roots(void) {
+    Program* programs[] = {&live, &pending};
+
+    for (int program = 0; program < 2; program++) {
+        for (int unit = 0; unit < programs[program]->unit_count; unit++) {
+            mark_nugget(&programs[program]->units[unit].nugget);
+        }
+    }
+}
+
+
+static void interrupt(int signal) {
+    (void)signal;
+    interrupted = 1;
+}
+
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+ * Run the script at path, then watch it until interrupted (Ctrl-C), which returns - so main() still gets to print its
+ * statistics and tidy up. The directory is watched rather than the file, since editors usually save by writing a new
+ * file and renaming it over the old one, which a watch on the old file would never see.
+ */
+void run_watch(const char* path) {
+    char* source = read_source(path);
+    if (source == NULL) {
+        fprintf(stderr, "Error: Could not open file at location '%s'.\nCheck path and retry.\n", path);
+        exit(74);
+    }
+
+    #ifdef __linux__
+        const char* slash = strrchr(path, '/');
+        const char* name  = (slash == NULL) ? path : slash + 1;
+        char* directory   = (slash == NULL) ? strdup(".") : strndup(path, (size_t)(slash - path + (slash == path)));
+
+        int watcher = inotify_init1(IN_CLOEXEC);
+        if (watcher < 0 || inotify_add_watch(watcher, directory, IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE) < 0) {
+            fprintf(stderr, "Error: Could not watch '%s' (%s).\n", directory, strerror(errno));
+            exit(74);
+        }
+        free(directory);
+
+        struct sigaction action;
+        memset(&action, 0, sizeof(action));
+        action.sa_handler = interrupt;
+        sigaction(SIGINT, &action, NULL);
+
+        first_global = vm.globals.occupied;
+        reload(source);
+        printf("[watch] Watching %s for changes - Ctrl-C to stop.\n", path);
+        fflush(stdout);
+
+        _Alignas(struct inotify_event) char events[4096];
+
+        while (!interrupted) {
+            ssize_t length = read(watcher, events, sizeof(events));
+            if (length <= 0) {
+                continue;
+            }
+
+            bool changed = false;
+            for (char* at = events; at < events + length; ) {
+                struct inotify_event* event = (struct inotify_event*)at;
+                changed = changed || (event->mask & IN_Q_OVERFLOW) || (event->len > 0 && strcmp(event->name, name) == 0);
+                at += sizeof(struct inotify_event) + event->len;
+            }
+            if (!changed) {
+                continue;
+            }
+
+            struct pollfd settle = {watcher, POLLIN, 0};
+            while (!interrupted && poll(&settle, 1, WATCH_SETTLE_MS) > 0) {
+                if (read(watcher, events, sizeof(events)) <= 0) {
+                    break;
+                }
+            }
+
+            source = read_source(path);
+            if (source != NULL) {
+                reload(source);
+            }
+        }
+
+        close(watcher);
+        free_program(&live);
+        signal(SIGINT, SIG_DFL);
+    #else
+        free(source);
+        fprintf(stderr, "Error: --watch needs inotify, so it's only supported on Linux.\n");
+        exit(64);
+    #endif
+}
@@ -0,0 +1,55 @@
+#ifndef cypsa_watch_h
+    #define cypsa_watch_h
+
+    #include "common.h"
+    #include "nugget.h"
+
+    /* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+     * --watch: run a script, then keep the interpreter warm and run it again every time the file changes on disk
+     * (inotify, so Linux only), recompiling only what the edit touched.
+     *
+     * A watched script is kept as one nugget per top-level declaration - a Unit - instead of one nugget for the lot.
+     * Top-level code only ever talks to other top-level code through globals, and global slots belong to the VM rather
+     * than to any one compile (see compiler.c), so each declaration compiles on its own to exactly what it would have
+     * compiled to as part of the whole script. When the file changes it's split into declarations again and each one
+     * is looked up, by its text, among the units of the last version: a match takes over the old unit's nugget, and
+     * only declarations that aren't found are compiled. A unit which is kept but has moved up or down the file has its
+     * line numbers shifted to match (shift_lines(), nugget.c). Kept function declarations keep their function object
+     * too - so a function body which was compiled on the last run (compiler.c) doesn't get compiled again either.
+     *
+     * Each run starts from a clean slate of globals: every global the script defines is set back to undefined first
+     * (anything loaded from a snapshot beforehand is left alone), so a declaration that's been deleted really is gone -
+     * and code_epoch moves on (vm.h), so no kept function's memoized results (memo.h) outlive a function it called.
+     * Then the units run in order, stopping at the first runtime error. If the new version doesn't compile, its errors
+     * are reported and the last good version stays loaded until the next change.
+     *
+     * After every reload the time it took is printed next to what compiling the whole new version from cold would have
+     * cost - the top-level code, plus the function bodies the reload got to keep.
+     *
+     * struct Unit:
+     *      start, length:  The declaration's text, within its Program's source. Comments around it aren't part of it.
+     *      line:           The line it starts on.
+     *      hash:           Of its text, for matching it up against the next version.
+     *      kept_from:      While a reload is being put together: the index of the unit in the last version whose
+     *                      nugget this one takes over, or -1 if it has to be compiled.
+     */
+    typedef struct {
+        const char* start;
+        int length;
+        int line;
+        uint64_t hash;
+        int kept_from;
+        Nugget nugget;
+    } Unit;
+
+    typedef struct {
+        char* source;
+        Unit* units;
+        int unit_count;
+        int unit_capacity;
+    } Program;
+
+    void run_watch(const char* path);
+    void mark_watch_roots(void);
+
+#endif